@@ -5,6 +5,7 @@
 #include <linux/ip.h>
 #include <linux/udp.h>
 #include <bpf/bpf_helpers.h>
+#include <xsknf_kern.h>
 
 /* 
  * Including the common/statistics.h header creates problems with other
@@ -22,13 +23,6 @@ struct {
 	__uint(max_entries, 1);
 } xdp_stats SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_XSKMAP);
-	__uint(key_size, sizeof(int));
-	__uint(value_size, sizeof(int));
-	__uint(max_entries, 32);
-} xsks SEC(".maps");
-
 struct global_data global = {0};
 
 SEC("xdp") int handle_xdp(struct xdp_md *ctx)
@@ -37,19 +31,17 @@ SEC("xdp") int handle_xdp(struct xdp_md *ctx)
 	void *data_end = (void *)(long)ctx->data_end;
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return XDP_ABORTED;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return XDP_ABORTED;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
-
-	/*
-	 * Need to send the at least one packet to user space for busy polling to
-	 * work in combined mode.
-	 * In pure XDP the redirect will fail and the packet will be dropped.
-	 */
-	if (stats->rx_npkts == 1) {
-		return bpf_redirect_map(&xsks, 0, global.action);
+
+	/* Starts busy polling in combined mode (see xsknf_kern.h) */
+	if (xsknf_bootstrapping(ctx)) {
+		return xsknf_redirect(ctx, global.action);
 	}
 
 	struct ethhdr *eth = data;
@@ -1,4 +1,5 @@
 #include "checksummer.h"
+#include "../common/csum.h"
 #include "../common/statistics.h"
 #include <arpa/inet.h>
 #include <bpf/bpf.h>
@@ -9,6 +10,7 @@
 #include <locale.h>
 #include <net/ethernet.h>
 #include <signal.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <xsknf.h>
 
@@ -23,6 +25,7 @@ static int opt_extra_stats;
 static int opt_app_stats;
 static enum action opt_action = ACTION_REDIRECT;
 static int opt_csum_iterations = 1;
+static int opt_csum_offload;
 
 struct bpf_object *obj;
 struct xsknf_config config;
@@ -54,15 +57,20 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 		return -1;
 	}
 
-	uint32_t csum_buffer = 0;
-
 	/* Compute pseudo-header checksum */
-	csum_buffer += (uint16_t)ip->saddr;
-	csum_buffer += (uint16_t)(ip->saddr >> 16);
-	csum_buffer += (uint16_t)ip->daddr;
-	csum_buffer += (uint16_t)(ip->daddr >> 16);
-	csum_buffer += (uint16_t)ip->protocol << 8;
-	csum_buffer += udp->len;
+	uint32_t csum_buffer = csum_tcpudp_nofold(ip->saddr, ip->daddr, udp->len,
+			IPPROTO_UDP, 0);
+
+	int verdict = opt_action == ACTION_REDIRECT ?
+			(ingress_ifindex + 1) % config.num_interfaces : -1;
+
+	if (opt_csum_offload && verdict != -1) {
+		/* The NIC expects the folded pseudo-header checksum in the field */
+		udp->check = ~csum_fold(csum_buffer);
+
+		return verdict | xsknf_tx_csum_offload(pkt, (void *)udp - pkt,
+				offsetof(struct udphdr, check));
+	}
 
 	/* Clean old checksum */
 	udp->check = 0;
@@ -88,27 +96,16 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 	// 	}
 	// }
 
-	/* Sane code */
+	/* Sane code, compute checksum on udp header + payload */
+	uint32_t csum = csum_buffer;
 	for (int i = 0; i < opt_csum_iterations; i++) {
-		/* Compute checksum on udp header + payload */
-		uint16_t *payload = (void *)udp;
-		while ((void *)(payload + 1) <= pkt_end) {
-			csum_buffer += *payload;
-			payload++;
-		}
-		if ((void *)payload + 1 <= pkt_end) {
-			/* In case payload is not 2 bytes aligned */
-			csum_buffer += *(uint8_t *)payload;
-		}
+		csum = csum_partial(udp, pkt_end - (void *)udp, csum_buffer);
 	}
 
-	uint16_t csum = (uint16_t)csum_buffer + (uint16_t)(csum_buffer >> 16);
-	csum = ~csum;
+	/* A computed checksum of 0 is transmitted as all ones in UDP */
+	udp->check = csum_fold(csum) ?: 0xffff;
 
-	udp->check = csum;
-
-	return opt_action == ACTION_REDIRECT ?
-			(ingress_ifindex + 1) % config.num_interfaces : -1;
+	return verdict;
 }
 
 static struct option long_options[] = {
@@ -117,6 +114,8 @@ static struct option long_options[] = {
 	{"quiet", no_argument, 0, 'q'},
 	{"extra-stats", no_argument, 0, 'x'},
 	{"app-stats", no_argument, 0, 'a'},
+	{"csum-offload", no_argument, 0, 'o'},
+	{"csum-impl", required_argument, 0, 'm'},
 	{0, 0, 0, 0}
 };
 
@@ -130,6 +129,9 @@ static void usage(const char *prog)
 		"  -q, --quiet		Do not display any stats.\n"
 		"  -x, --extra-stats	Display extra statistics.\n"
 		"  -a, --app-stats	Display application (syscall) statistics.\n"
+		"  -o, --csum-offload	Let the NIC compute the checksum (needs the -T xsknf option).\n"
+		"  -m, --csum-impl	Checksum implementation: scalar, avx2, avx512 or neon\n"
+		"			(default the fastest supported by the CPU).\n"
 		"\n";
 	fprintf(stderr, str, prog);
 
@@ -141,7 +143,7 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 	int option_index, c;
 
 	for (;;) {
-		c = getopt_long(argc, argv, "qxai:c:", long_options, &option_index);
+		c = getopt_long(argc, argv, "qxai:c:om:", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -168,6 +170,16 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 		case 'a':
 			opt_app_stats = 1;
 			break;
+		case 'o':
+			opt_csum_offload = 1;
+			break;
+		case 'm':
+			if (csum_set_impl(optarg)) {
+				fprintf(stderr, "ERROR: checksum implementation %s not "
+						"available\n", optarg);
+				usage(basename(app_path));
+			}
+			break;
 		default:
 			usage(basename(app_path));
 		}
@@ -196,6 +208,12 @@ int main(int argc, char **argv)
 
 	parse_command_line(argc, argv, argv[0]);
 
+	if (opt_csum_offload && !config.tx_metadata) {
+		fprintf(stderr, "ERROR: checksum offload needs TX metadata (-T)\n");
+		xsknf_cleanup();
+		exit(EXIT_FAILURE);
+	}
+
 	setlocale(LC_ALL, "");
 
 	if (config.working_mode & MODE_XDP) {
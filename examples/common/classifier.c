@@ -0,0 +1,328 @@
+#include "classifier.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PORT_PREFIXES 30
+/* All the combinations of prefix lengths and protocol/wildcard */
+#define MAX_TUPLES (33 * 33 * 17 * 17 * 2)
+
+static inline uint32_t addr_mask(uint8_t len)
+{
+	return htonl(len ? ~0U << (32 - len) : 0);
+}
+
+static inline uint16_t port_mask(uint8_t len)
+{
+	return htons(len ? (uint16_t)(0xffff << (16 - len)) : 0);
+}
+
+static inline void mask_key(const struct classifier_key *key,
+		const struct classifier_key *mask, struct classifier_key *masked)
+{
+	masked->saddr = key->saddr & mask->saddr;
+	masked->daddr = key->daddr & mask->daddr;
+	masked->sport = key->sport & mask->sport;
+	masked->dport = key->dport & mask->dport;
+	masked->proto = key->proto & mask->proto;
+}
+
+void classifier_init(struct classifier *cls)
+{
+	memset(cls, 0, sizeof(*cls));
+}
+
+void classifier_free(struct classifier *cls)
+{
+	for (int i = 0; i < cls->ntuples; i++)
+		khashmap_free(&cls->tuples[i].map);
+
+	free(cls->tuples);
+	free(cls->rules);
+	memset(cls, 0, sizeof(*cls));
+}
+
+int classifier_add_rule(struct classifier *cls,
+		const struct classifier_rule *rule)
+{
+	if (cls->tuples) {
+		fprintf(stderr, "classifier: rules added after build\n");
+		return 1;
+	}
+
+	if (rule->saddr_len > 32 || rule->daddr_len > 32
+			|| rule->sport_min > rule->sport_max
+			|| rule->dport_min > rule->dport_max) {
+		fprintf(stderr, "classifier: invalid rule\n");
+		return 1;
+	}
+
+	if (cls->nrules == cls->size) {
+		cls->size = cls->size ? cls->size * 2 : 64;
+		cls->rules = realloc(cls->rules, sizeof(*cls->rules) * cls->size);
+		if (!cls->rules) {
+			fprintf(stderr, "classifier: error allocating rules\n");
+			return 1;
+		}
+	}
+
+	cls->rules[cls->nrules++] = *rule;
+
+	return 0;
+}
+
+unsigned classifier_port_prefixes(uint16_t min, uint16_t max, uint16_t *ports,
+		uint8_t *lens)
+{
+	uint32_t lo = min, hi = max;
+	unsigned n = 0, bits;
+
+	/* Take every time the largest aligned block starting at lo */
+	while (lo <= hi) {
+		bits = lo ? __builtin_ctz(lo) : 16;
+		while (bits && lo + (1U << bits) - 1 > hi)
+			bits--;
+
+		ports[n] = lo;
+		lens[n++] = 16 - bits;
+		lo += 1U << bits;
+	}
+
+	return n;
+}
+
+/* Entry of a tuple, collected before creating the maps */
+struct tuple_entry {
+	unsigned tuple;
+	struct classifier_key key;
+	struct classifier_match match;
+};
+
+static int find_tuple(struct classifier *cls, struct khashmap *tuple_ids,
+		const struct classifier_key *mask, unsigned *tuple, unsigned *size)
+{
+	unsigned *id = khashmap_lookup_elem(tuple_ids, (void *)mask);
+
+	if (id) {
+		*tuple = *id;
+		return 0;
+	}
+
+	if (cls->ntuples == *size) {
+		*size = *size ? *size * 2 : 64;
+		cls->tuples = realloc(cls->tuples, sizeof(*cls->tuples) * *size);
+		if (!cls->tuples) {
+			fprintf(stderr, "classifier: error allocating tuples\n");
+			return 1;
+		}
+	}
+
+	*tuple = cls->ntuples++;
+	cls->tuples[*tuple].mask = *mask;
+	/* Rules are visited in priority order, the first one is the best */
+	cls->tuples[*tuple].best = ~0U;
+
+	return khashmap_update_elem(tuple_ids, (void *)mask, tuple, 0);
+}
+
+static int cmp_tuples(const void *a, const void *b)
+{
+	const struct classifier_tuple *ta = a, *tb = b;
+
+	return ta->best < tb->best ? -1 : ta->best > tb->best;
+}
+
+int classifier_build(struct classifier *cls)
+{
+	uint16_t sports[MAX_PORT_PREFIXES], dports[MAX_PORT_PREFIXES];
+	uint8_t slens[MAX_PORT_PREFIXES], dlens[MAX_PORT_PREFIXES];
+	unsigned nentries = 0, size = 0, tuples_size = 0, nsp, ndp, t;
+	uint64_t max_tuples = (uint64_t)cls->nrules * MAX_PORT_PREFIXES
+			* MAX_PORT_PREFIXES;
+	struct tuple_entry *entries = NULL, *e;
+	struct classifier_match *match;
+	struct khashmap tuple_ids;
+	struct classifier_key mask;
+	unsigned *counts = NULL, nmaps = 0;
+	int ret = 1;
+
+	if (cls->tuples) {
+		fprintf(stderr, "classifier: already built\n");
+		return 1;
+	}
+
+	/* At most one tuple per entry */
+	if (max_tuples > MAX_TUPLES)
+		max_tuples = MAX_TUPLES;
+	if (khashmap_init(&tuple_ids, sizeof(struct classifier_key),
+			sizeof(unsigned), max_tuples + 1, 0)) {
+		return 1;
+	}
+
+	/* Every rule is an entry for each combination of its port prefixes */
+	for (unsigned r = 0; r < cls->nrules; r++) {
+		struct classifier_rule *rule = &cls->rules[r];
+
+		nsp = classifier_port_prefixes(rule->sport_min, rule->sport_max,
+				sports, slens);
+		ndp = classifier_port_prefixes(rule->dport_min, rule->dport_max,
+				dports, dlens);
+
+		for (unsigned i = 0; i < nsp; i++) {
+			for (unsigned j = 0; j < ndp; j++) {
+				if (nentries == size) {
+					size = size ? size * 2 : 1024;
+					entries = realloc(entries, sizeof(*entries) * size);
+					if (!entries) {
+						fprintf(stderr, "classifier: error allocating "
+								"entries\n");
+						goto out;
+					}
+				}
+
+				mask.saddr = addr_mask(rule->saddr_len);
+				mask.daddr = addr_mask(rule->daddr_len);
+				mask.sport = port_mask(slens[i]);
+				mask.dport = port_mask(dlens[j]);
+				mask.proto = rule->proto ? 0xff : 0;
+
+				e = &entries[nentries++];
+				if (find_tuple(cls, &tuple_ids, &mask, &e->tuple,
+						&tuples_size)) {
+					goto out;
+				}
+				e->key.saddr = rule->saddr;
+				e->key.daddr = rule->daddr;
+				e->key.sport = htons(sports[i]);
+				e->key.dport = htons(dports[j]);
+				e->key.proto = rule->proto;
+				mask_key(&e->key, &mask, &e->key);
+				e->match.priority = r;
+				e->match.action = rule->action;
+
+				if (cls->tuples[e->tuple].best > r)
+					cls->tuples[e->tuple].best = r;
+			}
+		}
+	}
+
+	/* Size the map of every tuple on its entries */
+	counts = calloc(cls->ntuples + 1, sizeof(*counts));
+	if (!counts) {
+		fprintf(stderr, "classifier: error allocating tuples\n");
+		goto out;
+	}
+	for (unsigned i = 0; i < nentries; i++)
+		counts[entries[i].tuple]++;
+
+	for (t = 0; t < cls->ntuples; t++, nmaps++) {
+		if (khashmap_init(&cls->tuples[t].map, sizeof(struct classifier_key),
+				sizeof(struct classifier_match), counts[t],
+				KHASHMAP_F_OPEN_ADDR)) {
+			goto out;
+		}
+	}
+
+	/*
+	 * Rules with the same masked key in a tuple match the same packets, the
+	 * first one hides the others
+	 */
+	for (unsigned i = 0; i < nentries; i++) {
+		e = &entries[i];
+		match = khashmap_lookup_elem(&cls->tuples[e->tuple].map, &e->key);
+		if (match)
+			continue;
+
+		if (khashmap_update_elem(&cls->tuples[e->tuple].map, &e->key,
+				&e->match, 0)) {
+			fprintf(stderr, "classifier: error adding rule %u\n",
+					e->match.priority);
+			goto out;
+		}
+	}
+
+	/* Indexes are no longer needed, tuples can be sorted */
+	qsort(cls->tuples, cls->ntuples, sizeof(*cls->tuples), cmp_tuples);
+
+	ret = 0;
+
+out:
+	if (ret) {
+		for (t = 0; t < nmaps; t++)
+			khashmap_free(&cls->tuples[t].map);
+		free(cls->tuples);
+		cls->tuples = NULL;
+		cls->ntuples = 0;
+	}
+	free(entries);
+	free(counts);
+	khashmap_free(&tuple_ids);
+
+	return ret;
+}
+
+const struct classifier_match *classifier_lookup(struct classifier *cls,
+		const struct classifier_key *key)
+{
+	const struct classifier_match *best = NULL, *match;
+	struct classifier_key masked;
+
+	for (int t = 0; t < cls->ntuples; t++) {
+		struct classifier_tuple *tuple = &cls->tuples[t];
+
+		/* Tuples are sorted, the following ones can't do better */
+		if (best && best->priority < tuple->best)
+			break;
+
+		mask_key(key, &tuple->mask, &masked);
+		match = khashmap_lookup_elem(&tuple->map, &masked);
+		if (match && (!best || match->priority < best->priority))
+			best = match;
+	}
+
+	return best;
+}
+
+void classifier_lookup_batch(struct classifier *cls,
+		struct classifier_key *keys, const struct classifier_match **matches,
+		unsigned n)
+{
+	struct classifier_key masked[n];
+	void *mkeys[n], *values[n];
+	const struct classifier_match *match;
+	unsigned pending[n], npending = n, m;
+
+	for (unsigned i = 0; i < n; i++) {
+		matches[i] = NULL;
+		pending[i] = i;
+	}
+
+	for (int t = 0; t < cls->ntuples && npending; t++) {
+		struct classifier_tuple *tuple = &cls->tuples[t];
+
+		/* Keys whose match can still be improved by this tuple */
+		m = 0;
+		for (unsigned i = 0; i < npending; i++) {
+			unsigned k = pending[i];
+
+			if (matches[k] && matches[k]->priority < tuple->best)
+				continue;
+
+			pending[m] = k;
+			mask_key(&keys[k], &tuple->mask, &masked[m]);
+			mkeys[m] = &masked[m];
+			m++;
+		}
+		npending = m;
+
+		khashmap_lookup_batch(&tuple->map, mkeys, values, npending);
+
+		for (unsigned i = 0; i < npending; i++) {
+			match = values[i];
+			if (match && (!matches[pending[i]]
+					|| match->priority < matches[pending[i]]->priority))
+				matches[pending[i]] = match;
+		}
+	}
+}
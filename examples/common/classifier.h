@@ -0,0 +1,86 @@
+#ifndef __XSKNF_COMMON_CLASSIFIER_H
+#define __XSKNF_COMMON_CLASSIFIER_H
+
+#include "khashmap.h"
+
+/*
+ * Multi-field classifier matching the 5-tuple of packets against rules with
+ * address prefixes, port ranges and an optional protocol. When more rules
+ * match a packet the one added first wins, like in iptables.
+ *
+ * It is based on tuple space search: rules are grouped by the prefix lengths
+ * of their fields (their tuple), with port ranges split into prefixes, and
+ * every tuple is an exact-match open-addressed khashmap on the masked fields.
+ * Tuples are probed in order of their best rule, a lookup stops as soon as
+ * no remaining tuple can hold a better rule than the one already found, so
+ * the cost grows with the number of tuples and not with the number of rules.
+ */
+
+/* Fields of the packet, in network byte order */
+struct classifier_key {
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t proto;
+} __attribute__((packed));
+
+struct classifier_rule {
+	uint32_t saddr;	/* network byte order */
+	uint32_t daddr;	/* network byte order */
+	uint8_t saddr_len;	/* prefix lengths, 0 = any address */
+	uint8_t daddr_len;
+	uint16_t sport_min;	/* inclusive ranges, host byte order */
+	uint16_t sport_max;
+	uint16_t dport_min;
+	uint16_t dport_max;
+	uint8_t proto;	/* 0 = any protocol */
+	int action;
+};
+
+struct classifier_match {
+	unsigned priority;	/* index of the rule, lower is better */
+	int action;
+};
+
+struct classifier_tuple {
+	struct classifier_key mask;
+	unsigned best;	/* priority of the best rule of the tuple */
+	struct khashmap map;	/* masked key -> struct classifier_match */
+};
+
+struct classifier {
+	struct classifier_rule *rules;
+	unsigned nrules;
+	unsigned size;
+	struct classifier_tuple *tuples;
+	unsigned ntuples;
+};
+
+void classifier_init(struct classifier *cls);
+void classifier_free(struct classifier *cls);
+
+/* Rules can only be added before building the classifier. Return 0 on success */
+int classifier_add_rule(struct classifier *cls,
+		const struct classifier_rule *rule);
+int classifier_build(struct classifier *cls);
+
+/* Returns the best rule matching key or NULL */
+const struct classifier_match *classifier_lookup(struct classifier *cls,
+		const struct classifier_key *key);
+/*
+ * Looks up n keys at once, probing every tuple for all the keys together to
+ * overlap the cache misses of the different lookups
+ */
+void classifier_lookup_batch(struct classifier *cls,
+		struct classifier_key *keys, const struct classifier_match **matches,
+		unsigned n);
+
+/*
+ * Splits the port range [min, max] in the smallest set of prefixes, stored in
+ * ports and lens (at most 30 of them). Returns their number
+ */
+unsigned classifier_port_prefixes(uint16_t min, uint16_t max, uint16_t *ports,
+		uint8_t *lens);
+
+#endif  /* __XSKNF_COMMON_CLASSIFIER_H */
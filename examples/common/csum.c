@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include "csum.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+typedef uint32_t (*csum_fn)(const void *buf, unsigned len, uint32_t sum);
+
+/*
+ * All the kernels add 32-bit words into 64-bit accumulators and fold the
+ * result at the end: since 2^16 = 1 mod 0xffff the ones' complement sum of the
+ * 32-bit words is the same as the one of the 16-bit words, and 2^32 - 1 is a
+ * multiple of 0xffff. Starting from an accumulator of 0 there's no overflow
+ * before 2^32 words
+ */
+static inline uint32_t fold64(uint64_t acc)
+{
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	return (uint32_t)acc;
+}
+
+/* Sum of the last bytes of the buffer, the data before them has even length */
+static inline uint64_t csum_tail(const uint8_t *p, unsigned len, uint64_t acc)
+{
+	uint32_t w;
+	uint16_t h;
+
+	while (len >= 4) {
+		memcpy(&w, p, 4);
+		acc += w;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&h, p, 2);
+		acc += h;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		acc += *p;
+#else
+		acc += (uint32_t)*p << 8;
+#endif
+	}
+
+	return acc;
+}
+
+static uint32_t csum_partial_scalar(const void *buf, unsigned len,
+		uint32_t sum)
+{
+	const uint8_t *p = buf;
+	uint64_t acc0 = sum, acc1 = 0;
+	uint32_t w[4];
+
+	/* Two independent chains to not be bound by the latency of the adds */
+	while (len >= 16) {
+		memcpy(w, p, 16);
+		acc0 += w[0];
+		acc1 += w[1];
+		acc0 += w[2];
+		acc1 += w[3];
+		p += 16;
+		len -= 16;
+	}
+
+	return fold64(csum_tail(p, len, acc0 + acc1));
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint32_t csum_partial_avx2(const void *buf, unsigned len, uint32_t sum)
+{
+	const uint8_t *p = buf;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+	uint64_t acc;
+
+	/* Zero-extend the 32-bit lanes to 64 bits and accumulate them */
+	while (len >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+		p += 32;
+		len -= 32;
+	}
+
+	acc0 = _mm256_add_epi64(acc0, acc1);
+	__m128i r = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+			_mm256_extracti128_si256(acc0, 1));
+	acc = (uint64_t)_mm_cvtsi128_si64(r) +
+			(uint64_t)_mm_extract_epi64(r, 1) + sum;
+
+	return fold64(csum_tail(p, len, acc));
+}
+
+__attribute__((target("avx512f")))
+static uint32_t csum_partial_avx512(const void *buf, unsigned len,
+		uint32_t sum)
+{
+	const uint8_t *p = buf;
+	__m512i zero = _mm512_setzero_si512();
+	__m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+	uint64_t acc;
+
+	while (len >= 64) {
+		__m512i v = _mm512_loadu_si512((const void *)p);
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v, zero));
+		p += 64;
+		len -= 64;
+	}
+
+	/* Remaining 32-byte block, if any, with a masked load */
+	if (len >= 32) {
+		__m512i v = _mm512_maskz_loadu_epi32(0xff, (const void *)p);
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v, zero));
+		p += 32;
+		len -= 32;
+	}
+
+	acc = _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1)) + sum;
+
+	return fold64(csum_tail(p, len, acc));
+}
+#elif defined(__aarch64__)
+static uint32_t csum_partial_neon(const void *buf, unsigned len, uint32_t sum)
+{
+	const uint8_t *p = buf;
+	uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+	uint64_t acc;
+
+	/* Pairwise add of the 32-bit lanes into the 64-bit accumulators */
+	while (len >= 32) {
+		acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+		acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+		p += 32;
+		len -= 32;
+	}
+
+	acc = vaddvq_u64(vaddq_u64(acc0, acc1)) + sum;
+
+	return fold64(csum_tail(p, len, acc));
+}
+#endif
+
+static int always(void)
+{
+	return 1;
+}
+
+#if defined(__x86_64__)
+static int has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+/* Available implementations, from the slowest to the fastest */
+static const struct {
+	const char *name;
+	csum_fn fn;
+	int (*supported)(void);
+} impls[] = {
+	{"scalar", csum_partial_scalar, always},
+#if defined(__x86_64__)
+	{"avx2", csum_partial_avx2, has_avx2},
+	{"avx512", csum_partial_avx512, has_avx512},
+#elif defined(__aarch64__)
+	{"neon", csum_partial_neon, always},
+#endif
+};
+
+#define NUM_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static unsigned cur_impl;
+
+__attribute__((constructor))
+static void csum_select_impl(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+#endif
+	for (unsigned i = 0; i < NUM_IMPLS; i++) {
+		if (impls[i].supported())
+			cur_impl = i;
+	}
+}
+
+uint32_t csum_partial(const void *buf, unsigned len, uint32_t sum)
+{
+	return impls[cur_impl].fn(buf, len, sum);
+}
+
+int csum_set_impl(const char *name)
+{
+	for (unsigned i = 0; i < NUM_IMPLS; i++) {
+		if (!strcmp(impls[i].name, name)) {
+			if (!impls[i].supported())
+				return -1;
+			cur_impl = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *csum_impl_name()
+{
+	return impls[cur_impl].name;
+}
@@ -0,0 +1,102 @@
+#ifndef __XSKNF_COMMON_CSUM_H
+#define __XSKNF_COMMON_CSUM_H
+
+#include <stdint.h>
+
+/*
+ * Internet checksum helpers. The inline ones only use integer arithmetic so
+ * that they can be shared with the eBPF programs, sums are kept unfolded in
+ * 32 bits and folded only at the end
+ */
+
+static inline uint16_t csum_fold(uint32_t csum)
+{
+	csum = (csum & 0xffff) + (csum >> 16);
+	csum = (csum & 0xffff) + (csum >> 16);
+	return ~csum;
+}
+
+static inline uint32_t csum_unfold(uint16_t n)
+{
+	return (uint32_t)n;
+}
+
+static inline uint32_t csum_add(uint32_t csum, uint32_t addend)
+{
+	csum += addend;
+	return csum + (csum < addend);
+}
+
+/*
+ * Incremental updates of a checksum field when a 32 or 16 bit word of the
+ * covered data changes from 'from' to 'to' (RFC 1624, HC' = ~(~HC + ~m + m')),
+ * as needed by NAT rewrites
+ */
+static inline void csum_replace4(uint16_t *sum, uint32_t from, uint32_t to)
+{
+	uint32_t csum = ~csum_unfold(*sum);
+
+	csum = csum_add(csum, ~from);
+	csum = csum_add(csum, to);
+	*sum = csum_fold(csum);
+}
+
+static inline void csum_replace2(uint16_t *sum, uint16_t from, uint16_t to)
+{
+	uint32_t csum = ~csum_unfold(*sum);
+
+	csum = csum_add(csum, (uint16_t)~from);
+	csum = csum_add(csum, to);
+	*sum = csum_fold(csum);
+}
+
+/*
+ * Same for the l4 checksum of a NAT rewrite changing both an address and a
+ * port, folding only once
+ */
+static inline void csum_replace4_2(uint16_t *sum, uint32_t from, uint32_t to,
+		uint16_t from_port, uint16_t to_port)
+{
+	uint32_t csum = ~csum_unfold(*sum);
+
+	csum = csum_add(csum, ~from);
+	csum = csum_add(csum, to);
+	csum = csum_add(csum, (uint16_t)~from_port);
+	csum = csum_add(csum, to_port);
+	*sum = csum_fold(csum);
+}
+
+/*
+ * Sum of the UDP/TCP over IPv4 pseudo-header, addresses and len in network
+ * byte order
+ */
+static inline uint32_t csum_tcpudp_nofold(uint32_t saddr, uint32_t daddr,
+		uint16_t len, uint8_t proto, uint32_t sum)
+{
+	sum = csum_add(sum, saddr);
+	sum = csum_add(sum, daddr);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	sum = csum_add(sum, (uint32_t)proto << 8);
+#else
+	sum = csum_add(sum, proto);
+#endif
+	return csum_add(sum, len);
+}
+
+#ifndef __bpf__
+/*
+ * Adds the ones' complement sum of len bytes of buf to sum and returns the
+ * unfolded result. The implementation (scalar, AVX2, AVX-512 or NEON) is
+ * picked at startup according to the CPU features
+ */
+uint32_t csum_partial(const void *buf, unsigned len, uint32_t sum);
+
+/*
+ * Forces the implementation used by csum_partial(), returns -1 if it does not
+ * exist or is not supported by the CPU
+ */
+int csum_set_impl(const char *name);
+const char *csum_impl_name();
+#endif
+
+#endif  /* __XSKNF_COMMON_CSUM_H */
@@ -1,7 +1,15 @@
+#define _GNU_SOURCE
 #include "khashmap.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <linux/jhash.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* Copied from the kernel */
 /**
@@ -25,13 +33,142 @@ static unsigned long roundup_pow_of_two(unsigned long n)
 	return 1;
 }
 
+/*
+ * Target load factor of open-addressed maps (in 1/4), keeps probe sequences
+ * short when the map is close to max_entries
+ */
+#define OA_LOAD_FACTOR 3
+
+#define OA_TAG_EMPTY 0
+#define OA_TAG_DELETED 1
+
+static int oa_init(struct khashmap *map)
+{
+	unsigned long slots = (unsigned long)map->max_entries * 4
+			/ OA_LOAD_FACTOR + 1;
+
+	map->n_buckets = roundup_pow_of_two((slots + KHASHMAP_OA_SLOTS - 1)
+			/ KHASHMAP_OA_SLOTS);
+
+	/* Elements are stored by slot, no need for the hash list node */
+	map->elem_size = round_up(map->key_size, 8) + round_up(map->value_size, 8);
+
+	map->oa_buckets = aligned_alloc(sizeof(struct khashmap_oa_bucket),
+			map->n_buckets * sizeof(struct khashmap_oa_bucket));
+	if (!map->oa_buckets) {
+		fprintf(stderr, "khashmap: error allocating buckets\n");
+		return 1;
+	}
+	__builtin_memset(map->oa_buckets, 0,
+			map->n_buckets * sizeof(struct khashmap_oa_bucket));
+
+	map->elems = calloc(map->elem_size,
+			(size_t)map->n_buckets * KHASHMAP_OA_SLOTS);
+	if (!map->elems) {
+		fprintf(stderr, "khashmap: error allocating elements\n");
+		return 1;
+	}
+
+	pthread_spin_init(&map->oa_lock, PTHREAD_PROCESS_PRIVATE);
+
+	return 0;
+}
+
+static inline struct khashmap_elem *get_elem(struct khashmap *map,
+		unsigned i)
+{
+	return map->elems + (size_t)i * map->elem_size;
+}
+
+static inline struct khashmap_freelist *this_freelist(struct khashmap *map)
+{
+	int cpu = sched_getcpu();
+
+	return &map->freelists[(cpu < 0 ? 0 : cpu) % KHASHMAP_NR_FREELISTS];
+}
+
+static void freelist_push(struct khashmap_freelist *fl,
+		struct khashmap_elem *elem)
+{
+	pthread_spin_lock(&fl->lock);
+	elem->free_next = fl->head;
+	fl->head = elem;
+	pthread_spin_unlock(&fl->lock);
+}
+
+static struct khashmap_elem *freelist_pop(struct khashmap *map)
+{
+	struct khashmap_freelist *fl = this_freelist(map);
+	struct khashmap_elem *elem;
+
+	/* Same as the kernel pcpu_freelist, steal from the others if empty */
+	for (int i = 0; i < KHASHMAP_NR_FREELISTS; i++) {
+		/* Avoid taking the lock of empty lists */
+		if (READ_ONCE(fl->head)) {
+			pthread_spin_lock(&fl->lock);
+			elem = fl->head;
+			if (elem) {
+				fl->head = elem->free_next;
+				pthread_spin_unlock(&fl->lock);
+				return elem;
+			}
+			pthread_spin_unlock(&fl->lock);
+		}
+
+		if (++fl == map->freelists + KHASHMAP_NR_FREELISTS)
+			fl = map->freelists;
+	}
+
+	return NULL;
+}
+
+/* Spreads all the elements among the free lists, as done at init */
+static void freelists_populate(struct khashmap *map)
+{
+	for (int i = 0; i < KHASHMAP_NR_FREELISTS; i++)
+		map->freelists[i].head = NULL;
+
+	for (int i = map->max_entries - 1; i >= 0; i--) {
+		struct khashmap_elem *elem = get_elem(map, i);
+		struct khashmap_freelist *fl =
+				&map->freelists[i % KHASHMAP_NR_FREELISTS];
+
+		elem->used = 0;
+		elem->ref = 0;
+		elem->free_next = fl->head;
+		fl->head = elem;
+	}
+}
+
 int khashmap_init(struct khashmap *map, uint32_t key_size, uint32_t value_size,
-		uint32_t max_entries)
+		uint32_t max_entries, uint32_t flags)
 {
 	map->key_size = key_size;
 	map->value_size = value_size;
 	map->max_entries = max_entries;
+	map->flags = flags;
 	map->count = 0;
+	map->clock_hand = 0;
+	map->buckets = NULL;
+	map->oa_buckets = NULL;
+	map->freelists = NULL;
+	map->snapshot = NULL;
+	map->snapshot_len = 0;
+
+	/*
+	 * Should be set to a random value but it introduces additional variability
+	 * in tests. eBPF maps use a random value.
+	 */
+	map->hashrnd = 0;
+
+	if (flags & KHASHMAP_F_OPEN_ADDR) {
+		if (flags & KHASHMAP_F_LRU) {
+			fprintf(stderr, "khashmap: LRU not supported by open-addressed "
+					"maps\n");
+			return 1;
+		}
+		return oa_init(map);
+	}
 
 	map->n_buckets = roundup_pow_of_two(map->max_entries);
 
@@ -44,12 +181,6 @@ int khashmap_init(struct khashmap *map, uint32_t key_size, uint32_t value_size,
 		return 1;
 	}
 
-	/*
-	 * Should be set to a random value but it introduces additional variability
-	 * in tests. eBPF maps use a random value.
-	 */
-	map->hashrnd = 0;
-
 	for (int i = 0; i < map->n_buckets; i++) {
 		INIT_HLIST_NULLS_HEAD(&map->buckets[i].head, i);
 		pthread_spin_init(&map->buckets[i].lock, PTHREAD_PROCESS_PRIVATE);
@@ -61,15 +192,31 @@ int khashmap_init(struct khashmap *map, uint32_t key_size, uint32_t value_size,
 		return 1;
 	}
 
-	map->next_free = map->elems;
+	map->freelists = aligned_alloc(sizeof(struct khashmap_freelist),
+			KHASHMAP_NR_FREELISTS * sizeof(struct khashmap_freelist));
+	if (!map->freelists) {
+		fprintf(stderr, "khashmap: error allocating free lists\n");
+		return 1;
+	}
+
+	for (int i = 0; i < KHASHMAP_NR_FREELISTS; i++)
+		pthread_spin_init(&map->freelists[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+	freelists_populate(map);
 
 	return 0;
 }
 
 void khashmap_free(struct khashmap *map)
 {
-	free(map->elems);
+	if (map->snapshot) {
+		munmap(map->snapshot, map->snapshot_len);
+	} else {
+		free(map->elems);
+		free(map->oa_buckets);
+	}
 	free(map->buckets);
+	free(map->freelists);
 	__builtin_memset(map, 0, sizeof(*map));
 }
 
@@ -106,8 +253,8 @@ static struct khashmap_elem *lookup_elem_raw(struct hlist_nulls_head *head,
 
 /* can be called without bucket lock. it will repeat the loop in
  * the unlikely event when elements moved from one bucket into another
- * while link list is being walked (why should an element be moved to another
- * bucket?)
+ * while link list is being walked (deleted and evicted elements are reused
+ * right away and can be linked in another bucket)
  */
 static struct khashmap_elem *lookup_nulls_elem_raw(
 		struct hlist_nulls_head *head, uint32_t hash, void *key,
@@ -127,23 +274,366 @@ again:
 	return NULL;
 }
 
+static inline uint16_t oa_tag(uint32_t hash)
+{
+	uint16_t tag = hash >> 16;
+
+	/* Values 0 and 1 are reserved for empty and deleted slots */
+	return tag > OA_TAG_DELETED ? tag : tag + 2;
+}
+
+static inline void *oa_elem(struct khashmap *map, uint32_t bucket,
+		unsigned slot)
+{
+	return map->elems + ((size_t)bucket * KHASHMAP_OA_SLOTS + slot)
+			* map->elem_size;
+}
+
+static inline void *oa_elem_value(struct khashmap *map, void *elem)
+{
+	return elem + round_up(map->key_size, 8);
+}
+
+/*
+ * Looks for the key in an open-addressed map. Can be called without the map
+ * lock, in that case the bucket sequence counter is used to detect concurrent
+ * updates and repeat the search.
+ * Returns the element or NULL and, if free_elem is not NULL and the key is not
+ * found, stores there the first slot available for the key (only meaningful
+ * with the map lock taken).
+ */
+static void *oa_lookup_elem_raw(struct khashmap *map, uint32_t hash, void *key,
+		void **free_elem, struct khashmap_oa_bucket **free_bucket)
+{
+	uint32_t mask = map->n_buckets - 1, b = hash & mask, seq;
+	uint16_t tag = oa_tag(hash);
+	struct khashmap_oa_bucket *bucket;
+	void *elem;
+	int end;
+
+	if (free_elem)
+		*free_elem = NULL;
+
+	for (unsigned probe = 0; probe < map->n_buckets; probe++, b = (b + 1) & mask) {
+		bucket = &map->oa_buckets[b];
+again:
+		seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			goto again;
+
+		elem = NULL;
+		end = 0;
+		for (unsigned i = 0; i < KHASHMAP_OA_SLOTS; i++) {
+			uint16_t t = __atomic_load_n(&bucket->tags[i], __ATOMIC_RELAXED);
+
+			if (t == tag) {
+				void *e = oa_elem(map, b, i);
+				if (!__builtin_memcmp(e, key, map->key_size)) {
+					elem = e;
+					break;
+				}
+			} else if (t <= OA_TAG_DELETED) {
+				if (free_elem && !*free_elem) {
+					*free_elem = oa_elem(map, b, i);
+					*free_bucket = bucket;
+				}
+				/* The key would have been stored in the first empty slot */
+				if (t == OA_TAG_EMPTY)
+					end = 1;
+			}
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) != seq)
+			goto again;
+
+		if (elem || end)
+			return elem;
+	}
+
+	return NULL;
+}
+
+static inline void oa_write_begin(struct khashmap_oa_bucket *bucket)
+{
+	__atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void oa_write_end(struct khashmap_oa_bucket *bucket)
+{
+	__atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELEASE);
+}
+
+static int oa_update_elem(struct khashmap *map, void *key, void *value)
+{
+	struct khashmap_oa_bucket *bucket;
+	void *elem, *free_elem;
+	uint32_t hash;
+	int ret;
+
+	hash = jhash(key, map->key_size, map->hashrnd);
+
+	ret = pthread_spin_lock(&map->oa_lock);
+	if (ret) {
+		fprintf(stderr, "khashmap: error acquiring map lock\n");
+		return 1;
+	}
+
+	elem = oa_lookup_elem_raw(map, hash, key, &free_elem, &bucket);
+	if (elem) {
+		/* Same as the chained map, data is replaced in place */
+		bucket = &map->oa_buckets[((elem - map->elems) / map->elem_size)
+				/ KHASHMAP_OA_SLOTS];
+		oa_write_begin(bucket);
+		__builtin_memcpy(oa_elem_value(map, elem), value, map->value_size);
+		oa_write_end(bucket);
+
+	} else if (!free_elem || map->count >= map->max_entries) {
+		ret = 1;
+
+	} else {
+		unsigned slot = ((free_elem - map->elems) / map->elem_size)
+				% KHASHMAP_OA_SLOTS;
+
+		oa_write_begin(bucket);
+		__builtin_memcpy(free_elem, key, map->key_size);
+		__builtin_memcpy(oa_elem_value(map, free_elem), value,
+				map->value_size);
+		__atomic_store_n(&bucket->tags[slot], oa_tag(hash), __ATOMIC_RELAXED);
+		oa_write_end(bucket);
+		map->count++;
+	}
+
+	pthread_spin_unlock(&map->oa_lock);
+	return ret;
+}
+
+static inline int oa_has_empty(struct khashmap_oa_bucket *bucket)
+{
+	for (unsigned i = 0; i < KHASHMAP_OA_SLOTS; i++) {
+		if (bucket->tags[i] == OA_TAG_EMPTY)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Tells if some element stored after bucket b probed through it. Probes never
+ * go past a bucket with an empty slot, the search stops at the first one
+ */
+static int oa_probed_through(struct khashmap *map, uint32_t b)
+{
+	uint32_t mask = map->n_buckets - 1, n = (b + 1) & mask, home;
+	struct khashmap_oa_bucket *bucket;
+
+	for (uint32_t dist = 1; dist < map->n_buckets; dist++, n = (n + 1) & mask) {
+		bucket = &map->oa_buckets[n];
+		for (unsigned i = 0; i < KHASHMAP_OA_SLOTS; i++) {
+			if (bucket->tags[i] <= OA_TAG_DELETED)
+				continue;
+
+			home = jhash(oa_elem(map, n, i), map->key_size, map->hashrnd)
+					& mask;
+			if (((n - home) & mask) >= dist)
+				return 1;
+		}
+
+		if (oa_has_empty(bucket))
+			return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Deleted slots are only needed by the probes of the elements stored in the
+ * following buckets. Kept forever, after some churn they make misses probe
+ * most of the map. Deleting an element stored in bucket b, whose home bucket
+ * is home, can only end the need of the buckets from home to b: going
+ * backwards, the deleted slots of the ones that no other element probes
+ * through become empty, which also shortens the searches of the buckets
+ * before. A bucket with an empty slot never has deleted ones. Lookups running
+ * meanwhile find their key either way
+ */
+static void oa_reclaim_deleted(struct khashmap *map, uint32_t b, uint32_t home)
+{
+	uint32_t mask = map->n_buckets - 1;
+	struct khashmap_oa_bucket *bucket;
+
+	for (;; b = (b - 1) & mask) {
+		bucket = &map->oa_buckets[b];
+		if (!oa_has_empty(bucket) && !oa_probed_through(map, b)) {
+			oa_write_begin(bucket);
+			for (unsigned i = 0; i < KHASHMAP_OA_SLOTS; i++) {
+				if (bucket->tags[i] == OA_TAG_DELETED)
+					__atomic_store_n(&bucket->tags[i], OA_TAG_EMPTY,
+							__ATOMIC_RELAXED);
+			}
+			oa_write_end(bucket);
+		}
+
+		if (b == home)
+			break;
+	}
+}
+
+static int oa_delete_elem(struct khashmap *map, void *key)
+{
+	struct khashmap_oa_bucket *bucket;
+	uint32_t hash;
+	size_t pos;
+	void *elem;
+	int ret, empty;
+
+	hash = jhash(key, map->key_size, map->hashrnd);
+
+	ret = pthread_spin_lock(&map->oa_lock);
+	if (ret) {
+		fprintf(stderr, "khashmap: error acquiring map lock\n");
+		return 1;
+	}
+
+	elem = oa_lookup_elem_raw(map, hash, key, NULL, NULL);
+	if (elem) {
+		pos = (elem - map->elems) / map->elem_size;
+		bucket = &map->oa_buckets[pos / KHASHMAP_OA_SLOTS];
+		/* Nothing probes through a bucket with an empty slot */
+		empty = oa_has_empty(bucket);
+		oa_write_begin(bucket);
+		__atomic_store_n(&bucket->tags[pos % KHASHMAP_OA_SLOTS],
+				empty ? OA_TAG_EMPTY : OA_TAG_DELETED, __ATOMIC_RELAXED);
+		oa_write_end(bucket);
+		map->count--;
+
+		if (!empty)
+			oa_reclaim_deleted(map, pos / KHASHMAP_OA_SLOTS,
+					hash & (map->n_buckets - 1));
+	} else {
+		ret = 2;
+	}
+
+	pthread_spin_unlock(&map->oa_lock);
+	return ret;
+}
+
+static void oa_lookup_batch(struct khashmap *map, void **keys, void **values,
+		unsigned n)
+{
+	uint32_t hashes[n];
+	unsigned i;
+
+	/* Hash all the keys and prefetch their buckets */
+	for (i = 0; i < n; i++) {
+		hashes[i] = jhash(keys[i], map->key_size, map->hashrnd);
+		__builtin_prefetch(&map->oa_buckets[hashes[i] & (map->n_buckets - 1)]);
+	}
+
+	/* Prefetch the element of the first matching tag in the home bucket */
+	for (i = 0; i < n; i++) {
+		uint32_t b = hashes[i] & (map->n_buckets - 1);
+		uint16_t tag = oa_tag(hashes[i]);
+
+		for (unsigned j = 0; j < KHASHMAP_OA_SLOTS; j++) {
+			if (map->oa_buckets[b].tags[j] == tag) {
+				__builtin_prefetch(oa_elem(map, b, j));
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		void *elem = oa_lookup_elem_raw(map, hashes[i], keys[i], NULL, NULL);
+		values[i] = elem ? oa_elem_value(map, elem) : NULL;
+	}
+}
+
+/*
+ * CLOCK eviction: elements are examined in order, the ones looked up since the
+ * last pass get a second chance, the first one that was not is unlinked and
+ * returned. Bucket locks are only tried, busy buckets are skipped.
+ */
+static struct khashmap_elem *evict_elem(struct khashmap *map)
+{
+	struct khashmap_elem *elem;
+	struct khashmap_bucket *b;
+
+	for (unsigned i = 0; i < 2 * map->max_entries; i++) {
+		elem = get_elem(map, atomic_fetch_add_explicit(&map->clock_hand, 1,
+				memory_order_relaxed) % map->max_entries);
+
+		if (!__atomic_load_n(&elem->used, __ATOMIC_ACQUIRE))
+			continue;
+
+		if (elem->ref) {
+			elem->ref = 0;
+			continue;
+		}
+
+		b = __select_bucket(map, elem->hash);
+		if (pthread_spin_trylock(&b->lock))
+			continue;
+
+		/* The element could have been deleted or reused in the meantime */
+		if (elem->used && __select_bucket(map, elem->hash) == b && !elem->ref) {
+			hlist_nulls_del(&elem->hash_node);
+			elem->used = 0;
+			map->count--;
+			pthread_spin_unlock(&b->lock);
+			return elem;
+		}
+
+		pthread_spin_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+static struct khashmap_elem *alloc_elem(struct khashmap *map)
+{
+	struct khashmap_elem *elem = freelist_pop(map);
+
+	if (!elem && (map->flags & KHASHMAP_F_LRU))
+		elem = evict_elem(map);
+
+	return elem;
+}
+
 int khashmap_update_elem(struct khashmap *map, void *key, void *value,
 		uint64_t map_flags)
 {
-	struct khashmap_elem *elem;
+	struct khashmap_elem *elem, *new_elem = NULL;
 	struct hlist_nulls_head *head;
 	struct khashmap_bucket *b;
 	uint32_t hash;
 	int ret;
 
+	if (map->flags & KHASHMAP_F_OPEN_ADDR) {
+		return oa_update_elem(map, key, value);
+	}
+
 	hash = jhash(key, map->key_size, map->hashrnd);
 
 	b = __select_bucket(map, hash);
 	head = &b->head;
 
+	/*
+	 * Like the kernel LRU map, the element is taken before locking the bucket
+	 * since eviction needs to lock other buckets
+	 */
+	if (map->flags & KHASHMAP_F_LRU) {
+		new_elem = alloc_elem(map);
+		if (!new_elem) {
+			return 1;
+		}
+	}
+
 	ret = pthread_spin_lock(&b->lock);
 	if (ret) {
 		fprintf(stderr, "khashmap: error acquiring bucket lock\n");
+		if (new_elem)
+			freelist_push(this_freelist(map), new_elem);
 		return 1;
 	}
 
@@ -156,21 +646,40 @@ int khashmap_update_elem(struct khashmap *map, void *key, void *value,
 	 */
 	elem = lookup_elem_raw(&b->head, hash, key, map->key_size);
 	if (!elem) {
-		elem = map->next_free;
-		map->next_free += map->elem_size;
+		elem = new_elem ? new_elem : freelist_pop(map);
+		if (!elem) {
+			pthread_spin_unlock(&b->lock);
+			return 1;
+		}
+		new_elem = NULL;
+
+		elem->hash = hash;
+		elem->ref = 0;
+		__builtin_memcpy(elem->key, key, map->key_size);
 		hlist_nulls_add_head(&elem->hash_node, head);
+		__atomic_store_n(&elem->used, 1, __ATOMIC_RELEASE);
 		map->count++;
 	}
 
-	elem->hash = hash;
-	__builtin_memcpy(elem->key, key, map->key_size);
 	__builtin_memcpy(elem->key + round_up(map->key_size, 8), value,
 			map->value_size);
 
 	pthread_spin_unlock(&b->lock);
+
+	/* The key was already there */
+	if (new_elem)
+		freelist_push(this_freelist(map), new_elem);
+
 	return 0;
 }
 
+/* Avoid dirtying the cache line when the bit is already set */
+static inline void set_ref(struct khashmap *map, struct khashmap_elem *l)
+{
+	if ((map->flags & KHASHMAP_F_LRU) && !l->ref)
+		l->ref = 1;
+}
+
 void *khashmap_lookup_elem(struct khashmap *map, void *key)
 {
 	struct hlist_nulls_head *head;
@@ -181,17 +690,63 @@ void *khashmap_lookup_elem(struct khashmap *map, void *key)
 
 	hash = jhash(key, key_size, map->hashrnd);
 
+	if (map->flags & KHASHMAP_F_OPEN_ADDR) {
+		l = oa_lookup_elem_raw(map, hash, key, NULL, NULL);
+		return l ? oa_elem_value(map, l) : NULL;
+	}
+
 	head = select_bucket(map, hash);
-	struct khashmap_bucket *b = __select_bucket(map, hash);
 
 	l = lookup_nulls_elem_raw(head, hash, key, key_size, map->n_buckets);
 
-	if (l)
+	if (l) {
+		set_ref(map, l);
 		return l->key + round_up(map->key_size, 8);
+	}
 
 	return NULL;
 }
 
+void khashmap_lookup_batch(struct khashmap *map, void **keys, void **values,
+		unsigned n)
+{
+	struct hlist_nulls_head *heads[n];
+	struct hlist_nulls_node *first;
+	uint32_t hashes[n];
+	struct khashmap_elem *l;
+	unsigned i;
+
+	if (map->flags & KHASHMAP_F_OPEN_ADDR) {
+		oa_lookup_batch(map, keys, values, n);
+		return;
+	}
+
+	/* Hash all the keys and prefetch their buckets */
+	for (i = 0; i < n; i++) {
+		hashes[i] = jhash(keys[i], map->key_size, map->hashrnd);
+		heads[i] = select_bucket(map, hashes[i]);
+		__builtin_prefetch(heads[i]);
+	}
+
+	/* Prefetch the first element of every chain */
+	for (i = 0; i < n; i++) {
+		first = READ_ONCE(heads[i]->first);
+		if (!is_a_nulls(first))
+			__builtin_prefetch(first);
+	}
+
+	for (i = 0; i < n; i++) {
+		l = lookup_nulls_elem_raw(heads[i], hashes[i], keys[i], map->key_size,
+				map->n_buckets);
+		if (l) {
+			set_ref(map, l);
+			values[i] = l->key + round_up(map->key_size, 8);
+		} else {
+			values[i] = NULL;
+		}
+	}
+}
+
 int khashmap_delete_elem(struct khashmap *map, void *key)
 {
 	struct hlist_nulls_head *head;
@@ -201,6 +756,10 @@ int khashmap_delete_elem(struct khashmap *map, void *key)
 	uint32_t hash, key_size;
 	int ret;
 
+	if (map->flags & KHASHMAP_F_OPEN_ADDR) {
+		return oa_delete_elem(map, key);
+	}
+
 	key_size = map->key_size;
 
 	hash = jhash(key, key_size, map->hashrnd);
@@ -217,19 +776,42 @@ int khashmap_delete_elem(struct khashmap *map, void *key)
 
 	if (l) {
 		hlist_nulls_del(&l->hash_node);
+		l->used = 0;
 		map->count--;
-		/* Should make the element available in a free list */
 	} else {
 		ret = 2;
 	}
 
 	pthread_spin_unlock(&b->lock);
+
+	if (l)
+		freelist_push(this_freelist(map), l);
+
 	return ret;
 }
 
 int khashmap_clear(struct khashmap *map) {
 	int ret;
 
+	if (map->flags & KHASHMAP_F_OPEN_ADDR) {
+		ret = pthread_spin_lock(&map->oa_lock);
+		if (ret) {
+			fprintf(stderr, "khashmap: error acquiring map lock\n");
+			return 1;
+		}
+
+		for (int i = 0; i < map->n_buckets; i++) {
+			oa_write_begin(&map->oa_buckets[i]);
+			__builtin_memset(map->oa_buckets[i].tags, 0,
+					sizeof(map->oa_buckets[i].tags));
+			oa_write_end(&map->oa_buckets[i]);
+		}
+		map->count = 0;
+
+		pthread_spin_unlock(&map->oa_lock);
+		return 0;
+	}
+
 	for (int i = 0; i < map->n_buckets; i++) {
 		ret = pthread_spin_lock(&map->buckets[i].lock);
 		if (ret) {
@@ -242,7 +824,179 @@ int khashmap_clear(struct khashmap *map) {
 		pthread_spin_unlock(&map->buckets[i].lock);
 	}
 
-	map->next_free = map->elems;
+	/* Not safe against concurrent updates, as it was before free lists */
+	for (int i = 0; i < KHASHMAP_NR_FREELISTS; i++)
+		pthread_spin_lock(&map->freelists[i].lock);
+
+	freelists_populate(map);
+	map->count = 0;
+
+	for (int i = 0; i < KHASHMAP_NR_FREELISTS; i++)
+		pthread_spin_unlock(&map->freelists[i].lock);
 
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Snapshot layout: the header padded to a page, the buckets and the elements.
+ * Buckets are a multiple of the cache line size, so both stay aligned when
+ * the file is mapped
+ */
+#define SNAPSHOT_MAGIC "KHMAPOA1"
+#define SNAPSHOT_HDR_SIZE 4096
+
+struct snapshot_hdr {
+	char magic[8];
+	uint32_t key_size;
+	uint32_t value_size;
+	uint32_t max_entries;
+	uint32_t n_buckets;
+	uint32_t elem_size;
+	uint32_t hashrnd;
+	uint32_t count;
+};
+
+static size_t snapshot_size(uint32_t n_buckets, uint32_t elem_size)
+{
+	return SNAPSHOT_HDR_SIZE + (size_t)n_buckets
+			* (sizeof(struct khashmap_oa_bucket)
+			+ (size_t)KHASHMAP_OA_SLOTS * elem_size);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+int khashmap_save(struct khashmap *map, const char *path)
+{
+	char hdr_buf[SNAPSHOT_HDR_SIZE] = {}, tmp_path[4096];
+	struct snapshot_hdr *hdr = (struct snapshot_hdr *)hdr_buf;
+	int fd, ret;
+
+	if (!(map->flags & KHASHMAP_F_OPEN_ADDR)) {
+		fprintf(stderr, "khashmap: only open-addressed maps can be saved\n");
+		return 1;
+	}
+
+	/* Written aside and renamed, a crash never leaves a truncated snapshot */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "khashmap: error creating %s: %s\n", tmp_path,
+				strerror(errno));
+		return 1;
+	}
+
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->key_size = map->key_size;
+	hdr->value_size = map->value_size;
+	hdr->max_entries = map->max_entries;
+	hdr->n_buckets = map->n_buckets;
+	hdr->elem_size = map->elem_size;
+	hdr->hashrnd = map->hashrnd;
+
+	/* Updates are blocked while saving, so all the sequence counters are even */
+	if (pthread_spin_lock(&map->oa_lock)) {
+		fprintf(stderr, "khashmap: error acquiring map lock\n");
+		close(fd);
+		return 1;
+	}
+
+	hdr->count = map->count;
+	ret = write_all(fd, hdr_buf, sizeof(hdr_buf))
+			|| write_all(fd, map->oa_buckets, map->n_buckets
+			* sizeof(struct khashmap_oa_bucket))
+			|| write_all(fd, map->elems, (size_t)map->n_buckets
+			* KHASHMAP_OA_SLOTS * map->elem_size);
+
+	pthread_spin_unlock(&map->oa_lock);
+
+	if (close(fd) || ret) {
+		fprintf(stderr, "khashmap: error writing %s\n", tmp_path);
+		unlink(tmp_path);
+		return 1;
+	}
+
+	if (rename(tmp_path, path)) {
+		fprintf(stderr, "khashmap: error renaming %s: %s\n", tmp_path,
+				strerror(errno));
+		unlink(tmp_path);
+		return 1;
+	}
+
+	return 0;
+}
+
+int khashmap_load(struct khashmap *map, const char *path, uint32_t key_size,
+		uint32_t value_size)
+{
+	struct snapshot_hdr *hdr;
+	struct stat st;
+	void *mem;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 1;
+	}
+
+	if (fstat(fd, &st) || st.st_size < SNAPSHOT_HDR_SIZE) {
+		fprintf(stderr, "khashmap: invalid snapshot %s\n", path);
+		close(fd);
+		return 1;
+	}
+
+	/* Pages are read in advance, the first lookups don't fault */
+	mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "khashmap: error mapping %s: %s\n", path,
+				strerror(errno));
+		return 1;
+	}
+
+	hdr = mem;
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))
+			|| hdr->key_size != key_size || hdr->value_size != value_size
+			|| hdr->elem_size != round_up(key_size, 8) + round_up(value_size, 8)
+			|| !hdr->n_buckets || (hdr->n_buckets & (hdr->n_buckets - 1))
+			|| st.st_size != snapshot_size(hdr->n_buckets, hdr->elem_size)) {
+		fprintf(stderr, "khashmap: snapshot %s does not match the map\n",
+				path);
+		munmap(mem, st.st_size);
+		return 1;
+	}
+
+	memset(map, 0, sizeof(*map));
+	map->key_size = key_size;
+	map->value_size = value_size;
+	map->max_entries = hdr->max_entries;
+	map->flags = KHASHMAP_F_OPEN_ADDR;
+	map->n_buckets = hdr->n_buckets;
+	map->elem_size = hdr->elem_size;
+	map->hashrnd = hdr->hashrnd;
+	map->count = hdr->count;
+	map->oa_buckets = mem + SNAPSHOT_HDR_SIZE;
+	map->elems = mem + SNAPSHOT_HDR_SIZE
+			+ (size_t)map->n_buckets * sizeof(struct khashmap_oa_bucket);
+	map->snapshot = mem;
+	map->snapshot_len = st.st_size;
+	pthread_spin_init(&map->oa_lock, PTHREAD_PROCESS_PRIVATE);
+
+	return 0;
+}
@@ -1,34 +1,99 @@
+#ifndef __XSKNF_COMMON_KHASHMAP_H
+#define __XSKNF_COMMON_KHASHMAP_H
+
 #include <linux/list_nulls.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdint.h>
 
+/*
+ * Map flags
+ *
+ * KHASHMAP_F_OPEN_ADDR: open-addressed layout meant for read-mostly tables.
+ * Every bucket is a cache line holding the 16 bit tags of its slots, so a
+ * lookup usually touches only the bucket and the matching element. Lookups
+ * never write shared memory, updates are serialized by a map-wide lock and
+ * published to lookups through a per-bucket sequence counter.
+ */
+#define KHASHMAP_F_OPEN_ADDR (1U << 0)
+/*
+ * KHASHMAP_F_LRU: when the map is full an update evicts an element that was
+ * not looked up recently instead of failing, like BPF_MAP_TYPE_LRU_HASH. The
+ * LRU is approximated with the CLOCK algorithm on a reference bit set by
+ * lookups. Not supported together with KHASHMAP_F_OPEN_ADDR.
+ */
+#define KHASHMAP_F_LRU (1U << 1)
+
+/*
+ * Number of free lists of a chained map. Elements are taken from and returned
+ * to the list of the current cpu (workers are pinned so this is in practice a
+ * per-worker list), and stolen from the other lists when it is empty
+ */
+#define KHASHMAP_NR_FREELISTS 16
+
 struct khashmap_bucket {
 	struct hlist_nulls_head head;
 	pthread_spinlock_t lock;
 };
 
+#define KHASHMAP_OA_SLOTS 30
+
+struct khashmap_elem;
+
+struct khashmap_freelist {
+	pthread_spinlock_t lock;
+	struct khashmap_elem *head;
+} __attribute__((aligned(64)));
+
+struct khashmap_oa_bucket {
+	uint32_t seq;	/* odd while the bucket is being updated */
+	uint16_t tags[KHASHMAP_OA_SLOTS];	/* 0 = empty, 1 = deleted */
+} __attribute__((aligned(64)));
+
 struct khashmap {
+	/* Fields read by lookups, never written after init */
 	uint32_t key_size;
 	uint32_t value_size;
 	uint32_t max_entries;
+	uint32_t flags;
 	struct khashmap_bucket *buckets;
+	struct khashmap_oa_bucket *oa_buckets;
 	void *elems;
-	void *next_free;	/* For the moment just use elements sequentially */
-	atomic_int count;	/* number of elements in this hashtable */
 	uint32_t n_buckets;	/* number of hash buckets */
 	uint32_t elem_size;	/* size of each element in bytes */
 	uint32_t hashrnd;
+
+	struct khashmap_freelist *freelists;
+	/* File mapping backing the map when loaded from a snapshot */
+	void *snapshot;
+	size_t snapshot_len;
+
+	/* Fields written by updates, kept away from the lookup ones */
+	atomic_int count __attribute__((aligned(64)));	/* number of elements in this hashtable */
+	atomic_uint clock_hand;	/* next element examined by LRU eviction */
+	pthread_spinlock_t oa_lock;	/* serializes updates of open-addressed maps */
 };
 
 struct khashmap_elem {
-	struct hlist_nulls_node hash_node;
+	union {
+		struct hlist_nulls_node hash_node;
+		struct {
+			void *padding;
+			/*
+			 * Free list link, it overlaps pprev so that next is still valid
+			 * for lockless lookups walking a just deleted element
+			 */
+			struct khashmap_elem *free_next;
+		};
+	};
 	uint32_t hash;
+	uint8_t used;	/* linked in a bucket */
+	uint8_t ref;	/* looked up since the last CLOCK pass */
 	char key[] __attribute__((aligned(8)));
 };
 
 int khashmap_init(struct khashmap *map, uint32_t key_size, uint32_t value_size,
-		uint32_t max_entries);
+		uint32_t max_entries, uint32_t flags);
 void khashmap_free(struct khashmap *map);
 
 size_t khashmap_size(const struct khashmap *map);
@@ -36,5 +101,24 @@ size_t khashmap_size(const struct khashmap *map);
 int khashmap_update_elem(struct khashmap *map, void *key, void *value,
 		uint64_t map_flags);
 void *khashmap_lookup_elem(struct khashmap *map, void *key);
+/*
+ * Looks up n keys at once overlapping the cache misses of the different
+ * lookups. values[i] is set to the value associated to keys[i] or to NULL.
+ */
+void khashmap_lookup_batch(struct khashmap *map, void **keys, void **values,
+		unsigned n);
 int khashmap_delete_elem(struct khashmap *map, void *key);
-int khashmap_clear(struct khashmap *map);
\ No newline at end of file
+int khashmap_clear(struct khashmap *map);
+
+/*
+ * Snapshots of open-addressed maps. khashmap_save() writes the buckets and the
+ * elements of the map as they are in memory, khashmap_load() maps such a file
+ * (privately, later updates are not written back) and uses it directly as the
+ * storage of the map, without hashing or copying the elements. The key and
+ * value sizes must match the ones of the saved map. Return 0 on success
+ */
+int khashmap_save(struct khashmap *map, const char *path);
+int khashmap_load(struct khashmap *map, const char *path, uint32_t key_size,
+		uint32_t value_size);
+
+#endif  /* __XSKNF_COMMON_KHASHMAP_H */
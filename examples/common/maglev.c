@@ -0,0 +1,58 @@
+#include "maglev.h"
+#include <linux/jhash.h>
+#include <stdlib.h>
+
+#define MAGLEV_EMPTY (~0U)
+
+/* Seeds of the hashes giving the offset and skip of the permutations */
+#define OFFSET_SEED 0xdeadbeef
+#define SKIP_SEED 0x5bd1e995
+
+int maglev_build(const void *keys, uint32_t key_size, unsigned n,
+		unsigned size, unsigned *table)
+{
+	uint32_t *offset, *skip, *next, pos;
+	unsigned filled = 0;
+
+	if (n == 0 || n > size) {
+		return -1;
+	}
+
+	offset = malloc(sizeof(uint32_t) * n * 3);
+	if (!offset) {
+		return -1;
+	}
+	skip = offset + n;
+	next = skip + n;
+
+	for (unsigned i = 0; i < n; i++) {
+		const void *key = keys + (size_t)i * key_size;
+
+		offset[i] = jhash(key, key_size, OFFSET_SEED) % size;
+		skip[i] = jhash(key, key_size, SKIP_SEED) % (size - 1) + 1;
+		next[i] = 0;
+	}
+
+	for (unsigned p = 0; p < size; p++) {
+		table[p] = MAGLEV_EMPTY;
+	}
+
+	/*
+	 * size is prime, every permutation visits all the positions and there is
+	 * always a free one until the table is full
+	 */
+	for (;;) {
+		for (unsigned i = 0; i < n; i++) {
+			do {
+				pos = (offset[i] + (uint64_t)next[i] * skip[i]) % size;
+				next[i]++;
+			} while (table[pos] != MAGLEV_EMPTY);
+
+			table[pos] = i;
+			if (++filled == size) {
+				free(offset);
+				return 0;
+			}
+		}
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef __XSKNF_COMMON_MAGLEV_H
+#define __XSKNF_COMMON_MAGLEV_H
+
+#include <stdint.h>
+
+/*
+ * Maglev consistent hashing (Eisenbud et al., NSDI '16). Every backend has its
+ * own permutation of the positions of the lookup table, derived from the hash
+ * of its name, and backends take turns claiming the next free position of
+ * their permutation until the table is full. Every backend ends up with
+ * almost the same share of positions, and adding or removing one moves few
+ * positions besides its own.
+ * The size of the table must be a prime number, much larger than the number
+ * of backends for an even share.
+ */
+
+/*
+ * Fills table with the indexes of the n backends, keys holds their names of
+ * key_size bytes each. Returns -1 if n is 0 or larger than size
+ */
+int maglev_build(const void *keys, uint32_t key_size, unsigned n,
+		unsigned size, unsigned *table);
+
+#endif  /* __XSKNF_COMMON_MAGLEV_H */
@@ -5,7 +5,7 @@
 #include <stdlib.h>
 #include <time.h>
 
-#define NSTATS 13
+#define NSTATS 16
 
 struct socket_stats_ps {
 	/* Ring level stats */
@@ -24,6 +24,9 @@ struct socket_stats_ps {
 	double tx_wakeup_sendtos;
 	double tx_trigger_sendtos;
 	double opt_polls;
+	double idle_polls;
+	double steered_npkts;
+	double tx_backpressure_npkts;
 };
 
 static unsigned long start_time;
@@ -111,9 +114,81 @@ static void print_socket_stats(struct xsknf_socket_stats *stats,
 				stats->tx_trigger_sendtos);
 		printf(fmt, "opt polls", stats_ps->opt_polls,
 				stats->opt_polls);
+		printf(fmt, "idle polls", stats_ps->idle_polls,
+				stats->idle_polls);
+		printf(fmt, "steered pkts", stats_ps->steered_npkts,
+				stats->steered_npkts);
+		printf(fmt, "tx backpressure", stats_ps->tx_backpressure_npkts,
+				stats->tx_backpressure_npkts);
 	}
 }
 
+static const char *hist_names[XSKNF_NUM_HISTS] = {
+	[XSKNF_HIST_LATENCY] = "rx-tx (us)",
+	[XSKNF_HIST_PROCESS] = "process (us)",
+	[XSKNF_HIST_BATCH] = "batch (pkts)",
+};
+
+/* Times are converted in microseconds, batch sizes are left as they are */
+static double hist_scale(enum xsknf_hist_type type)
+{
+	return type == XSKNF_HIST_BATCH ? 1 : 1000000. / xsknf_tsc_hz();
+}
+
+static void acc_hist(struct xsknf_hist *acc, struct xsknf_hist *hist)
+{
+	acc->count += hist->count;
+	acc->sum += hist->sum;
+	if (hist->max > acc->max)
+		acc->max = hist->max;
+	for (int i = 0; i < XSKNF_HIST_BUCKETS; i++)
+		acc->buckets[i] += hist->buckets[i];
+}
+
+static void print_hists(struct xsknf_hist *hists)
+{
+	char *fmt = "%-18s %-10.2f %-10.2f %-10.2f %-10.2f %-10.2f\n";
+	double scale;
+
+	printf("%-18s %-10s %-10s %-10s %-10s %-10s\n", "", "mean", "p50", "p99",
+			"p99.9", "max");
+	for (int i = 0; i < XSKNF_NUM_HISTS; i++) {
+		scale = hist_scale(i);
+		printf(fmt, hist_names[i], hists[i].count
+				? (double)hists[i].sum / hists[i].count * scale : 0,
+				xsknf_hist_percentile(&hists[i], 50) * scale,
+				xsknf_hist_percentile(&hists[i], 99) * scale,
+				xsknf_hist_percentile(&hists[i], 99.9) * scale,
+				hists[i].max * scale);
+	}
+}
+
+/*
+ * Histograms are cumulative since the start, percentiles of the whole run are
+ * the ones of the last dump
+ */
+static void dump_hists(struct xsknf_config *config)
+{
+	static struct xsknf_hist hists[XSKNF_NUM_HISTS],
+			total[XSKNF_NUM_HISTS];
+	char buff[256];
+
+	memset(total, 0, sizeof(total));
+	for (int i = 0; i < config->workers; i++) {
+		for (int j = 0; j < XSKNF_NUM_HISTS; j++) {
+			xsknf_get_hist(i, j, &hists[j]);
+			acc_hist(&total[j], &hists[j]);
+		}
+
+		snprintf(buff, 256, " latency@wrk%d", i);
+		printf("\n%s\n", buff);
+		print_hists(hists);
+	}
+
+	printf("\n%s\n", " TOTAL latency");
+	print_hists(total);
+}
+
 void init_stats()
 {
 	start_time = get_nsecs();
@@ -154,9 +229,13 @@ void dump_stats(struct xsknf_config config, struct bpf_object *obj,
 
 		printf("\n%-19s", " TOTAL");
 		print_socket_stats(&total, &total_ps, dt, extra_stats, app_stats);
+
+		if (config.histograms)
+			dump_hists(&config);
 	}
 
-	if (config.working_mode & MODE_XDP) {
+	/* The eBPF programs don't count packets with --no-xdp-stats */
+	if (config.working_mode & MODE_XDP && !config.no_xdp_stats) {
 		unsigned int nr_cpus = libbpf_num_possible_cpus();
 		unsigned long total_xdp = 0;
 		double total_xdp_pps = 0;
@@ -233,7 +312,7 @@ void print_stats(struct xsknf_config *config, struct bpf_object *obj)
 			}
 		}
 
-	} else if (config->working_mode & MODE_XDP) {
+	} else if (config->working_mode & MODE_XDP && !config->no_xdp_stats) {
 		unsigned int nr_cpus = libbpf_num_possible_cpus();
 		struct xdp_cpu_stats values[nr_cpus];
 		int i, xdp_stats, zero = 0;
@@ -260,5 +339,29 @@ void print_stats(struct xsknf_config *config, struct bpf_object *obj)
 
 	fprintf(statsf, "%lu\n", total_rx);
 
+	/*
+	 * With histograms the following lines hold p50, p99, p99.9 and max of
+	 * every histogram of all the workers, the first line stays the same
+	 */
+	if (config->working_mode == MODE_AF_XDP && config->histograms) {
+		static struct xsknf_hist hist, total;
+		double scale;
+
+		for (int j = 0; j < XSKNF_NUM_HISTS; j++) {
+			memset(&total, 0, sizeof(total));
+			for (int i = 0; i < config->workers; i++) {
+				xsknf_get_hist(i, j, &hist);
+				acc_hist(&total, &hist);
+			}
+
+			scale = hist_scale(j);
+			fprintf(statsf, "%.3f %.3f %.3f %.3f\n",
+					xsknf_hist_percentile(&total, 50) * scale,
+					xsknf_hist_percentile(&total, 99) * scale,
+					xsknf_hist_percentile(&total, 99.9) * scale,
+					total.max * scale);
+		}
+	}
+
 	fclose(statsf);
 }
\ No newline at end of file
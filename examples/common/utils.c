@@ -1,4 +1,9 @@
 #include "utils.h"
+#include <bpf/bpf.h>
+#include <errno.h>
+
+/* Kernel internal error code, returned for unsupported batch operations */
+#define ENOTSUPP 524
 
 void hex_dump(void *pkt, size_t length)
 {
@@ -29,4 +34,63 @@ void hex_dump(void *pkt, size_t length)
 		}
 	}
 	printf("\n");
-}
\ No newline at end of file
+}
+
+static int batch_unsupported(int err)
+{
+	return err == EINVAL || err == ENOTSUPP || err == EOPNOTSUPP;
+}
+
+int map_update_batch(int fd, const void *keys, const void *values, uint32_t n,
+		size_t key_size, size_t value_size)
+{
+	uint32_t count = n;
+
+	if (n == 0 || !bpf_map_update_batch(fd, keys, values, &count, NULL))
+		return 0;
+
+	if (!batch_unsupported(errno))
+		return -1;
+
+	/* Kernels before 5.6, count tells how many entries went in anyway */
+	for (uint32_t i = count < n ? count : 0; i < n; i++) {
+		if (bpf_map_update_elem(fd, keys + i * key_size,
+				values + i * value_size, 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+int map_delete_batch(int fd, const void *keys, uint32_t n, size_t key_size)
+{
+	uint32_t count;
+
+	while (n > 0) {
+		count = n;
+		if (!bpf_map_delete_batch(fd, keys, &count, NULL))
+			return 0;
+
+		if (count > n)
+			count = 0;
+
+		if (errno == ENOENT) {
+			/* The batch stops at the first missing key, skip it */
+			count++;
+		} else if (batch_unsupported(errno)) {
+			for (uint32_t i = count; i < n; i++) {
+				if (bpf_map_delete_elem(fd, keys + i * key_size)
+						&& errno != ENOENT)
+					return -1;
+			}
+			return 0;
+		} else {
+			return -1;
+		}
+
+		keys += count * key_size;
+		n -= count;
+	}
+
+	return 0;
+}
@@ -17,4 +17,14 @@ static void __exit_with_error(int error, const char *file, const char *func,
 #define exit_with_error(error) __exit_with_error(error, __FILE__, __func__, \
 		__LINE__)
 
-void hex_dump(void *pkt, size_t length);
\ No newline at end of file
+void hex_dump(void *pkt, size_t length);
+
+/*
+ * Add or replace (update) and delete n entries of a BPF map with a single
+ * syscall when the kernel supports batch operations, one syscall per entry
+ * otherwise. Keys and values are stored in two separate arrays. Deleting a
+ * missing key is not an error. Return 0 on success or -1 with errno set
+ */
+int map_update_batch(int fd, const void *keys, const void *values, uint32_t n,
+		size_t key_size, size_t value_size);
+int map_delete_batch(int fd, const void *keys, uint32_t n, size_t key_size);
\ No newline at end of file
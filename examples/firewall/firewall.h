@@ -8,4 +8,50 @@ struct session_id {
 	uint16_t sport;
 	uint16_t dport;
 	uint8_t proto;
-} __attribute__((packed));
\ No newline at end of file
+} __attribute__((packed));
+
+/*
+ * Wildcard rules in XDP mode, classified with bit vectors: every field of the
+ * packet is looked up in its own map (LPM tries for addresses and ports, an
+ * array for the protocol) that returns the bitmap of the rules matching that
+ * field. The first bit set in the AND of the bitmaps is the matching rule
+ */
+#define MAX_WILDCARD_RULES 1024
+#define WILDCARD_WORDS (MAX_WILDCARD_RULES / 64)
+/* Ports ranges are stored as prefixes, up to 30 for every range */
+#define MAX_WILDCARD_PORTS (MAX_WILDCARD_RULES * 30)
+
+struct rule_bitmap {
+	uint64_t bits[WILDCARD_WORDS];
+};
+
+struct addr_lpm_key {
+	uint32_t prefixlen;
+	uint32_t addr;
+} __attribute__((packed));
+
+struct port_lpm_key {
+	uint32_t prefixlen;
+	uint16_t port;
+} __attribute__((packed));
+
+/*
+ * Binary ACL, written by tests/scripts/gen-acl.py --binary and loaded without
+ * any parsing. The header is followed by the keys of the nrules rules and, at
+ * the first multiple of 8 bytes after them, by their actions (int, -1 = DROP).
+ * Header and actions are in host byte order, keys as in the packet
+ */
+#define ACL_BIN_MAGIC 0x4c434158	/* "XACL" */
+
+struct acl_bin_header {
+	uint32_t magic;
+	uint32_t nrules;
+};
+
+static inline uint64_t acl_bin_actions_offset(uint32_t nrules)
+{
+	uint64_t off = sizeof(struct acl_bin_header)
+			+ (uint64_t)nrules * sizeof(struct session_id);
+
+	return (off + 7) & ~7ULL;
+}
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <bpf/bpf_helpers.h>
+#include <xsknf_kern.h>
 
 /* 
  * Including the common/statistics.h header creates problems with other
@@ -24,13 +25,6 @@ struct {
 	__uint(max_entries, 1);
 } xdp_stats SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_XSKMAP);
-	__uint(key_size, sizeof(int));
-	__uint(value_size, sizeof(int));
-	__uint(max_entries, 32);
-} xsks SEC(".maps");
-
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, struct session_id);
@@ -38,40 +32,94 @@ struct {
 	__uint(max_entries, MAX_ACL_SIZE);
 } acl SEC(".maps");
 
-SEC("xdp") int handle_xdp(struct xdp_md *ctx)
+/* Wildcard rules, see firewall.h */
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct addr_lpm_key);
+	__type(value, struct rule_bitmap);
+	__uint(max_entries, MAX_WILDCARD_RULES + 1);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} wc_saddr SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct addr_lpm_key);
+	__type(value, struct rule_bitmap);
+	__uint(max_entries, MAX_WILDCARD_RULES + 1);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} wc_daddr SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct port_lpm_key);
+	__type(value, struct rule_bitmap);
+	__uint(max_entries, MAX_WILDCARD_PORTS + 1);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} wc_sport SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct port_lpm_key);
+	__type(value, struct rule_bitmap);
+	__uint(max_entries, MAX_WILDCARD_PORTS + 1);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} wc_dport SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, int);
+	__type(value, struct rule_bitmap);
+	__uint(max_entries, 256);
+} wc_proto SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, int);
+	__type(value, int);
+	__uint(max_entries, MAX_WILDCARD_RULES);
+} wc_actions SEC(".maps");
+
+/*
+ * Counts the packet and parses its 5-tuple. Returns -1 if the packet has been
+ * handled (the action is stored in *action) or 0 if key is valid
+ */
+static __always_inline int parse_packet(struct xdp_md *ctx,
+		struct session_id *key, int *action)
 {
 	void *data = (void *)(long)ctx->data;
 	void *data_end = (void *)(long)ctx->data_end;
-	struct session_id key = {0};
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return XDP_ABORTED;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			*action = XDP_ABORTED;
+			return -1;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
-
-	/*
-	 * Need to send the at least one packet to user space for busy polling to
-	 * work in combined mode.
-	 * In pure XDP the redirect will fail and the packet will be dropped.
-	 */
-	if (stats->rx_npkts == 1) {
-		return bpf_redirect_map(&xsks, 0, XDP_DROP);
+
+	/* Starts busy polling in combined mode (see xsknf_kern.h) */
+	if (xsknf_bootstrapping(ctx)) {
+		*action = xsknf_redirect(ctx, XDP_DROP);
+		return -1;
 	}
 
+	*action = XDP_ABORTED;
+
 	struct ethhdr *eth = data;
 	if ((void *)(eth + 1) > data_end) {
-		return XDP_ABORTED;
+		return -1;
 	}
 
 	if (eth->h_proto != htons(ETH_P_IP)) {
-		return XDP_TX;
+		*action = XDP_TX;
+		return -1;
 	}
 
 	struct iphdr *iph = (void *)(eth + 1);
 	if ((void *)(iph + 1) > data_end) {
-		return XDP_ABORTED;
+		return -1;
 	}
 
 	void *next = (void *)iph + (iph->ihl << 2);
@@ -80,32 +128,45 @@ SEC("xdp") int handle_xdp(struct xdp_md *ctx)
 	case IPPROTO_TCP:;
 		struct tcphdr *tcph = next;
 		if ((void *)(tcph + 1) > data_end) {
-			return XDP_ABORTED;
+			return -1;
 		}
 
-		key.sport = tcph->source;
-		key.dport = tcph->dest;
+		key->sport = tcph->source;
+		key->dport = tcph->dest;
 
 		break;
 
 	case IPPROTO_UDP:;
 		struct udphdr *udph = next;
 		if ((void *)(udph + 1) > data_end) {
-			return XDP_ABORTED;
+			return -1;
 		}
 
-		key.sport = udph->source;
-		key.dport = udph->dest;
+		key->sport = udph->source;
+		key->dport = udph->dest;
 
 		break;
 
 	default:
-		return XDP_TX;
+		*action = XDP_TX;
+		return -1;
 	}
 
-	key.saddr = iph->saddr;
-	key.daddr = iph->daddr;
-	key.proto = iph->protocol;
+	key->saddr = iph->saddr;
+	key->daddr = iph->daddr;
+	key->proto = iph->protocol;
+
+	return 0;
+}
+
+SEC("xdp") int handle_xdp(struct xdp_md *ctx)
+{
+	struct session_id key = {0};
+	int verdict;
+
+	if (parse_packet(ctx, &key, &verdict)) {
+		return verdict;
+	}
 
 	int *action = bpf_map_lookup_elem(&acl, &key);
 	if (action) {
@@ -115,4 +176,60 @@ SEC("xdp") int handle_xdp(struct xdp_md *ctx)
 	}
 }
 
+/* No ctz instruction in eBPF, w must not be 0 */
+static __always_inline int lowest_bit(__u64 w)
+{
+	int n = 0;
+
+	if (!(w & 0xffffffff)) { n += 32; w >>= 32; }
+	if (!(w & 0xffff)) { n += 16; w >>= 16; }
+	if (!(w & 0xff)) { n += 8; w >>= 8; }
+	if (!(w & 0xf)) { n += 4; w >>= 4; }
+	if (!(w & 0x3)) { n += 2; w >>= 2; }
+	if (!(w & 0x1)) { n += 1; }
+
+	return n;
+}
+
+/* Wildcard rules, see firewall.h */
+SEC("xdp") int handle_xdp_wildcard(struct xdp_md *ctx)
+{
+	struct addr_lpm_key akey = {.prefixlen = 32};
+	struct port_lpm_key pkey = {.prefixlen = 16};
+	struct rule_bitmap *s, *d, *sp, *dp, *pr;
+	struct session_id key = {0};
+	int verdict, proto, rule;
+
+	if (parse_packet(ctx, &key, &verdict)) {
+		return verdict;
+	}
+
+	akey.addr = key.saddr;
+	s = bpf_map_lookup_elem(&wc_saddr, &akey);
+	akey.addr = key.daddr;
+	d = bpf_map_lookup_elem(&wc_daddr, &akey);
+	pkey.port = key.sport;
+	sp = bpf_map_lookup_elem(&wc_sport, &pkey);
+	pkey.port = key.dport;
+	dp = bpf_map_lookup_elem(&wc_dport, &pkey);
+	proto = key.proto;
+	pr = bpf_map_lookup_elem(&wc_proto, &proto);
+	if (!s || !d || !sp || !dp || !pr) {
+		return XDP_TX;
+	}
+
+	/* Rules are sorted by priority, take the first one matching all fields */
+	for (int i = 0; i < WILDCARD_WORDS; i++) {
+		__u64 w = s->bits[i] & d->bits[i] & sp->bits[i] & dp->bits[i]
+				& pr->bits[i];
+		if (w) {
+			rule = i * 64 + lowest_bit(w);
+			int *action = bpf_map_lookup_elem(&wc_actions, &rule);
+			return action ? *action : XDP_TX;
+		}
+	}
+
+	return XDP_TX;
+}
+
 char _license[] SEC("license") = "GPL";
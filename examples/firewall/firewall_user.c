@@ -1,4 +1,5 @@
 #include "firewall.h"
+#include "../common/classifier.h"
 #include "../common/khashmap.h"
 #include "../common/statistics.h"
 #include <arpa/inet.h>
@@ -15,6 +16,7 @@
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <xsknf.h>
 
@@ -23,6 +25,10 @@ static int opt_quiet;
 static int opt_extra_stats;
 static int opt_app_stats;
 static char *opt_acl_path = "./acl.txt";
+static char *opt_acl_diff_path = "./acl-diff.txt";
+static char *opt_snapshot_path;
+static int opt_wildcard;
+static volatile sig_atomic_t reload_pending;
 
 struct bpf_object *obj;
 struct xsknf_config config;
@@ -30,32 +36,662 @@ struct xsknf_config config;
 #define IP_STRLEN 16
 #define ACTION_STRLEN 5
 #define PROTO_STRLEN 4
+/* addr/len */
+#define PREFIX_STRLEN 19
+/* min-max */
+#define RANGE_STRLEN 12
 
 struct khashmap acl;
+struct classifier wc_acl;
+static int acl_map = -1;
 
-static void init_acl(const char *acl_path)
+/*
+ * Reads the next rule of f in the format of the ACL file. Returns 1 on
+ * success, 0 at the end of the file and -1 if the rule is malformed
+ */
+static int read_rule(FILE *f, struct session_id *sid, int *act)
 {
 	char saddr[IP_STRLEN], daddr[IP_STRLEN], action[ACTION_STRLEN],
 			proto[PROTO_STRLEN];
 	unsigned sport, dport;
-	FILE *f = fopen(acl_path, "r");
-	struct session_id sid;
 	struct in_addr addr;
-	unsigned nrules;
-	int i, ret, act, acl_map = -1;
+	int ret;
 
-	printf("Loading the ACL...\n");
+	ret = fscanf(f, " %15s %15s %u %u %3s %4s ", saddr, daddr, &sport, &dport,
+			proto, action);
+	if (ret == EOF) {
+		return 0;
+	} else if (ret < 6) {
+		fprintf(stderr, "ERROR: malformed rule\n");
+		return -1;
+	}
 
-	if (f == NULL) {
-		exit_with_error(errno);
+	if (!inet_aton(saddr, &addr)) {
+		fprintf(stderr, "ERROR: invalid address %s\n", saddr);
+		return -1;
+	}
+	sid->saddr = addr.s_addr;
+
+	if (!inet_aton(daddr, &addr)) {
+		fprintf(stderr, "ERROR: invalid address %s\n", daddr);
+		return -1;
+	}
+	sid->daddr = addr.s_addr;
+
+	sid->sport = htons(sport);
+	sid->dport = htons(dport);
+
+	if (strcmp(proto, "TCP") == 0) {
+		sid->proto = IPPROTO_TCP;
+	} else if (strcmp(proto, "UDP") == 0) {
+		sid->proto = IPPROTO_UDP;
+	} else {
+		fprintf(stderr, "Unexpected L4 protocol: %s\n", proto);
+		return -1;
+	}
+
+	if (strcmp(action, "DROP") == 0) {
+		*act = -1;
+	} else {
+		*act = atoi(action);
+	}
+
+	/* The eBPF program only knows about drops */
+	if (config.working_mode != MODE_AF_XDP) {
+		*act = XDP_DROP;
+	}
+
+	return 1;
+}
+
+static int parse_prefix(const char *str, uint32_t *addr, uint8_t *len)
+{
+	char buf[PREFIX_STRLEN + 1], *slash, *end;
+	struct in_addr in;
+	unsigned long l = 32;
+
+	strcpy(buf, str);
+	slash = strchr(buf, '/');
+	if (slash) {
+		*slash = '\0';
+		l = strtoul(slash + 1, &end, 10);
+		if (*end || end == slash + 1 || l > 32) {
+			return -1;
+		}
+	}
+
+	if (!inet_aton(buf, &in)) {
+		return -1;
+	}
+
+	*addr = in.s_addr;
+	*len = l;
+
+	return 0;
+}
+
+static int parse_range(const char *str, uint16_t *min, uint16_t *max)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	if (strcmp(str, "*") == 0) {
+		*min = 0;
+		*max = 65535;
+		return 0;
+	}
+
+	lo = hi = strtoul(str, &end, 10);
+	if (end == str) {
+		return -1;
+	}
+	if (*end == '-') {
+		str = end + 1;
+		hi = strtoul(str, &end, 10);
+		if (end == str) {
+			return -1;
+		}
+	}
+
+	if (*end || lo > hi || hi > 65535) {
+		return -1;
+	}
+
+	*min = lo;
+	*max = hi;
+
+	return 0;
+}
+
+/*
+ * Same as read_rule() for the wildcard ACL, where addresses can be prefixes
+ * (addr/len), ports can be ranges (min-max) and both ports and protocol can be
+ * * to match anything
+ */
+static int read_wildcard_rule(FILE *f, struct classifier_rule *rule)
+{
+	char saddr[PREFIX_STRLEN + 1], daddr[PREFIX_STRLEN + 1],
+			sport[RANGE_STRLEN], dport[RANGE_STRLEN], action[ACTION_STRLEN],
+			proto[PROTO_STRLEN];
+	int ret;
+
+	ret = fscanf(f, " %19s %19s %11s %11s %3s %4s ", saddr, daddr, sport,
+			dport, proto, action);
+	if (ret == EOF) {
+		return 0;
+	} else if (ret < 6) {
+		fprintf(stderr, "ERROR: malformed rule\n");
+		return -1;
+	}
+
+	if (parse_prefix(saddr, &rule->saddr, &rule->saddr_len)) {
+		fprintf(stderr, "ERROR: invalid prefix %s\n", saddr);
+		return -1;
+	}
+
+	if (parse_prefix(daddr, &rule->daddr, &rule->daddr_len)) {
+		fprintf(stderr, "ERROR: invalid prefix %s\n", daddr);
+		return -1;
+	}
+
+	if (parse_range(sport, &rule->sport_min, &rule->sport_max)) {
+		fprintf(stderr, "ERROR: invalid port range %s\n", sport);
+		return -1;
+	}
+
+	if (parse_range(dport, &rule->dport_min, &rule->dport_max)) {
+		fprintf(stderr, "ERROR: invalid port range %s\n", dport);
+		return -1;
+	}
+
+	if (strcmp(proto, "TCP") == 0) {
+		rule->proto = IPPROTO_TCP;
+	} else if (strcmp(proto, "UDP") == 0) {
+		rule->proto = IPPROTO_UDP;
+	} else if (strcmp(proto, "*") == 0) {
+		rule->proto = 0;
+	} else {
+		fprintf(stderr, "Unexpected L4 protocol: %s\n", proto);
+		return -1;
+	}
+
+	/*
+	 * The first matching rule wins, in XDP mode rules that don't drop must
+	 * stop the search too and send the packet back
+	 */
+	if (strcmp(action, "DROP") == 0) {
+		rule->action = config.working_mode == MODE_AF_XDP ? -1 : XDP_DROP;
+	} else {
+		rule->action = config.working_mode == MODE_AF_XDP ? atoi(action)
+				: XDP_TX;
+	}
+
+	return 1;
+}
+
+/* Prefix of a field of the wildcard rules, in host byte order */
+struct wc_prefix {
+	uint32_t len;
+	uint32_t value;
+};
+
+struct wc_entry {
+	struct wc_prefix prefix;
+	struct rule_bitmap rules;
+};
+
+static inline uint32_t wc_mask(uint32_t len, unsigned bits)
+{
+	return len ? (uint32_t)(~0ULL << (bits - len)) & (uint32_t)~(~0ULL << bits)
+			: 0;
+}
+
+static int cmp_wc_entries(const void *a, const void *b)
+{
+	const struct wc_prefix *pa = a, *pb = b;
+
+	if (pa->len != pb->len) {
+		return pa->len < pb->len ? -1 : 1;
+	}
+	return pa->value < pb->value ? -1 : pa->value > pb->value;
+}
+
+/*
+ * Builds the bitmaps of a field from the prefixes of the rules, entries holds
+ * n of them with one bit set each and some free space for the /0 prefix.
+ * The longest prefix of the trie matching a packet is covered by all the
+ * prefixes matching it, hence the bitmap of every prefix holds the rules of
+ * all its parents. Returns the number of distinct prefixes left in entries
+ */
+static unsigned build_wc_field(struct wc_entry *entries, unsigned n,
+		unsigned bits)
+{
+	struct wc_entry *parent, key;
+	unsigned m = 0;
+
+	/* Packets matching none of the prefixes must find an empty bitmap */
+	memset(&entries[n++], 0, sizeof(*entries));
+
+	qsort(entries, n, sizeof(*entries), cmp_wc_entries);
+	for (unsigned i = 0; i < n; i++) {
+		if (m && !cmp_wc_entries(&entries[m - 1], &entries[i])) {
+			for (int w = 0; w < WILDCARD_WORDS; w++) {
+				entries[m - 1].rules.bits[w] |= entries[i].rules.bits[w];
+			}
+		} else {
+			entries[m++] = entries[i];
+		}
+	}
+
+	/* Sorted by length, the parents of a prefix are already complete */
+	for (unsigned i = 0; i < m; i++) {
+		for (int len = entries[i].prefix.len - 1; len >= 0; len--) {
+			key.prefix.len = len;
+			key.prefix.value = entries[i].prefix.value & wc_mask(len, bits);
+			parent = bsearch(&key, entries, i, sizeof(*entries),
+					cmp_wc_entries);
+			if (parent) {
+				for (int w = 0; w < WILDCARD_WORDS; w++) {
+					entries[i].rules.bits[w] |= parent->rules.bits[w];
+				}
+				break;
+			}
+		}
+	}
+
+	return m;
+}
+
+static inline void wc_set_rule(struct wc_entry *e, uint32_t value, uint32_t len,
+		unsigned bits, unsigned rule)
+{
+	memset(e, 0, sizeof(*e));
+	e->prefix.len = len;
+	e->prefix.value = value & wc_mask(len, bits);
+	e->rules.bits[rule / 64] = 1ULL << (rule % 64);
+}
+
+static int wc_map_fd(const char *name)
+{
+	struct bpf_map *map = bpf_object__find_map_by_name(obj, name);
+	int fd = bpf_map__fd(map);
+
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: no %s map found: %s\n", name, strerror(fd));
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static void fill_wc_addr_map(const char *name, struct wc_entry *entries,
+		unsigned n)
+{
+	struct addr_lpm_key *keys = malloc(sizeof(*keys) * (n + 1));
+	struct rule_bitmap *values = malloc(sizeof(*values) * (n + 1));
+
+	if (!keys || !values) {
+		exit_with_error(ENOMEM);
+	}
+
+	n = build_wc_field(entries, n, 32);
+	for (unsigned i = 0; i < n; i++) {
+		keys[i].prefixlen = entries[i].prefix.len;
+		keys[i].addr = htonl(entries[i].prefix.value);
+		values[i] = entries[i].rules;
+	}
+
+	if (map_update_batch(wc_map_fd(name), keys, values, n, sizeof(*keys),
+			sizeof(*values))) {
+		fprintf(stderr, "ERROR: unable to fill %s: %s\n", name,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	free(keys);
+	free(values);
+}
+
+static void fill_wc_port_map(const char *name, struct wc_entry *entries,
+		unsigned n)
+{
+	struct port_lpm_key *keys = malloc(sizeof(*keys) * (n + 1));
+	struct rule_bitmap *values = malloc(sizeof(*values) * (n + 1));
+
+	if (!keys || !values) {
+		exit_with_error(ENOMEM);
+	}
+
+	n = build_wc_field(entries, n, 16);
+	for (unsigned i = 0; i < n; i++) {
+		keys[i].prefixlen = entries[i].prefix.len;
+		keys[i].port = htons(entries[i].prefix.value);
+		values[i] = entries[i].rules;
+	}
+
+	if (map_update_batch(wc_map_fd(name), keys, values, n, sizeof(*keys),
+			sizeof(*values))) {
+		fprintf(stderr, "ERROR: unable to fill %s: %s\n", name,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	free(keys);
+	free(values);
+}
+
+/* Bit-vector maps of handle_xdp_wildcard(), see firewall.h */
+static void load_wildcard_xdp(struct classifier_rule *rules, unsigned nrules)
+{
+	uint16_t ports[32];
+	uint8_t lens[32];
+	struct rule_bitmap protos[256] = {0};
+	int keys[MAX_WILDCARD_RULES], actions[MAX_WILDCARD_RULES];
+	struct wc_entry *entries;
+	unsigned n;
+
+	entries = malloc(sizeof(*entries) * (MAX_WILDCARD_PORTS + 1));
+	if (!entries) {
+		exit_with_error(ENOMEM);
+	}
+
+	for (unsigned r = 0; r < nrules; r++) {
+		wc_set_rule(&entries[r], ntohl(rules[r].saddr), rules[r].saddr_len, 32,
+				r);
+	}
+	fill_wc_addr_map("wc_saddr", entries, nrules);
+
+	for (unsigned r = 0; r < nrules; r++) {
+		wc_set_rule(&entries[r], ntohl(rules[r].daddr), rules[r].daddr_len, 32,
+				r);
+	}
+	fill_wc_addr_map("wc_daddr", entries, nrules);
+
+	n = 0;
+	for (unsigned r = 0; r < nrules; r++) {
+		unsigned np = classifier_port_prefixes(rules[r].sport_min,
+				rules[r].sport_max, ports, lens);
+		for (unsigned i = 0; i < np; i++) {
+			wc_set_rule(&entries[n++], ports[i], lens[i], 16, r);
+		}
+	}
+	fill_wc_port_map("wc_sport", entries, n);
+
+	n = 0;
+	for (unsigned r = 0; r < nrules; r++) {
+		unsigned np = classifier_port_prefixes(rules[r].dport_min,
+				rules[r].dport_max, ports, lens);
+		for (unsigned i = 0; i < np; i++) {
+			wc_set_rule(&entries[n++], ports[i], lens[i], 16, r);
+		}
+	}
+	fill_wc_port_map("wc_dport", entries, n);
+
+	for (int i = 0; i < MAX_WILDCARD_RULES; i++) {
+		keys[i] = i;
+	}
+
+	for (int p = 0; p < 256; p++) {
+		for (unsigned r = 0; r < nrules; r++) {
+			if (!rules[r].proto || rules[r].proto == p) {
+				protos[p].bits[r / 64] |= 1ULL << (r % 64);
+			}
+		}
+	}
+
+	for (unsigned r = 0; r < nrules; r++) {
+		actions[r] = rules[r].action;
+	}
+
+	if (map_update_batch(wc_map_fd("wc_proto"), keys, protos, 256,
+			sizeof(int), sizeof(*protos))
+			|| map_update_batch(wc_map_fd("wc_actions"), keys, actions,
+			nrules, sizeof(int), sizeof(int))) {
+		fprintf(stderr, "ERROR: unable to fill wildcard maps: %s\n",
+				strerror(errno));
+		exit(EXIT_FAILURE);
 	}
 
-	/* The first line shall contain the number of rules */
+	free(entries);
+}
+
+/*
+ * Wildcard ACL, same as the text one with the format of read_wildcard_rule().
+ * Rules are matched in the order of the file
+ */
+static void load_acl_wildcard(FILE *f)
+{
+	struct classifier_rule rule;
+	unsigned nrules, i = 0;
+	int ret;
+
 	if(fscanf(f, "%u\n", &nrules) != 1) {
 		exit_with_error(-1);
 	}
 
-	khashmap_init(&acl, sizeof(struct session_id), sizeof(int), MAX_ACL_SIZE);
+	if (config.working_mode != MODE_AF_XDP && nrules > MAX_WILDCARD_RULES) {
+		fprintf(stderr, "ERROR: too many wildcard rules for XDP (max %d)\n",
+				MAX_WILDCARD_RULES);
+		exit(EXIT_FAILURE);
+	}
+
+	classifier_init(&wc_acl);
+
+	while (i <= nrules && (ret = read_wildcard_rule(f, &rule)) > 0) {
+		if (classifier_add_rule(&wc_acl, &rule)) {
+			exit(EXIT_FAILURE);
+		}
+		i++;
+	}
+
+	if (ret < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (i != nrules) {
+		fprintf(stderr, "Incorrent input file: mismatch in rules number\n");
+		exit(-1);
+	}
+
+	if (config.working_mode == MODE_AF_XDP) {
+		if (classifier_build(&wc_acl)) {
+			exit(EXIT_FAILURE);
+		}
+		printf("Added %d rules in %u tuples\n", nrules, wc_acl.ntuples);
+	} else {
+		load_wildcard_xdp(wc_acl.rules, nrules);
+		printf("Added %d rules\n", nrules);
+	}
+}
+
+/* Saves the ACL of AF_XDP mode, if requested, to restart quickly */
+static void save_snapshot()
+{
+	if (!opt_snapshot_path || config.working_mode != MODE_AF_XDP) {
+		return;
+	}
+
+	if (khashmap_save(&acl, opt_snapshot_path)) {
+		fprintf(stderr, "WARNING: unable to save the ACL snapshot\n");
+	}
+}
+
+/*
+ * Adds (or replaces) and deletes rules of the running ACL. Rules are updated
+ * in place, so the lookups of the workers see either the old or the new
+ * version of every rule but never a missing one
+ */
+static int update_acl(struct session_id *add_keys, int *add_acts, unsigned nadd,
+		struct session_id *del_keys, unsigned ndel)
+{
+	if (config.working_mode == MODE_AF_XDP) {
+		for (int i = 0; i < ndel; i++) {
+			khashmap_delete_elem(&acl, &del_keys[i]);
+		}
+		for (int i = 0; i < nadd; i++) {
+			if (khashmap_update_elem(&acl, &add_keys[i], &add_acts[i], 0)) {
+				fprintf(stderr, "ERROR: unable to add rule to hash map\n");
+				return -1;
+			}
+		}
+	} else {
+		/* One syscall per batch instead of one per rule */
+		if (map_delete_batch(acl_map, del_keys, ndel,
+				sizeof(struct session_id))) {
+			fprintf(stderr, "ERROR: unable to delete rules from bpf map: "
+					"%s\n", strerror(errno));
+			return -1;
+		}
+		if (map_update_batch(acl_map, add_keys, add_acts, nadd,
+				sizeof(struct session_id), sizeof(int))) {
+			fprintf(stderr, "ERROR: unable to add rules to bpf map: %s\n",
+					strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Action of a rule of the running ACL, -1 if it is not there */
+static int lookup_rule(struct session_id *key, int *act)
+{
+	int *val;
+
+	if (config.working_mode == MODE_AF_XDP) {
+		val = khashmap_lookup_elem(&acl, key);
+		if (!val) {
+			return -1;
+		}
+		*act = *val;
+		return 0;
+	}
+
+	return bpf_map_lookup_elem(acl_map, key, act) ? -1 : 0;
+}
+
+/* Text ACL, the first line holds the number of rules */
+static void load_acl_text(FILE *f)
+{
+	struct session_id *keys;
+	unsigned nrules;
+	int i, ret, *acts;
+
+	if(fscanf(f, "%u\n", &nrules) != 1) {
+		exit_with_error(-1);
+	}
+
+	if (nrules > MAX_ACL_SIZE) {
+		fprintf(stderr, "ERROR: too many rules (max %d)\n", MAX_ACL_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	/* One more slot to detect extra rules */
+	keys = malloc(sizeof(*keys) * (nrules + 1));
+	acts = malloc(sizeof(*acts) * (nrules + 1));
+	if (!keys || !acts) {
+		exit_with_error(ENOMEM);
+	}
+
+	i = 0;
+	while (i <= nrules && (ret = read_rule(f, &keys[i], &acts[i])) > 0) {
+		i++;
+	}
+
+	if (ret < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (i != nrules) {
+		fprintf(stderr, "Incorrent input file: mismatch in rules number\n");
+		exit(-1);
+	}
+
+	if (update_acl(keys, acts, nrules, NULL, 0)) {
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Added %d rules\n", nrules);
+
+	free(keys);
+	free(acts);
+}
+
+/*
+ * Binary ACL (see firewall.h), the arrays of the file are mapped and passed
+ * as they are to the batch update of the BPF map
+ */
+static void load_acl_bin(FILE *f)
+{
+	struct acl_bin_header *hdr;
+	struct session_id *keys;
+	int *acts, *xdp_acts = NULL;
+	size_t len, acts_off;
+	void *mem;
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+
+	mem = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fileno(f), 0);
+	if (mem == MAP_FAILED) {
+		exit_with_error(errno);
+	}
+
+	/* Mappings are page sized, nrules can be read before checking len */
+	hdr = mem;
+	acts_off = acl_bin_actions_offset(hdr->nrules);
+	if (len < sizeof(*hdr) || len != acts_off + sizeof(int) * hdr->nrules) {
+		fprintf(stderr, "ERROR: truncated binary ACL\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (hdr->nrules > MAX_ACL_SIZE) {
+		fprintf(stderr, "ERROR: too many rules (max %d)\n", MAX_ACL_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	keys = mem + sizeof(*hdr);
+	acts = mem + acts_off;
+
+	/* Same as read_rule(), the eBPF program only knows about drops */
+	if (config.working_mode != MODE_AF_XDP) {
+		xdp_acts = malloc(sizeof(int) * (hdr->nrules + 1));
+		if (!xdp_acts) {
+			exit_with_error(ENOMEM);
+		}
+		for (int i = 0; i < hdr->nrules; i++) {
+			xdp_acts[i] = XDP_DROP;
+		}
+		acts = xdp_acts;
+	}
+
+	if (update_acl(keys, acts, hdr->nrules, NULL, 0)) {
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Added %d rules\n", hdr->nrules);
+
+	free(xdp_acts);
+	munmap(mem, len);
+}
+
+static void init_acl(const char *acl_path)
+{
+	uint32_t magic = 0;
+	FILE *f;
+
+	printf("Loading the ACL...\n");
+
+	if (opt_wildcard) {
+		f = fopen(acl_path, "r");
+		if (f == NULL) {
+			exit_with_error(errno);
+		}
+		load_acl_wildcard(f);
+		fclose(f);
+		return;
+	}
+
 	if (config.working_mode & MODE_XDP) {
 		struct bpf_map *map = bpf_object__find_map_by_name(obj, "acl");
 		acl_map = bpf_map__fd(map);
@@ -65,70 +701,183 @@ static void init_acl(const char *acl_path)
 		}
 	}
 
-	i = 0;
-	while (fscanf(f, " %s %s %u %u %s %s ", saddr, daddr, &sport, &dport,
-			proto, action) != EOF) {
-		inet_aton(saddr, &addr);
-		sid.saddr = addr.s_addr;
+	/* The snapshot already holds the hash table, nothing else to do */
+	if (opt_snapshot_path && config.working_mode == MODE_AF_XDP
+			&& !khashmap_load(&acl, opt_snapshot_path,
+			sizeof(struct session_id), sizeof(int))) {
+		printf("Loaded %zu rules from snapshot %s\n", khashmap_size(&acl),
+				opt_snapshot_path);
+		return;
+	}
 
-		inet_aton(daddr, &addr);
-		sid.daddr = addr.s_addr;
+	khashmap_init(&acl, sizeof(struct session_id), sizeof(int), MAX_ACL_SIZE,
+			KHASHMAP_F_OPEN_ADDR);
 
-		sid.sport = htons(sport);
-		sid.dport = htons(dport);
+	f = fopen(acl_path, "r");
+	if (f == NULL) {
+		exit_with_error(errno);
+	}
 
-		if (strcmp(proto, "TCP") == 0) {
-			sid.proto = IPPROTO_TCP;
-		} else if (strcmp(proto, "UDP") == 0) {
-			sid.proto = IPPROTO_UDP;
-		} else {
-			fprintf(stderr, "Unexpected L4 protocol: %s\n", proto);
-			exit(EXIT_FAILURE);
-		}
+	if (fread(&magic, sizeof(magic), 1, f) == 1 && magic == ACL_BIN_MAGIC) {
+		load_acl_bin(f);
+	} else {
+		rewind(f);
+		load_acl_text(f);
+	}
 
-		if (strcmp(action, "DROP") == 0) {
-			act = -1;
-		} else {
-			act = atoi(action);
+	fclose(f);
+
+	save_snapshot();
+}
+
+/*
+ * Applies the diff file to the running ACL. Every line is a rule in the format
+ * of the ACL file preceded by + (add or replace) or - (delete), e.g. as
+ * produced by
+ * diff --old-line-format='- %L' --new-line-format='+ %L'
+ * 		--unchanged-line-format='' old-acl new-acl
+ * The whole file is parsed before touching the ACL, so a malformed diff is not
+ * applied at all, and one that fails in the middle is undone. Rules both
+ * deleted and added are just replaced
+ */
+static void apply_acl_diff(const char *diff_path)
+{
+	struct session_id sid, *add_keys = NULL, *del_keys = NULL;
+	struct session_id *undo_keys = NULL, *undo_del = NULL;
+	unsigned nadd = 0, ndel = 0, size = 0, nundo = 0, nundo_del = 0;
+	int act, *add_acts = NULL, *undo_acts = NULL;
+	struct khashmap added;
+	FILE *f;
+	char op;
+
+	if (opt_wildcard) {
+		fprintf(stderr, "WARNING: diffs are not supported by the wildcard "
+				"ACL, restart to change it\n");
+		return;
+	}
+
+	printf("Applying ACL diff %s...\n", diff_path);
+
+	f = fopen(diff_path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "ERROR: unable to open %s: %s\n", diff_path,
+				strerror(errno));
+		return;
+	}
+
+	while (fscanf(f, " %c", &op) == 1) {
+		if ((op != '+' && op != '-') || read_rule(f, &sid, &act) <= 0) {
+			fprintf(stderr, "ERROR: malformed diff line %u, diff not "
+					"applied\n", nadd + ndel + 1);
+			goto out;
 		}
 
-		if (config.working_mode == MODE_AF_XDP) {
-			if (khashmap_update_elem(&acl, &sid, &act, 0)) {
-				fprintf(stderr, "Error adding element to hash map\n");
-				exit(EXIT_FAILURE);
+		if (nadd + ndel == size) {
+			size = size ? size * 2 : 1024;
+			add_keys = realloc(add_keys, sizeof(*add_keys) * size);
+			add_acts = realloc(add_acts, sizeof(*add_acts) * size);
+			del_keys = realloc(del_keys, sizeof(*del_keys) * size);
+			if (!add_keys || !add_acts || !del_keys) {
+				exit_with_error(ENOMEM);
 			}
+		}
+
+		if (op == '+') {
+			add_keys[nadd] = sid;
+			add_acts[nadd++] = act;
 		} else {
-			act = XDP_DROP;
-			if (bpf_map_update_elem(acl_map, &sid, &act, 0)) {
-				fprintf(stderr, "ERROR: bpf_map_update_elem %d\n", i);
-				exit(EXIT_FAILURE);
+			del_keys[ndel++] = sid;
+		}
+	}
+
+	/*
+	 * Deleting a rule that is also added would leave a window without it,
+	 * drop the deletion and let the update replace the rule
+	 */
+	if (nadd && ndel) {
+		if (khashmap_init(&added, sizeof(struct session_id), sizeof(int),
+				nadd, KHASHMAP_F_OPEN_ADDR)) {
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < nadd; i++) {
+			khashmap_update_elem(&added, &add_keys[i], &add_acts[i], 0);
+		}
+		for (int i = 0; i < ndel; i++) {
+			if (khashmap_lookup_elem(&added, &del_keys[i])) {
+				del_keys[i--] = del_keys[--ndel];
 			}
 		}
+		khashmap_free(&added);
+	}
 
-		i++;
+	/*
+	 * The undo: rules added that were not there go away, the ones replaced
+	 * or deleted get back their action
+	 */
+	undo_keys = malloc(sizeof(*undo_keys) * (nadd + ndel + 1));
+	undo_acts = malloc(sizeof(*undo_acts) * (nadd + ndel + 1));
+	undo_del = malloc(sizeof(*undo_del) * (nadd + 1));
+	if (!undo_keys || !undo_acts || !undo_del) {
+		exit_with_error(ENOMEM);
+	}
+	for (int i = 0; i < nadd; i++) {
+		if (lookup_rule(&add_keys[i], &act)) {
+			undo_del[nundo_del++] = add_keys[i];
+		} else {
+			undo_keys[nundo] = add_keys[i];
+			undo_acts[nundo++] = act;
+		}
+	}
+	for (int i = 0; i < ndel; i++) {
+		if (!lookup_rule(&del_keys[i], &act)) {
+			undo_keys[nundo] = del_keys[i];
+			undo_acts[nundo++] = act;
+		}
 	}
 
-	if (i != nrules) {
-		fprintf(stderr, "Incorrent input file: mismatch in rules number\n");
-		exit(-1);
+	if (update_acl(add_keys, add_acts, nadd, del_keys, ndel)) {
+		if (update_acl(undo_keys, undo_acts, nundo, undo_del, nundo_del)) {
+			fprintf(stderr, "ERROR: unable to undo the diff, the ACL is "
+					"partially updated\n");
+		} else {
+			fprintf(stderr, "ERROR: diff not applied\n");
+		}
+		goto out;
 	}
 
-	printf("Added %d rules\n", nrules);
+	printf("Added/replaced %u rules and deleted %u\n", nadd, ndel);
+
+	save_snapshot();
 
-	return;
+out:
+	free(add_keys);
+	free(add_acts);
+	free(del_keys);
+	free(undo_keys);
+	free(undo_acts);
+	free(undo_del);
+	fclose(f);
 }
 
 static void clear_acl()
 {
-	if (config.working_mode == MODE_AF_XDP) {
+	if (opt_wildcard) {
+		classifier_free(&wc_acl);
+	} else if (config.working_mode == MODE_AF_XDP) {
 		khashmap_free(&acl);
 	}
 }
 
-int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
+/*
+ * Parses the 5-tuple of the packet. Returns 0 if key is valid, otherwise the
+ * packet is already handled and its verdict is stored in *verdict
+ */
+static int parse_packet(void *pkt, unsigned len, struct session_id *key,
+		int *verdict)
 {
 	void *pkt_end = pkt + len;
-	struct session_id key;
+
+	*verdict = -1;
 
 	struct ethhdr *eth = pkt;
 	if ((void *)(eth + 1) > pkt_end) {
@@ -136,7 +885,8 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 	}
 
 	if (eth->h_proto != htons(ETH_P_IP)) {
-		return 0;
+		*verdict = 0;
+		return -1;
 	}
 
 	struct iphdr *iph = (void *)(eth + 1);
@@ -153,8 +903,8 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 			return -1;
 		}
 
-		key.sport = tcph->source;
-		key.dport = tcph->dest;
+		key->sport = tcph->source;
+		key->dport = tcph->dest;
 
 		break;
 
@@ -164,18 +914,45 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 			return -1;
 		}
 
-		key.sport = udph->source;
-		key.dport = udph->dest;
+		key->sport = udph->source;
+		key->dport = udph->dest;
 
 		break;
 
 	default:
-		return 0;
+		*verdict = 0;
+		return -1;
 	}
 
-	key.saddr = iph->saddr;
-	key.daddr = iph->daddr;
-	key.proto = iph->protocol;
+	key->saddr = iph->saddr;
+	key->daddr = iph->daddr;
+	key->proto = iph->protocol;
+
+	return 0;
+}
+
+int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
+{
+	struct session_id key;
+	int verdict;
+
+	if (parse_packet(pkt, len, &key, &verdict)) {
+		return verdict;
+	}
+
+	if (opt_wildcard) {
+		struct classifier_key ckey = {
+			.saddr = key.saddr,
+			.daddr = key.daddr,
+			.sport = key.sport,
+			.dport = key.dport,
+			.proto = key.proto
+		};
+		const struct classifier_match *match = classifier_lookup(&wc_acl,
+				&ckey);
+
+		return match ? match->action : 0;
+	}
 
 	int *action = khashmap_lookup_elem(&acl, &key);
 	if (action) {
@@ -185,8 +962,50 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 	}
 }
 
+/* Lookups of the whole batch at once, to overlap their cache misses */
+void xsknf_batch_processor(struct xsknf_packet *pkts, int *verdicts,
+		unsigned npkts, unsigned ingress_ifindex)
+{
+	struct session_id sids[npkts];
+	struct classifier_key keys[npkts];
+	const struct classifier_match *matches[npkts];
+	void *pkeys[npkts], *actions[npkts];
+	unsigned pkt_idx[npkts], n = 0;
+
+	for (unsigned i = 0; i < npkts; i++) {
+		if (!parse_packet(pkts[i].data, pkts[i].len, &sids[n], &verdicts[i])) {
+			pkeys[n] = &sids[n];
+			pkt_idx[n++] = i;
+		}
+	}
+
+	if (!opt_wildcard) {
+		khashmap_lookup_batch(&acl, pkeys, actions, n);
+		for (unsigned i = 0; i < n; i++) {
+			verdicts[pkt_idx[i]] = actions[i] ? *(int *)actions[i] : 0;
+		}
+		return;
+	}
+
+	for (unsigned i = 0; i < n; i++) {
+		keys[i].saddr = sids[i].saddr;
+		keys[i].daddr = sids[i].daddr;
+		keys[i].sport = sids[i].sport;
+		keys[i].dport = sids[i].dport;
+		keys[i].proto = sids[i].proto;
+	}
+
+	classifier_lookup_batch(&wc_acl, keys, matches, n);
+	for (unsigned i = 0; i < n; i++) {
+		verdicts[pkt_idx[i]] = matches[i] ? matches[i]->action : 0;
+	}
+}
+
 static struct option long_options[] = {
 	{"acl-path", required_argument, 0, 'f'},
+	{"acl-diff", required_argument, 0, 'd'},
+	{"snapshot", required_argument, 0, 's'},
+	{"wildcard", no_argument, 0, 'w'},
 	{"quiet", no_argument, 0, 'q'},
 	{"extra-stats", no_argument, 0, 'x'},
 	{"app-stats", no_argument, 0, 'a'},
@@ -199,11 +1018,18 @@ static void usage(const char *prog)
 		"  Usage: %s [XSKNF_OPTIONS] -- [APP_OPTIONS]\n"
 		"  App options:\n"
 		"  -f, --acl-path	ACL file path (default ./acl.txt)\n"
+		"  -d, --acl-diff	Path of the ACL diff applied on SIGHUP (default ./acl-diff.txt)\n"
+		"  -s, --snapshot	Load the ACL from this snapshot if it exists, otherwise\n"
+		"			save it there after loading the ACL file (AF_XDP mode only).\n"
+		"			The snapshot follows the diffs, delete it when the ACL file changes.\n"
+		"  -w, --wildcard	The ACL holds wildcard rules, with address prefixes (addr/len),\n"
+		"			port ranges (min-max) and * for any port or protocol.\n"
+		"			The first matching rule wins (max %d rules in XDP mode).\n"
 		"  -q, --quiet		Do not display any stats.\n"
 		"  -x, --extra-stats	Display extra statistics.\n"
 		"  -a, --app-stats	Display application (syscall) statistics.\n"
 		"\n";
-	fprintf(stderr, str, prog);
+	fprintf(stderr, str, prog, MAX_WILDCARD_RULES);
 
 	exit(EXIT_FAILURE);
 }
@@ -213,7 +1039,7 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 	int option_index, c;
 
 	for (;;) {
-		c = getopt_long(argc, argv, "qxaf:", long_options, &option_index);
+		c = getopt_long(argc, argv, "qxawf:d:s:", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -221,6 +1047,15 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 		case 'f':
 			opt_acl_path = optarg;
 			break;
+		case 'd':
+			opt_acl_diff_path = optarg;
+			break;
+		case 's':
+			opt_snapshot_path = optarg;
+			break;
+		case 'w':
+			opt_wildcard = 1;
+			break;
 		case 'q':
 			opt_quiet = 1;
 			break;
@@ -234,6 +1069,12 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 			usage(basename(app_path));
 		}
 	}
+
+	if (opt_wildcard && opt_snapshot_path) {
+		fprintf(stderr, "ERROR: snapshots are not supported by the wildcard "
+				"ACL\n");
+		exit(EXIT_FAILURE);
+	}
 }
 
 static void int_exit(int sig)
@@ -246,18 +1087,29 @@ static void int_usr(int sig)
 	print_stats(&config, obj);
 }
 
+/* The diff is applied by the main loop, outside of the signal handler */
+static void int_hup(int sig)
+{
+	reload_pending = 1;
+}
+
 int main(int argc, char **argv)
 {
 	signal(SIGINT, int_exit);
 	signal(SIGTERM, int_exit);
 	signal(SIGABRT, int_exit);
 	signal(SIGUSR1, int_usr);
+	signal(SIGHUP, int_hup);
 
 	xsknf_parse_args(argc, argv, &config);
-	xsknf_init(&config, &obj);
-
 	parse_command_line(argc, argv, argv[0]);
 
+	if (opt_wildcard) {
+		strcpy(config.xdp_progname, "handle_xdp_wildcard");
+	}
+
+	xsknf_init(&config, &obj);
+
 	setlocale(LC_ALL, "");
 
 	init_acl(opt_acl_path);
@@ -268,6 +1120,10 @@ int main(int argc, char **argv)
 
 	while (!benchmark_done) {
 		sleep(1);
+		if (reload_pending) {
+			reload_pending = 0;
+			apply_acl_diff(opt_acl_diff_path);
+		}
 		if (!opt_quiet) {
 			dump_stats(config, obj, opt_extra_stats, opt_app_stats);
 		}
@@ -1,5 +1,7 @@
 #include <stdint.h>
 
+#include "../common/csum.h"
+
 #define MAX_ACL_SIZE 1000000
 #define MAX_SERVICES 1024
 #define MAX_BACKENDS MAX_SERVICES * 128
@@ -47,21 +49,3 @@ struct replace_info {
 	uint8_t mac_addr[6];
 	uint16_t ifindex;
 } __attribute__((packed));
-
-static inline uint16_t csum_fold(uint32_t csum)
-{
-	csum = (csum & 0xffff) + (csum >> 16);
-	csum = (csum & 0xffff) + (csum >> 16);
-	return ~csum;
-}
-
-static inline uint32_t csum_unfold(uint16_t n)
-{
-	return (uint32_t)n;
-}
-
-static inline uint32_t csum_add(uint32_t csum, uint32_t addend)
-{
-	csum += addend;
-	return csum + (csum < addend);
-}
\ No newline at end of file
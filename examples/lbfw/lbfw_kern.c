@@ -7,6 +7,7 @@
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <bpf/bpf_helpers.h>
+#include <xsknf_kern.h>
 
 /* 
  * Including the common/statistics.h header creates problems with other
@@ -24,13 +25,6 @@ struct {
 	__uint(max_entries, 1);
 } xdp_stats SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_XSKMAP);
-	__uint(key_size, sizeof(int));
-	__uint(value_size, sizeof(int));
-	__uint(max_entries, 32);
-} xsks SEC(".maps");
-
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, struct session_id);
@@ -70,18 +64,17 @@ SEC("xdp1") int handle_xdp_hybrid(struct xdp_md *ctx)
 	struct session_id key = {0};
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return XDP_ABORTED;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return XDP_ABORTED;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
-
-	/*
-	 * Need to send at least one packet to user space for busy polling to
-	 * work in combined mode.
-	 */
-	if (stats->rx_npkts == 1) {
-		return bpf_redirect_map(&xsks, 0, XDP_ABORTED);
+
+	/* Starts busy polling in combined mode (see xsknf_kern.h) */
+	if (xsknf_bootstrapping(ctx)) {
+		return xsknf_redirect(ctx, XDP_ABORTED);
 	}
 
 	struct ethhdr *eth = data;
@@ -138,7 +131,7 @@ SEC("xdp1") int handle_xdp_hybrid(struct xdp_md *ctx)
 		return *action;
 	} else {
 		/* Only TCP and UDP packets are sent to user space */
-		return bpf_redirect_map(&xsks, 0, XDP_ABORTED);
+		return xsknf_redirect(ctx, XDP_ABORTED);
 	}
 }
 
@@ -148,11 +141,13 @@ SEC("xdp2") int handle_xdp(struct xdp_md *ctx)
 	void *data_end = (void *)(long)ctx->data_end;
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return XDP_ABORTED;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return XDP_ABORTED;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
 
 	struct ethhdr *eth = data;
 	if ((void *)(eth + 1) > data_end) {
@@ -23,6 +23,7 @@ static int opt_quiet;
 static int opt_extra_stats;
 static int opt_app_stats;
 static unsigned opt_passthrough = 0;
+static int opt_stage_stats;
 
 struct bpf_object *obj;
 struct xsknf_config config;
@@ -44,11 +45,9 @@ struct backend_entry {
 
 struct khashmap services;
 struct khashmap backends;
-/* 
- * This map should be handled in a LRU way, clearing older sessions when the map
- * is full. This is not done for simplicity.
- * In the eBPF LRU_HASH_MAP every bucket is handled as a LRU queue, this is
- * possible since it has a static size
+/*
+ * Handled in a LRU way like the eBPF LRU_HASH map, older sessions are evicted
+ * when the map is full
  */
 struct khashmap active_sessions;
 struct khashmap acl;
@@ -77,7 +76,7 @@ static void init_acl(const char *acl_path)
 
 	if (config.working_mode == MODE_AF_XDP) {
 		khashmap_init(&acl, sizeof(struct session_id), sizeof(int),
-				MAX_ACL_SIZE);
+				MAX_ACL_SIZE, KHASHMAP_F_OPEN_ADDR);
 	}
 	if (config.working_mode & MODE_XDP) {
 		struct bpf_map *map = bpf_object__find_map_by_name(obj, "acl");
@@ -207,7 +206,7 @@ static void load_services(const char *services_path)
 	service_entries = malloc(sizeof(struct service_entry) * nservices);
 	backend_entries = malloc(sizeof(struct backend_entry) * nbackends);
 	khashmap_init(&srv_to_index, sizeof(struct service_id), sizeof(int),
-			nservices);
+			nservices, 0);
 
 	i = 0;
 	while ((ret = fscanf(f, " %s %u %s %s %u"
@@ -286,11 +285,14 @@ static void load_services(const char *services_path)
 
 	if (config.working_mode & MODE_AF_XDP) {
 		khashmap_init(&active_sessions, sizeof(struct session_id),
-				sizeof(struct replace_info), MAX_SESSIONS);
+				sizeof(struct replace_info), MAX_SESSIONS,
+				KHASHMAP_F_LRU);
 		khashmap_init(&services, sizeof(struct service_id),
-			sizeof(struct service_info), MAX_SERVICES);
+			sizeof(struct service_info), MAX_SERVICES,
+			KHASHMAP_F_OPEN_ADDR);
 		khashmap_init(&backends, sizeof(struct backend_id),
-				sizeof(struct backend_info), MAX_BACKENDS);
+				sizeof(struct backend_info), MAX_BACKENDS,
+				KHASHMAP_F_OPEN_ADDR);
 
 		for (int i = 0; i < nservices; i++) {
 			if (khashmap_update_elem(&services, &service_entries[i].key,
@@ -417,9 +419,20 @@ static void clear_maps()
 	}
 }
 
-int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
+struct pkt_hdrs {
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	uint16_t *sport;
+	uint16_t *dport;
+	uint16_t *l4check;
+};
+
+/*
+ * Returns 0 if the packet is a TCP or UDP over IPv4 one, 1 if it is another
+ * kind of packet and -1 if it is malformed
+ */
+static inline int parse_pkt(void *pkt, unsigned len, struct pkt_hdrs *hdrs)
 {
-	/* Some checks can be removed if working in COMBINED mode*/
 	void *pkt_end = pkt + len;
 
 	struct ethhdr *eth = pkt;
@@ -428,11 +441,7 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 	}
 
 	if (eth->h_proto != htons(ETH_P_IP)) {
-		/* 
-		 * Temporary, send the packet back on the interface. What to do? Can't
-		 * rely on kernel stack
-		 */
-		return (ingress_ifindex + 1) % config.num_interfaces;
+		return 1;
 	}
 
 	struct iphdr *iph = (void *)(eth + 1);
@@ -441,7 +450,6 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 	}
 
 	void *next = (void *)iph + (iph->ihl << 2);
-	uint16_t *sport, *dport, *l4check;
 
 	switch (iph->protocol) {
 	case IPPROTO_TCP:;
@@ -450,9 +458,9 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 			return -1;
 		}
 
-		sport = &tcph->source;
-		dport = &tcph->dest;
-		l4check = &tcph->check;
+		hdrs->sport = &tcph->source;
+		hdrs->dport = &tcph->dest;
+		hdrs->l4check = &tcph->check;
 
 		break;
 
@@ -462,13 +470,70 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 			return -1;
 		}
 
-		sport = &udph->source;
-		dport = &udph->dest;
-		l4check = &udph->check;
+		hdrs->sport = &udph->source;
+		hdrs->dport = &udph->dest;
+		hdrs->l4check = &udph->check;
 
 		break;
 
 	default:
+		return 1;
+	}
+
+	hdrs->eth = eth;
+	hdrs->iph = iph;
+
+	return 0;
+}
+
+static inline void fill_session_id(struct pkt_hdrs *hdrs, struct session_id *sid)
+{
+	memset(sid, 0, sizeof(struct session_id));
+	sid->saddr = hdrs->iph->saddr;
+	sid->daddr = hdrs->iph->daddr;
+	sid->proto = hdrs->iph->protocol;
+	sid->sport = *hdrs->sport;
+	sid->dport = *hdrs->dport;
+}
+
+/*
+ * Firewall stage, drops malformed packets and the ones matching a DROP rule of
+ * the ACL. Packets matching other rules go on to the load balancer
+ */
+static void fw_stage(struct xsknf_packet *pkts, int *verdicts, unsigned npkts,
+		unsigned ingress_ifindex)
+{
+	struct pkt_hdrs hdrs;
+	struct session_id sid;
+	int *action;
+
+	for (unsigned i = 0; i < npkts; i++) {
+		switch (parse_pkt(pkts[i].data, pkts[i].len, &hdrs)) {
+		case -1:
+			verdicts[i] = -1;
+			continue;
+		case 1:
+			continue;
+		}
+
+		fill_session_id(&hdrs, &sid);
+		action = khashmap_lookup_elem(&acl, &sid);
+		if (action && *action == -1) {
+			verdicts[i] = -1;
+		}
+	}
+}
+
+static int lb_process(void *pkt, unsigned len, unsigned ingress_ifindex)
+{
+	struct pkt_hdrs hdrs;
+	struct session_id sid;
+	int ret;
+
+	ret = parse_pkt(pkt, len, &hdrs);
+	if (ret == -1) {
+		return -1;
+	} else if (ret == 1) {
 		/* 
 		 * Temporary, send the packet back on the interface. What to do? Can't
 		 * rely on kernel stack
@@ -476,19 +541,12 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 		return (ingress_ifindex + 1) % config.num_interfaces;
 	}
 
-	struct session_id sid = {0};
-	sid.saddr = iph->saddr;
-	sid.daddr = iph->daddr;
-	sid.proto = iph->protocol;
-	sid.sport = *sport;
-	sid.dport = *dport;
+	struct ethhdr *eth = hdrs.eth;
+	struct iphdr *iph = hdrs.iph;
+	uint16_t *sport = hdrs.sport, *dport = hdrs.dport,
+			*l4check = hdrs.l4check;
 
-	if (config.working_mode == MODE_AF_XDP) {
-		int *action = khashmap_lookup_elem(&acl, &sid);
-		if (action) {
-			return *action;
-		}
-	}
+	fill_session_id(&hdrs, &sid);
 
 	/* Used for checksum update before forward */
 	uint32_t old_addr, new_addr;
@@ -576,28 +634,50 @@ UPDATE:;
 	__builtin_memcpy(&eth->h_dest, &rep->mac_addr, sizeof(eth->h_dest));
 	output = rep->ifindex;
 
-	/* Update ip checksum */
-	uint32_t csum = ~csum_unfold(iph->check);
-	csum = csum_add(csum, ~old_addr);
-	csum = csum_add(csum, new_addr);
-	iph->check = csum_fold(csum);
-
-	/* Update l4 checksum */
-	csum = ~csum_unfold(*l4check);
-	csum = csum_add(csum, ~old_addr);
-	csum = csum_add(csum, new_addr);
-	csum = csum_add(csum, ~old_port);
-	csum = csum_add(csum, new_port);
-	*l4check = csum_fold(csum);
+	/* Update ip and l4 checksums */
+	csum_replace4(&iph->check, old_addr, new_addr);
+	csum_replace4_2(l4check, old_addr, new_addr, old_port, new_port);
 
 	return output;
 }
 
+/* Load balancer stage, packets reaching it have passed the firewall */
+static void lb_stage(struct xsknf_packet *pkts, int *verdicts, unsigned npkts,
+		unsigned ingress_ifindex)
+{
+	for (unsigned i = 0; i < npkts; i++) {
+		verdicts[i] = lb_process(pkts[i].data, pkts[i].len, ingress_ifindex);
+	}
+}
+
+static void print_stage_stats()
+{
+	struct xsknf_stage_stats stats, sum;
+	unsigned long *val, *tot;
+
+	printf("\n%-10s %16s %16s %12s\n", "stage", "packets", "dropped",
+			"cycles/pkt");
+	for (unsigned i = 0; i < xsknf_num_stages(); i++) {
+		memset(&sum, 0, sizeof(sum));
+		for (unsigned j = 0; j < config.workers; j++) {
+			xsknf_get_stage_stats(j, i, &stats);
+			val = (unsigned long *)&stats;
+			tot = (unsigned long *)&sum;
+			for (int k = 0; k < sizeof(stats) / sizeof(unsigned long); k++)
+				tot[k] += val[k];
+		}
+
+		printf("%-10s %16lu %16lu %12.1f\n", xsknf_stage_name(i), sum.npkts,
+				sum.ndropped, sum.npkts ? (double)sum.cycles / sum.npkts : 0);
+	}
+}
+
 static struct option long_options[] = {
 	{"quiet", no_argument, 0, 'q'},
 	{"extra-stats", no_argument, 0, 'x'},
 	{"app-stats", no_argument, 0, 'a'},
 	{"passthrough", no_argument, 0, 'p'},
+	{"stage-stats", no_argument, 0, 's'},
 	{0, 0, 0, 0}
 };
 
@@ -610,6 +690,7 @@ static void usage(const char *prog)
 		"  -x, --extra-stats	Display extra statistics.\n"
 		"  -a, --app-stats	Display application (syscall) statistics.\n"
 		"  -p, --passthrough=n	Populate the table of active sessions with n sessions for the pass-through test.\n"
+		"  -s, --stage-stats	Display per-stage statistics on exit.\n"
 		"\n";
 	fprintf(stderr, str, prog);
 
@@ -621,7 +702,7 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 	int option_index, c;
 
 	for (;;) {
-		c = getopt_long(argc, argv, "qxap:", long_options, &option_index);
+		c = getopt_long(argc, argv, "qxap:s", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -638,6 +719,9 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 		case 'p':
 			opt_passthrough = atoi(optarg);
 			break;
+		case 's':
+			opt_stage_stats = 1;
+			break;
 		default:
 			usage(basename(app_path));
 		}
@@ -670,6 +754,13 @@ int main(int argc, char **argv)
 		 */
 		strcpy(config.xdp_progname, "handle_xdp_hybrid");
 	}
+
+	/* In combined mode the fw runs in XDP, the chain only needs the lb */
+	if (config.working_mode == MODE_AF_XDP) {
+		xsknf_register_stage("fw", fw_stage);
+	}
+	xsknf_register_stage("lb", lb_stage);
+
 	xsknf_init(&config, &obj);
 
 	parse_command_line(argc, argv, argv[0]);
@@ -688,6 +779,10 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (opt_stage_stats) {
+		print_stage_stats();
+	}
+
 	xsknf_cleanup();
 
 	clear_maps();
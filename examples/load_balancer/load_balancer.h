@@ -1,9 +1,26 @@
 #include <stdint.h>
 
+#include "../common/csum.h"
+
 #define MAX_SERVICES 1024
-#define MAX_BACKENDS MAX_SERVICES * 128
+#define MAX_SERVICE_BACKENDS 128
+#define MAX_BACKENDS MAX_SERVICES * MAX_SERVICE_BACKENDS
 #define MAX_SESSIONS 2*1000000
 
+/*
+ * New sessions are mapped to backends with Maglev consistent hashing (see
+ * common/maglev.h): every service has a table of MAGLEV_SIZE backends indexed
+ * by the hash of the session, so that changing the backends of a service
+ * moves only a few of its sessions to other backends. The tables of all the
+ * services are stored one after the other in a single array, with room for
+ * two tables per service: a table that changes is built in a free slot and
+ * the service is switched to it, never rewritten while in use.
+ * Shares are even only with tables much larger than the backends, the size is
+ * the first prime above 100 times MAX_SERVICE_BACKENDS
+ */
+#define MAGLEV_SIZE 12809
+#define MAGLEV_TABLES (2 * MAX_SERVICES)
+
 struct global_data {
 	int passthrough_queues;
 };
@@ -16,6 +33,7 @@ struct service_id {
 
 struct service_info {
 	unsigned backends;
+	unsigned table;	/* index of the Maglev table of the service */
 } __attribute__((packed));
 
 struct backend_id {
@@ -51,20 +69,25 @@ struct replace_info {
 	uint16_t ifindex;
 } __attribute__((packed));
 
-static inline uint16_t csum_fold(uint32_t csum)
-{
-	csum = (csum & 0xffff) + (csum >> 16);
-	csum = (csum & 0xffff) + (csum >> 16);
-	return ~csum;
-}
+/*
+ * Binary services file, written by tests/scripts/gen-services.py --binary and
+ * loaded without any parsing. The header is followed by four arrays, each one
+ * starting at a multiple of 8 bytes: the service_id and service_info of the
+ * services and the backend_id and backend_info of the backends, all in the
+ * format of the maps (the table of the services is assigned at load time).
+ * The ifindex of a backend is the position of its interface among the ones of
+ * the NF
+ */
+#define SERVICES_BIN_MAGIC 0x56525358	/* "XSRV" */
 
-static inline uint32_t csum_unfold(uint16_t n)
-{
-	return (uint32_t)n;
-}
+struct services_bin_header {
+	uint32_t magic;
+	uint32_t nservices;
+	uint32_t nbackends;
+	uint32_t pad;
+};
 
-static inline uint32_t csum_add(uint32_t csum, uint32_t addend)
+static inline uint64_t services_bin_align(uint64_t off)
 {
-	csum += addend;
-	return csum + (csum < addend);
-}
\ No newline at end of file
+	return (off + 7) & ~7ULL;
+}
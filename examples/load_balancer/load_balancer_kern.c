@@ -8,6 +8,7 @@
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <bpf/bpf_helpers.h>
+#include <xsknf_kern.h>
 
 /* 
  * Including the common/statistics.h header creates problems with other
@@ -25,13 +26,6 @@ struct {
 	__uint(max_entries, 1);
 } xdp_stats SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_XSKMAP);
-	__uint(key_size, sizeof(int));
-	__uint(value_size, sizeof(int));
-	__uint(max_entries, 32);
-} xsks SEC(".maps");
-
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
 	__type(key, struct service_id);
@@ -39,12 +33,13 @@ struct {
 	__uint(max_entries, MAX_SERVICES);
 } services SEC(".maps");
 
+/* Maglev tables of the services, see load_balancer.h */
 struct {
-	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__type(key, struct backend_id);
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
 	__type(value, struct backend_info);
-	__uint(max_entries, MAX_BACKENDS);
-} backends SEC(".maps");
+	__uint(max_entries, MAGLEV_TABLES * MAGLEV_SIZE);
+} maglev SEC(".maps");
 
 /* 
  * A PERCPU_LRU map should be used here. Simple HASH is used to be coherent with
@@ -59,17 +54,23 @@ struct {
 
 struct global_data global = {0};
 
-static inline int load_balancer(struct xdp_md *ctx)
+/*
+ * With cache set new sessions are sent to user space, that installs them in
+ * active_sessions (see --cache)
+ */
+static inline int load_balancer(struct xdp_md *ctx, int cache)
 {
 	void *data = (void *)(long)ctx->data;
 	void *data_end = (void *)(long)ctx->data_end;
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return XDP_ABORTED;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return XDP_ABORTED;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
 
 	struct ethhdr *eth = data;
 	if ((void *)(eth + 1) > data_end) {
@@ -148,11 +149,19 @@ static inline int load_balancer(struct xdp_md *ctx)
 		return XDP_PASS;
 	}
 
-	struct backend_id bkdid = {
-		.service = srvid,
-		.index = jhash(&sid, sizeof(struct session_id), 0) % srvinfo->backends
-	};
-	struct backend_info *bkdinfo = bpf_map_lookup_elem(&backends, &bkdid);
+	if (cache) {
+		return xsknf_redirect(ctx, XDP_DROP);
+	}
+
+	/* Same hash of session_hash() in user space, for COMBINED mode */
+	__u32 hash;
+	if (xsknf_rx_hash(ctx, &hash)) {
+		hash = jhash(&sid, sizeof(struct session_id), 0);
+	}
+
+	/* A single read of the Maglev table of the service */
+	__u32 pos = srvinfo->table * MAGLEV_SIZE + hash % MAGLEV_SIZE;
+	struct backend_info *bkdinfo = bpf_map_lookup_elem(&maglev, &pos);
 	if (!bkdinfo) {
 		bpf_printk("ERROR: missing backend");
 		return XDP_ABORTED;
@@ -230,17 +239,21 @@ UPDATE:;
 }
 
 SEC("xdp1") int standard_xdp(struct xdp_md *ctx) {
-	return load_balancer(ctx);
+	return load_balancer(ctx, 0);
 }
 
 SEC("xdp2") int hybrid_xdp(struct xdp_md *ctx) {
 	if (ctx->rx_queue_index < global.passthrough_queues) {
-	 	return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_DROP);
+	 	return xsknf_redirect(ctx, XDP_DROP);
 	} else {
-		return load_balancer(ctx);
+		return load_balancer(ctx, 0);
 	}
 }
 
+SEC("xdp3") int cached_xdp(struct xdp_md *ctx) {
+	return load_balancer(ctx, 1);
+}
+
 /*
  * The egress code should be tailored to only care of backward (backend to
  * client) sessions. The ingress code on the other hand must handle both
@@ -259,11 +272,13 @@ SEC("tc") int handle_tc(struct __sk_buff *ctx)
 	void *data_end = (void *)(long)ctx->data_end;
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return TC_ACT_SHOT;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return TC_ACT_SHOT;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
 
 	struct ethhdr *eth = data;
 	if ((void *)(eth + 1) > data_end) {
@@ -340,11 +355,10 @@ SEC("tc") int handle_tc(struct __sk_buff *ctx)
 		return TC_ACT_OK;
 	}
 
-	struct backend_id bkdid = {
-		.service = srvid,
-		.index = jhash(&sid, sizeof(struct session_id), 0) % srvinfo->backends
-	};
-	struct backend_info *bkdinfo = bpf_map_lookup_elem(&backends, &bkdid);
+	/* A single read of the Maglev table of the service */
+	__u32 pos = srvinfo->table * MAGLEV_SIZE
+			+ jhash(&sid, sizeof(struct session_id), 0) % MAGLEV_SIZE;
+	struct backend_info *bkdinfo = bpf_map_lookup_elem(&maglev, &pos);
 	if (!bkdinfo) {
 		bpf_printk("ERROR: missing backend");
 		return TC_ACT_SHOT;
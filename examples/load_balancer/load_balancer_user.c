@@ -1,5 +1,6 @@
 #include "load_balancer.h"
 #include "../common/khashmap.h"
+#include "../common/maglev.h"
 #include "../common/statistics.h"
 #include <arpa/inet.h>
 #include <bpf/bpf.h>
@@ -15,6 +16,7 @@
 #include <net/ethernet.h>
 #include <net/if.h>
 #include <signal.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <xsknf.h>
 
@@ -26,6 +28,10 @@ static char *opt_services_path = NULL;
 static unsigned opt_passthrough = 0;
 static int opt_spread_flows = 0;
 static unsigned opt_local = 0;
+static int opt_cache = 0;
+/* Fast path map of the sessions and kernel ifindexes of the interfaces */
+static int fastpath_sessions;
+static int kern_ifindexes[XSKNF_MAX_INTERFACES];
 
 struct bpf_object *obj;
 struct xsknf_config config;
@@ -36,23 +42,33 @@ struct xsknf_config config;
 
 #define MEMCACHED_PORT 11211
 
-struct service_entry {
-	struct service_id key;
-	struct service_info value;
+/*
+ * Services and backends of a services file. Keys and values are stored in
+ * separate arrays as needed by batch operations on BPF maps
+ */
+struct services_set {
+	struct service_id *srv_keys;
+	struct service_info *srv_infos;
+	unsigned nservices;
+	struct backend_id *bkd_keys;
+	struct backend_info *bkd_infos;
+	unsigned nbackends;
 };
 
-struct backend_entry {
-	struct backend_id key;
-	struct backend_info value;
-};
+/* Currently loaded, to find what to remove on reload */
+static struct services_set cur_services;
+static int services_fd = -1, maglev_fd = -1;
+static volatile sig_atomic_t reload_pending;
 
 struct khashmap services;
-struct khashmap backends;
-/* 
- * This map should be handled in a LRU way, clearing older sessions when the map
- * is full. This is not done for simplicity.
- * In the eBPF LRU_HASH_MAP every bucket is handled as a LRU queue, this is
- * possible since it has a static size
+/*
+ * Maglev tables of the services (see load_balancer.h), also kept in XDP mode
+ * to write only the positions that change
+ */
+static struct backend_info *maglev;
+/*
+ * Handled in a LRU way like the eBPF LRU_HASH map, older sessions are evicted
+ * when the map is full
  */
 struct khashmap active_sessions;
 
@@ -94,7 +110,172 @@ void store_session(struct session_id *sid, struct replace_info *rep, int mapfd)
 	}
 }
 
-static void load_services(const char *services_path)
+/*
+ * Installs a new session in the XDP fast path (--cache), with the ifindex
+ * expected by the eBPF program. Sessions are never evicted from the fast
+ * path, when the map is full new ones are only handled in user space
+ */
+static void install_session(struct session_id *sid, struct replace_info *rep)
+{
+	struct replace_info krep = *rep;
+
+	if (krep.ifindex < config.num_interfaces) {
+		krep.ifindex = kern_ifindexes[krep.ifindex];
+	}
+	xsknf_fastpath_install(fastpath_sessions, sid, &krep);
+}
+
+static void free_services(struct services_set *set)
+{
+	free(set->srv_keys);
+	free(set->srv_infos);
+	free(set->bkd_keys);
+	free(set->bkd_infos);
+	memset(set, 0, sizeof(*set));
+}
+
+static int read_array(FILE *f, void *buf, size_t size, unsigned n, long *off)
+{
+	*off = services_bin_align(*off);
+	if (fseek(f, *off, SEEK_SET) || fread(buf, size, n, f) != n) {
+		return -1;
+	}
+	*off += size * n;
+
+	return 0;
+}
+
+/*
+ * A service without backends would have an empty Maglev table, one with more
+ * backends than positions could not use all of them
+ */
+static int check_services(struct services_set *set, unsigned nservices)
+{
+	for (int i = 0; i < nservices; i++) {
+		if (set->srv_infos[i].backends == 0
+				|| set->srv_infos[i].backends > MAX_SERVICE_BACKENDS) {
+			fprintf(stderr, "ERROR: service %d has %u backends (max %d)\n", i,
+					set->srv_infos[i].backends, MAX_SERVICE_BACKENDS);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The text loader numbers the backends of every service itself, the ones of a
+ * binary file must have each index from 0 to the backends of their service
+ * exactly once
+ */
+static int check_backends(struct services_set *set, unsigned nservices,
+		unsigned nbackends)
+{
+	struct khashmap srv_index;
+	unsigned *first, total = 0;
+	char *seen = NULL;
+	int *srv, i, ret = -1;
+
+	first = malloc(sizeof(*first) * (nservices + 1));
+	if (!first) {
+		exit_with_error(ENOMEM);
+	}
+	khashmap_init(&srv_index, sizeof(struct service_id), sizeof(int),
+			nservices + 1, KHASHMAP_F_OPEN_ADDR);
+	for (i = 0; i < nservices; i++) {
+		if (khashmap_lookup_elem(&srv_index, &set->srv_keys[i])) {
+			fprintf(stderr, "ERROR: service %d is duplicated\n", i);
+			goto out;
+		}
+		khashmap_update_elem(&srv_index, &set->srv_keys[i], &i, 0);
+		first[i] = total;
+		total += set->srv_infos[i].backends;
+	}
+
+	if (total != nbackends) {
+		fprintf(stderr, "ERROR: %u backends in the services, %u in the file\n",
+				total, nbackends);
+		goto out;
+	}
+
+	seen = calloc(nbackends + 1, 1);
+	if (!seen) {
+		exit_with_error(ENOMEM);
+	}
+	for (i = 0; i < nbackends; i++) {
+		srv = khashmap_lookup_elem(&srv_index, &set->bkd_keys[i].service);
+		if (!srv || set->bkd_keys[i].index >= set->srv_infos[*srv].backends
+				|| seen[first[*srv] + set->bkd_keys[i].index]++) {
+			fprintf(stderr, "ERROR: invalid or duplicated backend %d\n", i);
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	free(seen);
+	khashmap_free(&srv_index);
+	free(first);
+
+	return ret;
+}
+
+/* Binary services file (see load_balancer.h), arrays are read as they are */
+static int read_services_bin(FILE *f, struct services_set *set)
+{
+	struct services_bin_header hdr;
+	long off = sizeof(hdr);
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "ERROR: truncated services file\n");
+		return -1;
+	}
+
+	if (hdr.nservices > MAX_SERVICES || hdr.nbackends > MAX_BACKENDS) {
+		fprintf(stderr, "ERROR: too many services or backends\n");
+		return -1;
+	}
+
+	printf("Reading %u services and %u backends\n", hdr.nservices,
+			hdr.nbackends);
+
+	set->srv_keys = calloc(hdr.nservices + 1, sizeof(struct service_id));
+	set->srv_infos = calloc(hdr.nservices + 1, sizeof(struct service_info));
+	set->bkd_keys = calloc(hdr.nbackends + 1, sizeof(struct backend_id));
+	set->bkd_infos = calloc(hdr.nbackends + 1, sizeof(struct backend_info));
+	if (!set->srv_keys || !set->srv_infos || !set->bkd_keys
+			|| !set->bkd_infos) {
+		exit_with_error(ENOMEM);
+	}
+
+	if (read_array(f, set->srv_keys, sizeof(struct service_id),
+			hdr.nservices, &off)
+			|| read_array(f, set->srv_infos, sizeof(struct service_info),
+			hdr.nservices, &off)
+			|| read_array(f, set->bkd_keys, sizeof(struct backend_id),
+			hdr.nbackends, &off)
+			|| read_array(f, set->bkd_infos, sizeof(struct backend_info),
+			hdr.nbackends, &off)) {
+		fprintf(stderr, "ERROR: truncated services file\n");
+		free_services(set);
+		return -1;
+	}
+
+	if (check_services(set, hdr.nservices)
+			|| check_backends(set, hdr.nservices, hdr.nbackends)) {
+		free_services(set);
+		return -1;
+	}
+
+	set->nservices = hdr.nservices;
+	set->nbackends = hdr.nbackends;
+
+	return 0;
+}
+
+/* Returns 0 on success or -1 if the file is malformed */
+static int read_services(const char *services_path, struct services_set *set)
 {
 	char srv_addr[IP_STRLEN], bkd_addr[IP_STRLEN], proto[PROTO_STRLEN],
 			ifname[IFNAME_STRLEN];
@@ -102,181 +283,496 @@ static void load_services(const char *services_path)
 	uint8_t mac_addr[6];
 	FILE *f;
 	struct service_info *srv_info;
-	struct backend_entry *bkd_entry;
+	struct backend_id *bkd_key;
+	struct backend_info *bkd_info;
 	struct in_addr addr;
 	unsigned nservices, nbackends, service_first_free = 0;
-	int i, ret, ifindex, *srvindex;
-	struct service_entry *service_entries;
-	struct backend_entry *backend_entries;
+	int i, ret, ifindex, *srvindex, err = -1;
 	struct khashmap srv_to_index;
+	uint32_t magic = 0;
 
-	if (config.working_mode & MODE_AF_XDP) {
-		khashmap_init(&active_sessions, sizeof(struct session_id),
-				sizeof(struct replace_info), MAX_SESSIONS);
-		khashmap_init(&services, sizeof(struct service_id),
-				sizeof(struct service_info), MAX_SERVICES);
-		khashmap_init(&backends, sizeof(struct backend_id),
-				sizeof(struct backend_info), MAX_BACKENDS);
+	memset(set, 0, sizeof(*set));
+
+	f = fopen(services_path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "ERROR: unable to open %s: %s\n", services_path,
+				strerror(errno));
+		return -1;
 	}
 
-	if (services_path) {
-		printf("Loading services...\n");
+	if (fread(&magic, sizeof(magic), 1, f) == 1
+			&& magic == SERVICES_BIN_MAGIC) {
+		rewind(f);
+		err = read_services_bin(f, set);
+		fclose(f);
+		return err;
+	}
+	rewind(f);
 
-		f = fopen(services_path, "r");
-		if (f == NULL) {
-			exit_with_error(errno);
-		}
+	/* The first line shall contain the number of services and backends */
+	if(fscanf(f, "%u %u\n", &nservices, &nbackends) != 2) {
+		fprintf(stderr, "ERROR: wrong services file format\n");
+		fclose(f);
+		return -1;
+	}
+
+	if (nservices > MAX_SERVICES || nbackends > MAX_BACKENDS) {
+		fprintf(stderr, "ERROR: too many services or backends\n");
+		fclose(f);
+		return -1;
+	}
+
+	printf("Reading %u services and %u backends\n", nservices, nbackends);
 
-		/* The first line shall contain the number of services and backends */
-		if(fscanf(f, "%u %u\n", &nservices, &nbackends) != 2) {
+	set->srv_keys = calloc(nservices + 1, sizeof(struct service_id));
+	set->srv_infos = calloc(nservices + 1, sizeof(struct service_info));
+	set->bkd_keys = calloc(nbackends + 1, sizeof(struct backend_id));
+	set->bkd_infos = calloc(nbackends + 1, sizeof(struct backend_info));
+	if (!set->srv_keys || !set->srv_infos || !set->bkd_keys
+			|| !set->bkd_infos) {
+		exit_with_error(ENOMEM);
+	}
+	khashmap_init(&srv_to_index, sizeof(struct service_id), sizeof(int),
+			nservices + 1, 0);
+
+	i = 0;
+	while ((ret = fscanf(f, " %15s %u %3s %15s %u"
+			" %2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx %255s", srv_addr, &srv_port,
+			proto, bkd_addr, &bkd_port, &mac_addr[0], &mac_addr[1],
+			&mac_addr[2], &mac_addr[3], &mac_addr[4], &mac_addr[5], ifname))
+			!= EOF) {
+		if (ret < 12) {
 			fprintf(stderr, "ERROR: wrong services file format\n");
-			exit_with_error(-1);
+			goto out;
 		}
 
-		printf("Reading %u services and %u backends\n", nservices, nbackends);
+		if (i == nbackends) {
+			break;
+		}
 
-		service_entries = malloc(sizeof(struct service_entry) * nservices);
-		backend_entries = malloc(sizeof(struct backend_entry) * nbackends);
-		khashmap_init(&srv_to_index, sizeof(struct service_id), sizeof(int),
-				nservices);
+		bkd_key = &set->bkd_keys[i];
+		bkd_info = &set->bkd_infos[i];
+		inet_aton(srv_addr, &addr);
+		bkd_key->service.vaddr = addr.s_addr;
+		bkd_key->service.vport = htons(srv_port);
+		if (strcmp(proto, "TCP") == 0) {
+			bkd_key->service.proto = IPPROTO_TCP;
+		} else if (strcmp(proto, "UDP") == 0) {
+			bkd_key->service.proto = IPPROTO_UDP;
+		} else {
+			fprintf(stderr, "ERROR: Unexpected L4 protocol: %s\n", proto);
+			goto out;
+		}
 
-		i = 0;
-		while ((ret = fscanf(f, " %s %u %s %s %u"
-				" %2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx %s", srv_addr, &srv_port,
-				proto, bkd_addr, &bkd_port, &mac_addr[0], &mac_addr[1],
-				&mac_addr[2], &mac_addr[3], &mac_addr[4], &mac_addr[5], ifname))
-				!= EOF) {		
-			if (ret < 12) {
-				fprintf(stderr, "ERROR: wrong services file format\n");
-				exit(EXIT_FAILURE);
+		inet_aton(bkd_addr, &addr);
+		bkd_info->addr = addr.s_addr;
+		bkd_info->port = htons(bkd_port);
+		__builtin_memcpy(&bkd_info->mac_addr, mac_addr, sizeof(mac_addr));
+
+		if (!strcmp(ifname, "local")) {
+			/* This works only in tests */
+			ifindex = 1;
+		} else {
+			ifindex = ifname_to_app_idx(ifname);
+		}
+		if (ifindex == -1) {
+			fprintf(stderr, "ERROR: Parsed unknown interface %s\n", ifname);
+			goto out;
+		}
+		bkd_info->ifindex = ifindex;
+
+		srvindex = khashmap_lookup_elem(&srv_to_index, &bkd_key->service);
+		if (!srvindex) {
+			if (service_first_free == nservices) {
+				break;
 			}
 
-			bkd_entry = &backend_entries[i];
-			inet_aton(srv_addr, &addr);
-			bkd_entry->key.service.vaddr = addr.s_addr;
-			bkd_entry->key.service.vport = htons(srv_port);
-			if (strcmp(proto, "TCP") == 0) {
-				bkd_entry->key.service.proto = IPPROTO_TCP;
-			} else if (strcmp(proto, "UDP") == 0) {
-				bkd_entry->key.service.proto = IPPROTO_UDP;
-			} else {
-				fprintf(stderr, "ERROR: Unexpected L4 protocol: %s\n", proto);
-				exit(-1);
+			set->srv_keys[service_first_free] = bkd_key->service;
+			srv_info = &set->srv_infos[service_first_free];
+			srv_info->backends = 0;
+
+			if (khashmap_update_elem(&srv_to_index, &bkd_key->service,
+					&service_first_free, 0)) {
+				fprintf(stderr,
+						"ERROR: unable to add service index to hash map\n");
+				goto out;
 			}
 
-			inet_aton(bkd_addr, &addr);
-			bkd_entry->value.addr = addr.s_addr;
-			bkd_entry->value.port = htons(bkd_port);
-			__builtin_memcpy(&bkd_entry->value.mac_addr, mac_addr,
-					sizeof(mac_addr));
+			service_first_free++;
+		} else {
+			srv_info = &set->srv_infos[*srvindex];
+		}
 
-			if (!strcmp(ifname, "local")) {
-				/* This works only in tests */
-				ifindex = 1;
-			} else {
-				ifname_to_app_idx(ifname);
+		bkd_key->index = srv_info->backends;
+		srv_info->backends++;
+
+		i++;
+	}
+
+	if (ret != EOF || i != nbackends || service_first_free != nservices) {
+		fprintf(stderr,
+				"ERROR: incorrent input file: mismatch in items number\n");
+		goto out;
+	}
+
+	if (check_services(set, nservices)) {
+		goto out;
+	}
+
+	set->nservices = nservices;
+	set->nbackends = nbackends;
+	err = 0;
+
+out:
+	if (err) {
+		free_services(set);
+	}
+	khashmap_free(&srv_to_index);
+	fclose(f);
+
+	return err;
+}
+
+/* Name of a backend for Maglev, it keeps its positions as long as it exists */
+struct backend_name {
+	uint32_t addr;
+	uint16_t port;
+} __attribute__((packed));
+
+/*
+ * The table of a service is switched with a single aligned store, values of
+ * khashmaps are 8-byte aligned
+ */
+static inline unsigned *service_table(struct service_info *info)
+{
+	return (unsigned *)((char *)info + offsetof(struct service_info, table));
+}
+
+/*
+ * Builds the Maglev tables of the services of set. A service that remains
+ * keeps its table (already assigned) if it doesn't change, otherwise the new
+ * one is written in a slot not used by any service, old or new, and stored in
+ * keys and values for the BPF map. Returns the number of positions written or
+ * -1, moved counts the ones that changed backend in the tables replaced
+ */
+static int build_tables(struct services_set *set, char *used, uint32_t *keys,
+		struct backend_info *values, unsigned *moved)
+{
+	struct backend_name names[MAX_SERVICE_BACKENDS];
+	struct backend_info *built, *bkds, *old;
+	unsigned *table, *first, slot = 0, diff;
+	struct khashmap srv_index;
+	int *srv, n = 0;
+
+	/* Tables are too large for the stack */
+	built = malloc(sizeof(*built) * MAGLEV_SIZE);
+	table = malloc(sizeof(*table) * MAGLEV_SIZE);
+	first = malloc(sizeof(*first) * (set->nservices + 1));
+	bkds = calloc(set->nbackends + 1, sizeof(*bkds));
+	if (!built || !table || !first || !bkds) {
+		exit_with_error(ENOMEM);
+	}
+
+	/* The backends of every service, sorted by index */
+	khashmap_init(&srv_index, sizeof(struct service_id), sizeof(int),
+			set->nservices + 1, KHASHMAP_F_OPEN_ADDR);
+	first[0] = 0;
+	for (int i = 0; i < set->nservices; i++) {
+		khashmap_update_elem(&srv_index, &set->srv_keys[i], &i, 0);
+		first[i + 1] = first[i] + set->srv_infos[i].backends;
+	}
+	for (int i = 0; i < set->nbackends; i++) {
+		srv = khashmap_lookup_elem(&srv_index, &set->bkd_keys[i].service);
+		if (!srv || set->bkd_keys[i].index
+				>= set->srv_infos[*srv].backends) {
+			fprintf(stderr, "ERROR: backend %d not in its service\n", i);
+			n = -1;
+			goto out;
+		}
+		bkds[first[*srv] + set->bkd_keys[i].index] = set->bkd_infos[i];
+	}
+
+	*moved = 0;
+	for (int i = 0; i < set->nservices; i++) {
+		unsigned nbkds = set->srv_infos[i].backends;
+
+		for (int j = 0; j < nbkds; j++) {
+			names[j].addr = bkds[first[i] + j].addr;
+			names[j].port = bkds[first[i] + j].port;
+		}
+		if (maglev_build(names, sizeof(*names), nbkds, MAGLEV_SIZE, table)) {
+			fprintf(stderr, "ERROR: unable to build Maglev table\n");
+			n = -1;
+			goto out;
+		}
+		for (int j = 0; j < MAGLEV_SIZE; j++) {
+			built[j] = bkds[first[i] + table[j]];
+		}
+
+		if (set->srv_infos[i].table < MAGLEV_TABLES) {
+			old = &maglev[set->srv_infos[i].table * MAGLEV_SIZE];
+			diff = 0;
+			for (int j = 0; j < MAGLEV_SIZE; j++) {
+				diff += !!memcmp(&old[j], &built[j], sizeof(*built));
 			}
-			if (ifindex == -1) {
-				fprintf(stderr, "ERROR: Parsed unknown interface %s\n", ifname);
-				exit(EXIT_FAILURE);
+			if (!diff) {
+				continue;
 			}
-			bkd_entry->value.ifindex = ifindex;
-
-			srvindex = khashmap_lookup_elem(&srv_to_index,
-					&bkd_entry->key.service);
-			if (!srvindex) {
-				struct service_entry *srv_entry =
-						&service_entries[service_first_free];
-				srv_entry->key = bkd_entry->key.service;
-				srv_entry->value.backends = 0;
-				srv_info = &srv_entry->value;
-
-				if (khashmap_update_elem(&srv_to_index, &srv_entry->key,
-						&service_first_free, 0)) {
-					fprintf(stderr,
-							"ERROR: unable to add service index to hash map\n");
-					exit(EXIT_FAILURE);
-				}
-
-				service_first_free++;
-			} else {
-				srv_info = &service_entries[*srvindex].value;
+			*moved += diff;
+		}
+
+		/* There is always one, old and new services are MAX_SERVICES each */
+		while (used[slot]) {
+			slot++;
+		}
+		used[slot] = 1;
+		memcpy(&maglev[slot * MAGLEV_SIZE], built,
+				sizeof(*built) * MAGLEV_SIZE);
+		for (int j = 0; j < MAGLEV_SIZE; j++) {
+			keys[n] = slot * MAGLEV_SIZE + j;
+			values[n++] = built[j];
+		}
+		set->srv_infos[i].table = slot;
+	}
+
+out:
+	khashmap_free(&srv_index);
+	free(built);
+	free(table);
+	free(first);
+	free(bkds);
+
+	return n;
+}
+
+/*
+ * Makes the services of set visible to the workers, in AF_XDP mode those
+ * already there are switched to their table in place
+ */
+static int publish_services(struct services_set *set)
+{
+	struct service_info *info;
+
+	if (config.working_mode & MODE_XDP) {
+		if (map_update_batch(services_fd, set->srv_keys, set->srv_infos,
+				set->nservices, sizeof(struct service_id),
+				sizeof(struct service_info))) {
+			fprintf(stderr, "ERROR: unable to add services to bpf map: %s\n",
+					strerror(errno));
+			return -1;
+		}
+	}
+
+	if (config.working_mode & MODE_AF_XDP) {
+		for (int i = 0; i < set->nservices; i++) {
+			info = khashmap_lookup_elem(&services, &set->srv_keys[i]);
+			if (info) {
+				info->backends = set->srv_infos[i].backends;
+				__atomic_store_n(service_table(info),
+						set->srv_infos[i].table, __ATOMIC_RELEASE);
+			} else if (khashmap_update_elem(&services, &set->srv_keys[i],
+					&set->srv_infos[i], 0)) {
+				fprintf(stderr, "ERROR: unable to add service to hash map\n");
+				return -1;
 			}
+		}
+	}
 
-			bkd_entry->key.index = srv_info->backends;
-			srv_info->backends++;
+	return 0;
+}
 
-			i++;
+static int delete_services(struct service_id *keys, unsigned n)
+{
+	if (config.working_mode & MODE_AF_XDP) {
+		for (int i = 0; i < n; i++) {
+			khashmap_delete_elem(&services, &keys[i]);
 		}
+	}
 
-		if (i != nbackends || service_first_free != nservices) {
-			fprintf(stderr,
-					"ERROR: incorrent input file: mismatch in items number\n");
-			exit(-1);
+	if (config.working_mode & MODE_XDP) {
+		if (map_delete_batch(services_fd, keys, n,
+				sizeof(struct service_id))) {
+			fprintf(stderr, "ERROR: unable to delete services from bpf map: "
+					"%s\n", strerror(errno));
+			return -1;
 		}
+	}
 
-		if (config.working_mode & MODE_AF_XDP) {
-			for (int i = 0; i < nservices; i++) {
-				if (khashmap_update_elem(&services, &service_entries[i].key,
-						&service_entries[i].value, 0)) {
-					fprintf(stderr,
-							"ERROR: unable to add service to hash map\n");
-					exit(EXIT_FAILURE);
-				}
-			}
+	return 0;
+}
 
-			for (int i = 0; i < nbackends; i++) {
-				if (khashmap_update_elem(&backends, &backend_entries[i].key,
-						&backend_entries[i].value, 0)) {
-					fprintf(stderr,
-							"ERROR: unable to add backend to hash map\n");
-					exit(EXIT_FAILURE);
-				}
-			}
+/*
+ * Moves the tables from the old to the new set of services, without stopping
+ * the workers. The tables that change are built in the slots left free by the
+ * old ones, nothing seen by the workers is written until then. Services gone
+ * are deleted and the others are switched to their new table, an old table
+ * is rewritten only by a following reload, when no lookup can still be using
+ * it. Existing sessions keep their backend. If the services can't be updated
+ * the old ones are put back, their tables are untouched
+ */
+static int update_services(struct services_set *old, struct services_set *new)
+{
+	struct service_id *del_srvs, *add_srvs;
+	unsigned ndel_srvs = 0, nadd_srvs = 0, moved;
+	char used[MAGLEV_TABLES] = {0};
+	struct backend_info *values;
+	struct service_info *info;
+	struct khashmap old_index;
+	uint32_t *keys;
+	int ret = 0, n;
+
+	del_srvs = malloc(sizeof(*del_srvs) * (old->nservices + 1));
+	add_srvs = malloc(sizeof(*add_srvs) * (new->nservices + 1));
+	keys = malloc(sizeof(*keys) * (new->nservices * MAGLEV_SIZE + 1));
+	values = malloc(sizeof(*values) * (new->nservices * MAGLEV_SIZE + 1));
+	if (!del_srvs || !add_srvs || !keys || !values) {
+		exit_with_error(ENOMEM);
+	}
+
+	/* Services gone and added, and tables of the ones that remain */
+	khashmap_init(&old_index, sizeof(struct service_id),
+			sizeof(struct service_info), old->nservices + 1,
+			KHASHMAP_F_OPEN_ADDR);
+	for (int i = 0; i < old->nservices; i++) {
+		khashmap_update_elem(&old_index, &old->srv_keys[i],
+				&old->srv_infos[i], 0);
+		used[old->srv_infos[i].table] = 1;
+	}
+	for (int i = 0; i < new->nservices; i++) {
+		info = khashmap_lookup_elem(&old_index, &new->srv_keys[i]);
+		if (info) {
+			new->srv_infos[i].table = info->table;
+			khashmap_delete_elem(&old_index, &new->srv_keys[i]);
+		} else {
+			new->srv_infos[i].table = MAGLEV_TABLES;
+			add_srvs[nadd_srvs++] = new->srv_keys[i];
 		}
+	}
+	for (int i = 0; i < old->nservices; i++) {
+		if (khashmap_lookup_elem(&old_index, &old->srv_keys[i])) {
+			del_srvs[ndel_srvs++] = old->srv_keys[i];
+		}
+	}
+	khashmap_free(&old_index);
+
+	n = build_tables(new, used, keys, values, &moved);
+	if (n < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	if (config.working_mode & MODE_XDP) {
+		/* One syscall for all the tables instead of one per entry */
+		if (map_update_batch(maglev_fd, keys, values, n, sizeof(*keys),
+				sizeof(*values))) {
+			fprintf(stderr, "ERROR: unable to update Maglev tables: %s\n",
+					strerror(errno));
+			ret = -1;
+			goto out;
+		}
+	}
+
+	/* Services gone first, to make room for the new ones */
+	if (delete_services(del_srvs, ndel_srvs) || publish_services(new)) {
+		/* The new services go away before putting back the old ones */
+		if (delete_services(add_srvs, nadd_srvs) || publish_services(old)) {
+			fprintf(stderr, "ERROR: unable to restore the services\n");
+		}
+		ret = -1;
+		goto out;
+	}
+
+	printf("Replaced %d Maglev tables, %u positions moved\n",
+			n / MAGLEV_SIZE, moved);
+
+out:
+	free(del_srvs);
+	free(add_srvs);
+	free(keys);
+	free(values);
+
+	return ret;
+}
+
+/* Reloads the services file, called by the main loop on SIGHUP */
+static void reload_services()
+{
+	struct services_set set;
+
+	if (!opt_services_path) {
+		fprintf(stderr, "WARNING: no services file to reload\n");
+		return;
+	}
+
+	printf("Reloading services...\n");
+
+	if (read_services(opt_services_path, &set)) {
+		fprintf(stderr, "ERROR: services not reloaded\n");
+		return;
+	}
+
+	/* The old services stay in place, and are the ones to diff next time */
+	if (update_services(&cur_services, &set)) {
+		fprintf(stderr, "ERROR: services not reloaded\n");
+		free_services(&set);
+		return;
+	}
+
+	free_services(&cur_services);
+	cur_services = set;
+
+	printf("Loaded %u services and %u backends\n", set.nservices,
+			set.nbackends);
+}
+
+static void load_services(const char *services_path)
+{
+	struct services_set none = {};
+
+	if (config.working_mode & MODE_AF_XDP) {
+		khashmap_init(&active_sessions, sizeof(struct session_id),
+				sizeof(struct replace_info), MAX_SESSIONS,
+				KHASHMAP_F_LRU);
+		khashmap_init(&services, sizeof(struct service_id),
+				sizeof(struct service_info), MAX_SERVICES,
+				KHASHMAP_F_OPEN_ADDR);
+	}
+
+	maglev = calloc((size_t)MAGLEV_TABLES * MAGLEV_SIZE, sizeof(*maglev));
+	if (!maglev) {
+		exit_with_error(ENOMEM);
+	}
+
+	if (services_path) {
+		printf("Loading services...\n");
 
 		if (config.working_mode & MODE_XDP) {
 			struct bpf_map *map;
-			int i, mapfd;
 
 			map = bpf_object__find_map_by_name(obj, "services");
-			mapfd = bpf_map__fd(map);
-			if (mapfd < 0) {
+			services_fd = bpf_map__fd(map);
+			if (services_fd < 0) {
 				fprintf(stderr, "ERROR: no services map found: %s\n",
-						strerror(mapfd));
+						strerror(services_fd));
 				exit(EXIT_FAILURE);
 			}
-			for (int i = 0; i < nservices; i++) {
-				if (bpf_map_update_elem(mapfd, &service_entries[i].key,
-						&service_entries[i].value, 0)) {
-					fprintf(stderr,
-							"ERROR: unable to add service to bpf map %d\n", i);
-					exit(EXIT_FAILURE);
-				}
-			}
 
-			map = bpf_object__find_map_by_name(obj, "backends");
-			mapfd = bpf_map__fd(map);
-			if (mapfd < 0) {
-				fprintf(stderr, "ERROR: no backends map found: %s\n",
-						strerror(mapfd));
+			map = bpf_object__find_map_by_name(obj, "maglev");
+			maglev_fd = bpf_map__fd(map);
+			if (maglev_fd < 0) {
+				fprintf(stderr, "ERROR: no maglev map found: %s\n",
+						strerror(maglev_fd));
 				exit(EXIT_FAILURE);
 			}
-			for (int i = 0; i < nbackends; i++) {
-				if (bpf_map_update_elem(mapfd, &backend_entries[i].key,
-						&backend_entries[i].value, 0)) {
-					fprintf(stderr,
-							"ERROR: unable to add backend to bpf map %d\n", i);
-					exit(EXIT_FAILURE);
-				}
-			}
 		}
 
-		printf("Added %u services and %u backends\n", nservices, nbackends);
+		if (read_services(services_path, &cur_services)
+				|| update_services(&none, &cur_services)) {
+			exit(EXIT_FAILURE);
+		}
 
-		free(service_entries);
-		free(backend_entries);
-		khashmap_free(&srv_to_index);
+		printf("Added %u services and %u backends\n", cur_services.nservices,
+				cur_services.nbackends);
 	}
 
 	if (opt_passthrough > 0) {
@@ -388,69 +884,123 @@ static void clear_maps()
 {
 	if (config.working_mode == MODE_AF_XDP) {
 		khashmap_clear(&active_sessions);
-		khashmap_clear(&backends);
 		khashmap_clear(&services);
 	}
+
+	free(maglev);
 }
 
-int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
+struct lb_packet {
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	uint16_t *sport, *dport, *l4check;
+	struct session_id sid;
+};
+
+/*
+ * Parses the headers of the packet. Returns 0 if the packet must go through
+ * the load balancing logic, otherwise the verdict is stored in *verdict
+ */
+static int parse_packet(void *pkt, unsigned len, unsigned ingress_ifindex,
+		struct lb_packet *p, int *verdict)
 {
 	void *pkt_end = pkt + len;
 
 	struct ethhdr *eth = pkt;
 	if ((void *)(eth + 1) > pkt_end) {
-		return -1;
+		*verdict = -1;
+		return 1;
 	}
 
 	if (eth->h_proto != htons(ETH_P_IP)) {
-		return config.num_interfaces > 1 ?
+		*verdict = config.num_interfaces > 1 ?
 				(ingress_ifindex + 1) % config.num_interfaces : -1;
+		return 1;
 	}
 
 	struct iphdr *iph = (void *)(eth + 1);
 	if ((void *)(iph + 1) > pkt_end) {
-		return -1;
+		*verdict = -1;
+		return 1;
 	}
 
 	void *next = (void *)iph + (iph->ihl << 2);
-	uint16_t *sport, *dport, *l4check;
 
 	switch (iph->protocol) {
 	case IPPROTO_TCP:;
 		struct tcphdr *tcph = next;
 		if ((void *)(tcph + 1) > pkt_end) {
-			return -1;
+			*verdict = -1;
+			return 1;
 		}
 
-		sport = &tcph->source;
-		dport = &tcph->dest;
-		l4check = &tcph->check;
+		p->sport = &tcph->source;
+		p->dport = &tcph->dest;
+		p->l4check = &tcph->check;
 
 		break;
 
 	case IPPROTO_UDP:;
 		struct udphdr *udph = next;
 		if ((void *)(udph + 1) > pkt_end) {
-			return -1;
+			*verdict = -1;
+			return 1;
 		}
 
-		sport = &udph->source;
-		dport = &udph->dest;
-		l4check = &udph->check;
+		p->sport = &udph->source;
+		p->dport = &udph->dest;
+		p->l4check = &udph->check;
 
 		break;
 
 	default:
-		return config.num_interfaces > 1 ?
+		*verdict = config.num_interfaces > 1 ?
 				(ingress_ifindex + 1) % config.num_interfaces : -1;
+		return 1;
 	}
 
-	struct session_id sid = {0};
-	sid.saddr = iph->saddr;
-	sid.daddr = iph->daddr;
-	sid.proto = iph->protocol;
-	sid.sport = *sport;
-	sid.dport = *dport;
+	p->eth = eth;
+	p->iph = iph;
+	__builtin_memset(&p->sid, 0, sizeof(p->sid));
+	p->sid.saddr = iph->saddr;
+	p->sid.daddr = iph->daddr;
+	p->sid.proto = iph->protocol;
+	p->sid.sport = *p->sport;
+	p->sid.dport = *p->dport;
+
+	return 0;
+}
+
+/*
+ * Hash used to pick the backend of a new session, the RSS hash computed by the
+ * NIC is used when available. The XDP program does the same, so in COMBINED
+ * mode a session gets the same backend on both paths
+ */
+static inline uint32_t session_hash(struct lb_packet *p)
+{
+	struct xsknf_rx_meta *meta;
+
+	if (config.rx_metadata) {
+		meta = xsknf_get_rx_meta(p->eth);
+		if (meta->flags & XSKNF_META_HASH) {
+			return meta->hash;
+		}
+	}
+
+	return jhash(&p->sid, sizeof(struct session_id), 0);
+}
+
+/*
+ * Applies the load balancing logic to a parsed packet. rep is the result of
+ * the lookup of the packet session in the active sessions table
+ */
+static int load_balance(struct lb_packet *p, struct replace_info *rep,
+		unsigned ingress_ifindex)
+{
+	struct ethhdr *eth = p->eth;
+	struct iphdr *iph = p->iph;
+	uint16_t *sport = p->sport, *dport = p->dport, *l4check = p->l4check;
+	struct session_id sid = p->sid;
 
 	/* Used for checksum update before forward */
 	uint32_t old_addr, new_addr;
@@ -458,8 +1008,7 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 
 	unsigned output = -1;
 
-	/* Look for known sessions */
-	struct replace_info *rep = khashmap_lookup_elem(&active_sessions, &sid);
+	/* Known session */
 	if (rep) {
 		goto UPDATE;
 	}
@@ -477,15 +1026,10 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 				(ingress_ifindex + 1) % config.num_interfaces : -1;
 	}
 
-	struct backend_id bkdid = {
-		.service = srvid,
-		.index = jhash(&sid, sizeof(struct session_id), 0) % srvinfo->backends
-	};
-	struct backend_info *bkdinfo = khashmap_lookup_elem(&backends, &bkdid);
-	if (!bkdinfo) {
-		fprintf(stderr, "ERROR: missing backend\n");
-		return -1;
-	}
+	/* A single read of the Maglev table of the service */
+	unsigned table = __atomic_load_n(service_table(srvinfo), __ATOMIC_ACQUIRE);
+	struct backend_info *bkdinfo = &maglev[table * MAGLEV_SIZE
+			+ session_hash(p) % MAGLEV_SIZE];
 
 	/* Store the forward session */
 	struct replace_info fwd_rep;
@@ -500,6 +1044,9 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 		fprintf(stderr, "ERROR: unable to add forward session to map\n");
 		goto UPDATE;
 	}
+	if (opt_cache) {
+		install_session(&sid, &fwd_rep);
+	}
 
 	/* Store the backward session */
 	struct replace_info bwd_rep;
@@ -516,6 +1063,9 @@ int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 		fprintf(stderr, "ERROR: unable to add backward session to map\n");
 		goto UPDATE;
 	}
+	if (opt_cache) {
+		install_session(&sid, &bwd_rep);
+	}
 
 UPDATE:;
 	if (rep->dir == DIR_TO_BACKEND) {
@@ -535,23 +1085,54 @@ UPDATE:;
 	__builtin_memcpy(&eth->h_dest, &rep->mac_addr, sizeof(eth->h_dest));
 	output = rep->ifindex;
 
-	/* Update ip checksum */
-	uint32_t csum = ~csum_unfold(iph->check);
-	csum = csum_add(csum, ~old_addr);
-	csum = csum_add(csum, new_addr);
-	iph->check = csum_fold(csum);
-
-	/* Update l4 checksum */
-	csum = ~csum_unfold(*l4check);
-	csum = csum_add(csum, ~old_addr);
-	csum = csum_add(csum, new_addr);
-	csum = csum_add(csum, ~old_port);
-	csum = csum_add(csum, new_port);
-	*l4check = csum_fold(csum);
+	/* Update ip and l4 checksums */
+	csum_replace4(&iph->check, old_addr, new_addr);
+	csum_replace4_2(l4check, old_addr, new_addr, old_port, new_port);
 
 	return output;
 }
 
+int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
+{
+	struct lb_packet p;
+	int verdict;
+
+	if (parse_packet(pkt, len, ingress_ifindex, &p, &verdict)) {
+		return verdict;
+	}
+
+	/* Look for known sessions */
+	return load_balance(&p, khashmap_lookup_elem(&active_sessions, &p.sid),
+			ingress_ifindex);
+}
+
+void xsknf_batch_processor(struct xsknf_packet *pkts, int *verdicts,
+		unsigned npkts, unsigned ingress_ifindex)
+{
+	struct lb_packet p[npkts];
+	void *keys[npkts], *reps[npkts];
+	unsigned pkt_idx[npkts], n = 0;
+
+	for (unsigned i = 0; i < npkts; i++) {
+		if (!parse_packet(pkts[i].data, pkts[i].len, ingress_ifindex, &p[n],
+				&verdicts[i])) {
+			keys[n] = &p[n].sid;
+			pkt_idx[n++] = i;
+		}
+	}
+
+	/*
+	 * Look for known sessions of the whole batch at once. If two packets of the
+	 * same new session are in the batch both of them are handled as new, this
+	 * is harmless since they are mapped to the same backend
+	 */
+	khashmap_lookup_batch(&active_sessions, keys, reps, n);
+
+	for (unsigned i = 0; i < n; i++) {
+		verdicts[pkt_idx[i]] = load_balance(&p[i], reps[i], ingress_ifindex);
+	}
+}
+
 static struct option long_options[] = {
 	{"services-path", required_argument, 0, 'p'},
 	{"passthrough", required_argument, 0, 'p'},
@@ -560,6 +1141,7 @@ static struct option long_options[] = {
 	{"quiet", no_argument, 0, 'q'},
 	{"extra-stats", no_argument, 0, 'x'},
 	{"app-stats", no_argument, 0, 'a'},
+	{"cache", no_argument, 0, 'c'},
 	{0, 0, 0, 0}
 };
 
@@ -568,13 +1150,14 @@ static void usage(const char *prog)
 	const char *str =
 		"  Usage: %s [XSKNF_OPTIONS] -- [APP_OPTIONS]\n"
 		"  App options:\n"
-		"  -f, --services-path	Path of the services file.\n"
+		"  -f, --services-path	Path of the services file, reloaded on SIGHUP.\n"
 		"  -p, --passthrough=n	Populate the table of active sessions with n sessions for the pass-through test.\n"
 		"  -s, --spread-flows	Spread pass-through flows on a different virtual service for every worker.\n"
 		"  -l, --local=n		Populate the table of active sessions with n sessions for the local test.\n"
 		"  -q, --quiet		Do not display any stats.\n"
 		"  -x, --extra-stats	Display extra statistics.\n"
 		"  -a, --app-stats	Display application (syscall) statistics.\n"
+		"  -c, --cache		In COMBINED mode only new sessions reach user space, that installs them in the XDP fast path.\n"
 		"\n";
 	fprintf(stderr, str, prog);
 
@@ -587,7 +1170,7 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 	unsigned int extended_mac[6];
 
 	for (;;) {
-		c = getopt_long(argc, argv, "f:p:sl:qxa", long_options, &option_index);
+		c = getopt_long(argc, argv, "f:p:sl:qxac", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -613,6 +1196,9 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 		case 'a':
 			opt_app_stats = 1;
 			break;
+		case 'c':
+			opt_cache = 1;
+			break;
 		default:
 			usage(basename(app_path));
 		}
@@ -623,6 +1209,13 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 				"configuring a number of pass-through flows\n");
 		usage(basename(app_path));
 	}
+
+	if (opt_cache && (config.working_mode != MODE_COMBINED
+			|| opt_spread_flows)) {
+		fprintf(stderr, "ERROR: the cache option requires COMBINED mode and "
+				"no spread-flows\n");
+		usage(basename(app_path));
+	}
 }
 
 static void int_exit(int sig)
@@ -635,24 +1228,40 @@ static void int_usr(int sig)
 	print_stats(&config, obj);
 }
 
+static void int_hup(int sig)
+{
+	reload_pending = 1;
+}
+
 int main(int argc, char **argv)
 {
 	signal(SIGINT, int_exit);
 	signal(SIGTERM, int_exit);
 	signal(SIGABRT, int_exit);
 	signal(SIGUSR1, int_usr);
+	signal(SIGHUP, int_hup);
 
 	xsknf_parse_args(argc, argv, &config);
 	parse_command_line(argc, argv, argv[0]);
 
 	strcpy(config.tc_progname, "handle_tc");
-	strcpy(config.xdp_progname,
-			opt_spread_flows ? "hybrid_xdp" : "standard_xdp");
+	strcpy(config.xdp_progname, opt_cache ? "cached_xdp"
+			: opt_spread_flows ? "hybrid_xdp" : "standard_xdp");
 
 	xsknf_init(&config, &obj);
 
 	load_services(opt_services_path);
 
+	if (opt_cache) {
+		fastpath_sessions = xsknf_fastpath_map("active_sessions");
+		if (fastpath_sessions < 0) {
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < config.num_interfaces; i++) {
+			kern_ifindexes[i] = ifname_to_kern_idx(config.interfaces[i]);
+		}
+	}
+
 	if (config.working_mode & MODE_XDP && opt_spread_flows) {
 		struct bpf_map *global_map = bpf_object__find_map_by_name(obj,
 				"load_bal.bss");
@@ -680,11 +1289,24 @@ int main(int argc, char **argv)
 
 	while (!benchmark_done) {
 		sleep(1);
+		if (reload_pending) {
+			reload_pending = 0;
+			reload_services();
+		}
 		if (!opt_quiet) {
 			dump_stats(config, obj, opt_extra_stats, opt_app_stats);
 		}
 	}
 
+	if (opt_cache) {
+		struct xsknf_fastpath_stats fp;
+
+		xsknf_get_fastpath_stats(&fp);
+		printf("Fast path: %lu sessions installed, %lu rejected, %lu not "
+				"queued, %lu syscalls\n", fp.installed, fp.errors, fp.full,
+				fp.syscalls);
+	}
+
 	xsknf_cleanup();
 
 	clear_maps();
@@ -4,6 +4,7 @@
 #include <linux/if_ether.h>
 #include <linux/pkt_cls.h>
 #include <bpf/bpf_helpers.h>
+#include <xsknf_kern.h>
 
 /* 
  * Including the common/statistics.h header creates problems with other
@@ -21,13 +22,6 @@ struct {
 	__uint(max_entries, 1);
 } xdp_stats SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_XSKMAP);
-	__uint(key_size, sizeof(int));
-	__uint(value_size, sizeof(int));
-	__uint(max_entries, 32);
-} xsks SEC(".maps");
-
 struct global_data global = {0};
 
 SEC("xdp") int handle_xdp(struct xdp_md *ctx)
@@ -36,20 +30,17 @@ SEC("xdp") int handle_xdp(struct xdp_md *ctx)
 	void *data_end = (void *)(long)ctx->data_end;
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return XDP_ABORTED;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return XDP_ABORTED;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
-
-	/*
-	 * Need to send the at least one packet to user space for busy polling to
-	 * work in combined mode.
-	 * In pure XDP the redirect will fail and the packet will be sent back.
-	 */
-	if (stats->rx_npkts == 1) {
-		return bpf_redirect_map(&xsks, 0, XDP_TX);
-		// return bpf_redirect_map(&xsks, 0, XDP_PASS);
+
+	/* Starts busy polling in combined mode (see xsknf_kern.h) */
+	if (xsknf_bootstrapping(ctx)) {
+		return xsknf_redirect(ctx, XDP_TX);
 	}
 
 	struct ethhdr *eth = data;
@@ -71,11 +62,13 @@ SEC("tc") int handle_tc(struct __sk_buff *skb)
 	void *data_end = (void *)(long)skb->data_end;
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return TC_ACT_SHOT;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return TC_ACT_SHOT;
+		}
+		stats->tx_npkts++;
 	}
-	stats->tx_npkts++;
 
 	struct ethhdr *eth = data;
 	if ((void *)(eth + 1) > data_end) {
@@ -8,11 +8,18 @@
  */
 #define ARRAY_SIZE 10000000
 
+/*
+ * In the pointer chase pattern the first bytes of a line hold the index of the
+ * next one, the NF writes after them
+ */
 struct cache_line {
-	uint8_t data[64];
+	union {
+		uint64_t next;
+		uint8_t data[64];
+	};
 } __attribute__((aligned(64)));
 
 struct global_data {
 	unsigned test_size;
 	int action;
-};
\ No newline at end of file
+};
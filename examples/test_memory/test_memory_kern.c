@@ -1,6 +1,7 @@
 #include "test_memory.h"
 #include <linux/bpf.h>
 #include <bpf/bpf_helpers.h>
+#include <xsknf_kern.h>
 
 /* 
  * Including the common/statistics.h header creates problems with other
@@ -18,13 +19,6 @@ struct {
 	__uint(max_entries, 1);
 } xdp_stats SEC(".maps");
 
-struct {
-	__uint(type, BPF_MAP_TYPE_XSKMAP);
-	__uint(key_size, sizeof(int));
-	__uint(value_size, sizeof(int));
-	__uint(max_entries, 32);
-} xsks SEC(".maps");
-
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
 	__type(key, int);
@@ -40,19 +34,17 @@ SEC("xdp") int handle_xdp(struct xdp_md *ctx)
 	void *data_end = (void *)(long)ctx->data_end;
 	int zero = 0;
 
-	struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
-	if (!stats) {
-		return XDP_ABORTED;
+	if (xsknf_xdp_stats) {
+		struct xdp_cpu_stats *stats = bpf_map_lookup_elem(&xdp_stats, &zero);
+		if (!stats) {
+			return XDP_ABORTED;
+		}
+		stats->rx_npkts++;
 	}
-	stats->rx_npkts++;
 
-	/*
-	 * Need to send the at least one packet to user space for busy polling to
-	 * work in combined mode.
-	 * In pure XDP the redirect will fail and the packet will be sent back.
-	 */
-	if (stats->rx_npkts == 1) {
-		return bpf_redirect_map(&xsks, 0, global.action);
+	/* Starts busy polling in combined mode (see xsknf_kern.h) */
+	if (xsknf_bootstrapping(ctx)) {
+		return xsknf_redirect(ctx, global.action);
 	}
 
 	if (data + sizeof(uint64_t) > data_end) {
@@ -4,46 +4,246 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <locale.h>
+#include <math.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <xsknf.h>
 
+/* Scatters the ranks of the Zipf pattern over the array, it is prime */
+#define ZIPF_SCATTER 2654435761UL
+
 enum action {
 	ACTION_REDIRECT,
 	ACTION_DROP
 };
 
+/*
+ * How packets pick the lines they touch: uniformly at random, at random with
+ * a Zipf popularity (hot lines scattered in the array, like the popular
+ * entries of a hash table), walking the array sequentially or following a
+ * random cycle through all the lines, every access depending on the previous
+ * one (like the buckets of a chained hash table)
+ */
+enum pattern {
+	PATTERN_UNIFORM,
+	PATTERN_ZIPF,
+	PATTERN_SEQUENTIAL,
+	PATTERN_CHASE
+};
+
+enum writes {
+	WRITES_NONE,
+	WRITES_SHARED,	/* to the lines read, shared by all the workers */
+	WRITES_PRIVATE	/* to a private copy of the lines of every worker */
+};
+
+/* State of a worker thread, set up by its first packet */
+struct worker_state {
+	uint64_t rand;
+	uint64_t pos;	/* next line of the sequential and pointer chase patterns */
+	struct cache_line *writes;
+} __attribute__((aligned(64)));
+
 static int benchmark_done;
 static int opt_quiet;
 static int opt_extra_stats;
 static int opt_app_stats;
 static enum action opt_action = ACTION_REDIRECT;
+static enum pattern opt_pattern = PATTERN_UNIFORM;
+static enum writes opt_writes = WRITES_SHARED;
+static double opt_zipf = 0.99;
+static unsigned opt_lines = 1;
+static int opt_hugepages;
+static unsigned opt_seed = 1;
 
 struct bpf_object *obj;
 struct xsknf_config config;
 
 unsigned opt_test_size = 1;
-struct cache_line array[ARRAY_SIZE];
+static struct cache_line *array;
+static struct cache_line *private_arrays;
+static unsigned nthreads;
+static __thread struct worker_state *state;
+
+static inline uint64_t xorshift(uint64_t *s)
+{
+	/* xorshift64* */
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, n) without divisions */
+static inline unsigned rand_below(uint64_t *s, unsigned n)
+{
+	return ((xorshift(s) >> 32) * n) >> 32;
+}
+
+/*
+ * Rank in [0, n) with popularity about 1 / (rank + 1)^s, inverting the CDF of
+ * the continuous distribution on [0.5, n + 0.5), rank k taking [k + 0.5,
+ * k + 1.5). A couple of pow() per packet instead of a table of n entries
+ * that would compete for the cache with the array
+ */
+static inline unsigned rand_zipf(uint64_t *st, unsigned n, double s)
+{
+	double u = (xorshift(st) >> 11) * (1.0 / (1UL << 53)), a, b, x;
+
+	if (s == 1) {
+		x = 0.5 * pow(2. * n + 1, u);
+	} else {
+		a = pow(0.5, 1 - s);
+		b = pow(n + 0.5, 1 - s);
+		x = pow(a + u * (b - a), 1 / (1 - s));
+	}
+
+	x += 0.5;
+	return x < n + 1 ? (unsigned)x - 1 : n - 1;
+}
+
+static struct worker_state *worker_init()
+{
+	static unsigned next_worker;
+	/* In its own cache line, not to share it with the other workers */
+	struct worker_state *s = aligned_alloc(64, sizeof(*s));
+	unsigned id = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED);
+
+	if (!s) {
+		fprintf(stderr, "ERROR: unable to allocate the worker state\n");
+		exit(EXIT_FAILURE);
+	}
+
+	s->rand = (opt_seed + id) * 0x9e3779b97f4a7c15ULL | 1;
+	s->pos = rand_below(&s->rand, opt_test_size);
+	if (opt_writes == WRITES_PRIVATE)
+		s->writes = private_arrays + (size_t)(id % nthreads) * opt_test_size;
+	else
+		s->writes = array;
+
+	return s;
+}
+
+static inline uint64_t next_line(struct worker_state *s)
+{
+	uint64_t idx;
+
+	switch (opt_pattern) {
+	case PATTERN_ZIPF:
+		return rand_zipf(&s->rand, opt_test_size, opt_zipf) * ZIPF_SCATTER
+				% opt_test_size;
+	case PATTERN_SEQUENTIAL:
+		idx = s->pos;
+		s->pos = idx + 1 == opt_test_size ? 0 : idx + 1;
+		return idx;
+	case PATTERN_CHASE:
+		idx = s->pos;
+		s->pos = array[idx].next;
+		return idx;
+	default:
+		return rand_below(&s->rand, opt_test_size);
+	}
+}
 
 int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex)
 {
 	void *pkt_end = pkt + len;
+	struct worker_state *s = state;
+	uint8_t val = 0;
+	uint64_t idx;
 
 	if (pkt + sizeof(uint64_t) > pkt_end) {
 		return XDP_ABORTED;
 	}
 
-	unsigned idx = rand() % opt_test_size;
-	*(uint8_t *)pkt = array[idx].data[0];
-	array[idx].data[1] = *(uint8_t *)(pkt + 1);
+	if (!s)
+		s = state = worker_init();
+
+	for (unsigned i = 0; i < opt_lines; i++) {
+		idx = next_line(s);
+		val += array[idx].data[sizeof(uint64_t)];
+		if (opt_writes != WRITES_NONE)
+			s->writes[idx].data[sizeof(uint64_t) + 1] = *(uint8_t *)(pkt + 1);
+	}
+	*(uint8_t *)pkt = val;
 
 	return opt_action == ACTION_REDIRECT ?
 			(ingress_ifindex + 1) % config.num_interfaces : -1;
 }
 
+/*
+ * Allocates n zeroed lines, with hugepages of the default size if requested.
+ * Memory is touched right away so that page faults are not measured
+ */
+static struct cache_line *alloc_lines(size_t n)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	size_t len = n * sizeof(struct cache_line);
+	void *mem = MAP_FAILED;
+
+	if (opt_hugepages) {
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+				-1, 0);
+		if (mem == MAP_FAILED)
+			fprintf(stderr, "WARNING: unable to allocate hugepages, using "
+					"normal pages\n");
+	}
+
+	if (mem == MAP_FAILED)
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "ERROR: unable to allocate %zu lines\n", n);
+		exit(EXIT_FAILURE);
+	}
+
+	return mem;
+}
+
+static void init_array()
+{
+	uint64_t s = opt_seed * 0x9e3779b97f4a7c15ULL | 1, j, tmp;
+	uint64_t *perm;
+
+	array = alloc_lines(opt_test_size);
+	if (opt_writes == WRITES_PRIVATE)
+		private_arrays = alloc_lines((size_t)nthreads * opt_test_size);
+
+	if (opt_pattern != PATTERN_CHASE) {
+		/* Need to init the array, otherwise the compiler removes it */
+		for (uint64_t i = 0; i < opt_test_size; i++) {
+			array[i].next = i;
+		}
+		return;
+	}
+
+	/* A single random cycle through all the lines (Sattolo's algorithm) */
+	perm = malloc(opt_test_size * sizeof(*perm));
+	if (!perm) {
+		fprintf(stderr, "ERROR: unable to allocate the pointer chase\n");
+		exit(EXIT_FAILURE);
+	}
+	for (uint64_t i = 0; i < opt_test_size; i++)
+		perm[i] = i;
+	for (uint64_t i = opt_test_size - 1; i > 0; i--) {
+		j = rand_below(&s, i);
+		tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+	for (uint64_t i = 0; i < opt_test_size; i++)
+		array[perm[i]].next = perm[(i + 1) % opt_test_size];
+	free(perm);
+}
+
 static struct option long_options[] = {
 	{"action", required_argument, 0, 'c'},
 	{"test-size", required_argument, 0, 's'},
+	{"pattern", required_argument, 0, 'p'},
+	{"lines", required_argument, 0, 'l'},
+	{"writes", required_argument, 0, 'w'},
+	{"hugepages", no_argument, 0, 'H'},
+	{"seed", required_argument, 0, 'S'},
 	{"quiet", no_argument, 0, 'q'},
 	{"extra-stats", no_argument, 0, 'x'},
 	{"app-stats", no_argument, 0, 'a'},
@@ -56,7 +256,14 @@ static void usage(const char *prog)
 		"  Usage: %s [XSKNF_OPTIONS] -- [APP_OPTIONS]\n"
 		"  App options:\n"
 		"  -c, --action		REDIRECT or DROP packets (default REDIRECT).\n"
-		"  -s, --test-size	Number of consecutive array entries to access.\n"
+		"  -s, --test-size	Number of array entries (64 B lines) to access.\n"
+		"  -p, --pattern		Access pattern: uniform, zipf[:s] (default s 0.99),\n"
+		"			seq or chase (default uniform).\n"
+		"  -l, --lines		Lines accessed by every packet (default 1).\n"
+		"  -w, --writes		none, shared (to the lines read) or private (to a\n"
+		"			copy of the array of every worker), default shared.\n"
+		"  -H, --hugepages	Back the arrays with hugepages.\n"
+		"  -S, --seed		Seed of the random patterns (default 1).\n"
 		"  -q, --quiet		Do not display any stats.\n"
 		"  -x, --extra-stats	Display extra statistics.\n"
 		"  -a, --app-stats	Display application (syscall) statistics.\n"
@@ -71,7 +278,8 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 	int option_index, c;
 
 	for (;;) {
-		c = getopt_long(argc, argv, "qxas:c:", long_options, &option_index);
+		c = getopt_long(argc, argv, "qxas:c:p:l:w:HS:", long_options,
+				&option_index);
 		if (c == -1)
 			break;
 
@@ -89,6 +297,44 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 		case 's':
 			opt_test_size = atoi(optarg);
 			break;
+		case 'p':
+			if (!strcmp(optarg, "uniform")) {
+				opt_pattern = PATTERN_UNIFORM;
+			} else if (!strncmp(optarg, "zipf", 4)
+					&& (!optarg[4] || optarg[4] == ':')) {
+				opt_pattern = PATTERN_ZIPF;
+				if (optarg[4])
+					opt_zipf = atof(optarg + 5);
+			} else if (!strcmp(optarg, "seq")) {
+				opt_pattern = PATTERN_SEQUENTIAL;
+			} else if (!strcmp(optarg, "chase")) {
+				opt_pattern = PATTERN_CHASE;
+			} else {
+				fprintf(stderr, "ERROR: invalid pattern %s\n", optarg);
+				usage(basename(app_path));
+			}
+			break;
+		case 'l':
+			opt_lines = atoi(optarg);
+			break;
+		case 'w':
+			if (!strcmp(optarg, "none")) {
+				opt_writes = WRITES_NONE;
+			} else if (!strcmp(optarg, "shared")) {
+				opt_writes = WRITES_SHARED;
+			} else if (!strcmp(optarg, "private")) {
+				opt_writes = WRITES_PRIVATE;
+			} else {
+				fprintf(stderr, "ERROR: invalid writes %s\n", optarg);
+				usage(basename(app_path));
+			}
+			break;
+		case 'H':
+			opt_hugepages = 1;
+			break;
+		case 'S':
+			opt_seed = atoi(optarg);
+			break;
 		case 'q':
 			opt_quiet = 1;
 			break;
@@ -102,6 +348,11 @@ static void parse_command_line(int argc, char **argv, char *app_path)
 			usage(basename(app_path));
 		}
 	}
+
+	if (!opt_test_size || !opt_lines || opt_zipf <= 0) {
+		fprintf(stderr, "ERROR: invalid test size, lines or Zipf exponent\n");
+		usage(basename(app_path));
+	}
 }
 
 static void int_exit(int sig)
@@ -127,6 +378,15 @@ int main(int argc, char **argv)
 	parse_command_line(argc, argv, argv[0]);
 
 	if (config.working_mode & MODE_XDP) {
+		/* The eBPF program only implements the original test */
+		if (opt_pattern != PATTERN_UNIFORM || opt_lines != 1
+				|| opt_writes != WRITES_SHARED
+				|| opt_test_size > ARRAY_SIZE) {
+			fprintf(stderr, "ERROR: XDP only supports one uniform shared "
+					"line per packet out of at most %u\n", ARRAY_SIZE);
+			exit(EXIT_FAILURE);
+		}
+
 		struct bpf_map *global_map = bpf_object__find_map_by_name(obj,
 				"test_mem.bss");
 		if (!global_map) {
@@ -151,10 +411,9 @@ int main(int argc, char **argv)
 
 	}
 
-	/* Need to init the array, otherwise the compiler removes it */
-	for (int i = 0; i < ARRAY_SIZE; i++) {
-		*(uint64_t *)array[i].data = i;
-	}
+	/* Threads running the processing function */
+	nthreads = config.workers * (config.pipeline ? config.pipeline : 1);
+	init_array();
 
 	setlocale(LC_ALL, "");
 
@@ -172,4 +431,4 @@ int main(int argc, char **argv)
 	xsknf_cleanup();
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -4,28 +4,48 @@
 
 #include <arpa/inet.h>
 #include <bpf/bpf.h>
+#include <bpf/btf.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libmnl/libmnl.h>
 #include <linux/if_ether.h>
 #include <linux/if_link.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
 #include <linux/pkt_cls.h>
 #include <linux/pkt_sched.h>
 #include <linux/rtnetlink.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <math.h>
 #include <net/if.h>
 #include <poll.h>
 #include <pthread.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include <xdp/xsk.h>
 
 #ifndef SOL_XDP
 #define SOL_XDP 283
 #endif
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
 /*
  * The number of frames per socket and the size of the frame shall always be a
  * power of two. This allows to quickly identify the owner (socket) of the frame
@@ -33,14 +53,55 @@
  * Every address in the UMEM area can be structured as follows:
  * | owner-id | frame-id | in-frame-offset |
  */
-#define FRAMES_PER_SOCKET_SHIFT 12
-#define FRAMES_PER_SOCKET (1 << FRAMES_PER_SOCKET_SHIFT)  // 4096
+#define DEFAULT_FRAMES_PER_SOCKET 4096
+#define FRAMES_PER_SOCKET (conf.frames_per_socket)
+
+#define HUGEPAGE_2M (1UL << 21)
+#define HUGEPAGE_1G (1UL << 30)
 
 #define DEFAULT_BIND_FLAGS (XDP_USE_NEED_WAKEUP)
 
 #define POLL_TIMEOUT_MS 1000
+#define TX_COMPLETION_TIMEOUT_MS 1
+/* Max time a parking worker waits for its transmissions to complete */
+#define PARK_DRAIN_TIMEOUT_MS 100
+
+/*
+ * Fast path cache, see xsknf_fastpath_map(). Every thread running the
+ * processing functions queues its entries in its own ring, the fast path
+ * thread moves them to the maps FASTPATH_BATCH at a time
+ */
+#define FASTPATH_MAX_MAPS 8
+#define FASTPATH_RING_SIZE 4096
+#define FASTPATH_BATCH 256
+#define FASTPATH_SLOT_HDR 8	/* id of the map, before the key and the value */
+#define FASTPATH_IDLE_US 100
+/* Returned by the kernel for maps without batched operations */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Software flow steering, flows are hashed into buckets and every bucket is
+ * processed by one worker. The load of a worker is the share of full rx
+ * batches over the last STEER_WINDOW polls
+ */
+#define STEER_BUCKETS 16384
+#define STEER_WINDOW 1024
+#define DEFAULT_STEER_IDLE_MS 100
+
+/* Maximum time packets wait in the tx staging buffers (see stage_tx()) */
+#define DEFAULT_TX_COALESCE_US 50
+
+/*
+ * The application can provide either the per-packet or the batch processing
+ * function (or both, in that case the batch one is used)
+ */
+#pragma weak xsknf_packet_processor
+#pragma weak xsknf_batch_processor
 
-static size_t umem_bufsize;
 static int stop_workers = 0;
 static struct xsknf_config conf;
 static struct xsknf_config default_conf = {
@@ -48,38 +109,216 @@ static struct xsknf_config default_conf = {
 	.xsk_frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
 	.batch_size = 64,
 	.workers = 1,
-	.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST
+	.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+	.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+	.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
+	.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+	.frames_per_socket = DEFAULT_FRAMES_PER_SOCKET,
+	.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST,
+	.numa_node = XSKNF_NUMA_OFF,
+	.steer_idle_ms = DEFAULT_STEER_IDLE_MS,
+	.tx_coalesce_us = DEFAULT_TX_COALESCE_US
 };
 
 struct xsk_socket_info {
 	struct worker *worker;
 	struct xsk_socket *xsk;
+	unsigned iface;
+	unsigned queue;
 	uint32_t bind_flags;
 	void *buffer;
 	struct xsk_ring_cons rx;
 	struct xsk_ring_prod tx;
 	struct xsk_ring_prod fq;
 	struct xsk_ring_cons cq;
-	struct xsknf_socket_stats stats;
+	/*
+	 * Counters, in the private stats of the worker, and their shared copy
+	 * (see publish_stats())
+	 */
+	struct xsknf_socket_stats *stats;
+	struct xsknf_stats_block *stats_block;
 	unsigned outstanding_tx;
+	/* Descriptors waiting for transmission with tx_coalesce */
+	struct pkt_info *staged;
+	unsigned nstaged;
+	uint64_t staged_tsc;	/* read_tsc() when the first one was staged */
+};
+
+/*
+ * In pipelined mode every worker (the I/O thread) moves batches of received
+ * descriptors to its processing threads through single-producer
+ * single-consumer rings of batches. A slot is filled by the worker
+ * (submitted), processed by the processing thread (processed) and then
+ * transmitted by the worker (completed). Packet data never leaves the UMEM of
+ * the worker, so frames are still recycled through the owner-id of their
+ * addresses
+ */
+#define PIPE_RING_SIZE 16
+
+struct pipe_batch {
+	unsigned sock;	/* index of the rx socket in worker->xsks */
+	unsigned npkts;
+	uint64_t *addrs;
+	struct xsknf_packet *pkts;
+	int *verdicts;
+	uint64_t rx_tsc;	/* reception time, with histograms */
+};
+
+struct pipe_ring {
+	void *mem;	/* holds the arrays of all the batches */
+	struct pipe_batch batches[PIPE_RING_SIZE];
+	/* Written by the producer */
+	unsigned submitted __attribute__((aligned(64)));
+	unsigned completed;
+	/* Written by the consumer */
+	unsigned processed __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct proc_thread {
+	struct worker *worker;
+	pthread_t thread;
+	struct pipe_ring ring;
+	struct xsknf_stage_stats stage_stats[XSKNF_MAX_STAGES];
+	struct xsknf_hist *hists;
+} __attribute__((aligned(64)));
+
+struct socket_stats {
+	struct xsknf_socket_stats stats;
+} __attribute__((aligned(64)));
+
+struct steer_bucket {
+	uint32_t last_seen;	/* ms */
+	uint32_t worker;
+};
+
+struct fastpath_map {
+	int fd;
+	unsigned key_size;
+	unsigned value_size;
+	int no_batch;	/* batched updates not supported */
+	/* Entries waiting to be written, in the layout of the batch syscall */
+	void *keys;
+	void *values;
+	unsigned n;
+};
+
+struct fastpath_ring {
+	void *slots;
+	/* Written by the producer */
+	unsigned prod __attribute__((aligned(64)));
+	unsigned cons_cache;
+	unsigned long queued;
+	unsigned long full;
+	/* Written by the fast path thread */
+	unsigned cons __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+/* See xsknf_park_worker() */
+enum worker_state {
+	WORKER_ACTIVE,
+	WORKER_PARKING,	/* draining its transmissions */
+	WORKER_PARKED,	/* its sockets are served by another worker */
+	WORKER_UNPARKING	/* going back to serve its sockets */
 };
 
 struct worker {
 	unsigned id;
 	pthread_t thread;
+	/*
+	 * All the sockets of the worker, the index of a socket in this array is
+	 * the owner-id of its UMEM region. Packets toward an interface are sent
+	 * through the first socket of the worker on that interface
+	 */
 	struct xsk_socket_info *xsks;
+	unsigned nsockets;
+	struct xsk_socket_info *tx_xsks[XSKNF_MAX_INTERFACES];
+	size_t umem_size;
 	struct xsk_umem *umem;
 	void *buffer;
 	struct xsk_umem *copy_umem;
 	void *copy_buffer;
+	/* Frame pool, frames are taken from the buffer where the NF writes them */
+	void *pool_buffer;
+	uint64_t *pool;
+	unsigned pool_nfree;
+	/*
+	 * Free frames of the zero-copy (0) and copy (1) UMEMs used to forward
+	 * packets between sockets of different UMEMs, see handoff_frames()
+	 */
+	uint64_t *xfer[2];
+	unsigned xfer_nfree[2];
+	struct xsknf_stage_stats stage_stats[XSKNF_MAX_STAGES];
+	/* Processing threads of the pipelined mode */
+	struct proc_thread *procs;
+	unsigned next_submit;
+	unsigned next_complete;
+	unsigned inflight;
+	/* Software flow steering, see steer_batch() */
+	struct steer_bucket *steer_table;
+	struct pipe_ring *steer_rings;	/* the one at index i goes to worker i */
+	unsigned steer_inflight;
+	unsigned steer_polls;
+	unsigned steer_full;
+	unsigned load;	/* % of full batches, read by the other workers */
+	/* Counters of the sockets, each one in its own cache lines */
+	struct socket_stats *sock_stats;
+	uint32_t stats_ms;	/* last refresh of the ring stats */
+	struct xsknf_hist *hists;	/* of the I/O thread, in the stats memory */
+	/* Staging buffers of all the sockets with tx_coalesce */
+	struct pkt_info *tx_staged;
+	/* Benchmark mode, see bench_loop() */
+	void *bench_trace;
+	struct xsknf_bench_stats bench_stats;
+	/*
+	 * Parking, the control thread changes the state of the worker or the
+	 * parked workers it has to serve, bumps ctl_seq and waits for the thread
+	 * of the worker to copy it in ctl_ack once the change is applied
+	 */
+	unsigned ctl_seq __attribute__((aligned(64)));
+	unsigned ctl_ack;
+	enum worker_state state;
+	unsigned server;	/* worker serving the sockets, this one if active */
+	struct worker *adopted[XSKNF_MAX_WORKERS];	/* parked workers it serves */
+	unsigned nadopted;
 } __attribute__((aligned(64)));
 
-static unsigned num_sockets;
+struct stage {
+	const char *name;
+	xsknf_stage_fn fn;
+};
+
+static struct stage stages[XSKNF_MAX_STAGES];
+static unsigned nstages;
+
 static int *ifindexes;
 static struct worker *workers;
 static struct bpf_object *obj;
 static int egress_ebpf_program = 0;
 static int owner_shift;
+static int numa_node = -1;	/* node used for placement, -1 if disabled */
+static __thread struct worker *current_worker;
+static __thread struct xsknf_stage_stats *current_stage_stats;
+static __thread struct xsknf_hist *current_hists;
+static struct xsknf_stats_header *stats_shm;
+static size_t stats_shm_size;
+static unsigned bench_running;	/* workers still sending their packets */
+static int workers_running;
+/* Serializes parking operations, parked workers sleep on park_cond */
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static struct fastpath_map fastpath_maps[FASTPATH_MAX_MAPS];
+static unsigned nfastpath_maps;
+static unsigned fastpath_slot_size;
+/* One for every worker, then the ones of the processing threads */
+static struct fastpath_ring *fastpath_rings;
+static unsigned nfastpath_rings;
+static pthread_t fastpath_thread;
+static int fastpath_stop;
+static __thread struct fastpath_ring *current_fastpath;
+/* Written by the fast path thread */
+static unsigned long fastpath_installed, fastpath_errors, fastpath_syscalls;
+/* Counters of the rings of the previous runs */
+static unsigned long fastpath_queued, fastpath_full;
 
 static int xsk_get_xdp_stats(int fd, struct xsknf_socket_stats *stats)
 {
@@ -118,6 +357,199 @@ static void __exit_with_error(int error, const char *file, const char *func,
 
 #define exit_with_error(error) __exit_with_error(error, __FILE__, __func__, __LINE__)
 
+static int read_sysfs_line(const char *path, char *buf, size_t len)
+{
+	FILE *f = fopen(path, "r");
+	int ret = 0;
+
+	if (!f)
+		return -1;
+
+	if (!fgets(buf, len, f))
+		ret = -1;
+
+	fclose(f);
+	return ret;
+}
+
+/* Parses a list of CPUs in the "0-3,8,10-11" format */
+static int read_cpulist(const char *path, cpu_set_t *set)
+{
+	char buf[1024], *p;
+	long first, last;
+
+	if (read_sysfs_line(path, buf, sizeof(buf)))
+		return -1;
+
+	CPU_ZERO(set);
+	for (p = buf; *p && *p != '\n';) {
+		first = last = strtol(p, &p, 10);
+		if (*p == '-')
+			last = strtol(p + 1, &p, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+		if (*p == ',')
+			p++;
+		else
+			break;
+	}
+
+	return 0;
+}
+
+static int iface_numa_node(const char *iface)
+{
+	char path[128], buf[16];
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", iface);
+	if (read_sysfs_line(path, buf, sizeof(buf)))
+		return -1;
+
+	return atoi(buf);
+}
+
+static void resolve_numa_node()
+{
+	int node;
+
+	if (conf.numa_node == XSKNF_NUMA_OFF)
+		return;
+
+	if (conf.numa_node != XSKNF_NUMA_AUTO) {
+		numa_node = conf.numa_node;
+		return;
+	}
+
+	numa_node = iface_numa_node(conf.interfaces[0]);
+	if (numa_node < 0) {
+		fprintf(stderr, "WARNING: unable to find the NUMA node of %s, "
+				"disabling NUMA placement\n", conf.interfaces[0]);
+		numa_node = -1;
+		return;
+	}
+
+	for (int i = 1; i < conf.num_interfaces; i++) {
+		node = iface_numa_node(conf.interfaces[i]);
+		if (node >= 0 && node != numa_node) {
+			fprintf(stderr, "WARNING: %s is on NUMA node %d, %s on node %d\n",
+					conf.interfaces[i], node, conf.interfaces[0], numa_node);
+		}
+	}
+}
+
+/*
+ * Sets the memory policy of the range so that its pages are allocated on the
+ * NIC node when first touched (or pinned by the UMEM registration)
+ */
+static void numa_bind(void *addr, size_t len)
+{
+	unsigned long nodemask[16] = {0};
+
+	if (numa_node < 0)
+		return;
+
+	nodemask[numa_node / (8 * sizeof(unsigned long))] |=
+			1UL << (numa_node % (8 * sizeof(unsigned long)));
+
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, nodemask,
+			sizeof(nodemask) * 8, 0)) {
+		fprintf(stderr, "WARNING: mbind to NUMA node %d failed: %s\n",
+				numa_node, strerror(errno));
+	}
+}
+
+/* Zeroed allocation on the NIC node, to be released with numa_free() */
+static void *numa_zalloc(size_t len)
+{
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (addr == MAP_FAILED)
+		exit_with_error(errno);
+
+	numa_bind(addr, len);
+
+	return addr;
+}
+
+static void numa_free(void *addr, size_t len)
+{
+	if (addr)
+		munmap(addr, len);
+}
+
+/*
+ * Looks in /proc/interrupts for the IRQ of a queue of the interface. There is
+ * no standard naming, the heuristic matches names containing the interface
+ * name or its PCI address (e.g., ens1f0-TxRx-3 or mlx5_comp3@pci:0000:3b:00.0)
+ * and takes the queue index from the digits ending the name (before any '@')
+ */
+static int find_queue_irq(const char *iface, unsigned queue)
+{
+	char path[128], link[256], line[4096], *pci = NULL, *name, *end;
+	int irq = -1, len;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device", iface);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = 0;
+		pci = strrchr(link, '/');
+		pci = pci ? pci + 1 : link;
+	}
+
+	f = fopen("/proc/interrupts", "r");
+	if (!f)
+		return -1;
+
+	while (irq < 0 && fgets(line, sizeof(line), f)) {
+		if (!strchr(line, ':'))
+			continue;
+
+		line[strcspn(line, "\n")] = 0;
+		name = strrchr(line, ' ');
+		if (!name || (!strstr(name, iface) && !(pci && strstr(name, pci))))
+			continue;
+
+		end = strchr(name, '@');
+		if (!end)
+			end = name + strlen(name);
+		while (end > name && end[-1] >= '0' && end[-1] <= '9')
+			end--;
+
+		if (*end >= '0' && *end <= '9' && strtoul(end, NULL, 10) == queue)
+			irq = atoi(line);
+	}
+
+	fclose(f);
+	return irq;
+}
+
+static void check_irq_affinity(struct worker *worker, int cpu)
+{
+	struct xsk_socket_info *xsk;
+	char path[64];
+	cpu_set_t irq_set;
+	int irq;
+
+	for (int i = 0; i < worker->nsockets; i++) {
+		xsk = &worker->xsks[i];
+		irq = find_queue_irq(conf.interfaces[xsk->iface], xsk->queue);
+		if (irq < 0)
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+		if (read_cpulist(path, &irq_set))
+			continue;
+
+		if (!CPU_ISSET(cpu, &irq_set)) {
+			fprintf(stderr, "WARNING: IRQ %d of %s queue %u is not affine to "
+					"CPU %d of worker %u\n", irq, conf.interfaces[xsk->iface],
+					xsk->queue, cpu, worker->id);
+		}
+	}
+}
+
 static void xsk_configure_socket(char *iface, unsigned queue,
 		struct xsk_socket_info *xsk, unsigned umem_offset)
 {
@@ -125,8 +557,8 @@ static void xsk_configure_socket(char *iface, unsigned queue,
 	int ret, sock_opt;
 	uint32_t idx;
 
-	cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
-	cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+	cfg.rx_size = conf.rx_size;
+	cfg.tx_size = conf.tx_size;
 	if (conf.working_mode & MODE_XDP) {
 		cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
 	} else {
@@ -177,6 +609,19 @@ static void enter_xsks_into_map(struct bpf_object *obj)
 	struct bpf_map *map;
 	int xsks_map;
 
+	/* Tells the programs the interface index used in the xsks map keys */
+	map = bpf_object__find_map_by_name(obj, "xsknf_ifaces");
+	if (map) {
+		for (int if_idx = 0; if_idx < conf.num_interfaces; if_idx++) {
+			if (bpf_map_update_elem(bpf_map__fd(map), &ifindexes[if_idx],
+					&if_idx, 0)) {
+				fprintf(stderr, "ERROR: unable to add %s to the xsknf_ifaces "
+						"map\n", conf.interfaces[if_idx]);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
 	map = bpf_object__find_map_by_name(obj, "xsks");
 	xsks_map = bpf_map__fd(map);
 	if (xsks_map < 0) {
@@ -184,11 +629,12 @@ static void enter_xsks_into_map(struct bpf_object *obj)
 		return;
 	}
 
-	for (int if_idx = 0; if_idx < conf.num_interfaces; if_idx++) {
-		for (int wrk_idx = 0; wrk_idx < conf.workers; wrk_idx++) {
-			int fd = xsk_socket__fd(workers[wrk_idx].xsks[if_idx].xsk);
-			/* TODO: support multiple workers with multiple iterfaces */
-			int key = wrk_idx;
+	for (int wrk_idx = 0; wrk_idx < conf.workers; wrk_idx++) {
+		for (int i = 0; i < workers[wrk_idx].nsockets; i++) {
+			struct xsk_socket_info *xsk = &workers[wrk_idx].xsks[i];
+			int fd = xsk_socket__fd(xsk->xsk);
+			/* See xsknf_xsk_key() in xsknf_kern.h */
+			int key = xsk->iface * XSKNF_MAX_QUEUES + xsk->queue;
 
 			if (bpf_map_update_elem(xsks_map, &key, &fd, 0)) {
 				fprintf(stderr, "ERROR: bpf_map_update_elem %d\n", key);
@@ -198,6 +644,61 @@ static void enter_xsks_into_map(struct bpf_object *obj)
 	}
 }
 
+/* Must match struct xsknf_bootstrap in xsknf_kern.h */
+struct bootstrap_data {
+	uint32_t pending;
+	uint8_t sockets[XSKNF_MAX_INTERFACES * XSKNF_MAX_QUEUES];
+};
+
+/*
+ * Busy polling drives the NAPI context the socket got its last packet from,
+ * until the first one the socket has no NAPI id and the busy polling syscalls
+ * do nothing. In combined mode the XDP program could handle all the packets
+ * of a queue, so the sockets still without an id are flagged in the global
+ * data of xsknf_kern.h and the program redirects their first packet (see
+ * xsknf_bootstrapping())
+ */
+static void bootstrap_busy_poll(struct bpf_object *obj)
+{
+	struct bootstrap_data data = {0};
+	struct bpf_map *map;
+	unsigned napi_id;
+	socklen_t len;
+	int zero = 0;
+
+	map = bpf_object__find_map_by_name(obj, ".data.xsknf");
+	if (!map || bpf_map__value_size(map) != sizeof(data)) {
+		fprintf(stderr, "WARNING: the eBPF program can't bootstrap busy "
+				"polling (include xsknf_kern.h), sockets are not polled "
+				"until they receive a packet\n");
+		return;
+	}
+
+	for (int wrk_idx = 0; wrk_idx < conf.workers; wrk_idx++) {
+		for (int i = 0; i < workers[wrk_idx].nsockets; i++) {
+			struct xsk_socket_info *xsk = &workers[wrk_idx].xsks[i];
+
+			if (xsk->bind_flags & XDP_COPY)
+				continue;
+
+			len = sizeof(napi_id);
+			if (!getsockopt(xsk_socket__fd(xsk->xsk), SOL_SOCKET,
+					SO_INCOMING_NAPI_ID, &napi_id, &len) && napi_id)
+				continue;
+
+			data.sockets[xsk->iface * XSKNF_MAX_QUEUES + xsk->queue] = 1;
+			data.pending++;
+		}
+	}
+
+	/* The section only holds the bootstrap state, it can be written whole */
+	if (data.pending && bpf_map_update_elem(bpf_map__fd(map), &zero, &data,
+			0)) {
+		fprintf(stderr, "ERROR: unable to set up the busy poll bootstrap\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
 static void load_tc_programs(int fd)
 {
 	struct mnl_socket *nl;
@@ -355,6 +856,48 @@ static void del_clsact_qdiscs()
 	mnl_socket_close(nl);
 }
 
+/*
+ * Sets the initial value of a const volatile global variable of the eBPF
+ * object, must be called before loading it. Returns 0 on success or -1 if the
+ * variable does not exist
+ */
+static int set_rodata_var(struct bpf_object *obj, const char *name,
+		const void *val, size_t size)
+{
+	struct btf *btf = bpf_object__btf(obj);
+	struct bpf_map *map = bpf_object__find_map_by_name(obj, ".rodata");
+	const struct btf_type *sec, *var;
+	const struct btf_var_secinfo *vsi;
+	size_t map_size;
+	void *data;
+	int id;
+
+	if (!btf || !map)
+		return -1;
+
+	id = btf__find_by_name_kind(btf, ".rodata", BTF_KIND_DATASEC);
+	if (id < 0)
+		return -1;
+
+	sec = btf__type_by_id(btf, id);
+	vsi = btf_var_secinfos(sec);
+	for (int i = 0; i < btf_vlen(sec); i++, vsi++) {
+		var = btf__type_by_id(btf, vsi->type);
+		if (strcmp(btf__name_by_offset(btf, var->name_off), name)
+				|| vsi->size != size)
+			continue;
+
+		data = bpf_map__initial_value(map, &map_size);
+		if (!data || vsi->offset + size > map_size)
+			return -1;
+
+		memcpy(data + vsi->offset, val, size);
+		return 0;
+	}
+
+	return -1;
+}
+
 static void load_ebpf_programs(char *path, struct bpf_object **obj,
 		char *xdp_progname, char *tc_progname)
 {
@@ -373,6 +916,41 @@ static void load_ebpf_programs(char *path, struct bpf_object **obj,
 		exit(EXIT_FAILURE);
 	}
 	bpf_program__set_type(xdp_prog, BPF_PROG_TYPE_XDP);
+
+	if (conf.rx_metadata) {
+		int val = 1;
+
+		if (set_rodata_var(*obj, "xsknf_rx_metadata", &val, sizeof(val))) {
+			fprintf(stderr, "ERROR: the eBPF program does not support RX "
+					"metadata (include xsknf_kern.h)\n");
+			exit(EXIT_FAILURE);
+		}
+
+		/*
+		 * The kfuncs reading the metadata only work in programs bound to a
+		 * device, otherwise they report all fields as unavailable
+		 */
+#ifdef BPF_F_XDP_DEV_BOUND_ONLY
+		if (conf.num_interfaces == 1) {
+			bpf_program__set_ifindex(xdp_prog, ifindexes[0]);
+			bpf_program__set_flags(xdp_prog, bpf_program__flags(xdp_prog)
+					| BPF_F_XDP_DEV_BOUND_ONLY);
+		} else
+#endif
+		fprintf(stderr, "WARNING: RX metadata needs a program bound to a "
+				"single interface, NIC hints will not be available\n");
+	}
+
+	if (conf.no_xdp_stats) {
+		int val = 0;
+
+		if (set_rodata_var(*obj, "xsknf_xdp_stats", &val, sizeof(val))) {
+			fprintf(stderr, "ERROR: the eBPF program can't disable its "
+					"statistics (include xsknf_kern.h)\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	err = bpf_object__load(*obj);
 	if(err){
 		fprintf(stderr, "ERROR: unable to load eBPF file\n");
@@ -413,336 +991,2043 @@ static void kick_tx(struct xsk_socket_info *xsk)
 struct pkt_info {
 	uint64_t addr;
 	uint32_t len;
+	uint32_t options;
 };
 
-static inline void complete_tx(struct xsk_socket_info *xsks,
-		unsigned ifindex)
+/*
+ * TX metadata sits right before the packet data, the rx metadata of the
+ * packet is overwritten
+ */
+#ifdef XDP_TX_METADATA
+#define TX_META_LEN sizeof(struct xsk_tx_metadata)
+#else
+#define TX_META_LEN 0
+#endif
+
+/* Options of the tx descriptor of a packet given its verdict */
+static inline uint32_t tx_options(int verdict)
 {
-	struct xsk_socket_info *tx_xsk = &xsks[ifindex];
-	uint32_t idx;
-	unsigned int sent, ret;
-	uint64_t to_fill[conf.num_interfaces][conf.batch_size];
-	/* This counters support a max batch size of 511 packets */
-	uint8_t nfill[XSKNF_MAX_INTERFACES] = {0};
-	size_t ndescs;
-	int i, j, owner;
-	uint64_t addr;
+#ifdef XDP_TX_METADATA
+	return verdict & XSKNF_TX_METADATA ? XDP_TX_METADATA : 0;
+#else
+	return 0;
+#endif
+}
 
-	if (!tx_xsk->outstanding_tx)
-		return;
+int xsknf_tx_csum_offload(void *pkt, uint16_t csum_start,
+		uint16_t csum_offset)
+{
+#ifdef XDP_TX_METADATA
+	struct xsk_tx_metadata *meta = pkt - TX_META_LEN;
 
-	/* 
-	 * Tx must be manually triggered for COPY mode sockets and when busy polling
-	 * is disabled and the NEED_WAKEUP flag of the tx queue is set
-	 */
-	if (tx_xsk->bind_flags & XDP_COPY || (!conf.poll && !conf.busy_poll
-			&& xsk_ring_prod__needs_wakeup(&tx_xsk->tx))) {
-		tx_xsk->stats.tx_trigger_sendtos++;
-		kick_tx(tx_xsk);
+	if (!conf.tx_metadata)
+		return 0;
+
+	meta->flags = XDP_TXMD_FLAGS_CHECKSUM;
+	meta->request.csum_start = csum_start;
+	meta->request.csum_offset = csum_offset;
+
+	return XSKNF_TX_METADATA;
+#else
+	return 0;
+#endif
+}
+
+static inline void prefetch_packet(struct xsknf_packet *pkt)
+{
+	__builtin_prefetch(pkt->data);
+	if (conf.prefetch_headroom) {
+		/* The line right before the packet holds headroom and metadata */
+		__builtin_prefetch(pkt->data - CACHE_LINE_SIZE);
 	}
+}
 
-	ndescs = (tx_xsk->outstanding_tx > conf.batch_size) ? conf.batch_size :
-			tx_xsk->outstanding_tx;
+static inline uint64_t read_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
 
-	/* Recycle completed tx frames */
-	sent = xsk_ring_cons__peek(&tx_xsk->cq, ndescs, &idx);
-	if (sent > 0) {
-		/* Map every frame to its owner */
-		for (i = 0; i < sent; i++) {
-			addr = *xsk_ring_cons__comp_addr(&tx_xsk->cq, idx++);
-			owner = addr >> owner_shift;
-			to_fill[owner][nfill[owner]++] = addr;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
 
-		xsk_ring_cons__release(&tx_xsk->cq, sent);
-		tx_xsk->stats.tx_npkts += sent;
+/*
+ * Histograms are only written by their thread, readers take the values as
+ * they are (see xsknf.h)
+ */
+static inline void hist_record(enum xsknf_hist_type type, uint64_t val,
+		uint64_t n)
+{
+	struct xsknf_hist *hist = &current_hists[type];
 
-		/* Put frames in their owner's fill queue */
-		for (i = 0; i < conf.num_interfaces; i++) {
-			if (nfill[i]) {
-				ret = xsk_ring_prod__reserve(&xsks[i].fq, nfill[i], &idx);
-				if (ret != nfill[i]) {
-					/* (0 < ret < nfill[i]) should never happen */
-					exit_with_error(-ret);
-				}
+	hist->buckets[xsknf_hist_bucket(val)] += n;
+	hist->count += n;
+	hist->sum += val * n;
+	if (val > hist->max)
+		hist->max = val;
+}
 
-				for (int j = 0; j < nfill[i]; j++) {
-					*xsk_ring_prod__fill_addr(&xsks[i].fq, idx++) =
-							to_fill[i][j];
-				}
+/* Reception time of a batch for its latency, 0 without histograms */
+static inline uint64_t hist_rx_time()
+{
+	return conf.histograms ? read_tsc() : 0;
+}
 
-				xsk_ring_prod__submit(&xsks[i].fq, nfill[i]);
-			}
-		}
-		
-		tx_xsk->outstanding_tx -= sent;
-	}
+static inline void hist_latency(uint64_t rx_tsc, unsigned npkts)
+{
+	if (conf.histograms)
+		hist_record(XSKNF_HIST_LATENCY, read_tsc() - rx_tsc, npkts);
 }
 
-static void process_batch(struct xsk_socket_info *xsks, unsigned ifindex)
+/*
+ * Run the batch through the chain of stages. Stages work on a compacted copy of
+ * the batch so that dropped packets can be left out without touching the
+ * arrays of the caller, verdicts of the survivors are copied back at the end
+ */
+static void run_stages(struct xsknf_packet *pkts, int *verdicts,
+		unsigned npkts, unsigned ingress_ifindex)
 {
-	struct xsk_socket_info *rx_xsk = &xsks[ifindex];
-	struct pkt_info to_drop[conf.batch_size],
-			to_tx[conf.num_interfaces][conf.batch_size];
-	/* These counters support a max batch size of 511 packets */
-	uint8_t ndrop = 0, ntx[XSKNF_MAX_INTERFACES] = {0};
-	unsigned int rcvd, i, j;
-	uint32_t idx;
-	int ret;
+	struct xsknf_stage_stats *stats = current_stage_stats;
+	struct xsknf_packet spkts[npkts];
+	int sverdicts[npkts];
+	unsigned pos[npkts], n = npkts, left, i, s;
+	uint64_t start;
+
+	memcpy(spkts, pkts, npkts * sizeof(struct xsknf_packet));
+	for (i = 0; i < npkts; i++) {
+		sverdicts[i] = ingress_ifindex;
+		verdicts[i] = -1;
+		pos[i] = i;
+	}
 
-	complete_tx(xsks, ifindex);
+	for (s = 0; s < nstages && n; s++) {
+		start = read_tsc();
+		stages[s].fn(spkts, sverdicts, n, ingress_ifindex);
+		stats[s].cycles += read_tsc() - start;
+		stats[s].npkts += n;
 
-	/* Check if there are rx packets */
-	rcvd = xsk_ring_cons__peek(&rx_xsk->rx, conf.batch_size, &idx);
-	if (!rcvd) {
-		if (!(rx_xsk->bind_flags & XDP_COPY) && (conf.busy_poll
-				|| xsk_ring_prod__needs_wakeup(&rx_xsk->fq))) {
-			rx_xsk->stats.rx_empty_polls++;
-			recvfrom(xsk_socket__fd(rx_xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL,
-					NULL);
+		for (i = 0, left = 0; i < n; i++) {
+			if (sverdicts[i] == -1)
+				continue;
+			if (left != i) {
+				spkts[left] = spkts[i];
+				sverdicts[left] = sverdicts[i];
+				pos[left] = pos[i];
+			}
+			left++;
 		}
-		return;
+		stats[s].ndropped += n - left;
+		n = left;
 	}
 
-	/* Process packets and store destination queue */
-	for (i = 0; i < rcvd; i++) {
-		uint64_t addr = xsk_ring_cons__rx_desc(&rx_xsk->rx, idx)->addr;
-		uint32_t len = xsk_ring_cons__rx_desc(&rx_xsk->rx, idx++)->len;
-		uint64_t orig = addr;
+	for (i = 0; i < n; i++) {
+		verdicts[pos[i]] = sverdicts[i];
+		pkts[pos[i]].len = spkts[i].len;
+	}
+}
 
-		addr = xsk_umem__add_offset_to_addr(addr);
-		void *pkt = xsk_umem__get_data(rx_xsk->buffer, addr);
+static inline void call_processor(struct xsknf_packet *pkts, int *verdicts,
+		unsigned npkts, unsigned ingress_ifindex)
+{
+	if (nstages) {
+		run_stages(pkts, verdicts, npkts, ingress_ifindex);
+	} else if (xsknf_batch_processor) {
+		xsknf_batch_processor(pkts, verdicts, npkts, ingress_ifindex);
+	} else {
+		for (unsigned i = 0; i < npkts; i++) {
+			/*
+			 * The first prefetch_distance packets have already been prefetched
+			 * while collecting the batch
+			 */
+			if (conf.prefetch_distance && i + conf.prefetch_distance < npkts)
+				prefetch_packet(&pkts[i + conf.prefetch_distance]);
 
-		ret = xsknf_packet_processor(pkt, len, ifindex);
-		if (ret == -1) {
-			/* Enqueue to drop queue */
-			to_drop[ndrop].addr = orig;
-			to_drop[ndrop++].len = len;
-		} else {
-			/* Enqueue to TX queue of the target dev */
-			to_tx[ret][ntx[ret]].addr = orig;
-			to_tx[ret][ntx[ret]++].len = len;
+			verdicts[i] = xsknf_packet_processor(pkts[i].data, pkts[i].len,
+					ingress_ifindex);
 		}
 	}
+}
 
-	xsk_ring_cons__release(&rx_xsk->rx, rcvd);
-	rx_xsk->stats.rx_npkts += rcvd;
+static inline void run_processor(struct xsknf_packet *pkts, int *verdicts,
+		unsigned npkts, unsigned ingress_ifindex)
+{
+	uint64_t start;
 
-	/*
-	 * Put frames of dropped packets back in the fill queue of the receiving
-	 * interface
-	 */
-	if (ndrop) {
-		ret = xsk_ring_prod__reserve(&rx_xsk->fq, ndrop, &idx);
-		if (ret != ndrop) {
-			/* (0 < ret < ndrop) should never happen */
-			exit_with_error(-ret);
-		}
+	if (!conf.histograms) {
+		call_processor(pkts, verdicts, npkts, ingress_ifindex);
+		return;
+	}
 
-		for (i = 0; i < ndrop; i++) {
-			*xsk_ring_prod__fill_addr(&rx_xsk->fq, idx++) = to_drop[i].addr;
-		}
+	start = read_tsc();
+	call_processor(pkts, verdicts, npkts, ingress_ifindex);
+	hist_record(XSKNF_HIST_PROCESS, read_tsc() - start, 1);
+}
 
-		xsk_ring_prod__submit(&rx_xsk->fq, ndrop);
-	}
+/*
+ * The frame pool of a worker uses the UMEM region right after the ones of the
+ * sockets, hence its frames are owned by the (non-existing) socket with index
+ * nsockets
+ */
+static inline int is_pool_frame(struct worker *worker, uint64_t addr)
+{
+	return (addr >> owner_shift) == worker->nsockets;
+}
 
-	/*
-	 * Put frames of redirected packets in the tx queue of the target interface
-	 */
-	for (i = 0; i < conf.num_interfaces; i++) {
-		if (ntx[i]) {
-			ret = xsk_ring_prod__reserve(&xsks[i].tx, ntx[i], &idx);
-			while (ret != ntx[i]) {
-				if (ret < 0)
-					exit_with_error(-ret);
-				complete_tx(xsks, ifindex);
-				if (conf.busy_poll
-						|| xsk_ring_prod__needs_wakeup(&xsks[i].tx)) {
-					xsks[i].stats.tx_wakeup_sendtos++;
-					kick_tx(&xsks[i]);
-				}
-				ret = xsk_ring_prod__reserve(&xsks[i].tx, ntx[i], &idx);
-			}
+/* Index of the UMEM of the socket, 0 for zero-copy and 1 for copy */
+static inline int umem_idx(struct worker *worker,
+		struct xsk_socket_info *xsk)
+{
+	return xsk->buffer == worker->copy_buffer;
+}
 
-			if (rx_xsk->buffer != xsks[i].buffer) {
-				for (int j = 0; j < ntx[i]; j++) {
-					__builtin_memcpy(xsks[i].buffer + to_tx[i][j].addr,
-							rx_xsk->buffer + to_tx[i][j].addr, to_tx[i][j].len);
-					xsk_ring_prod__tx_desc(&xsks[i].tx, idx)->addr
-							= to_tx[i][j].addr;
-					xsk_ring_prod__tx_desc(&xsks[i].tx, idx++)->len
-							= to_tx[i][j].len;
-				}
-			} else {
-				for (int j = 0; j < ntx[i]; j++) {
-					xsk_ring_prod__tx_desc(&xsks[i].tx, idx)->addr
-							= to_tx[i][j].addr;
-					xsk_ring_prod__tx_desc(&xsks[i].tx, idx++)->len
-							= to_tx[i][j].len;
-				}
-			}
+static inline void pool_put(struct worker *worker, uint64_t addr)
+{
+	worker->pool[worker->pool_nfree++] = addr;
+}
+
+int xsknf_alloc_packet(struct xsknf_packet *pkt)
+{
+	struct worker *worker = current_worker;
+
+	if (!worker || !worker->pool_nfree)
+		return -1;
+
+	pkt->data = xsk_umem__get_data(worker->pool_buffer,
+			worker->pool[--worker->pool_nfree]);
+	pkt->len = 0;
+
+	return 0;
+}
+
+int xsknf_clone_packet(struct xsknf_packet *pkt, struct xsknf_packet *clone)
+{
+	if (xsknf_alloc_packet(clone))
+		return -1;
+
+	__builtin_memcpy(clone->data, pkt->data, pkt->len);
+	clone->len = pkt->len;
+
+	return 0;
+}
+
+void xsknf_free_packet(struct xsknf_packet *pkt)
+{
+	struct worker *worker = current_worker;
 
-			xsk_ring_prod__submit(&xsks[i].tx, ntx[i]);
-			xsks[i].outstanding_tx += ntx[i];
+	if (!worker)
+		return;
+
+	pool_put(worker, pkt->data - worker->pool_buffer);
+}
+
+int xsknf_fastpath_install(int map_id, const void *key, const void *value)
+{
+	struct fastpath_ring *ring = current_fastpath;
+	struct fastpath_map *map;
+	char *slot;
+
+	if (!ring || map_id < 0 || map_id >= nfastpath_maps)
+		return -1;
+
+	if (ring->prod - ring->cons_cache == FASTPATH_RING_SIZE) {
+		ring->cons_cache = __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE);
+		if (ring->prod - ring->cons_cache == FASTPATH_RING_SIZE) {
+			ring->full++;
+			return -1;
 		}
 	}
+
+	map = &fastpath_maps[map_id];
+	slot = ring->slots + (size_t)(ring->prod & (FASTPATH_RING_SIZE - 1))
+			* fastpath_slot_size;
+	*(uint32_t *)slot = map_id;
+	memcpy(slot + FASTPATH_SLOT_HDR, key, map->key_size);
+	memcpy(slot + FASTPATH_SLOT_HDR + map->key_size, value, map->value_size);
+
+	ring->queued++;
+	__atomic_store_n(&ring->prod, ring->prod + 1, __ATOMIC_RELEASE);
+
+	return 0;
 }
 
-static inline void complete_tx_1if(struct xsk_socket_info *xsk)
+int xsknf_send_packet(struct xsknf_packet *pkt, unsigned ifindex)
 {
-	uint32_t idx_cq, idx_fq;
-	unsigned int sent, ret, i;
+	struct worker *worker = current_worker;
+	struct xsk_socket_info *xsk;
+	uint64_t addr;
+	uint32_t idx;
+
+	if (!worker)
+		return -1;
+
+	xsk = worker->tx_xsks[ifindex];
+	addr = pkt->data - worker->pool_buffer;
+	if (!xsk || xsk_ring_prod__reserve(&xsk->tx, 1, &idx) != 1)
+		return -1;
+
+	/* The pool region is reserved in both UMEMs, use the same frame */
+	if (xsk->buffer != worker->pool_buffer)
+		__builtin_memcpy(xsk->buffer + addr, pkt->data, pkt->len);
+
+	xsk_ring_prod__tx_desc(&xsk->tx, idx)->addr = addr;
+	xsk_ring_prod__tx_desc(&xsk->tx, idx)->len = pkt->len;
+	xsk_ring_prod__tx_desc(&xsk->tx, idx)->options = 0;
+	xsk_ring_prod__submit(&xsk->tx, 1);
+	xsk->outstanding_tx++;
+
+	return 0;
+}
+
+/*
+ * The functions of the rx/tx path take the batch size, the number of
+ * interfaces and the wakeup mode (LOOP_* flags) as arguments. Specialized
+ * versions of process_batch() call them with constants (see
+ * SPECIALIZED_BATCHES), the other callers with the runtime configuration
+ */
+#define LOOP_BUSY_POLL 0x1
+#define LOOP_POLL 0x2
+
+static inline unsigned loop_flags()
+{
+	return (conf.busy_poll ? LOOP_BUSY_POLL : 0) | (conf.poll ? LOOP_POLL : 0);
+}
+
+static __always_inline void __complete_tx(struct worker *worker,
+		struct xsk_socket_info *tx_xsk, unsigned batch, unsigned flags)
+{
+	struct xsk_socket_info *xsks = worker->xsks;
+	uint32_t idx;
+	unsigned int sent, ret;
+	uint64_t to_fill[worker->nsockets][batch];
+	unsigned nfill[worker->nsockets];
 	size_t ndescs;
+	int i, j, owner;
+	uint64_t addr;
 
-	if (!xsk->outstanding_tx)
+	if (!tx_xsk->outstanding_tx)
 		return;
 
+	__builtin_memset(nfill, 0, sizeof(nfill));
+
 	/* 
 	 * Tx must be manually triggered for COPY mode sockets and when busy polling
 	 * is disabled and the NEED_WAKEUP flag of the tx queue is set
 	 */
-	if (xsk->bind_flags & XDP_COPY || (!conf.poll && !conf.busy_poll
-			&& xsk_ring_prod__needs_wakeup(&xsk->tx))) {
-		xsk->stats.tx_trigger_sendtos++;
-		kick_tx(xsk);
+	if (tx_xsk->bind_flags & XDP_COPY || (!(flags & (LOOP_POLL
+			| LOOP_BUSY_POLL)) && xsk_ring_prod__needs_wakeup(&tx_xsk->tx))) {
+		tx_xsk->stats->tx_trigger_sendtos++;
+		kick_tx(tx_xsk);
 	}
 
-	ndescs = (xsk->outstanding_tx > conf.batch_size) ? conf.batch_size :
-			xsk->outstanding_tx;
+	ndescs = (tx_xsk->outstanding_tx > batch) ? batch : tx_xsk->outstanding_tx;
 
 	/* Recycle completed tx frames */
-	sent = xsk_ring_cons__peek(&xsk->cq, ndescs, &idx_cq);
+	sent = xsk_ring_cons__peek(&tx_xsk->cq, ndescs, &idx);
 	if (sent > 0) {
-		xsk->stats.tx_npkts += sent;
+		/* Map every frame to its owner */
+		for (i = 0; i < sent; i++) {
+			addr = *xsk_ring_cons__comp_addr(&tx_xsk->cq, idx++);
+			owner = addr >> owner_shift;
+			if (owner == worker->nsockets) {
+				pool_put(worker, addr);
+				continue;
+			}
+			/*
+			 * A frame of the other UMEM, given by handoff_frames(). The packet
+			 * might not start at the beginning of the frame with TX metadata
+			 */
+			if (xsks[owner].buffer != tx_xsk->buffer) {
+				int t = umem_idx(worker, tx_xsk);
+				worker->xfer[t][worker->xfer_nfree[t]++] = addr
+						- addr % conf.xsk_frame_size;
+				continue;
+			}
+			to_fill[owner][nfill[owner]++] = addr;
+		}
 
-		ret = xsk_ring_prod__reserve(&xsk->fq, sent, &idx_fq);
-		if (ret != sent) {
-			/* (0 < ret < sent) should never happen */
-			exit_with_error(-ret);
+		xsk_ring_cons__release(&tx_xsk->cq, sent);
+		tx_xsk->stats->tx_npkts += sent;
+
+		/* Put frames in their owner's fill queue */
+		for (i = 0; i < worker->nsockets; i++) {
+			if (nfill[i]) {
+				ret = xsk_ring_prod__reserve(&xsks[i].fq, nfill[i], &idx);
+				if (ret != nfill[i]) {
+					/* (0 < ret < nfill[i]) should never happen */
+					exit_with_error(-ret);
+				}
+
+				for (int j = 0; j < nfill[i]; j++) {
+					*xsk_ring_prod__fill_addr(&xsks[i].fq, idx++) =
+							to_fill[i][j];
+				}
+
+				xsk_ring_prod__submit(&xsks[i].fq, nfill[i]);
+			}
 		}
+		
+		tx_xsk->outstanding_tx -= sent;
+	}
+}
 
-		for (int i = 0; i < sent; i++)
-			*xsk_ring_prod__fill_addr(&xsk->fq, idx_fq++) =
-				*xsk_ring_cons__comp_addr(&xsk->cq, idx_cq++);
+static inline void complete_tx(struct worker *worker,
+		struct xsk_socket_info *tx_xsk)
+{
+	__complete_tx(worker, tx_xsk, conf.batch_size, loop_flags());
+}
 
-		xsk_ring_prod__submit(&xsk->fq, sent);
-		xsk_ring_cons__release(&xsk->cq, sent);
-		xsk->outstanding_tx -= sent;
+/*
+ * The kernel does not allow to mix copy and zero-copy sockets on the same UMEM
+ * (sockets sharing a UMEM inherit its mode), so packets between sockets of the
+ * two UMEMs of a worker must be copied. Instead of holding the rx frame until
+ * the transmission completes, packets are copied into free frames of the
+ * target UMEM and the rx frames are recycled right away through the recycle
+ * array. Free frames of a UMEM are the ones of the regions of the sockets
+ * using the other UMEM, they go back to the xfer list of the target UMEM
+ * once transmitted.
+ * Returns the number of packets that can be sent (the first of pkts, now
+ * pointing to the new frames), the other ones are dropped.
+ */
+static unsigned handoff_frames(struct worker *worker,
+		struct xsk_socket_info *rx_xsk, struct xsk_socket_info *tx_xsk,
+		struct pkt_info *pkts, unsigned n, struct pkt_info *recycle,
+		unsigned *nrecycle)
+{
+	int t = umem_idx(worker, tx_xsk);
+	unsigned nframes, j;
+	uint64_t addr;
+
+	if (worker->xfer_nfree[t] < n)
+		complete_tx(worker, tx_xsk);
+
+	nframes = worker->xfer_nfree[t] < n ? worker->xfer_nfree[t] : n;
+
+	for (j = 0; j < nframes; j++) {
+		if (j + 1 < nframes) {
+			__builtin_prefetch(xsk_umem__get_data(rx_xsk->buffer,
+					xsk_umem__add_offset_to_addr(pkts[j + 1].addr)));
+		}
+
+		addr = worker->xfer[t][--worker->xfer_nfree[t]];
+		if (pkts[j].options) {
+			/* Copy the TX metadata too, the packet follows it */
+			__builtin_memcpy(xsk_umem__get_data(tx_xsk->buffer, addr),
+					xsk_umem__get_data(rx_xsk->buffer,
+					xsk_umem__add_offset_to_addr(pkts[j].addr)) - TX_META_LEN,
+					TX_META_LEN + pkts[j].len);
+			addr += TX_META_LEN;
+		} else {
+			__builtin_memcpy(xsk_umem__get_data(tx_xsk->buffer, addr),
+					xsk_umem__get_data(rx_xsk->buffer,
+					xsk_umem__add_offset_to_addr(pkts[j].addr)), pkts[j].len);
+		}
+
+		recycle[(*nrecycle)++] = pkts[j];
+		pkts[j].addr = addr;
 	}
+
+	for (; j < n; j++)
+		recycle[(*nrecycle)++] = pkts[j];
+
+	return nframes;
 }
 
-static void process_batch_1if(struct xsk_socket_info *xsk)
+/*
+ * Collects up to batch_size packets from the rx ring of the socket, their
+ * descriptors are released right away. Returns the number of packets
+ */
+static __always_inline unsigned __rx_batch(struct xsk_socket_info *rx_xsk,
+		uint64_t *addrs, struct xsknf_packet *pkts, unsigned batch,
+		unsigned flags)
 {
-	struct pkt_info to_drop[conf.batch_size], to_tx[conf.batch_size];
-	/* These counters support a max batch size of 511 packets */
-	uint8_t ndrop = 0, ntx = 0;
 	unsigned int rcvd, i;
 	uint32_t idx;
-	int ret;
-
-	complete_tx_1if(xsk);
 
 	/* Check if there are rx packets */
-	rcvd = xsk_ring_cons__peek(&xsk->rx, conf.batch_size, &idx);
+	rcvd = xsk_ring_cons__peek(&rx_xsk->rx, batch, &idx);
 	if (!rcvd) {
-		if (!(xsk->bind_flags & XDP_COPY) && (conf.busy_poll
-				|| xsk_ring_prod__needs_wakeup(&xsk->fq))) {
-			xsk->stats.rx_empty_polls++;
-			recvfrom(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL,
+		if (!(rx_xsk->bind_flags & XDP_COPY) && (flags & LOOP_BUSY_POLL
+				|| xsk_ring_prod__needs_wakeup(&rx_xsk->fq))) {
+			rx_xsk->stats->rx_empty_polls++;
+			recvfrom(xsk_socket__fd(rx_xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL,
 					NULL);
 		}
-		return;
+		return 0;
 	}
 
-	/* Process packets and store destination queue */
+	/* Collect the packets of the batch */
 	for (i = 0; i < rcvd; i++) {
-		uint64_t addr = xsk_ring_cons__rx_desc(&xsk->rx, idx)->addr;
-		uint32_t len = xsk_ring_cons__rx_desc(&xsk->rx, idx++)->len;
-		uint64_t orig = addr;
+		const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&rx_xsk->rx,
+				idx++);
 
-		addr = xsk_umem__add_offset_to_addr(addr);
-		void *pkt = xsk_umem__get_data(xsk->buffer, addr);
+		addrs[i] = desc->addr;
+		pkts[i].data = xsk_umem__get_data(rx_xsk->buffer,
+				xsk_umem__add_offset_to_addr(desc->addr));
+		pkts[i].len = desc->len;
 
-		ret = xsknf_packet_processor(pkt, len, 0);
-		if (ret == -1) {
-			/* Enqueue to drop queue */
-			to_drop[ndrop].addr = orig;
-			to_drop[ndrop++].len = len;
-		} else {
-			/* Enqueue to TX queue of the dev */
-			to_tx[ntx].addr = orig;
-			to_tx[ntx++].len = len;
+		if (i < conf.prefetch_distance)
+			prefetch_packet(&pkts[i]);
+	}
+
+	xsk_ring_cons__release(&rx_xsk->rx, rcvd);
+	rx_xsk->stats->rx_npkts += rcvd;
+	if (conf.histograms)
+		hist_record(XSKNF_HIST_BATCH, rcvd, 1);
+
+	return rcvd;
+}
+
+static inline unsigned rx_batch(struct xsk_socket_info *rx_xsk,
+		uint64_t *addrs, struct xsknf_packet *pkts)
+{
+	return __rx_batch(rx_xsk, addrs, pkts, conf.batch_size, loop_flags());
+}
+
+/*
+ * TX coalescing: with tx_coalesce the descriptors of transmitted packets are
+ * staged per tx socket across rx batches and moved to the tx ring when
+ * tx_coalesce of them are collected, when the oldest one has waited for
+ * tx_coalesce_us or when the worker finds no traffic, with a single wakeup of
+ * the socket. Instead of waiting for the NIC when the tx ring stays full, the
+ * packets that don't fit are dropped
+ */
+static uint64_t tx_coalesce_tsc;
+
+/* Gives the frames of n packets not transmitted by tx_xsk back to the owners */
+static void drop_unsent(struct worker *worker, struct xsk_socket_info *tx_xsk,
+		struct pkt_info *pkts, unsigned n)
+{
+	struct xsk_socket_info *xsks = worker->xsks;
+	unsigned nfill, owner, ret;
+	uint32_t idx;
+	uint64_t addr;
+
+	tx_xsk->stats->tx_backpressure_npkts += n;
+
+	/* Frames go back as if they were transmitted (see complete_tx()) */
+	for (unsigned i = 0; i < n; i++) {
+		addr = pkts[i].addr;
+		owner = addr >> owner_shift;
+		if (owner == worker->nsockets) {
+			pool_put(worker, addr);
+			pkts[i].len = 0;
+		} else if (xsks[owner].buffer != tx_xsk->buffer) {
+			int t = umem_idx(worker, tx_xsk);
+			worker->xfer[t][worker->xfer_nfree[t]++] = addr
+					- addr % conf.xsk_frame_size;
+			pkts[i].len = 0;
 		}
 	}
 
-	xsk_ring_cons__release(&xsk->rx, rcvd);
-	xsk->stats.rx_npkts += rcvd;
+	/*
+	 * Dropping is rare, frames are collected one fill queue at a time (len 0
+	 * marks the ones already recycled)
+	 */
+	for (unsigned s = 0; s < worker->nsockets; s++) {
+		nfill = 0;
+		for (unsigned i = 0; i < n; i++)
+			nfill += pkts[i].len && pkts[i].addr >> owner_shift == s;
+		if (!nfill)
+			continue;
 
-	/* Put frames of dropped packets back in the fill queue */
-	if (ndrop) {
-		ret = xsk_ring_prod__reserve(&xsk->fq, ndrop, &idx);
-		if (ret != ndrop) {
-			/* (0 < ret < ndrop) should never happen */
+		ret = xsk_ring_prod__reserve(&xsks[s].fq, nfill, &idx);
+		if (ret != nfill) {
+			/* (0 < ret < nfill) should never happen */
 			exit_with_error(-ret);
 		}
 
-		for (i = 0; i < ndrop; i++) {
-			*xsk_ring_prod__fill_addr(&xsk->fq, idx++) = to_drop[i].addr;
+		for (unsigned i = 0; i < n; i++) {
+			if (pkts[i].len && pkts[i].addr >> owner_shift == s)
+				*xsk_ring_prod__fill_addr(&xsks[s].fq, idx++) = pkts[i].addr;
 		}
 
-		xsk_ring_prod__submit(&xsk->fq, ndrop);
+		xsk_ring_prod__submit(&xsks[s].fq, nfill);
 	}
+}
 
-	/* Put frames of redirected packets in the tx queue */
-	if (ntx) {
-		ret = xsk_ring_prod__reserve(&xsk->tx, ntx, &idx);
-		while (ret != ntx) {
+static void flush_tx(struct worker *worker, struct xsk_socket_info *tx_xsk)
+{
+	unsigned n = tx_xsk->nstaged, nfree;
+	uint32_t idx;
+
+	tx_xsk->nstaged = 0;
+
+	nfree = xsk_prod_nb_free(&tx_xsk->tx, n);
+	if (nfree < n) {
+		complete_tx(worker, tx_xsk);
+		nfree = xsk_prod_nb_free(&tx_xsk->tx, n);
+	}
+	if (nfree > n)
+		nfree = n;
+
+	if (nfree) {
+		xsk_ring_prod__reserve(&tx_xsk->tx, nfree, &idx);
+		for (unsigned i = 0; i < nfree; i++) {
+			struct xdp_desc *desc = xsk_ring_prod__tx_desc(&tx_xsk->tx,
+					idx++);
+
+			desc->addr = tx_xsk->staged[i].addr;
+			desc->len = tx_xsk->staged[i].len;
+			desc->options = tx_xsk->staged[i].options;
+		}
+
+		xsk_ring_prod__submit(&tx_xsk->tx, nfree);
+		tx_xsk->outstanding_tx += nfree;
+
+		if (tx_xsk->bind_flags & XDP_COPY || conf.busy_poll
+				|| xsk_ring_prod__needs_wakeup(&tx_xsk->tx)) {
+			tx_xsk->stats->tx_wakeup_sendtos++;
+			kick_tx(tx_xsk);
+		}
+	}
+
+	if (nfree < n)
+		drop_unsent(worker, tx_xsk, tx_xsk->staged + nfree, n - nfree);
+}
+
+static void stage_tx(struct worker *worker, struct xsk_socket_info *tx_xsk,
+		struct pkt_info *pkts, unsigned n)
+{
+	unsigned m;
+
+	while (n) {
+		if (!tx_xsk->nstaged)
+			tx_xsk->staged_tsc = read_tsc();
+
+		m = conf.tx_coalesce - tx_xsk->nstaged;
+		if (m > n)
+			m = n;
+		__builtin_memcpy(&tx_xsk->staged[tx_xsk->nstaged], pkts,
+				m * sizeof(*pkts));
+		tx_xsk->nstaged += m;
+		pkts += m;
+		n -= m;
+
+		if (tx_xsk->nstaged == conf.tx_coalesce)
+			flush_tx(worker, tx_xsk);
+	}
+}
+
+/*
+ * Flushes the staging buffers of the worker, all of them if force is set or
+ * the ones whose packets waited for more than tx_coalesce_us
+ */
+static void flush_staged_tx(struct worker *worker, int force)
+{
+	uint64_t now = 0;
+
+	for (int i = 0; i < worker->nsockets; i++) {
+		struct xsk_socket_info *xsk = &worker->xsks[i];
+
+		if (!xsk->nstaged)
+			continue;
+		if (!force && !now)
+			now = read_tsc();
+		if (force || now - xsk->staged_tsc >= tx_coalesce_tsc)
+			flush_tx(worker, xsk);
+	}
+}
+
+/* Transmits or drops the packets of a batch received on rx_xsk */
+static __always_inline void __apply_verdicts(struct worker *worker,
+		struct xsk_socket_info *rx_xsk, uint64_t *addrs,
+		struct xsknf_packet *pkts, int *verdicts, unsigned rcvd,
+		unsigned nifs, unsigned batch, unsigned flags)
+{
+	struct xsk_socket_info *tx_xsk;
+	struct pkt_info to_drop[batch], to_tx[nifs][batch];
+	unsigned ndrop = 0, ntx[nifs];
+	unsigned int i;
+	uint32_t idx;
+	int ret;
+
+	__builtin_memset(ntx, 0, sizeof(ntx));
+
+	/* Store destination queue */
+	for (i = 0; i < rcvd; i++) {
+		ret = verdicts[i];
+		if (ret != -1)
+			ret &= ~XSKNF_TX_METADATA;
+		/* The worker might not serve the target interface */
+		if (ret == -1 || !worker->tx_xsks[ret]) {
+			/* Enqueue to drop queue */
+			to_drop[ndrop].addr = addrs[i];
+			to_drop[ndrop++].len = pkts[i].len;
+		} else {
+			/* Enqueue to TX queue of the target dev */
+			to_tx[ret][ntx[ret]].addr = addrs[i];
+			to_tx[ret][ntx[ret]].options = tx_options(verdicts[i]);
+			to_tx[ret][ntx[ret]++].len = pkts[i].len;
+		}
+	}
+
+	/*
+	 * Put frames of redirected packets in the tx queue of the target interface
+	 */
+	for (i = 0; i < nifs; i++) {
+		if (ntx[i] && rx_xsk->buffer != worker->tx_xsks[i]->buffer) {
+			/* Copied packets free their rx frames as the dropped ones */
+			ntx[i] = handoff_frames(worker, rx_xsk, worker->tx_xsks[i],
+					to_tx[i], ntx[i], to_drop, &ndrop);
+		}
+
+		if (ntx[i] && conf.tx_coalesce) {
+			stage_tx(worker, worker->tx_xsks[i], to_tx[i], ntx[i]);
+		} else if (ntx[i]) {
+			tx_xsk = worker->tx_xsks[i];
+			ret = xsk_ring_prod__reserve(&tx_xsk->tx, ntx[i], &idx);
+			while (ret != ntx[i]) {
+				if (ret < 0)
+					exit_with_error(-ret);
+				__complete_tx(worker, tx_xsk, batch, flags);
+				if (flags & LOOP_BUSY_POLL
+						|| xsk_ring_prod__needs_wakeup(&tx_xsk->tx)) {
+					tx_xsk->stats->tx_wakeup_sendtos++;
+					kick_tx(tx_xsk);
+				}
+				ret = xsk_ring_prod__reserve(&tx_xsk->tx, ntx[i], &idx);
+			}
+
+			for (int j = 0; j < ntx[i]; j++) {
+				struct xdp_desc *desc = xsk_ring_prod__tx_desc(&tx_xsk->tx,
+						idx++);
+
+				desc->addr = to_tx[i][j].addr;
+				desc->len = to_tx[i][j].len;
+				desc->options = to_tx[i][j].options;
+			}
+
+			xsk_ring_prod__submit(&tx_xsk->tx, ntx[i]);
+			tx_xsk->outstanding_tx += ntx[i];
+		}
+	}
+
+	/*
+	 * Put frames of dropped (and copied) packets back in the fill queue of the
+	 * receiving interface
+	 */
+	if (ndrop) {
+		ret = xsk_ring_prod__reserve(&rx_xsk->fq, ndrop, &idx);
+		if (ret != ndrop) {
+			/* (0 < ret < ndrop) should never happen */
+			exit_with_error(-ret);
+		}
+
+		for (i = 0; i < ndrop; i++) {
+			*xsk_ring_prod__fill_addr(&rx_xsk->fq, idx++) = to_drop[i].addr;
+		}
+
+		xsk_ring_prod__submit(&rx_xsk->fq, ndrop);
+	}
+}
+
+static inline void apply_verdicts(struct worker *worker,
+		struct xsk_socket_info *rx_xsk, uint64_t *addrs,
+		struct xsknf_packet *pkts, int *verdicts, unsigned rcvd)
+{
+	__apply_verdicts(worker, rx_xsk, addrs, pkts, verdicts, rcvd,
+			conf.num_interfaces, conf.batch_size, loop_flags());
+}
+
+static __always_inline unsigned __process_batch(struct worker *worker,
+		struct xsk_socket_info *rx_xsk, unsigned nifs, unsigned batch,
+		unsigned flags)
+{
+	struct xsknf_packet pkts[batch];
+	uint64_t addrs[batch];
+	int verdicts[batch];
+	uint64_t rx_tsc;
+	unsigned rcvd;
+
+	__complete_tx(worker, worker->tx_xsks[rx_xsk->iface], batch, flags);
+
+	rcvd = __rx_batch(rx_xsk, addrs, pkts, batch, flags);
+	if (!rcvd)
+		return 0;
+
+	rx_tsc = hist_rx_time();
+	run_processor(pkts, verdicts, rcvd, rx_xsk->iface);
+	__apply_verdicts(worker, rx_xsk, addrs, pkts, verdicts, rcvd, nifs, batch,
+			flags);
+	hist_latency(rx_tsc, rcvd);
+
+	return rcvd;
+}
+
+/*
+ * Slow path of complete_tx_1if() when the frame pool is enabled, completed
+ * frames can either go back to the fill queue or to the pool
+ */
+static void complete_tx_pool_1if(struct xsk_socket_info *xsk, unsigned sent,
+		uint32_t idx_cq)
+{
+	unsigned nfill = 0, ret;
+	uint32_t idx_fq = 0;
+	uint64_t addr;
+
+	for (int i = 0; i < sent; i++) {
+		if (!is_pool_frame(xsk->worker,
+				*xsk_ring_cons__comp_addr(&xsk->cq, idx_cq + i)))
+			nfill++;
+	}
+
+	if (nfill) {
+		ret = xsk_ring_prod__reserve(&xsk->fq, nfill, &idx_fq);
+		if (ret != nfill) {
+			/* (0 < ret < nfill) should never happen */
+			exit_with_error(-ret);
+		}
+	}
+
+	for (int i = 0; i < sent; i++) {
+		addr = *xsk_ring_cons__comp_addr(&xsk->cq, idx_cq++);
+		if (is_pool_frame(xsk->worker, addr))
+			pool_put(xsk->worker, addr);
+		else
+			*xsk_ring_prod__fill_addr(&xsk->fq, idx_fq++) = addr;
+	}
+
+	if (nfill)
+		xsk_ring_prod__submit(&xsk->fq, nfill);
+	xsk_ring_cons__release(&xsk->cq, sent);
+	xsk->stats->tx_npkts += sent;
+	xsk->outstanding_tx -= sent;
+}
+
+static __always_inline void __complete_tx_1if(struct xsk_socket_info *xsk,
+		unsigned batch, unsigned flags)
+{
+	uint32_t idx_cq, idx_fq;
+	unsigned int sent, ret, i;
+	size_t ndescs;
+
+	if (!xsk->outstanding_tx)
+		return;
+
+	/* 
+	 * Tx must be manually triggered for COPY mode sockets and when busy polling
+	 * is disabled and the NEED_WAKEUP flag of the tx queue is set
+	 */
+	if (xsk->bind_flags & XDP_COPY || (!(flags & (LOOP_POLL | LOOP_BUSY_POLL))
+			&& xsk_ring_prod__needs_wakeup(&xsk->tx))) {
+		xsk->stats->tx_trigger_sendtos++;
+		kick_tx(xsk);
+	}
+
+	ndescs = (xsk->outstanding_tx > batch) ? batch : xsk->outstanding_tx;
+
+	/* Recycle completed tx frames */
+	sent = xsk_ring_cons__peek(&xsk->cq, ndescs, &idx_cq);
+	if (sent > 0 && conf.frame_pool) {
+		complete_tx_pool_1if(xsk, sent, idx_cq);
+
+	} else if (sent > 0) {
+		xsk->stats->tx_npkts += sent;
+
+		ret = xsk_ring_prod__reserve(&xsk->fq, sent, &idx_fq);
+		if (ret != sent) {
+			/* (0 < ret < sent) should never happen */
+			exit_with_error(-ret);
+		}
+
+		for (int i = 0; i < sent; i++)
+			*xsk_ring_prod__fill_addr(&xsk->fq, idx_fq++) =
+				*xsk_ring_cons__comp_addr(&xsk->cq, idx_cq++);
+
+		xsk_ring_prod__submit(&xsk->fq, sent);
+		xsk_ring_cons__release(&xsk->cq, sent);
+		xsk->outstanding_tx -= sent;
+	}
+}
+
+static inline void complete_tx_1if(struct xsk_socket_info *xsk)
+{
+	__complete_tx_1if(xsk, conf.batch_size, loop_flags());
+}
+
+/* Same as apply_verdicts() when there is one interface */
+static __always_inline void __apply_verdicts_1if(struct xsk_socket_info *xsk,
+		uint64_t *addrs, struct xsknf_packet *pkts, int *verdicts,
+		unsigned rcvd, unsigned batch, unsigned flags)
+{
+	struct pkt_info to_drop[batch], to_tx[batch];
+	unsigned ndrop = 0, ntx = 0;
+	unsigned int i;
+	uint32_t idx;
+	int ret;
+
+	/* Store destination queue */
+	for (i = 0; i < rcvd; i++) {
+		if (verdicts[i] == -1) {
+			/* Enqueue to drop queue */
+			to_drop[ndrop].addr = addrs[i];
+			to_drop[ndrop++].len = pkts[i].len;
+		} else {
+			/* Enqueue to TX queue of the dev */
+			to_tx[ntx].addr = addrs[i];
+			to_tx[ntx].options = tx_options(verdicts[i]);
+			to_tx[ntx++].len = pkts[i].len;
+		}
+	}
+
+	/* Put frames of dropped packets back in the fill queue */
+	if (ndrop) {
+		ret = xsk_ring_prod__reserve(&xsk->fq, ndrop, &idx);
+		if (ret != ndrop) {
+			/* (0 < ret < ndrop) should never happen */
+			exit_with_error(-ret);
+		}
+
+		for (i = 0; i < ndrop; i++) {
+			*xsk_ring_prod__fill_addr(&xsk->fq, idx++) = to_drop[i].addr;
+		}
+
+		xsk_ring_prod__submit(&xsk->fq, ndrop);
+	}
+
+	/* Put frames of redirected packets in the tx queue */
+	if (ntx && conf.tx_coalesce) {
+		stage_tx(xsk->worker, xsk, to_tx, ntx);
+	} else if (ntx) {
+		ret = xsk_ring_prod__reserve(&xsk->tx, ntx, &idx);
+		while (ret != ntx) {
+			if (ret < 0)
+				exit_with_error(-ret);
+			__complete_tx_1if(xsk, batch, flags);
+			if (flags & LOOP_BUSY_POLL
+					|| xsk_ring_prod__needs_wakeup(&xsk->tx)) {
+				xsk->stats->tx_wakeup_sendtos++;
+				kick_tx(xsk);
+			}
+			ret = xsk_ring_prod__reserve(&xsk->tx, ntx, &idx);
+		}
+
+		for (int i = 0; i < ntx; i++) {
+			struct xdp_desc *desc = xsk_ring_prod__tx_desc(&xsk->tx, idx++);
+
+			desc->addr = to_tx[i].addr;
+			desc->len = to_tx[i].len;
+			desc->options = to_tx[i].options;
+		}
+
+		xsk_ring_prod__submit(&xsk->tx, ntx);
+		xsk->outstanding_tx += ntx;
+	}
+}
+
+static inline void apply_verdicts_1if(struct xsk_socket_info *xsk,
+		uint64_t *addrs, struct xsknf_packet *pkts, int *verdicts,
+		unsigned rcvd)
+{
+	__apply_verdicts_1if(xsk, addrs, pkts, verdicts, rcvd, conf.batch_size,
+			loop_flags());
+}
+
+static __always_inline unsigned __process_batch_1if(
+		struct xsk_socket_info *xsk, unsigned batch, unsigned flags)
+{
+	struct xsknf_packet pkts[batch];
+	uint64_t addrs[batch];
+	int verdicts[batch];
+	uint64_t rx_tsc;
+	unsigned rcvd;
+
+	__complete_tx_1if(xsk, batch, flags);
+
+	rcvd = __rx_batch(xsk, addrs, pkts, batch, flags);
+	if (!rcvd)
+		return 0;
+
+	rx_tsc = hist_rx_time();
+	run_processor(pkts, verdicts, rcvd, 0);
+	__apply_verdicts_1if(xsk, addrs, pkts, verdicts, rcvd, batch, flags);
+	hist_latency(rx_tsc, rcvd);
+
+	return rcvd;
+}
+
+typedef unsigned (*batch_fn)(struct worker *worker,
+		struct xsk_socket_info *xsk);
+
+/* Generic versions, on the runtime configuration */
+static unsigned process_batch(struct worker *worker,
+		struct xsk_socket_info *xsk)
+{
+	return __process_batch(worker, xsk, conf.num_interfaces, conf.batch_size,
+			loop_flags());
+}
+
+/* With one interface every socket transmits its own packets */
+static unsigned process_batch_1if(struct worker *worker,
+		struct xsk_socket_info *xsk)
+{
+	return __process_batch_1if(xsk, conf.batch_size, loop_flags());
+}
+
+/*
+ * Versions of process_batch() for the common configurations, with the number
+ * of interfaces, the batch size and the wakeup mode known at compile time the
+ * arrays of the batch have a fixed size and the mode checks disappear.
+ * X(interfaces, batch size, mode), mode is plain, poll or busy
+ */
+#define LOOP_plain 0
+#define LOOP_poll LOOP_POLL
+#define LOOP_busy LOOP_BUSY_POLL
+
+#define SPECIALIZED_MODES(X, nifs, batch) \
+	X(nifs, batch, plain) X(nifs, batch, poll) X(nifs, batch, busy)
+#define SPECIALIZED_SIZES(X, nifs) \
+	SPECIALIZED_MODES(X, nifs, 32) SPECIALIZED_MODES(X, nifs, 64) \
+	SPECIALIZED_MODES(X, nifs, 128)
+#define SPECIALIZED_BATCHES(X) \
+	SPECIALIZED_SIZES(X, 1) SPECIALIZED_SIZES(X, 2)
+
+#define DEFINE_BATCH_FN(nifs, batch, mode) \
+static unsigned process_batch_##nifs##_##batch##_##mode(struct worker *worker, \
+		struct xsk_socket_info *xsk) \
+{ \
+	if (nifs == 1) \
+		return __process_batch_1if(xsk, batch, LOOP_##mode); \
+	return __process_batch(worker, xsk, nifs, batch, LOOP_##mode); \
+}
+SPECIALIZED_BATCHES(DEFINE_BATCH_FN)
+
+#define BATCH_FN_ENTRY(nifs, batch, mode) \
+	{nifs, batch, LOOP_##mode, process_batch_##nifs##_##batch##_##mode},
+static const struct {
+	unsigned nifs;
+	unsigned batch;
+	unsigned flags;
+	batch_fn fn;
+} batch_fns[] = {
+	SPECIALIZED_BATCHES(BATCH_FN_ENTRY)
+};
+
+/* Chosen by xsknf_start_workers() */
+static batch_fn process_batch_fn = process_batch;
+
+static void select_batch_fn()
+{
+	process_batch_fn = conf.num_interfaces > 1 ? process_batch :
+			process_batch_1if;
+
+	for (int i = 0; i < sizeof(batch_fns) / sizeof(batch_fns[0]); i++) {
+		if (batch_fns[i].nifs == conf.num_interfaces
+				&& batch_fns[i].batch == conf.batch_size
+				&& batch_fns[i].flags == loop_flags()) {
+			process_batch_fn = batch_fns[i].fn;
+			break;
+		}
+	}
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline void recycle_tx(struct worker *worker,
+		struct xsk_socket_info *rx_xsk)
+{
+	if (conf.num_interfaces > 1)
+		complete_tx(worker, worker->tx_xsks[rx_xsk->iface]);
+	else
+		complete_tx_1if(rx_xsk);
+}
+
+/* Returns the slot the producer has to fill next or NULL if the ring is full */
+static inline struct pipe_batch *pipe_ring_slot(struct pipe_ring *ring)
+{
+	if (ring->submitted - ring->completed == PIPE_RING_SIZE)
+		return NULL;
+
+	return &ring->batches[ring->submitted % PIPE_RING_SIZE];
+}
+
+static inline void pipe_ring_submit(struct pipe_ring *ring)
+{
+	__atomic_store_n(&ring->submitted, ring->submitted + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer side, runs the processing functions on the oldest submitted batch.
+ * Returns 0 if there was nothing to process
+ */
+static inline int pipe_ring_process(struct worker *owner,
+		struct pipe_ring *ring)
+{
+	struct pipe_batch *batch;
+
+	if (ring->processed == __atomic_load_n(&ring->submitted,
+			__ATOMIC_ACQUIRE))
+		return 0;
+
+	batch = &ring->batches[ring->processed % PIPE_RING_SIZE];
+	run_processor(batch->pkts, batch->verdicts, batch->npkts,
+			owner->xsks[batch->sock].iface);
+	__atomic_store_n(&ring->processed, ring->processed + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/*
+ * Producer side, transmits the oldest processed batch. Returns 0 if no batch
+ * has been processed yet
+ */
+static inline int pipe_ring_complete(struct worker *worker,
+		struct pipe_ring *ring)
+{
+	struct pipe_batch *batch;
+	struct xsk_socket_info *xsk;
+
+	if (ring->completed == __atomic_load_n(&ring->processed,
+			__ATOMIC_ACQUIRE))
+		return 0;
+
+	batch = &ring->batches[ring->completed % PIPE_RING_SIZE];
+	xsk = &worker->xsks[batch->sock];
+	if (conf.num_interfaces > 1)
+		apply_verdicts(worker, xsk, batch->addrs, batch->pkts,
+				batch->verdicts, batch->npkts);
+	else
+		apply_verdicts_1if(xsk, batch->addrs, batch->pkts, batch->verdicts,
+				batch->npkts);
+	hist_latency(batch->rx_tsc, batch->npkts);
+	ring->completed++;
+
+	return 1;
+}
+
+/*
+ * Pipelined mode, moves the next batch of rx_xsk to a processing thread.
+ * Batches are handed out round robin, if the ring of the next thread is full
+ * packets are left in the rx ring
+ */
+static unsigned pipe_submit(struct worker *worker,
+		struct xsk_socket_info *rx_xsk)
+{
+	struct pipe_ring *ring = &worker->procs[worker->next_submit].ring;
+	struct pipe_batch *batch;
+	unsigned rcvd;
+
+	recycle_tx(worker, rx_xsk);
+
+	batch = pipe_ring_slot(ring);
+	if (!batch)
+		return 0;
+
+	rcvd = rx_batch(rx_xsk, batch->addrs, batch->pkts);
+	if (!rcvd)
+		return 0;
+
+	batch->sock = rx_xsk - worker->xsks;
+	batch->npkts = rcvd;
+	batch->rx_tsc = hist_rx_time();
+	pipe_ring_submit(ring);
+
+	worker->next_submit = (worker->next_submit + 1) % conf.pipeline;
+	worker->inflight++;
+
+	return rcvd;
+}
+
+/*
+ * Pipelined mode, transmits the batches processed so far. Batches are taken in
+ * the same order they were submitted, so packets are not reordered by threads
+ * running at different speeds
+ */
+static void pipe_complete(struct worker *worker)
+{
+	struct pipe_ring *ring;
+
+	while (worker->inflight) {
+		ring = &worker->procs[worker->next_complete].ring;
+		if (!pipe_ring_complete(worker, ring))
+			break;
+
+		worker->next_complete = (worker->next_complete + 1) % conf.pipeline;
+		worker->inflight--;
+	}
+}
+
+static void *proc_loop(void *arg)
+{
+	struct proc_thread *proc = (struct proc_thread *)arg;
+
+	current_stage_stats = proc->stage_stats;
+	current_hists = proc->hists;
+	if (fastpath_rings) {
+		current_fastpath = &fastpath_rings[conf.workers
+				+ proc->worker->id * conf.pipeline
+				+ (proc - proc->worker->procs)];
+	}
+
+	while (!stop_workers) {
+		if (!pipe_ring_process(proc->worker, &proc->ring))
+			cpu_relax();
+	}
+
+	return NULL;
+}
+
+/* Hash of the L3/L4 addresses of the packet, 0 if it is not an IP one */
+static inline uint32_t flow_hash(struct xsknf_packet *pkt)
+{
+	void *data = pkt->data, *data_end = pkt->data + pkt->len;
+	struct ethhdr *eth = data;
+	uint32_t ports = 0;
+
+	if ((void *)(eth + 1) > data_end)
+		return 0;
+
+	if (eth->h_proto == htons(ETH_P_IP)) {
+		struct iphdr *iph = (void *)(eth + 1);
+		void *l4;
+
+		if ((void *)(iph + 1) > data_end)
+			return 0;
+
+		/* Fragments and unknown protocols are hashed on addresses only */
+		l4 = (void *)iph + (iph->ihl << 2);
+		if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP)
+				&& !(iph->frag_off & htons(0x3fff))	/* MF | offset */
+				&& l4 + sizeof(ports) <= data_end)
+			memcpy(&ports, l4, sizeof(ports));
+
+		return jhash_3words(iph->saddr, iph->daddr, ports, iph->protocol);
+
+	} else if (eth->h_proto == htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ip6h = (void *)(eth + 1);
+		void *l4 = ip6h + 1;
+
+		if ((void *)(ip6h + 1) > data_end)
+			return 0;
+
+		if ((ip6h->nexthdr == IPPROTO_TCP || ip6h->nexthdr == IPPROTO_UDP)
+				&& l4 + sizeof(ports) <= data_end)
+			memcpy(&ports, l4, sizeof(ports));
+
+		return jhash_2words(jhash2((uint32_t *)&ip6h->saddr, 8, 0), ports,
+				ip6h->nexthdr);
+	}
+
+	return 0;
+}
+
+static inline uint32_t coarse_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Updates the load of the worker after an rx poll */
+static inline void steer_account(struct worker *worker, unsigned rcvd)
+{
+	worker->steer_full += rcvd == conf.batch_size;
+	if (++worker->steer_polls == STEER_WINDOW) {
+		__atomic_store_n(&worker->load, worker->steer_full * 100
+				/ STEER_WINDOW, __ATOMIC_RELAXED);
+		worker->steer_polls = 0;
+		worker->steer_full = 0;
+	}
+}
+
+/*
+ * Returns the id of the worker where new flows should go, the worker itself
+ * unless it is overloaded and some other worker is not
+ */
+static unsigned steer_choose(struct worker *worker)
+{
+	unsigned best = worker->id, best_load, load;
+
+	if (worker->load < conf.steer_threshold)
+		return worker->id;
+
+	best_load = conf.steer_threshold;
+	for (unsigned i = 0; i < conf.workers; i++) {
+		load = __atomic_load_n(&workers[i].load, __ATOMIC_RELAXED);
+		if (i != worker->id && load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Steering mode, packets of the batch are processed by the worker owning the
+ * bucket of their flow. Buckets only change worker after being idle for
+ * steer_idle_ms, so active flows are sticky and the per-worker state of the
+ * NF stays valid. Packets of other workers are moved in batches through the
+ * steer rings, they still belong to this worker that transmits them once
+ * processed (see steer_poll())
+ */
+static unsigned steer_batch(struct worker *worker,
+		struct xsk_socket_info *rx_xsk)
+{
+	struct xsknf_packet pkts[conf.batch_size];
+	uint64_t addrs[conf.batch_size];
+	int verdicts[conf.batch_size];
+	struct pipe_batch *remote[conf.workers], *batch;
+	struct steer_bucket *bucket;
+	unsigned rcvd, nlocal = 0, target, i;
+	uint64_t rx_tsc;
+	uint32_t now;
+
+	recycle_tx(worker, rx_xsk);
+
+	rcvd = rx_batch(rx_xsk, addrs, pkts);
+	steer_account(worker, rcvd);
+	if (!rcvd)
+		return 0;
+
+	memset(remote, 0, sizeof(remote));
+	target = steer_choose(worker);
+	now = coarse_ms();
+	rx_tsc = hist_rx_time();
+
+	for (i = 0; i < rcvd; i++) {
+		bucket = &worker->steer_table[flow_hash(&pkts[i]) % STEER_BUCKETS];
+		if (now - bucket->last_seen > conf.steer_idle_ms)
+			bucket->worker = target;
+		bucket->last_seen = now;
+
+		if (bucket->worker != worker->id) {
+			batch = remote[bucket->worker];
+			if (!batch) {
+				batch = pipe_ring_slot(&worker->steer_rings[bucket->worker]);
+				if (batch) {
+					batch->sock = rx_xsk - worker->xsks;
+					batch->npkts = 0;
+					batch->rx_tsc = rx_tsc;
+					remote[bucket->worker] = batch;
+				}
+			}
+
+			/*
+			 * If the ring is full the other worker is lagging behind, better
+			 * to process the packet here than to stall
+			 */
+			if (batch) {
+				batch->addrs[batch->npkts] = addrs[i];
+				batch->pkts[batch->npkts++] = pkts[i];
+				continue;
+			}
+		}
+
+		addrs[nlocal] = addrs[i];
+		pkts[nlocal++] = pkts[i];
+	}
+
+	for (i = 0; i < conf.workers; i++) {
+		if (remote[i]) {
+			rx_xsk->stats->steered_npkts += remote[i]->npkts;
+			pipe_ring_submit(&worker->steer_rings[i]);
+			worker->steer_inflight++;
+		}
+	}
+
+	if (nlocal) {
+		run_processor(pkts, verdicts, nlocal, rx_xsk->iface);
+		if (conf.num_interfaces > 1)
+			apply_verdicts(worker, rx_xsk, addrs, pkts, verdicts, nlocal);
+		else
+			apply_verdicts_1if(rx_xsk, addrs, pkts, verdicts, nlocal);
+		hist_latency(rx_tsc, nlocal);
+	}
+
+	return rcvd;
+}
+
+/*
+ * Steering mode, processes the batches moved here by the other workers and
+ * transmits the ones of this worker they are done with. Returns the number of
+ * batches processed for the other workers
+ */
+static unsigned steer_poll(struct worker *worker)
+{
+	struct pipe_ring *ring;
+	unsigned served = 0;
+
+	for (unsigned i = 0; i < conf.workers; i++) {
+		if (i == worker->id)
+			continue;
+
+		ring = &workers[i].steer_rings[worker->id];
+		while (pipe_ring_process(&workers[i], ring))
+			served++;
+
+		ring = &worker->steer_rings[i];
+		while (worker->steer_inflight && pipe_ring_complete(worker, ring))
+			worker->steer_inflight--;
+	}
+
+	return served;
+}
+
+static inline unsigned process_socket(struct worker *worker,
+		struct xsk_socket_info *xsk)
+{
+	if (conf.pipeline)
+		return pipe_submit(worker, xsk);
+	if (conf.steer_threshold)
+		return steer_batch(worker, xsk);
+
+	return process_batch_fn(worker, xsk);
+}
+
+/*
+ * Recycles the frames of all the sockets with transmissions in flight, staged
+ * packets are sent first
+ */
+static void complete_pending_tx(struct worker *worker)
+{
+	if (conf.tx_coalesce)
+		flush_staged_tx(worker, 1);
+
+	for (int i = 0; i < worker->nsockets; i++) {
+		if (!worker->xsks[i].outstanding_tx)
+			continue;
+
+		if (conf.num_interfaces > 1)
+			complete_tx(worker, &worker->xsks[i]);
+		else
+			complete_tx_1if(&worker->xsks[i]);
+	}
+}
+
+/*
+ * Waits for packets on the nsocks sockets served by the worker (its own and
+ * the ones of the workers it adopted) through epoll (if epfd is valid) or
+ * poll, storing in ready the indexes of the sockets with events. Returns
+ * their number or -1 on error
+ */
+static int wait_sockets(struct worker *worker, struct xsk_socket_info **socks,
+		unsigned nsocks, struct pollfd *fds, int epfd, unsigned *ready)
+{
+	struct epoll_event events[XSKNF_MAX_SOCKETS];
+	int timeout = POLL_TIMEOUT_MS, n = 0, ret;
+
+	/*
+	 * There are no events for tx completions and processed batches, if frames
+	 * are in flight wake up soon to recycle them
+	 */
+	if (worker->inflight)
+		timeout = TX_COMPLETION_TIMEOUT_MS;
+	for (int i = 0; i < nsocks; i++) {
+		if (socks[i]->outstanding_tx) {
+			timeout = TX_COMPLETION_TIMEOUT_MS;
+			break;
+		}
+	}
+
+	if (epfd >= 0) {
+		ret = epoll_wait(epfd, events, nsocks, timeout);
+		for (int i = 0; i < ret; i++)
+			ready[n++] = events[i].data.u32;
+	} else {
+		ret = poll(fds, nsocks, timeout);
+		for (int i = 0; i < nsocks && n < ret; i++) {
+			if (fds[i].revents)
+				ready[n++] = i;
+		}
+	}
+
+	return ret < 0 ? -1 : n;
+}
+
+/*
+ * Copies the counters of the sockets of the worker in their shared blocks.
+ * Ring stats need a syscall, they are read from the kernel only if refresh is
+ * set, at most every XSKNF_STATS_PUBLISH_MS
+ */
+static void publish_stats(struct worker *worker, uint32_t now, int refresh)
+{
+	struct xsknf_stats_block *block;
+	struct xsk_socket_info *xsk;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	for (int i = 0; i < worker->nsockets; i++) {
+		xsk = &worker->xsks[i];
+		block = xsk->stats_block;
+
+		/* Sockets of the benchmark mode have no kernel side */
+		if (refresh && xsk->xsk)
+			xsk_get_xdp_stats(xsk_socket__fd(xsk->xsk), xsk->stats);
+
+		/* Readers retry while seq is odd or changes under them */
+		__atomic_store_n(&block->seq, block->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		block->timestamp_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+		memcpy(&block->stats, xsk->stats, sizeof(block->stats));
+		__atomic_store_n(&block->seq, block->seq + 1, __ATOMIC_RELEASE);
+	}
+
+	if (refresh)
+		worker->stats_ms = now;
+}
+
+/*
+ * Hardware counters of the benchmark mode, read with rdpmc when the kernel
+ * allows it and with read() otherwise. Only user space events are counted
+ */
+enum {
+	BENCH_INSTRUCTIONS,
+	BENCH_L1D_MISSES,
+	BENCH_LLC_MISSES,
+	BENCH_NUM_COUNTERS
+};
+
+struct bench_counter {
+	int fd;
+	struct perf_event_mmap_page *page;	/* NULL if not mapped */
+};
+
+static void bench_open_counters(struct bench_counter *counters)
+{
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[BENCH_NUM_COUNTERS] = {
+		[BENCH_INSTRUCTIONS] = {PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_INSTRUCTIONS},
+		[BENCH_L1D_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+				| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		[BENCH_LLC_MISSES] = {PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_CACHE_MISSES},
+	};
+	static int warned;
+	struct perf_event_attr attr;
+	void *page;
+
+	for (int i = 0; i < BENCH_NUM_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		counters[i].page = NULL;
+		counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counters[i].fd < 0) {
+			if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+				fprintf(stderr, "WARNING: hardware counters not available: "
+						"%s (see perf_event_paranoid)\n", strerror(errno));
+			}
+			continue;
+		}
+
+		page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED,
+				counters[i].fd, 0);
+		if (page != MAP_FAILED)
+			counters[i].page = page;
+	}
+}
+
+static void bench_close_counters(struct bench_counter *counters)
+{
+	for (int i = 0; i < BENCH_NUM_COUNTERS; i++) {
+		if (counters[i].page)
+			munmap(counters[i].page, getpagesize());
+		if (counters[i].fd >= 0)
+			close(counters[i].fd);
+	}
+}
+
+static inline uint64_t bench_read_counter(struct bench_counter *counter)
+{
+	uint64_t val;
+#if defined(__x86_64__) || defined(__i386__)
+	struct perf_event_mmap_page *pc = counter->page;
+	uint32_t seq, idx;
+	int64_t pmc;
+
+	/*
+	 * See the comment of struct perf_event_mmap_page, an index of 0 means that
+	 * the event is not on the PMU right now
+	 */
+	if (pc && pc->cap_user_rdpmc) {
+		do {
+			seq = __atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE);
+			idx = pc->index;
+			if (!idx)
+				goto slow;
+			pmc = __builtin_ia32_rdpmc(idx - 1);
+			pmc <<= 64 - pc->pmc_width;
+			pmc >>= 64 - pc->pmc_width;
+			val = pc->offset + pmc;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while (__atomic_load_n(&pc->lock, __ATOMIC_RELAXED) != seq);
+
+		return val;
+	}
+slow:
+#endif
+	if (read(counter->fd, &val, sizeof(val)) != sizeof(val))
+		return 0;
+
+	return val;
+}
+
+/* Bytes of the trace restored in the frames, at least all the headers */
+#define BENCH_HDR_SIZE 64
+
+/*
+ * Benchmark mode, runs the processing functions on the packets of the trace of
+ * the worker, round robin on its (fake) sockets. Before every batch the headers
+ * of the packets are copied from the trace to the next frames of the loopback
+ * UMEM, undoing the changes of the NF, so packets are in the cache as with
+ * DDIO. Only the processing functions are counted in cycles and in the
+ * hardware counters
+ */
+static void bench_loop(struct worker *worker)
+{
+	struct xsknf_packet pkts[conf.batch_size];
+	int verdicts[conf.batch_size];
+	struct xsknf_bench_stats *stats = &worker->bench_stats;
+	struct bench_counter counters[BENCH_NUM_COUNTERS];
+	uint64_t before[BENCH_NUM_COUNTERS], start;
+	long *hw = &stats->instructions;
+	unsigned frame = 0, pos = 0, sock = 0, n, ntx, i, c;
+	struct xsk_socket_info *xsk;
+	uint32_t now;
+
+	bench_open_counters(counters);
+	for (c = 0; c < BENCH_NUM_COUNTERS; c++)
+		hw[c] = counters[c].fd < 0 ? -1 : 0;
+
+	while (!stop_workers && (!conf.bench.npkts
+			|| stats->npkts < conf.bench.npkts)) {
+		xsk = &worker->xsks[sock];
+		sock = (sock + 1) % worker->nsockets;
+
+		n = conf.batch_size;
+		if (conf.bench.npkts && conf.bench.npkts - stats->npkts < n)
+			n = conf.bench.npkts - stats->npkts;
+
+		for (i = 0; i < n; i++) {
+			pkts[i].data = worker->buffer + (uint64_t)frame
+					* conf.xsk_frame_size + XDP_PACKET_HEADROOM;
+			pkts[i].len = conf.bench.pkt_size;
+			memcpy(pkts[i].data, worker->bench_trace + (uint64_t)pos
+					* BENCH_HDR_SIZE, BENCH_HDR_SIZE);
+
+			frame = (frame + 1) & (conf.frames_per_socket - 1);
+			if (++pos == conf.bench.trace_size)
+				pos = 0;
+		}
+		xsk->stats->rx_npkts += n;
+		if (conf.histograms)
+			hist_record(XSKNF_HIST_BATCH, n, 1);
+
+		for (c = 0; c < BENCH_NUM_COUNTERS; c++) {
+			if (counters[c].fd >= 0)
+				before[c] = bench_read_counter(&counters[c]);
+		}
+		start = read_tsc();
+		run_processor(pkts, verdicts, n, xsk->iface);
+		stats->cycles += read_tsc() - start;
+		for (c = 0; c < BENCH_NUM_COUNTERS; c++) {
+			if (counters[c].fd >= 0)
+				hw[c] += bench_read_counter(&counters[c]) - before[c];
+		}
+
+		for (i = 0, ntx = 0; i < n; i++)
+			ntx += verdicts[i] != -1;
+		xsk->stats->tx_npkts += ntx;
+		stats->ntx += ntx;
+		stats->npkts += n;
+
+		now = coarse_ms();
+		if (now - worker->stats_ms >= XSKNF_STATS_PUBLISH_MS)
+			publish_stats(worker, now, 1);
+	}
+
+	publish_stats(worker, coarse_ms(), 1);
+	bench_close_counters(counters);
+
+	/* The last worker done wakes up the main loop of the NF */
+	if (!stop_workers && !__atomic_sub_fetch(&bench_running, 1,
+			__ATOMIC_ACQ_REL))
+		kill(getpid(), SIGINT);
+}
+
+/*
+ * Parked workers are served with their own structures by the thread of
+ * another worker, only the thread-local state of the thread has to follow
+ */
+static inline void switch_worker(struct worker *worker)
+{
+	current_worker = worker;
+	current_stage_stats = worker->stage_stats;
+	current_hists = worker->hists;
+}
+
+static int pending_tx(struct worker *worker)
+{
+	for (int i = 0; i < worker->nsockets; i++) {
+		if (worker->xsks[i].outstanding_tx)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Completes the transmissions of a parking worker and sleeps until it is
+ * unparked. Frames still in flight after PARK_DRAIN_TIMEOUT_MS are left to
+ * the worker serving its sockets
+ */
+static void park(struct worker *worker, unsigned seq)
+{
+	uint32_t start = coarse_ms();
+
+	complete_pending_tx(worker);
+	while (pending_tx(worker)) {
+		if (coarse_ms() - start >= PARK_DRAIN_TIMEOUT_MS) {
+			fprintf(stderr, "WARNING: worker %u parked with transmissions "
+					"in flight\n", worker->id);
+			break;
+		}
+		cpu_relax();
+		complete_pending_tx(worker);
+	}
+	publish_stats(worker, coarse_ms(), 1);
+
+	__atomic_store_n(&worker->state, WORKER_PARKED, __ATOMIC_RELAXED);
+	__atomic_store_n(&worker->ctl_ack, seq, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&park_lock);
+	while (__atomic_load_n(&worker->state, __ATOMIC_ACQUIRE) != WORKER_ACTIVE
+			&& !stop_workers)
+		pthread_cond_wait(&park_cond, &park_lock);
+	pthread_mutex_unlock(&park_lock);
+}
+
+/*
+ * Collects the parked workers served by this one and all the sockets to
+ * wait for in poll mode, rebuilding fds and the epoll instance
+ */
+static unsigned update_served(struct worker *worker,
+		struct xsk_socket_info **socks, struct pollfd *fds, int *epfd)
+{
+	struct epoll_event ev;
+	struct worker *served;
+	unsigned nsocks = 0;
+
+	worker->nadopted = 0;
+	for (unsigned i = 0; i < conf.workers; i++) {
+		if (i != worker->id && __atomic_load_n(&workers[i].state,
+				__ATOMIC_ACQUIRE) == WORKER_PARKED
+				&& workers[i].server == worker->id)
+			worker->adopted[worker->nadopted++] = &workers[i];
+	}
+
+	for (int i = -1; i < (int)worker->nadopted; i++) {
+		served = i < 0 ? worker : worker->adopted[i];
+		for (int j = 0; j < served->nsockets; j++) {
+			socks[nsocks] = &served->xsks[j];
+			fds[nsocks].fd = xsk_socket__fd(served->xsks[j].xsk);
+			fds[nsocks++].events = POLLIN;
+		}
+	}
+
+	if (conf.epoll) {
+		if (*epfd >= 0)
+			close(*epfd);
+		*epfd = epoll_create1(0);
+		if (*epfd < 0)
+			exit_with_error(errno);
+
+		for (unsigned i = 0; i < nsocks; i++) {
+			ev.events = EPOLLIN;
+			ev.data.u32 = i;
+			if (epoll_ctl(*epfd, EPOLL_CTL_ADD, fds[i].fd, &ev))
+				exit_with_error(errno);
+		}
+	}
+
+	return nsocks;
+}
+
+/* Busy polling mode, one pass on the sockets of the adopted workers */
+static unsigned serve_adopted(struct worker *worker)
+{
+	struct worker *adopted;
+	unsigned rcvd = 0, n;
+
+	for (unsigned i = 0; i < worker->nadopted; i++) {
+		adopted = worker->adopted[i];
+		switch_worker(adopted);
+		n = 0;
+		for (int j = 0; j < adopted->nsockets; j++)
+			n += process_socket(adopted, &adopted->xsks[j]);
+		if (conf.tx_coalesce)
+			flush_staged_tx(adopted, !n);
+		rcvd += n;
+	}
+	switch_worker(worker);
+
+	return rcvd;
+}
+
+static void publish_adopted_stats(struct worker *worker, uint32_t now,
+		int force)
+{
+	struct worker *adopted;
+
+	for (unsigned i = 0; i < worker->nadopted; i++) {
+		adopted = worker->adopted[i];
+		if (force || now - adopted->stats_ms >= XSKNF_STATS_PUBLISH_MS)
+			publish_stats(adopted, now, 1);
+	}
+}
+
+static void *worker_loop(void *arg)
+{
+	struct worker *worker = (struct worker *)arg;
+	struct pollfd fds[XSKNF_MAX_SOCKETS] = {};
+	struct xsk_socket_info *socks[XSKNF_MAX_SOCKETS], *xsk;
+	unsigned ready[XSKNF_MAX_SOCKETS];
+	unsigned idle_loops = 0, rcvd, nsocks, seq;
+	uint32_t now;
+	int i, ret, epfd = -1;
+
+	switch_worker(worker);
+	/* Adopted workers use the ring of the thread, it has one producer */
+	if (fastpath_rings)
+		current_fastpath = &fastpath_rings[worker->id];
+
+	if (conf.bench.enabled) {
+		bench_loop(worker);
+		return NULL;
+	}
+
+	nsocks = update_served(worker, socks, fds, &epfd);
+
+	while (!stop_workers) {
+		rcvd = 0;
+
+		/* Parked or adopting (see xsknf_park_worker()) */
+		seq = __atomic_load_n(&worker->ctl_seq, __ATOMIC_ACQUIRE);
+		if (seq != worker->ctl_ack) {
+			if (worker->state == WORKER_PARKING) {
+				park(worker, seq);
+				continue;
+			}
+			nsocks = update_served(worker, socks, fds, &epfd);
+			__atomic_store_n(&worker->ctl_ack, seq, __ATOMIC_RELEASE);
+		}
+
+		if (conf.poll || (conf.adaptive_poll
+				&& idle_loops >= conf.adaptive_poll)) {
+			/*
+			 * Either always in poll mode or no traffic for a while (adaptive
+			 * mode), sleep until the next packet. poll() wakes up the driver
+			 * of need_wakeup sockets, with busy polling interrupts are
+			 * re-enabled by the kernel once NAPI polls stop finding packets
+			 * (see napi_defer_hard_irqs).
+			 * Only the sockets with events are processed
+			 */
+			if (conf.poll)
+				worker->xsks[0].stats->opt_polls++;
+			else
+				worker->xsks[0].stats->idle_polls++;
+
+			/* Nothing changes while blocked, readers get the latest values */
+			now = coarse_ms();
+			publish_stats(worker, now,
+					now - worker->stats_ms >= XSKNF_STATS_PUBLISH_MS);
+
+			if (worker->nadopted)
+				publish_adopted_stats(worker, now, 0);
+
+			ret = wait_sockets(worker, socks, nsocks, fds, epfd, ready);
 			if (ret < 0)
-				exit_with_error(-ret);
-			complete_tx_1if(xsk);
-			if (conf.busy_poll || xsk_ring_prod__needs_wakeup(&xsk->tx)) {
-				xsk->stats.tx_wakeup_sendtos++;
-				kick_tx(xsk);
+				continue;
+
+			for (i = 0; i < ret; i++) {
+				xsk = socks[ready[i]];
+				if (xsk->worker != current_worker)
+					switch_worker(xsk->worker);
+				rcvd += process_socket(xsk->worker, xsk);
 			}
-			ret = xsk_ring_prod__reserve(&xsk->tx, ntx, &idx);
+			if (conf.pipeline)
+				pipe_complete(worker);
+			for (i = 0; i < worker->nadopted; i++) {
+				switch_worker(worker->adopted[i]);
+				complete_pending_tx(worker->adopted[i]);
+			}
+			switch_worker(worker);
+			complete_pending_tx(worker);
+
+			/* Adaptive mode goes back to polling the rings */
+			if (rcvd)
+				idle_loops = 0;
+			continue;
 		}
 
-		for (int i = 0; i < ntx; i++) {
-			xsk_ring_prod__tx_desc(&xsk->tx, idx)->addr = to_tx[i].addr;
-			xsk_ring_prod__tx_desc(&xsk->tx, idx++)->len = to_tx[i].len;
+		for (i = 0; i < worker->nsockets; i++) {
+			rcvd += process_socket(worker, &worker->xsks[i]);
 		}
+		/* Without traffic there is nothing to coalesce with */
+		if (conf.tx_coalesce)
+			flush_staged_tx(worker, !rcvd);
+		if (worker->nadopted)
+			rcvd += serve_adopted(worker);
+		if (conf.pipeline)
+			pipe_complete(worker);
+		if (conf.steer_threshold)
+			steer_poll(worker);
+
+		idle_loops = rcvd ? 0 : idle_loops + 1;
+
+		now = coarse_ms();
+		if (now - worker->stats_ms >= XSKNF_STATS_PUBLISH_MS)
+			publish_stats(worker, now, 1);
+		if (worker->nadopted)
+			publish_adopted_stats(worker, now, 0);
+	}
 
-		xsk_ring_prod__submit(&xsk->tx, ntx);
-		xsk->outstanding_tx += ntx;
+	/* Stats of parked workers are published by the ones serving them */
+	if (worker->state == WORKER_ACTIVE) {
+		publish_stats(worker, coarse_ms(), 1);
+		publish_adopted_stats(worker, coarse_ms(), 1);
 	}
+
+	if (epfd >= 0)
+		close(epfd);
+
+	return NULL;
 }
 
-static void *worker_loop(void *arg)
+/* Defaults of the benchmark mode, like the ones of tests/gen-traffic.lua */
+#define BENCH_FLOWS 1024
+#define BENCH_PKT_SIZE 64
+#define BENCH_SRC "10.0.0.0/8"
+#define BENCH_DST "172.0.0.1"
+#define BENCH_SPORT 5000
+#define BENCH_DPORT 80
+#define BENCH_TRACE_SIZE 65536
+
+static int parse_bench_prefix(char *str, uint32_t *addr, uint8_t *len)
 {
-	struct worker *worker = (struct worker *)arg;
-	struct pollfd fds[XSKNF_MAX_INTERFACES] = {};
-	int i, ret;
+	char *slash = strchr(str, '/');
+	int l = 32;
 
-	while (!stop_workers) {
-		if (conf.poll) {
-			for (i = 0; i < conf.num_interfaces; i++) {
-				fds[i].fd = xsk_socket__fd(worker->xsks[i].xsk);
-				fds[i].events = POLLIN;
-				worker->xsks[i].stats.opt_polls++;
-			}
-			ret = poll(fds, conf.num_interfaces, POLL_TIMEOUT_MS);
-			if (ret <= 0)
-				continue;
-		}
+	if (slash) {
+		*slash++ = 0;
+		l = atoi(slash);
+	}
+	if (l < 0 || l > 32 || inet_pton(AF_INET, str, addr) != 1)
+		return -1;
+	*len = l;
 
-		if (conf.num_interfaces > 1) {
-			for (i = 0; i < conf.num_interfaces; i++) {
-				process_batch(worker->xsks, i);
-			}
+	return 0;
+}
+
+static int parse_bench_ports(const char *str, uint16_t *min, uint16_t *max)
+{
+	unsigned lo, hi;
+	int n = sscanf(str, "%u-%u", &lo, &hi);
+
+	if (n < 1)
+		return -1;
+	if (n == 1)
+		hi = lo;
+	if (lo > hi || hi > 65535)
+		return -1;
+	*min = lo;
+	*max = hi;
+
+	return 0;
+}
+
+/*
+ * Enables the benchmark mode with the given spec (see usage()), NULL for the
+ * defaults. Returns -1 if the spec is not valid
+ */
+static int parse_bench(const char *spec, struct xsknf_bench_config *bench)
+{
+	char buf[256], src[] = BENCH_SRC, dst[] = BENCH_DST, *tok, *val, *save;
+
+	memset(bench, 0, sizeof(*bench));
+	bench->enabled = 1;
+	bench->flows = BENCH_FLOWS;
+	bench->pkt_size = BENCH_PKT_SIZE;
+	bench->proto = IPPROTO_UDP;
+	parse_bench_prefix(src, &bench->saddr, &bench->saddr_len);
+	parse_bench_prefix(dst, &bench->daddr, &bench->daddr_len);
+	bench->sport_min = bench->sport_max = BENCH_SPORT;
+	bench->dport_min = bench->dport_max = BENCH_DPORT;
+	bench->trace_size = BENCH_TRACE_SIZE;
+	bench->seed = 1;
+
+	if (!spec)
+		return 0;
+	if (strlen(spec) >= sizeof(buf))
+		return -1;
+	strcpy(buf, spec);
+
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",",
+			&save)) {
+		val = strchr(tok, '=');
+		if (!val)
+			return -1;
+		*val++ = 0;
+
+		if (!strcmp(tok, "pkts")) {
+			bench->npkts = strtoul(val, NULL, 0);
+		} else if (!strcmp(tok, "flows")) {
+			bench->flows = atoi(val);
+		} else if (!strcmp(tok, "zipf")) {
+			bench->zipf = atof(val);
+		} else if (!strcmp(tok, "size")) {
+			bench->pkt_size = atoi(val);
+		} else if (!strcmp(tok, "proto")) {
+			if (!strcasecmp(val, "udp"))
+				bench->proto = IPPROTO_UDP;
+			else if (!strcasecmp(val, "tcp"))
+				bench->proto = IPPROTO_TCP;
+			else
+				return -1;
+		} else if (!strcmp(tok, "src")) {
+			if (parse_bench_prefix(val, &bench->saddr, &bench->saddr_len))
+				return -1;
+		} else if (!strcmp(tok, "dst")) {
+			if (parse_bench_prefix(val, &bench->daddr, &bench->daddr_len))
+				return -1;
+		} else if (!strcmp(tok, "sport")) {
+			if (parse_bench_ports(val, &bench->sport_min, &bench->sport_max))
+				return -1;
+		} else if (!strcmp(tok, "dport")) {
+			if (parse_bench_ports(val, &bench->dport_min, &bench->dport_max))
+				return -1;
+		} else if (!strcmp(tok, "trace")) {
+			bench->trace_size = atoi(val);
+		} else if (!strcmp(tok, "seed")) {
+			bench->seed = atoi(val);
 		} else {
-			process_batch_1if(&worker->xsks[0]);
+			return -1;
 		}
 	}
+
+	if (!bench->flows || !bench->trace_size || bench->zipf < 0)
+		return -1;
+
+	return 0;
 }
 
 static struct option long_options[] = {
@@ -755,6 +3040,26 @@ static struct option long_options[] = {
 	{"busy-poll", no_argument, 0, 'B'},
 	{"mode", required_argument, 0, 'M'},
 	{"workers", required_argument, 0, 'w'},
+	{"prefetch", required_argument, 0, 'P'},
+	{"rx-size", required_argument, 0, 'r'},
+	{"tx-size", required_argument, 0, 't'},
+	{"fill-size", required_argument, 0, 'F'},
+	{"comp-size", required_argument, 0, 'c'},
+	{"frames", required_argument, 0, 'n'},
+	{"hugepages", optional_argument, 0, 'H'},
+	{"numa", required_argument, 0, 'N'},
+	{"queue", required_argument, 0, 'Q'},
+	{"adaptive-poll", required_argument, 0, 'A'},
+	{"epoll", no_argument, 0, 'E'},
+	{"pipeline", required_argument, 0, 'W'},
+	{"steer", required_argument, 0, 'R'},
+	{"tx-coalesce", required_argument, 0, 'C'},
+	{"rx-metadata", no_argument, 0, 'm'},
+	{"no-xdp-stats", no_argument, 0, 'D'},
+	{"tx-metadata", no_argument, 0, 'T'},
+	{"stats-shm", required_argument, 0, 's'},
+	{"latency-hist", no_argument, 0, 'L'},
+	{"bench", optional_argument, 0, 'X'},
 	{0, 0, 0, 0}
 };
 
@@ -772,8 +3077,55 @@ static void usage()
 		"	-B, --busy-poll		Busy poll\n"
 		"	-M  --mode		Working mode (AF_XDP, XDP, COMBINED)\n"
 		"	-w  --workers=n		Number of packet processing workers\n"
+		"	-P  --prefetch=n[:h]	Prefetch packets n positions ahead in the batch (optionally\n"
+		"				prefetching also the headroom (h)). Default is 0 (disabled)\n"
+		"	-r  --rx-size=n		Size of the rx rings. Default is %u\n"
+		"	-t  --tx-size=n		Size of the tx rings. Default is %u\n"
+		"	-F  --fill-size=n	Size of the fill rings. Default is %u\n"
+		"	-c  --comp-size=n	Size of the completion rings. Default is %u\n"
+		"	-n  --frames=n		Number of UMEM frames per socket. Default is %u\n"
+		"	-H  --hugepages[=2M|1G]	Back the UMEM with hugepages (of the default size if not\n"
+		"				specified). 1G pages fall back to the default size if not\n"
+		"				available\n"
+		"	-N  --numa=auto|n[:s]	Place workers and their memory on the NUMA node of the first\n"
+		"				interface (auto) or on node n. With s workers are only placed\n"
+		"				on CPUs of the node\n"
+		"	-Q  --queue=w:i:q	Worker w serves queue q of interface i (index in the -i order).\n"
+		"				Can be repeated multiple times. Default is worker N serving\n"
+		"				queue N of every interface\n"
+		"	-A  --adaptive-poll=n	Block in poll() after n loops without packets, go back\n"
+		"				to polling the rings as soon as traffic restarts\n"
+		"	-E  --epoll		Wait for packets with epoll instead of poll (with -p or -A)\n"
+		"	-W  --pipeline=n	Pipelined mode, every worker only does rx and tx and hands\n"
+		"				received batches to n processing threads\n"
+		"	-R  --steer=p[:ms]	Move new flows of workers with more than p%% of full rx\n"
+		"				batches to less loaded workers. Flows go back to the RSS\n"
+		"				worker after ms of inactivity (default %u)\n"
+		"	-C  --tx-coalesce=n[:us]	Stage up to n packets per tx queue across rx batches, for\n"
+		"				at most us microseconds (default %u), and drop them if the\n"
+		"				tx ring stays full\n"
+		"	-m  --rx-metadata	Store RX hints (hash, timestamp, VLAN) before the packets\n"
+		"				(XDP and COMBINED modes)\n"
+		"	-D  --no-xdp-stats	Don't count packets in the eBPF programs\n"
+		"	-T  --tx-metadata	Enable AF_XDP TX metadata (checksum offload)\n"
+		"	-s  --stats-shm=name	Export the socket stats in the shared memory /dev/shm/name\n"
+		"				(see tools/xsknf-stat)\n"
+		"	-L  --latency-hist	Record histograms of the rx to tx latency, of the processing\n"
+		"				time and of the batch sizes\n"
+		"	-X  --bench[=spec]	Benchmark the NF on synthetic packets instead of the\n"
+		"				interfaces. spec is a comma separated list of:\n"
+		"				pkts=n (per worker, default until stopped), flows=n (%u),\n"
+		"				zipf=s (popularity of flows, default uniform),\n"
+		"				size=n (%u), proto=udp|tcp, src=a.b.c.d[/l] (%s),\n"
+		"				dst=a.b.c.d[/l] (%s), sport=n[-m] (%u), dport=n[-m] (%u),\n"
+		"				trace=n (pkts generated per worker, %u), seed=n\n"
 		"\n";
-	fprintf(stderr, str, XSK_UMEM__DEFAULT_FRAME_SIZE, default_conf.batch_size);
+	fprintf(stderr, str, XSK_UMEM__DEFAULT_FRAME_SIZE, default_conf.batch_size,
+			default_conf.rx_size, default_conf.tx_size, default_conf.fill_size,
+			default_conf.comp_size, default_conf.frames_per_socket,
+			default_conf.steer_idle_ms, default_conf.tx_coalesce_us,
+			BENCH_FLOWS, BENCH_PKT_SIZE, BENCH_SRC, BENCH_DST, BENCH_SPORT,
+			BENCH_DPORT, BENCH_TRACE_SIZE);
 
 	exit(EXIT_FAILURE);
 }
@@ -788,7 +3140,7 @@ int xsknf_parse_args(int argc, char **argv, struct xsknf_config *config)
 	config->tc_progname[0] = 0;
 
 	for (;;) {
-		c = getopt_long(argc, argv, "i:pSf:ub:BM:w:", long_options,
+		c = getopt_long(argc, argv, "i:pSf:ub:BM:w:P:r:t:F:c:n:H::N:Q:A:EW:R:C:mDTs:LX::", long_options,
 				&option_index);
 		if (c == -1)
 			break;
@@ -853,11 +3205,140 @@ int xsknf_parse_args(int argc, char **argv, struct xsknf_config *config)
 				usage();
 			}
 			break;
+		case 'P':;
+			char *sep;
+			config->prefetch_distance = strtoul(optarg, &sep, 10);
+			if (*sep == ':') {
+				if (strcmp(sep + 1, "h")) {
+					fprintf(stderr, "ERROR: unknown prefetch option '%s'\n",
+							sep + 1);
+					usage();
+				}
+				config->prefetch_headroom = 1;
+			} else if (*sep != 0) {
+				fprintf(stderr, "ERROR: invalid prefetch distance %s\n",
+						optarg);
+				usage();
+			}
+			break;
+		case 'r':
+			config->rx_size = atoi(optarg);
+			break;
+		case 't':
+			config->tx_size = atoi(optarg);
+			break;
+		case 'F':
+			config->fill_size = atoi(optarg);
+			break;
+		case 'c':
+			config->comp_size = atoi(optarg);
+			break;
+		case 'n':
+			config->frames_per_socket = atoi(optarg);
+			break;
+		case 'H':
+			if (!optarg) {
+				config->hugepage_size = 1;
+			} else if (strcmp(optarg, "2M") == 0) {
+				config->hugepage_size = HUGEPAGE_2M;
+			} else if (strcmp(optarg, "1G") == 0) {
+				config->hugepage_size = HUGEPAGE_1G;
+			} else {
+				fprintf(stderr, "ERROR: unsupported hugepage size %s\n",
+						optarg);
+				usage();
+			}
+			break;
+		case 'N':
+			if (strncmp(optarg, "auto", 4) == 0) {
+				config->numa_node = XSKNF_NUMA_AUTO;
+				sep = optarg + 4;
+			} else {
+				config->numa_node = strtol(optarg, &sep, 10);
+				if (sep == optarg || config->numa_node < 0
+						|| config->numa_node >= 1024) {
+					fprintf(stderr, "ERROR: invalid NUMA node %s\n", optarg);
+					usage();
+				}
+			}
+			if (strcmp(sep, ":s") == 0) {
+				config->numa_strict = 1;
+			} else if (*sep != 0) {
+				fprintf(stderr, "ERROR: unknown NUMA option '%s'\n", sep);
+				usage();
+			}
+			break;
+		case 'A':
+			config->adaptive_poll = atoi(optarg);
+			break;
+		case 'E':
+			config->epoll = 1;
+			break;
+		case 'W':
+			config->pipeline = atoi(optarg);
+			break;
+		case 'm':
+			config->rx_metadata = 1;
+			break;
+		case 'D':
+			config->no_xdp_stats = 1;
+			break;
+		case 'T':
+			config->tx_metadata = 1;
+			break;
+		case 's':
+			/* shm_open() names start with a slash */
+			snprintf(config->stats_shm, sizeof(config->stats_shm), "%s%s",
+					optarg[0] == '/' ? "" : "/", optarg);
+			break;
+		case 'L':
+			config->histograms = 1;
+			break;
+		case 'X':
+			if (parse_bench(optarg, &config->bench)) {
+				fprintf(stderr, "ERROR: invalid benchmark spec %s\n", optarg);
+				usage();
+			}
+			break;
+		case 'R':
+			if (sscanf(optarg, "%u:%u", &config->steer_threshold,
+					&config->steer_idle_ms) < 1
+					|| !config->steer_threshold
+					|| config->steer_threshold > 100) {
+				fprintf(stderr, "ERROR: invalid steering option %s\n", optarg);
+				usage();
+			}
+			break;
+		case 'C':
+			if (sscanf(optarg, "%u:%u", &config->tx_coalesce,
+					&config->tx_coalesce_us) < 1 || !config->tx_coalesce) {
+				fprintf(stderr, "ERROR: invalid tx coalescing option %s\n",
+						optarg);
+				usage();
+			}
+			break;
+		case 'Q':;
+			struct xsknf_queue *q = &config->queues[config->num_queues];
+			if (config->num_queues == XSKNF_MAX_SOCKETS) {
+				fprintf(stderr, "ERROR: too many queues\n");
+				usage();
+			}
+			if (sscanf(optarg, "%u:%u:%u", &q->worker, &q->iface, &q->queue)
+					!= 3) {
+				fprintf(stderr, "ERROR: invalid queue %s\n", optarg);
+				usage();
+			}
+			config->num_queues++;
+			break;
 		default:
 			usage();
 		}
 	}
 
+	/* Benchmarks don't need interfaces, but the NF might expect one */
+	if (config->num_interfaces == 0 && config->bench.enabled)
+		config->interfaces[config->num_interfaces++] = "bench";
+
 	if (config->num_interfaces == 0) {
 		fprintf(stderr, "ERROR: at least one interface in required\n");
 		usage();
@@ -877,18 +3358,513 @@ int xsknf_parse_args(int argc, char **argv, struct xsknf_config *config)
 	return 0;
 }
 
+static int is_power_of_two(uint32_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+static void check_sizes()
+{
+	if (!is_power_of_two(conf.rx_size) || !is_power_of_two(conf.tx_size)
+			|| !is_power_of_two(conf.fill_size)
+			|| !is_power_of_two(conf.comp_size)) {
+		fprintf(stderr, "ERROR: ring sizes must be powers of two\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Needed to identify the owner of a frame from its address */
+	if (!is_power_of_two(conf.frames_per_socket)) {
+		fprintf(stderr, "ERROR: frames per socket must be a power of two\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* All the frames of a socket are put in its fill ring at startup */
+	if (conf.fill_size < conf.frames_per_socket) {
+		fprintf(stderr, "ERROR: fill ring size (%u) smaller than the frames "
+				"per socket (%u)\n", conf.fill_size, conf.frames_per_socket);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Validates the queue map, building the default one (worker N serves queue N
+ * of every interface) if not given
+ */
+static void check_queues()
+{
+	unsigned nqueues[XSKNF_MAX_WORKERS] = {0};
+
+	if (conf.workers > XSKNF_MAX_WORKERS) {
+		fprintf(stderr, "ERROR: too many workers (max %d)\n",
+				XSKNF_MAX_WORKERS);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!conf.num_queues) {
+		if (conf.workers * conf.num_interfaces > XSKNF_MAX_SOCKETS) {
+			fprintf(stderr, "ERROR: too many sockets (max %d)\n",
+					XSKNF_MAX_SOCKETS);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int wrk_idx = 0; wrk_idx < conf.workers; wrk_idx++) {
+			for (int if_idx = 0; if_idx < conf.num_interfaces; if_idx++) {
+				conf.queues[conf.num_queues].worker = wrk_idx;
+				conf.queues[conf.num_queues].iface = if_idx;
+				conf.queues[conf.num_queues++].queue = wrk_idx;
+			}
+		}
+	}
+
+	for (int i = 0; i < conf.num_queues; i++) {
+		struct xsknf_queue *q = &conf.queues[i];
+
+		if (q->worker >= conf.workers || q->iface >= conf.num_interfaces
+				|| q->queue >= XSKNF_MAX_QUEUES) {
+			fprintf(stderr, "ERROR: invalid queue %u:%u:%u\n", q->worker,
+					q->iface, q->queue);
+			exit(EXIT_FAILURE);
+		}
+
+		for (int j = 0; j < i; j++) {
+			if (conf.queues[j].iface == q->iface
+					&& conf.queues[j].queue == q->queue) {
+				fprintf(stderr, "ERROR: queue %u of %s assigned twice\n",
+						q->queue, conf.interfaces[q->iface]);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		nqueues[q->worker]++;
+	}
+
+	for (int i = 0; i < conf.workers; i++) {
+		if (!nqueues[i]) {
+			fprintf(stderr, "ERROR: worker %d has no queues\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Size of the UMEM of a worker, with an additional region for the frame pool
+ */
+static size_t umem_size(unsigned nsockets)
+{
+	size_t size = (size_t)FRAMES_PER_SOCKET * (nsockets
+			+ (conf.frame_pool ? 1 : 0)) * conf.xsk_frame_size;
+
+	/*
+	 * Hugepage mappings must be a multiple of the page size (assume 2M for the
+	 * default size)
+	 */
+	if (conf.hugepage_size || conf.unaligned_chunks) {
+		unsigned long page_size = conf.hugepage_size == HUGEPAGE_1G ?
+				HUGEPAGE_1G : HUGEPAGE_2M;
+		size = (size + page_size - 1) & ~(page_size - 1);
+	}
+
+	return size;
+}
+
+/* Size of the arrays of the batches of a ring */
+static size_t pipe_mem_size()
+{
+	return PIPE_RING_SIZE * conf.batch_size * (sizeof(struct xsknf_packet)
+			+ sizeof(uint64_t) + sizeof(int));
+}
+
+static void pipe_ring_init(struct pipe_ring *ring)
+{
+	void *mem = numa_zalloc(pipe_mem_size());
+
+	ring->mem = mem;
+	for (int i = 0; i < PIPE_RING_SIZE; i++) {
+		struct pipe_batch *batch = &ring->batches[i];
+		batch->pkts = mem;
+		mem += conf.batch_size * sizeof(struct xsknf_packet);
+		batch->addrs = mem;
+		mem += conf.batch_size * sizeof(uint64_t);
+		batch->verdicts = mem;
+		mem += conf.batch_size * sizeof(int);
+	}
+}
+
+static void pipe_ring_free(struct pipe_ring *ring)
+{
+	numa_free(ring->mem, pipe_mem_size());
+}
+
+/* Frequency of read_tsc(), measured against CLOCK_MONOTONIC over 10 ms */
+static uint64_t measure_tsc_hz()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec start, end, delay = {0, 10000000};
+	uint64_t tsc;
+	long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tsc = read_tsc();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	tsc = read_tsc() - tsc;
+
+	ns = (end.tv_sec - start.tv_sec) * 1000000000L
+			+ end.tv_nsec - start.tv_nsec;
+	return tsc * 1000000000. / ns;
+#else
+	return 1000000000UL;
+#endif
+}
+
+/*
+ * Maps the stats shared memory (see xsknf.h), named if stats_shm is set in the
+ * config, with one block for every socket and, with histograms, one histogram
+ * block for every thread
+ */
+static void stats_shm_init()
+{
+	struct xsknf_stats_header *hdr;
+	int fd = -1, flags = MAP_SHARED;
+	unsigned nhists = 0;
+
+	if (conf.histograms)
+		nhists = conf.workers * (1 + conf.pipeline);
+
+	stats_shm_size = sizeof(struct xsknf_stats_header)
+			+ conf.num_queues * sizeof(struct xsknf_stats_block)
+			+ nhists * sizeof(struct xsknf_hist_block);
+
+	if (conf.stats_shm[0]) {
+		fd = shm_open(conf.stats_shm, O_CREAT | O_RDWR | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, stats_shm_size)) {
+			fprintf(stderr, "ERROR: unable to create stats shared memory %s: "
+					"%s\n", conf.stats_shm, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		flags |= MAP_ANONYMOUS;
+	}
+
+	hdr = mmap(NULL, stats_shm_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (hdr == MAP_FAILED)
+		exit_with_error(errno);
+	if (fd >= 0)
+		close(fd);
+
+	hdr->version = XSKNF_STATS_VERSION;
+	hdr->header_size = sizeof(struct xsknf_stats_header);
+	hdr->block_size = sizeof(struct xsknf_stats_block);
+	hdr->nblocks = conf.num_queues;
+	hdr->num_interfaces = conf.num_interfaces;
+	hdr->pid = getpid();
+	hdr->workers = conf.workers;
+	hdr->nhists = nhists;
+	hdr->hist_size = sizeof(struct xsknf_hist_block);
+	hdr->tsc_hz = conf.histograms || conf.bench.enabled || conf.tx_coalesce ?
+			measure_tsc_hz() : 0;
+	for (int i = 0; i < nhists; i++) {
+		xsknf_stats_hists(hdr)[i].worker = i / (1 + conf.pipeline);
+		xsknf_stats_hists(hdr)[i].thread = i % (1 + conf.pipeline);
+	}
+	for (int i = 0; i < conf.num_interfaces; i++) {
+		strncpy(hdr->interfaces[i], conf.interfaces[i],
+				XSKNF_STATS_IFNAMSIZ - 1);
+	}
+	__atomic_store_n(&hdr->magic, XSKNF_STATS_MAGIC, __ATOMIC_RELEASE);
+
+	stats_shm = hdr;
+}
+
+/*
+ * Allocates a UMEM area, unaligned mode keeps using hugepages of the default
+ * size if not configured otherwise
+ */
+static void *umem_alloc(size_t size)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	unsigned long page_size = conf.hugepage_size;
+	void *buf;
+
+	if (!page_size && conf.unaligned_chunks)
+		page_size = 1;
+
+	if (page_size == HUGEPAGE_1G) {
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB
+				| (30 << MAP_HUGE_SHIFT), -1, 0);
+		if (buf != MAP_FAILED) {
+			numa_bind(buf, size);
+			return buf;
+		}
+
+		fprintf(stderr, "WARNING: unable to allocate 1G hugepages, using the "
+				"default size\n");
+		page_size = 1;
+	}
+
+	if (page_size == HUGEPAGE_2M)
+		flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+	else if (page_size)
+		flags |= MAP_HUGETLB;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (buf == MAP_FAILED)
+		exit_with_error(errno);
+
+	numa_bind(buf, size);
+
+	return buf;
+}
+
+static inline uint64_t bench_rand(uint64_t *state)
+{
+	/* xorshift64* */
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t bench_sum(const void *data, unsigned len, uint32_t sum)
+{
+	const uint16_t *p = data;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	if (len)
+		sum += *(const uint8_t *)p;
+
+	return sum;
+}
+
+static uint16_t bench_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/* Headers of a packet of flow f (see struct xsknf_bench_config) */
+static void bench_write_packet(void *data, unsigned f)
+{
+	struct xsknf_bench_config *bench = &conf.bench;
+	struct ethhdr *eth = data;
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	struct tcphdr *tcp = (struct tcphdr *)(ip + 1);
+	uint64_t nsrc = 1ULL << (32 - bench->saddr_len),
+			ndst = 1ULL << (32 - bench->daddr_len);
+	uint16_t l4_len = bench->pkt_size - sizeof(*eth) - sizeof(*ip), sport,
+			dport;
+	uint32_t sum;
+
+	memset(data, 0, BENCH_HDR_SIZE);
+	memcpy(eth->h_dest, "\x02\x00\x00\x00\x00\x02", ETH_ALEN);
+	memcpy(eth->h_source, "\x02\x00\x00\x00\x00\x01", ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->tot_len = htons(bench->pkt_size - sizeof(*eth));
+	ip->ttl = 64;
+	ip->protocol = bench->proto;
+	ip->saddr = htonl((ntohl(bench->saddr) & ~(nsrc - 1)) + f % nsrc);
+	ip->daddr = htonl((ntohl(bench->daddr) & ~(ndst - 1)) + f % ndst);
+	ip->check = bench_fold(bench_sum(ip, sizeof(*ip), 0));
+
+	sport = htons(bench->sport_min + f % (bench->sport_max
+			- bench->sport_min + 1));
+	dport = htons(bench->dport_min + f % (bench->dport_max
+			- bench->dport_min + 1));
+
+	/* The payload is zeroed, only the l4 header counts in the checksum */
+	sum = bench_sum(&ip->saddr, 8, htons(bench->proto) + htons(l4_len));
+	if (bench->proto == IPPROTO_TCP) {
+		tcp->source = sport;
+		tcp->dest = dport;
+		tcp->doff = sizeof(*tcp) / 4;
+		tcp->ack = 1;
+		tcp->window = htons(65535);
+		tcp->check = bench_fold(bench_sum(tcp, sizeof(*tcp), sum));
+	} else {
+		udp->source = sport;
+		udp->dest = dport;
+		udp->len = htons(l4_len);
+		udp->check = bench_fold(bench_sum(udp, sizeof(*udp), sum));
+	}
+}
+
+/*
+ * The trace of a worker only holds its flows (w, w + workers, ...), the
+ * popularity of flow f is 1 / (f + 1)^zipf
+ */
+static void bench_build_trace(struct worker *worker)
+{
+	struct xsknf_bench_config *bench = &conf.bench;
+	unsigned nflows = (bench->flows - worker->id + conf.workers - 1)
+			/ conf.workers, lo, hi, mid;
+	uint64_t state = bench->seed * 0x9e3779b97f4a7c15ULL + worker->id + 1;
+	double *cdf, sum = 0, r;
+
+	cdf = malloc(nflows * sizeof(double));
+	if (!cdf)
+		exit_with_error(errno);
+
+	for (unsigned i = 0; i < nflows; i++) {
+		sum += bench->zipf ? pow(worker->id + i * conf.workers + 1,
+				-bench->zipf) : 1;
+		cdf[i] = sum;
+	}
+
+	worker->bench_trace = numa_zalloc((size_t)bench->trace_size
+			* BENCH_HDR_SIZE);
+	for (unsigned n = 0; n < bench->trace_size; n++) {
+		r = (bench_rand(&state) >> 11) * 0x1.0p-53 * sum;
+
+		/* First flow whose cumulative popularity is above r */
+		for (lo = 0, hi = nflows - 1; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (cdf[mid] > r)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+
+		bench_write_packet(worker->bench_trace + (size_t)n * BENCH_HDR_SIZE,
+				worker->id + lo * conf.workers);
+	}
+
+	free(cdf);
+}
+
+/*
+ * Benchmark mode, every worker gets a fake socket for each of its queues, with
+ * stats as the real ones, and a loopback UMEM with the frames of one socket
+ */
+static void bench_init()
+{
+	unsigned min_size = sizeof(struct ethhdr) + sizeof(struct iphdr)
+			+ (conf.bench.proto == IPPROTO_TCP ? sizeof(struct tcphdr)
+			: sizeof(struct udphdr));
+
+	if (conf.bench.pkt_size < min_size || conf.bench.pkt_size
+			+ XDP_PACKET_HEADROOM > conf.xsk_frame_size) {
+		fprintf(stderr, "ERROR: benchmark packets must be between %u and %u "
+				"bytes\n", min_size, conf.xsk_frame_size - XDP_PACKET_HEADROOM);
+		exit(EXIT_FAILURE);
+	}
+
+	if (conf.bench.flows < conf.workers) {
+		fprintf(stderr, "ERROR: the benchmark needs at least one flow per "
+				"worker\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int wrk_idx = 0, block = 0; wrk_idx < conf.workers; wrk_idx++) {
+		struct worker *worker = &workers[wrk_idx];
+		worker->id = wrk_idx;
+
+		for (int i = 0; i < conf.num_queues; i++) {
+			if (conf.queues[i].worker == wrk_idx)
+				worker->nsockets++;
+		}
+
+		worker->xsks = numa_zalloc(worker->nsockets
+				* sizeof(struct xsk_socket_info));
+		worker->sock_stats = numa_zalloc(worker->nsockets
+				* sizeof(struct socket_stats));
+		worker->umem_size = (size_t)conf.frames_per_socket
+				* conf.xsk_frame_size;
+		worker->buffer = umem_alloc(worker->umem_size);
+		if (conf.histograms) {
+			worker->hists = xsknf_stats_hists(stats_shm)[wrk_idx].hists;
+		}
+
+		for (int q = 0, xsk_idx = 0; q < conf.num_queues; q++) {
+			if (conf.queues[q].worker != wrk_idx)
+				continue;
+
+			struct xsk_socket_info *xsk = &worker->xsks[xsk_idx];
+			xsk->worker = worker;
+			xsk->iface = conf.queues[q].iface;
+			xsk->queue = conf.queues[q].queue;
+			xsk->buffer = worker->buffer;
+			xsk->stats = &worker->sock_stats[xsk_idx++].stats;
+			xsk->stats_block = &xsknf_stats_blocks(stats_shm)[block++];
+			xsk->stats_block->worker = wrk_idx;
+			xsk->stats_block->iface = xsk->iface;
+			xsk->stats_block->queue = xsk->queue;
+		}
+
+		bench_build_trace(worker);
+	}
+}
+
 int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj)
 {
 	int ret;
 
 	memcpy(&conf, config, sizeof(struct xsknf_config));
 
+	if (!nstages && !xsknf_packet_processor && !xsknf_batch_processor
+			&& (conf.working_mode & MODE_AF_XDP)) {
+		fprintf(stderr, "ERROR: no packet processing function defined\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (conf.pipeline && conf.frame_pool) {
+		/* The pool belongs to the worker, processing threads can't use it */
+		fprintf(stderr, "ERROR: the frame pool is not supported in pipelined "
+				"mode\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (conf.rx_metadata && !(conf.working_mode & MODE_XDP)) {
+		fprintf(stderr, "ERROR: RX metadata is stored by the XDP program, use "
+				"XDP or COMBINED mode\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (conf.tx_coalesce > conf.tx_size) {
+		fprintf(stderr, "ERROR: can't stage more packets than the tx ring "
+				"size (%u)\n", conf.tx_size);
+		exit(EXIT_FAILURE);
+	}
+
+#ifndef XDP_TX_METADATA
+	if (conf.tx_metadata) {
+		fprintf(stderr, "ERROR: built without AF_XDP TX metadata support\n");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	if (conf.bench.enabled && (conf.working_mode != MODE_AF_XDP
+			|| conf.pipeline || conf.steer_threshold || conf.frame_pool)) {
+		fprintf(stderr, "ERROR: the benchmark mode only supports the AF_XDP "
+				"mode, without pipeline, steering and frame pool\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (conf.steer_threshold) {
+		/* Workers must keep polling the rings of the other workers */
+		if (conf.pipeline || conf.poll || conf.adaptive_poll) {
+			fprintf(stderr, "ERROR: steering can't be used with pipelined "
+					"mode or workers waiting for packets\n");
+			exit(EXIT_FAILURE);
+		}
+		if (conf.workers < 2) {
+			fprintf(stderr, "ERROR: steering needs at least two workers\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	ifindexes = malloc(conf.num_interfaces * sizeof(int));
 	if (!ifindexes) {
 		exit_with_error(errno);
 	}
 
-	for (int i = 0; i < conf.num_interfaces; i++) {
+	/* Interfaces of the benchmark mode are only names */
+	for (int i = 0; i < conf.num_interfaces && !conf.bench.enabled; i++) {
 		ifindexes[i] = if_nametoindex(conf.interfaces[i]);
 		if (!ifindexes[i]) {
 			fprintf(stderr, "ERROR: interface \"%s\" does not exist\n",
@@ -897,10 +3873,10 @@ int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj)
 		}
 	}
 
-	num_sockets = conf.workers * conf.num_interfaces;
-
 	if (conf.working_mode & MODE_AF_XDP) {
-		owner_shift = FRAMES_PER_SOCKET_SHIFT
+		check_sizes();
+
+		owner_shift = __builtin_ffs(conf.frames_per_socket) - 1
 				+ __builtin_ffs(conf.xsk_frame_size) - 1;
 
 		/* Set bind flags for sockets */
@@ -922,48 +3898,90 @@ int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj)
 			}
 		}
 
+		check_queues();
+
+		resolve_numa_node();
+
 		/* Allocate workers */
-		workers = calloc(conf.workers, sizeof(struct worker));
-		if (!workers) {
-			exit_with_error(errno);
-		}
+		workers = numa_zalloc(conf.workers * sizeof(struct worker));
 
-		/* Configure the UMEM */
-		umem_bufsize = FRAMES_PER_SOCKET * conf.num_interfaces
-				* conf.xsk_frame_size;
-		int umem_buf_flags = MAP_PRIVATE | MAP_ANONYMOUS
-				| (conf.unaligned_chunks ? MAP_HUGETLB : 0);
 		struct xsk_umem_config umem_cfg = {
-			.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS * 2,
-			.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+			.fill_size = conf.fill_size,
+			.comp_size = conf.comp_size,
 			.frame_size = conf.xsk_frame_size,
 			.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
 			.flags = conf.unaligned_chunks ?
 					XDP_UMEM_UNALIGNED_CHUNK_FLAG : 0
 		};
 
-		for (int wrk_idx = 0; wrk_idx < conf.workers; wrk_idx++) {
+#ifdef XDP_TX_METADATA
+		if (conf.tx_metadata) {
+			umem_cfg.tx_metadata_len = TX_META_LEN;
+#ifdef XDP_UMEM_TX_METADATA_LEN
+			umem_cfg.flags |= XDP_UMEM_TX_METADATA_LEN;
+#endif
+		}
+#endif
+
+		stats_shm_init();
+		tx_coalesce_tsc = stats_shm->tsc_hz * conf.tx_coalesce_us / 1000000;
+
+		if (conf.bench.enabled) {
+			bench_init();
+			*bpf_obj = NULL;
+			memcpy(config, &conf, sizeof(struct xsknf_config));
+			return 0;
+		}
+
+		for (int wrk_idx = 0, block = 0; wrk_idx < conf.workers; wrk_idx++) {
 			struct worker *worker = &workers[wrk_idx];
 			worker->id = wrk_idx;
 
-			worker->xsks = calloc(conf.num_interfaces,
-					sizeof(struct xsk_socket_info));
-			if (!worker->xsks) {
-				exit_with_error(errno);
+			for (int i = 0; i < conf.num_queues; i++) {
+				if (conf.queues[i].worker == wrk_idx)
+					worker->nsockets++;
+			}
+
+			worker->xsks = numa_zalloc(worker->nsockets
+					* sizeof(struct xsk_socket_info));
+			worker->sock_stats = numa_zalloc(worker->nsockets
+					* sizeof(struct socket_stats));
+			if (conf.tx_coalesce) {
+				worker->tx_staged = numa_zalloc(worker->nsockets
+						* conf.tx_coalesce * sizeof(struct pkt_info));
+			}
+			worker->umem_size = umem_size(worker->nsockets);
+			size_t umem_bufsize = worker->umem_size;
+			if (conf.histograms) {
+				worker->hists = xsknf_stats_hists(stats_shm)[wrk_idx
+						* (1 + conf.pipeline)].hists;
 			}
 
 			/* Create sockets */
-			for (int if_idx = 0; if_idx < conf.num_interfaces; if_idx++) {
-				struct xsk_socket_info *xsk = &worker->xsks[if_idx];
+			for (int q = 0, xsk_idx = 0; q < conf.num_queues; q++) {
+				if (conf.queues[q].worker != wrk_idx)
+					continue;
+
+				int if_idx = conf.queues[q].iface;
+				struct xsk_socket_info *xsk = &worker->xsks[xsk_idx];
 				xsk->worker = worker;
+				xsk->iface = if_idx;
+				xsk->queue = conf.queues[q].queue;
+				xsk->stats = &worker->sock_stats[xsk_idx].stats;
+				if (worker->tx_staged) {
+					xsk->staged = &worker->tx_staged[xsk_idx
+							* conf.tx_coalesce];
+				}
+				xsk->stats_block = &xsknf_stats_blocks(stats_shm)[block++];
+				xsk->stats_block->worker = wrk_idx;
+				xsk->stats_block->iface = if_idx;
+				xsk->stats_block->queue = xsk->queue;
+				if (!worker->tx_xsks[if_idx])
+					worker->tx_xsks[if_idx] = xsk;
 
 				if (conf.bind_flags[if_idx] & XDP_COPY) {
 					if (worker->copy_buffer == NULL) {
-						worker->copy_buffer = mmap(NULL, umem_bufsize,
-								PROT_READ | PROT_WRITE, umem_buf_flags, -1, 0);
-						if (worker->copy_buffer == MAP_FAILED) {
-							exit_with_error(errno);
-						}
+						worker->copy_buffer = umem_alloc(umem_bufsize);
 						ret = xsk_umem__create(&worker->copy_umem,
 								worker->copy_buffer, umem_bufsize, &xsk->fq,
 								&xsk->cq, &umem_cfg);
@@ -976,11 +3994,7 @@ int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj)
 
 				} else {
 					if (worker->buffer == NULL) {
-						worker->buffer = mmap(NULL, umem_bufsize,
-								PROT_READ | PROT_WRITE, umem_buf_flags, -1, 0);
-						if (worker->buffer == MAP_FAILED) {
-							exit_with_error(errno);
-						}
+						worker->buffer = umem_alloc(umem_bufsize);
 						ret = xsk_umem__create(&worker->umem, 
 								worker->buffer, umem_bufsize,
 								&xsk->fq, &xsk->cq, &umem_cfg);
@@ -993,8 +4007,64 @@ int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj)
 				}
 
 				xsk->bind_flags = conf.bind_flags[if_idx];
-				xsk_configure_socket(conf.interfaces[if_idx], wrk_idx,
-						xsk, if_idx * FRAMES_PER_SOCKET);
+				xsk_configure_socket(conf.interfaces[if_idx], xsk->queue,
+						xsk, xsk_idx++ * FRAMES_PER_SOCKET);
+			}
+
+			if (worker->buffer && worker->copy_buffer) {
+				for (int t = 0; t < 2; t++) {
+					worker->xfer[t] = numa_zalloc(worker->nsockets
+							* FRAMES_PER_SOCKET * sizeof(uint64_t));
+				}
+
+				/* The regions of a UMEM are free in the other one */
+				for (int i = 0; i < worker->nsockets; i++) {
+					int t = !umem_idx(worker, &worker->xsks[i]);
+					for (int j = 0; j < FRAMES_PER_SOCKET; j++) {
+						worker->xfer[t][worker->xfer_nfree[t]++] =
+								(i * FRAMES_PER_SOCKET + j)
+								* (uint64_t)conf.xsk_frame_size;
+					}
+				}
+			}
+
+			if (conf.frame_pool) {
+				worker->pool = numa_zalloc(FRAMES_PER_SOCKET
+						* sizeof(uint64_t));
+
+				worker->pool_buffer = worker->buffer ? worker->buffer :
+						worker->copy_buffer;
+				for (int i = 0; i < FRAMES_PER_SOCKET; i++) {
+					pool_put(worker, (worker->nsockets * FRAMES_PER_SOCKET
+							+ i) * (uint64_t)conf.xsk_frame_size);
+				}
+			}
+
+			if (conf.pipeline) {
+				worker->procs = numa_zalloc(conf.pipeline
+						* sizeof(struct proc_thread));
+
+				for (int i = 0; i < conf.pipeline; i++) {
+					worker->procs[i].worker = worker;
+					pipe_ring_init(&worker->procs[i].ring);
+					if (conf.histograms) {
+						worker->procs[i].hists = xsknf_stats_hists(
+								stats_shm)[wrk_idx * (1 + conf.pipeline)
+								+ 1 + i].hists;
+					}
+				}
+			}
+
+			if (conf.steer_threshold) {
+				worker->steer_table = numa_zalloc(STEER_BUCKETS
+						* sizeof(struct steer_bucket));
+				worker->steer_rings = numa_zalloc(conf.workers
+						* sizeof(struct pipe_ring));
+
+				for (int i = 0; i < conf.workers; i++) {
+					if (i != wrk_idx)
+						pipe_ring_init(&worker->steer_rings[i]);
+				}
 			}
 		}
 	}
@@ -1007,6 +4077,8 @@ int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj)
 
 		if (conf.working_mode & MODE_AF_XDP) {
 			enter_xsks_into_map(obj);
+			if (conf.busy_poll)
+				bootstrap_busy_poll(obj);
 		}
 
 		printf("Programs loaded\n");
@@ -1019,25 +4091,194 @@ int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj)
 	return 0;
 }
 
+/*
+ * Writes the queued entries of a map, one at a time when batches are not
+ * supported or one of them is rejected
+ */
+static void fastpath_flush(struct fastpath_map *map)
+{
+	uint32_t count = map->n, done = 0;
+
+	if (!map->n)
+		return;
+
+	if (!map->no_batch) {
+		fastpath_syscalls++;
+		if (!bpf_map_update_batch(map->fd, map->keys, map->values, &count,
+				NULL)) {
+			fastpath_installed += map->n;
+			map->n = 0;
+			return;
+		}
+
+		if (!count && (errno == EINVAL || errno == EOPNOTSUPP
+				|| errno == ENOTSUPP)) {
+			fprintf(stderr, "WARNING: batched map updates not supported, "
+					"fast path entries are written one at a time\n");
+			map->no_batch = 1;
+		}
+		fastpath_installed += count;
+		done = count;
+	}
+
+	for (unsigned i = done; i < map->n; i++) {
+		fastpath_syscalls++;
+		if (bpf_map_update_elem(map->fd, map->keys + i * map->key_size,
+				map->values + i * map->value_size, BPF_ANY))
+			fastpath_errors++;
+		else
+			fastpath_installed++;
+	}
+	map->n = 0;
+}
+
+static void *fastpath_loop(void *arg)
+{
+	struct fastpath_ring *ring;
+	struct fastpath_map *map;
+	unsigned prod, moved;
+	char *slot;
+	int stop;
+
+	for (;;) {
+		/* Read before the last pass, to find everything queued until now */
+		stop = __atomic_load_n(&fastpath_stop, __ATOMIC_ACQUIRE);
+		moved = 0;
+
+		for (unsigned r = 0; r < nfastpath_rings; r++) {
+			ring = &fastpath_rings[r];
+			prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+
+			for (; ring->cons != prod; moved++) {
+				slot = ring->slots + (size_t)(ring->cons
+						& (FASTPATH_RING_SIZE - 1)) * fastpath_slot_size;
+				map = &fastpath_maps[*(uint32_t *)slot];
+				memcpy(map->keys + map->n * map->key_size,
+						slot + FASTPATH_SLOT_HDR, map->key_size);
+				memcpy(map->values + map->n * map->value_size,
+						slot + FASTPATH_SLOT_HDR + map->key_size,
+						map->value_size);
+				if (++map->n == FASTPATH_BATCH)
+					fastpath_flush(map);
+
+				/* Give back the slot as soon as possible */
+				__atomic_store_n(&ring->cons, ring->cons + 1,
+						__ATOMIC_RELEASE);
+			}
+		}
+
+		for (unsigned i = 0; i < nfastpath_maps; i++)
+			fastpath_flush(&fastpath_maps[i]);
+
+		if (!moved) {
+			if (stop)
+				break;
+			usleep(FASTPATH_IDLE_US);
+		}
+	}
+
+	return NULL;
+}
+
+static void fastpath_start()
+{
+	int ret;
+
+	nfastpath_rings = conf.workers * (1 + conf.pipeline);
+	fastpath_rings = aligned_alloc(CACHE_LINE_SIZE,
+			nfastpath_rings * sizeof(*fastpath_rings));
+	if (!fastpath_rings)
+		exit_with_error(ENOMEM);
+
+	for (unsigned i = 0; i < nfastpath_rings; i++) {
+		memset(&fastpath_rings[i], 0, sizeof(fastpath_rings[i]));
+		fastpath_rings[i].slots = malloc((size_t)FASTPATH_RING_SIZE
+				* fastpath_slot_size);
+		if (!fastpath_rings[i].slots)
+			exit_with_error(ENOMEM);
+	}
+
+	fastpath_stop = 0;
+	ret = pthread_create(&fastpath_thread, NULL, fastpath_loop, NULL);
+	if (ret)
+		exit_with_error(ret);
+}
+
+/* After the workers, entries still queued are written before stopping */
+static void fastpath_end()
+{
+	__atomic_store_n(&fastpath_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(fastpath_thread, NULL);
+
+	for (unsigned i = 0; i < nfastpath_rings; i++) {
+		fastpath_queued += fastpath_rings[i].queued;
+		fastpath_full += fastpath_rings[i].full;
+		free(fastpath_rings[i].slots);
+	}
+	free(fastpath_rings);
+	fastpath_rings = NULL;
+	nfastpath_rings = 0;
+}
+
 int xsknf_cleanup()
 {
 	xsknf_stop_workers();
 
+	for (unsigned i = 0; i < nfastpath_maps; i++) {
+		free(fastpath_maps[i].keys);
+		free(fastpath_maps[i].values);
+	}
+	nfastpath_maps = 0;
+
 	if (conf.working_mode & MODE_AF_XDP) {
 		for (int wrk_idx = 0; wrk_idx < conf.workers; wrk_idx++) {
-			for (int if_idx = 0; if_idx < conf.num_interfaces; if_idx++) {
-				xsk_socket__delete(workers[wrk_idx].xsks[if_idx].xsk);
+			for (int i = 0; i < workers[wrk_idx].nsockets; i++) {
+				xsk_socket__delete(workers[wrk_idx].xsks[i].xsk);
 			}
 			xsk_umem__delete(workers[wrk_idx].umem);
-			munmap(workers[wrk_idx].buffer, umem_bufsize);
+			munmap(workers[wrk_idx].buffer, workers[wrk_idx].umem_size);
 			xsk_umem__delete(workers[wrk_idx].copy_umem);
-			munmap(workers[wrk_idx].copy_buffer, umem_bufsize);
-			free(workers[wrk_idx].xsks);
+			munmap(workers[wrk_idx].copy_buffer, workers[wrk_idx].umem_size);
+			numa_free(workers[wrk_idx].xsks, workers[wrk_idx].nsockets
+					* sizeof(struct xsk_socket_info));
+			numa_free(workers[wrk_idx].sock_stats, workers[wrk_idx].nsockets
+					* sizeof(struct socket_stats));
+			numa_free(workers[wrk_idx].tx_staged, workers[wrk_idx].nsockets
+					* conf.tx_coalesce * sizeof(struct pkt_info));
+			numa_free(workers[wrk_idx].pool, FRAMES_PER_SOCKET
+					* sizeof(uint64_t));
+			numa_free(workers[wrk_idx].bench_trace,
+					(size_t)conf.bench.trace_size * BENCH_HDR_SIZE);
+			for (int t = 0; t < 2; t++) {
+				numa_free(workers[wrk_idx].xfer[t], workers[wrk_idx].nsockets
+						* FRAMES_PER_SOCKET * sizeof(uint64_t));
+			}
+			if (workers[wrk_idx].procs) {
+				for (int i = 0; i < conf.pipeline; i++) {
+					pipe_ring_free(&workers[wrk_idx].procs[i].ring);
+				}
+				numa_free(workers[wrk_idx].procs, conf.pipeline
+						* sizeof(struct proc_thread));
+			}
+			if (workers[wrk_idx].steer_rings) {
+				for (int i = 0; i < conf.workers; i++) {
+					if (i != wrk_idx)
+						pipe_ring_free(&workers[wrk_idx].steer_rings[i]);
+				}
+				numa_free(workers[wrk_idx].steer_rings, conf.workers
+						* sizeof(struct pipe_ring));
+				numa_free(workers[wrk_idx].steer_table, STEER_BUCKETS
+						* sizeof(struct steer_bucket));
+			}
 		}
-		free(workers);
+		numa_free(workers, conf.workers * sizeof(struct worker));
+
+		munmap(stats_shm, stats_shm_size);
+		if (conf.stats_shm[0])
+			shm_unlink(conf.stats_shm);
 	}
 
-	for (int i = 0; i < conf.num_interfaces; i++) {
+	for (int i = 0; i < conf.num_interfaces && !conf.bench.enabled; i++) {
 		bpf_xdp_attach(ifindexes[i], -1, conf.xdp_flags, NULL);
 	}
 	if (egress_ebpf_program) {
@@ -1050,6 +4291,7 @@ int xsknf_cleanup()
 int xsknf_start_workers()
 {
 	stop_workers = 0;
+	select_batch_fn();
 
 	if (conf.working_mode & MODE_AF_XDP) {
 		/* Get available CPUs */
@@ -1062,17 +4304,60 @@ int xsknf_start_workers()
 
 		int num_cpus = CPU_COUNT(&cpu_set), curr_cpu = 0;
 		int cpus[num_cpus];
+		cpu_set_t node_set;
+		char path[64];
+
+		if (numa_node >= 0) {
+			snprintf(path, sizeof(path),
+					"/sys/devices/system/node/node%d/cpulist", numa_node);
+			if (read_cpulist(path, &node_set)) {
+				fprintf(stderr, "ERROR: unable to read CPUs of NUMA node %d\n",
+						numa_node);
+				xsknf_cleanup();
+				exit(EXIT_FAILURE);
+			}
+
+			/* CPUs of the NIC node come first, the others only if allowed */
+			for (int i = 0; curr_cpu < num_cpus && i < CPU_SETSIZE; i++) {
+				if (CPU_ISSET(i, &cpu_set) && CPU_ISSET(i, &node_set)) {
+					cpus[curr_cpu++] = i;
+				}
+			}
+			if (!conf.numa_strict) {
+				for (int i = 0; curr_cpu < num_cpus && i < CPU_SETSIZE; i++) {
+					if (CPU_ISSET(i, &cpu_set) && !CPU_ISSET(i, &node_set)) {
+						cpus[curr_cpu++] = i;
+					}
+				}
+			}
+			num_cpus = curr_cpu;
+
+		} else {
+			for (int i = 0; curr_cpu < num_cpus; i++) {
+				if (CPU_ISSET(i, &cpu_set)) {
+					cpus[curr_cpu++] = i;
+				}
+			}
+		}
 
-		if (num_cpus < conf.workers) {
+		if (num_cpus < conf.workers * (1 + conf.pipeline)) {
 			fprintf(stderr, "ERROR: not enough CPUs to host all workers\n");
 			xsknf_cleanup();
 			exit(EXIT_FAILURE);
 		}
 
-		for (int i = 0; curr_cpu < num_cpus; i++) {
-			if (CPU_ISSET(i, &cpu_set)) {
-				cpus[curr_cpu++] = i;
-			}
+		bench_running = conf.workers;
+
+		/* Rings are taken by the threads when they start */
+		if (nfastpath_maps)
+			fastpath_start();
+
+		/* Workers parked in a previous run start active */
+		for (int i = 0; i < conf.workers; i++) {
+			workers[i].state = WORKER_ACTIVE;
+			workers[i].server = i;
+			workers[i].nadopted = 0;
+			workers[i].ctl_seq = workers[i].ctl_ack = 0;
 		}
 
 		curr_cpu = 0;
@@ -1090,6 +4375,15 @@ int xsknf_start_workers()
 			 * correct CPU through irq_affinity
 			 * (i.e., queue N -> Nth CPU -> worker N).
 			 */
+			if (numa_node >= 0) {
+				if (!CPU_ISSET(cpus[curr_cpu], &node_set)) {
+					fprintf(stderr, "WARNING: worker %d on CPU %d, outside "
+							"NUMA node %d\n", i, cpus[curr_cpu], numa_node);
+				}
+				if (!conf.bench.enabled)
+					check_irq_affinity(&workers[i], cpus[curr_cpu]);
+			}
+
 			CPU_ZERO(&cpu_set);
 			CPU_SET(cpus[curr_cpu++], &cpu_set);
 			ret = pthread_setaffinity_np(workers[i].thread, sizeof(cpu_set_t),
@@ -1098,31 +4392,430 @@ int xsknf_start_workers()
 				exit_with_error(ret);
 			}
 		}
+
+		/* Processing threads take the CPUs after the ones of the workers */
+		for (int i = 0; i < conf.workers; i++) {
+			for (int j = 0; j < conf.pipeline; j++) {
+				struct proc_thread *proc = &workers[i].procs[j];
+
+				ret = pthread_create(&proc->thread, NULL, proc_loop, proc);
+				if (ret) {
+					exit_with_error(ret);
+				}
+
+				CPU_ZERO(&cpu_set);
+				CPU_SET(cpus[curr_cpu++], &cpu_set);
+				ret = pthread_setaffinity_np(proc->thread, sizeof(cpu_set_t),
+						&cpu_set);
+				if (ret) {
+					exit_with_error(ret);
+				}
+			}
+		}
+
+		workers_running = 1;
 	}
 
 	return 0;
 }
 
+/* Hardware counters not available are printed as nan */
+static double per_pkt(long val, unsigned long npkts)
+{
+	return val < 0 ? NAN : npkts ? (double)val / npkts : 0;
+}
+
+static void bench_print(const char *name, struct xsknf_bench_stats *stats,
+		double mpps)
+{
+	printf("%-10s %-10.3f %-10.1f %-10.1f %-12.3f %-12.3f %-10.2f\n", name,
+			mpps, per_pkt(stats->cycles, stats->npkts),
+			per_pkt(stats->instructions, stats->npkts),
+			per_pkt(stats->l1d_misses, stats->npkts),
+			per_pkt(stats->llc_misses, stats->npkts),
+			per_pkt(stats->ntx * 100, stats->npkts));
+}
+
+/* Results of the benchmark mode, per worker and total */
+static void bench_report()
+{
+	struct xsknf_bench_stats *stats, total = {0};
+	long *hw, *total_hw = &total.instructions;
+	double hz = xsknf_tsc_hz(), mpps, total_mpps = 0;
+	char buff[32];
+
+	printf("\n%-10s %-10s %-10s %-10s %-12s %-12s %-10s\n", " BENCH", "Mpps",
+			"cycles/pkt", "instr/pkt", "L1D miss/pkt", "LLC miss/pkt", "tx %");
+
+	for (int i = 0; i < conf.workers; i++) {
+		stats = &workers[i].bench_stats;
+		mpps = stats->cycles ? stats->npkts * hz / stats->cycles / 1e6 : 0;
+		snprintf(buff, sizeof(buff), " wrk%d", i);
+		bench_print(buff, stats, mpps);
+
+		/* Workers run in parallel, their rates add up */
+		total_mpps += mpps;
+		total.npkts += stats->npkts;
+		total.ntx += stats->ntx;
+		total.cycles += stats->cycles;
+		hw = &stats->instructions;
+		for (int c = 0; c < BENCH_NUM_COUNTERS; c++) {
+			if (hw[c] < 0 || total_hw[c] < 0)
+				total_hw[c] = -1;
+			else
+				total_hw[c] += hw[c];
+		}
+	}
+
+	bench_print(" TOTAL", &total, total_mpps);
+}
+
 int xsknf_stop_workers()
 {
 	stop_workers = 1;
 
 	if (conf.working_mode & MODE_AF_XDP) {
-		for (int i = 0; i < conf.workers; i++)
+		/* Wake up parked workers */
+		pthread_mutex_lock(&park_lock);
+		pthread_cond_broadcast(&park_cond);
+		workers_running = 0;
+		pthread_mutex_unlock(&park_lock);
+
+		for (int i = 0; i < conf.workers; i++) {
 			pthread_join(workers[i].thread, NULL);
+			for (int j = 0; j < conf.pipeline; j++)
+				pthread_join(workers[i].procs[j].thread, NULL);
+		}
+
+		if (fastpath_rings)
+			fastpath_end();
+
+		if (conf.bench.enabled)
+			bench_report();
+	}
+
+	return 0;
+}
+
+/*
+ * Asks the thread of worker to apply the changes to its state or to the
+ * workers it serves, returns -1 if workers are stopped meanwhile
+ */
+static int ctl_request(struct worker *worker)
+{
+	unsigned seq = __atomic_add_fetch(&worker->ctl_seq, 1, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&worker->ctl_ack, __ATOMIC_ACQUIRE) != seq) {
+		if (stop_workers)
+			return -1;
+		usleep(100);
+	}
+
+	return 0;
+}
+
+static int check_parking(unsigned worker_idx)
+{
+	if (!(conf.working_mode & MODE_AF_XDP) || conf.pipeline
+			|| conf.steer_threshold || conf.bench.enabled) {
+		fprintf(stderr, "ERROR: workers can only be parked in AF_XDP mode, "
+				"without pipelining, steering and benchmark\n");
+		return -1;
+	}
+
+	if (worker_idx >= conf.workers) {
+		fprintf(stderr, "ERROR: invalid worker %u\n", worker_idx);
+		return -1;
+	}
+
+	if (!workers_running) {
+		fprintf(stderr, "ERROR: workers are not running\n");
+		return -1;
 	}
 
 	return 0;
 }
 
+int xsknf_park_worker(unsigned worker_idx, unsigned target_idx)
+{
+	struct worker *worker, *target;
+	int ret = -1;
+
+	pthread_mutex_lock(&park_lock);
+
+	if (check_parking(worker_idx))
+		goto out;
+
+	if (target_idx >= conf.workers || target_idx == worker_idx) {
+		fprintf(stderr, "ERROR: invalid target worker %u\n", target_idx);
+		goto out;
+	}
+
+	worker = &workers[worker_idx];
+	target = &workers[target_idx];
+	if (worker->state != WORKER_ACTIVE || worker->nadopted) {
+		fprintf(stderr, "ERROR: worker %u is parked or serving parked "
+				"workers\n", worker_idx);
+		goto out;
+	}
+	if (target->state != WORKER_ACTIVE) {
+		fprintf(stderr, "ERROR: worker %u is parked\n", target_idx);
+		goto out;
+	}
+
+	/* The worker stops using its sockets before the target starts */
+	worker->server = target_idx;
+	__atomic_store_n(&worker->state, WORKER_PARKING, __ATOMIC_RELEASE);
+	if (ctl_request(worker) || ctl_request(target))
+		goto out;
+
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&park_lock);
+
+	return ret;
+}
+
+int xsknf_unpark_worker(unsigned worker_idx)
+{
+	struct worker *worker;
+	int ret = -1;
+
+	pthread_mutex_lock(&park_lock);
+
+	if (check_parking(worker_idx))
+		goto out;
+
+	worker = &workers[worker_idx];
+	if (worker->state != WORKER_PARKED) {
+		fprintf(stderr, "ERROR: worker %u is not parked\n", worker_idx);
+		goto out;
+	}
+
+	/* The target stops using the sockets before the worker starts again */
+	__atomic_store_n(&worker->state, WORKER_UNPARKING, __ATOMIC_RELEASE);
+	if (ctl_request(&workers[worker->server]))
+		goto out;
+
+	worker->server = worker_idx;
+	__atomic_store_n(&worker->state, WORKER_ACTIVE, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&park_cond);
+
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&park_lock);
+
+	return ret;
+}
+
+int xsknf_worker_server(unsigned worker_idx)
+{
+	if (worker_idx >= conf.workers)
+		return -1;
+
+	return __atomic_load_n(&workers[worker_idx].server, __ATOMIC_RELAXED);
+}
+
 int xsknf_get_socket_stats(unsigned worker_idx, unsigned iface_idx,
 		struct xsknf_socket_stats *stats)
 {
-	xsk_get_xdp_stats(xsk_socket__fd(workers[worker_idx].xsks[iface_idx].xsk),
-			&workers[worker_idx].xsks[iface_idx].stats);
+	struct worker *worker = &workers[worker_idx];
+	struct xsknf_stats_block snap;
+	unsigned long *sum = (unsigned long *)stats, *val;
+
+	/*
+	 * Sum the stats of all the sockets of the worker on the interface, from
+	 * their last published snapshot
+	 */
+	memset(stats, 0, sizeof(struct xsknf_socket_stats));
+	for (int i = 0; i < worker->nsockets; i++) {
+		if (worker->xsks[i].iface != iface_idx)
+			continue;
+
+		xsknf_read_stats_block(worker->xsks[i].stats_block, &snap);
+
+		val = (unsigned long *)&snap.stats;
+		for (int j = 0; j < sizeof(snap.stats) / sizeof(unsigned long); j++)
+			sum[j] += val[j];
+	}
+
+	return 0;
+}
+
+int xsknf_register_stage(const char *name, xsknf_stage_fn fn)
+{
+	if (nstages == XSKNF_MAX_STAGES) {
+		fprintf(stderr, "ERROR: at most %d stages can be registered\n",
+				XSKNF_MAX_STAGES);
+		return -1;
+	}
+
+	stages[nstages].name = name;
+	stages[nstages].fn = fn;
+
+	return nstages++;
+}
+
+int xsknf_fastpath_map(const char *name)
+{
+	struct fastpath_map *fmap;
+	struct bpf_map *map;
+	unsigned slot_size;
+
+	if (conf.working_mode != MODE_COMBINED || conf.bench.enabled) {
+		fprintf(stderr, "ERROR: the fast path cache requires COMBINED mode\n");
+		return -1;
+	}
+
+	if (workers_running) {
+		fprintf(stderr, "ERROR: fast path maps must be added before starting "
+				"the workers\n");
+		return -1;
+	}
+
+	if (nfastpath_maps == FASTPATH_MAX_MAPS) {
+		fprintf(stderr, "ERROR: at most %d fast path maps can be added\n",
+				FASTPATH_MAX_MAPS);
+		return -1;
+	}
+
+	map = bpf_object__find_map_by_name(obj, name);
+	if (!map || bpf_map__fd(map) < 0) {
+		fprintf(stderr, "ERROR: no '%s' map found\n", name);
+		return -1;
+	}
+
+	switch (bpf_map__type(map)) {
+	case BPF_MAP_TYPE_PERCPU_HASH:
+	case BPF_MAP_TYPE_PERCPU_ARRAY:
+	case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+		fprintf(stderr, "ERROR: per-CPU map '%s' can't be a fast path map\n",
+				name);
+		return -1;
+	default:
+		break;
+	}
+
+	fmap = &fastpath_maps[nfastpath_maps];
+	memset(fmap, 0, sizeof(*fmap));
+	fmap->fd = bpf_map__fd(map);
+	fmap->key_size = bpf_map__key_size(map);
+	fmap->value_size = bpf_map__value_size(map);
+	fmap->keys = malloc(FASTPATH_BATCH * fmap->key_size);
+	fmap->values = malloc(FASTPATH_BATCH * fmap->value_size);
+	if (!fmap->keys || !fmap->values) {
+		fprintf(stderr, "ERROR: unable to allocate fast path map\n");
+		free(fmap->keys);
+		free(fmap->values);
+		return -1;
+	}
+
+	/* Slots fit the largest entry, aligned to 8 bytes */
+	slot_size = (FASTPATH_SLOT_HDR + fmap->key_size + fmap->value_size + 7)
+			& ~7U;
+	if (slot_size > fastpath_slot_size)
+		fastpath_slot_size = slot_size;
+
+	return nfastpath_maps++;
+}
+
+int xsknf_get_fastpath_stats(struct xsknf_fastpath_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!nfastpath_maps)
+		return -1;
+
+	stats->queued = fastpath_queued;
+	stats->full = fastpath_full;
+	for (unsigned i = 0; i < nfastpath_rings; i++) {
+		stats->queued += fastpath_rings[i].queued;
+		stats->full += fastpath_rings[i].full;
+	}
+	stats->installed = fastpath_installed;
+	stats->errors = fastpath_errors;
+	stats->syscalls = fastpath_syscalls;
+
+	return 0;
+}
+
+unsigned xsknf_num_stages()
+{
+	return nstages;
+}
+
+const char *xsknf_stage_name(unsigned stage_idx)
+{
+	if (stage_idx >= nstages)
+		return NULL;
+
+	return stages[stage_idx].name;
+}
+
+int xsknf_get_stage_stats(unsigned worker_idx, unsigned stage_idx,
+		struct xsknf_stage_stats *stats)
+{
+	struct worker *worker;
+	struct xsknf_stage_stats *proc_stats;
+
+	if (worker_idx >= conf.workers || stage_idx >= nstages)
+		return -1;
+
+	worker = &workers[worker_idx];
+	memcpy(stats, &worker->stage_stats[stage_idx],
+			sizeof(struct xsknf_stage_stats));
+
+	/* In pipelined mode stages run in the processing threads of the worker */
+	for (int i = 0; i < conf.pipeline; i++) {
+		proc_stats = &worker->procs[i].stage_stats[stage_idx];
+		stats->npkts += proc_stats->npkts;
+		stats->ndropped += proc_stats->ndropped;
+		stats->cycles += proc_stats->cycles;
+	}
+
+	return 0;
+}
+
+int xsknf_get_hist(unsigned worker_idx, enum xsknf_hist_type type,
+		struct xsknf_hist *hist)
+{
+	struct xsknf_hist_block *blocks;
+	struct xsknf_hist *src;
+
+	if (!conf.histograms || worker_idx >= conf.workers
+			|| type >= XSKNF_NUM_HISTS)
+		return -1;
+
+	/* The I/O thread of the worker and then its processing threads */
+	blocks = &xsknf_stats_hists(stats_shm)[worker_idx * (1 + conf.pipeline)];
+	memset(hist, 0, sizeof(struct xsknf_hist));
+	for (int i = 0; i <= conf.pipeline; i++) {
+		src = &blocks[i].hists[type];
+		hist->count += src->count;
+		hist->sum += src->sum;
+		if (src->max > hist->max)
+			hist->max = src->max;
+		for (int j = 0; j < XSKNF_HIST_BUCKETS; j++)
+			hist->buckets[j] += src->buckets[j];
+	}
+
+	return 0;
+}
+
+uint64_t xsknf_tsc_hz()
+{
+	return stats_shm ? stats_shm->tsc_hz : 0;
+}
+
+int xsknf_get_bench_stats(unsigned worker_idx,
+		struct xsknf_bench_stats *stats)
+{
+	if (!conf.bench.enabled || worker_idx >= conf.workers)
+		return -1;
 
-	memcpy(stats, &workers[worker_idx].xsks[iface_idx].stats,
-			sizeof(struct xsknf_socket_stats));
+	memcpy(stats, &workers[worker_idx].bench_stats,
+			sizeof(struct xsknf_bench_stats));
 
 	return 0;
-}
\ No newline at end of file
+}
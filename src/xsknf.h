@@ -10,18 +10,150 @@ extern "C" {
 
 #define XSKNF_MAX_INTERFACES 32
 #define XSKNF_MAX_WORKERS 32
+/* Max queues per interface, also used to build the keys of the xsks map */
+#define XSKNF_MAX_QUEUES 64
+#define XSKNF_MAX_SOCKETS 256
+#define XSKNF_MAX_STAGES 8
+
+/* Special values of numa_node */
+#define XSKNF_NUMA_OFF -1	/* no NUMA-aware placement */
+#define XSKNF_NUMA_AUTO -2	/* use the node of the first interface */
 
 /* Application working modes */
 #define MODE_AF_XDP 0x1
 #define MODE_XDP 0x2
 #define MODE_COMBINED (MODE_AF_XDP | MODE_XDP)
 
-/* 
+/*
+ * RX metadata stored by xsknf_redirect() (see xsknf_kern.h) right before the
+ * packet data when rx_metadata is set in the config, obtained through
+ * xsknf_get_rx_meta(). flags tells which fields have been provided by the NIC.
+ * Must match the definition in xsknf_kern.h
+ */
+#define XSKNF_META_HASH 0x1
+#define XSKNF_META_TIMESTAMP 0x2
+#define XSKNF_META_VLAN 0x4
+
+struct xsknf_rx_meta {
+	uint64_t timestamp;	/* ns */
+	uint32_t hash;	/* RSS hash */
+	uint32_t hash_type;	/* enum xdp_rss_hash_type */
+	uint16_t vlan_proto;	/* network byte order */
+	uint16_t vlan_tci;
+	uint32_t flags;
+};
+
+static inline struct xsknf_rx_meta *xsknf_get_rx_meta(void *pkt)
+{
+	return (struct xsknf_rx_meta *)pkt - 1;
+}
+
+/*
  * Custom packet processing function defined by the user.
  * Returns the ifindex toward which redirect the packet or -1 to drop it
  */
 int xsknf_packet_processor(void *pkt, unsigned len, unsigned ingress_ifindex);
 
+struct xsknf_packet {
+	void *data;
+	unsigned len;
+};
+
+/*
+ * Optional batch processing function defined by the user.
+ * Receives all the packets of an rx batch and must store in verdicts[i] the
+ * ifindex toward which redirect pkts[i] or -1 to drop it.
+ * If defined it is used in place of xsknf_packet_processor(), that can be left
+ * undefined.
+ */
+void xsknf_batch_processor(struct xsknf_packet *pkts, int *verdicts,
+		unsigned npkts, unsigned ingress_ifindex);
+
+/*
+ * TX checksum offload, available when tx_metadata is set in the config and the
+ * NIC supports it. Asks the NIC to compute the L4 checksum of pkt, that starts
+ * csum_start bytes after the beginning of the packet and is stored csum_offset
+ * bytes after csum_start. The checksum field must hold the checksum of the
+ * pseudo-header.
+ * The request is stored in the headroom of the packet, hence it overwrites the
+ * RX metadata. Returns XSKNF_TX_METADATA, to be set in the verdict of the
+ * packet, or 0 if TX metadata is not enabled and the checksum must be computed
+ * in software
+ */
+#define XSKNF_TX_METADATA (1 << 30)
+
+int xsknf_tx_csum_offload(void *pkt, uint16_t csum_start,
+		uint16_t csum_offset);
+
+/*
+ * Processing stages, an alternative to the functions above to compose an NF as
+ * an ordered chain of batch processors running on the same worker.
+ * Stages are registered with xsknf_register_stage() before xsknf_init() and
+ * run in registration order. Every stage receives the packets of the batch
+ * together with the verdicts of the previous stage (the first one finds the
+ * ingress interface index in every verdict) and can change them with the same
+ * semantics of xsknf_batch_processor(). Packets dropped by a stage are removed
+ * from the batch before it is passed to the next one.
+ * If at least one stage is registered the processing functions above are not
+ * used. Returns the index of the stage or -1 if too many stages are registered.
+ */
+typedef void (*xsknf_stage_fn)(struct xsknf_packet *pkts, int *verdicts,
+		unsigned npkts, unsigned ingress_ifindex);
+
+int xsknf_register_stage(const char *name, xsknf_stage_fn fn);
+
+/*
+ * Per-worker frame pool, enabled by setting frame_pool in the config.
+ * These functions can only be called by the processing functions.
+ * xsknf_alloc_packet() gets an empty frame (len is set to 0) where the NF can
+ * build a new packet, xsknf_clone_packet() gets a frame holding a copy of pkt.
+ * Both return 0 on success or -1 if the pool is empty.
+ * xsknf_send_packet() transmits a frame of the pool on the interface with the
+ * given index (same indexes of the verdicts). The frame goes back to the pool
+ * when the transmission completes. Returns 0 on success or -1 if the tx ring
+ * is full, in that case the frame is still owned by the NF.
+ * Frames that are not sent must be returned through xsknf_free_packet().
+ */
+int xsknf_alloc_packet(struct xsknf_packet *pkt);
+int xsknf_clone_packet(struct xsknf_packet *pkt, struct xsknf_packet *clone);
+int xsknf_send_packet(struct xsknf_packet *pkt, unsigned ifindex);
+void xsknf_free_packet(struct xsknf_packet *pkt);
+
+/* Assignment of an rx queue of an interface to a worker */
+struct xsknf_queue {
+	unsigned worker;
+	unsigned iface;
+	unsigned queue;
+};
+
+/*
+ * Benchmark mode, AF_XDP only. Interfaces are not opened and no eBPF program is
+ * loaded: every worker writes synthetic packets in a private (loopback) UMEM
+ * and runs the processing functions on them, as if they were received by its
+ * sockets. Flow i has addresses src + i and dst + i (modulo the size of their
+ * prefixes) and ports sport_min + i and dport_min + i (modulo their ranges),
+ * packets pick their flow with a Zipf distribution. Flows are spread on the
+ * workers as by RSS, flow i going to worker i % workers
+ */
+struct xsknf_bench_config {
+	int enabled;
+	unsigned long npkts;	/* packets per worker, 0 = until stopped */
+	unsigned flows;
+	double zipf;	/* exponent of the popularity of the flows, 0 = uniform */
+	unsigned pkt_size;
+	uint8_t proto;	/* IPPROTO_UDP or IPPROTO_TCP */
+	uint32_t saddr;	/* network byte order */
+	uint32_t daddr;
+	uint8_t saddr_len;
+	uint8_t daddr_len;
+	uint16_t sport_min;	/* inclusive ranges, host byte order */
+	uint16_t sport_max;
+	uint16_t dport_min;
+	uint16_t dport_max;
+	unsigned trace_size;	/* packets generated in advance for every worker */
+	unsigned seed;
+};
+
 struct xsknf_config {
 	char *interfaces[XSKNF_MAX_INTERFACES];
 	uint32_t bind_flags[XSKNF_MAX_INTERFACES];
@@ -34,9 +166,56 @@ struct xsknf_config {
 	int unaligned_chunks;
 	int xsk_frame_size;
 	int busy_poll;
+	/*
+	 * If not 0, workers block in poll() after this number of consecutive
+	 * loops without received packets, and go back to polling the rings on
+	 * the first packet
+	 */
+	unsigned adaptive_poll;
+	int epoll;	/* wait with epoll instead of poll */
+	/*
+	 * If not 0, every worker only does rx and tx and hands the received
+	 * batches to this number of dedicated processing threads
+	 */
+	unsigned pipeline;
+	/*
+	 * If not 0, software flow steering moves new flows of a worker to the
+	 * least loaded one when more than steer_threshold% of its rx batches are
+	 * full. Flows stay on their worker until idle for steer_idle_ms
+	 */
+	unsigned steer_threshold;
+	unsigned steer_idle_ms;
+	/*
+	 * If not 0, workers stage up to tx_coalesce packets per tx socket across
+	 * rx batches, for at most tx_coalesce_us, before moving them to the tx
+	 * ring with a single wakeup. Packets that don't fit in a full ring are
+	 * dropped
+	 */
+	unsigned tx_coalesce;
+	unsigned tx_coalesce_us;
+	int rx_metadata;	/* XDP or COMBINED mode only */
+	int no_xdp_stats;	/* see xsknf_xdp_stats in xsknf_kern.h */
+	int tx_metadata;
+	unsigned prefetch_distance;
+	int prefetch_headroom;
+	int frame_pool;
+	uint32_t rx_size;
+	uint32_t tx_size;
+	uint32_t fill_size;
+	uint32_t comp_size;
+	uint32_t frames_per_socket;
+	unsigned long hugepage_size;	/* 0 = no hugepages, 1 = system default */
+	int numa_node;
+	int numa_strict;	/* only use CPUs of numa_node */
+	/* If num_queues is 0 worker N serves queue N of every interface */
+	struct xsknf_queue queues[XSKNF_MAX_SOCKETS];
+	unsigned num_queues;
 	char ebpf_filename[256];
 	char xdp_progname[256];
 	char tc_progname[256];
+	char stats_shm[256];	/* name of the stats shared memory, if any */
+	int histograms;	/* record the latency histograms (see xsknf_get_hist()) */
+	struct xsknf_bench_config bench;
 };
 
 struct xsknf_socket_stats {
@@ -56,16 +235,262 @@ struct xsknf_socket_stats {
 	unsigned long tx_wakeup_sendtos;
 	unsigned long tx_trigger_sendtos;
 	unsigned long opt_polls;
+	unsigned long idle_polls;
+	unsigned long steered_npkts;	/* processed by another worker */
+	unsigned long tx_backpressure_npkts;	/* dropped by tx_coalesce */
 };
 
+/*
+ * Stats shared memory. Workers keep the counters of their sockets in private
+ * memory and publish a snapshot of them every XSKNF_STATS_PUBLISH_MS (and
+ * before blocking in poll) in the block of the socket, protected by a
+ * sequence counter. xsknf_get_socket_stats() reads these blocks, and when
+ * stats_shm is set in the config the segment is also available to other
+ * processes as /dev/shm/<stats_shm> (see tools/xsknf-stat.c). The segment
+ * starts with a header followed by its blocks
+ */
+#define XSKNF_STATS_MAGIC 0x54534b58	/* "XKST" */
+#define XSKNF_STATS_VERSION 3
+#define XSKNF_STATS_PUBLISH_MS 10
+#define XSKNF_STATS_IFNAMSIZ 16
+
+struct xsknf_stats_header {
+	uint32_t magic;	/* written last, once the header is complete */
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t block_size;
+	uint32_t nblocks;
+	uint32_t num_interfaces;
+	int32_t pid;
+	uint32_t workers;
+	/* Histogram blocks after the socket ones, 0 if histograms are disabled */
+	uint32_t nhists;
+	uint32_t hist_size;
+	uint64_t tsc_hz;	/* cycles per second of the histograms of times */
+	char interfaces[XSKNF_MAX_INTERFACES][XSKNF_STATS_IFNAMSIZ];
+} __attribute__((aligned(64)));
+
+struct xsknf_stats_block {
+	uint32_t seq;	/* odd while the block is being written */
+	uint32_t worker;
+	uint32_t iface;
+	uint32_t queue;
+	uint64_t timestamp_ns;	/* CLOCK_MONOTONIC time of the snapshot */
+	struct xsknf_socket_stats stats;
+} __attribute__((aligned(64)));
+
+static inline struct xsknf_stats_block *xsknf_stats_blocks(
+		struct xsknf_stats_header *hdr)
+{
+	return (struct xsknf_stats_block *)((char *)hdr + hdr->header_size);
+}
+
+/* Copies a consistent snapshot of a block, retrying while it is written */
+static inline void xsknf_read_stats_block(
+		const struct xsknf_stats_block *block, struct xsknf_stats_block *snap)
+{
+	uint32_t seq;
+
+	do {
+		while ((seq = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		__builtin_memcpy(snap, block, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&block->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/*
+ * Latency histograms, recorded when histograms is set in the config. Buckets
+ * are log-linear like the ones of HdrHistogram: values below
+ * 2^XSKNF_HIST_SUB_BITS have their own bucket, every following power of two is
+ * split in 2^(XSKNF_HIST_SUB_BITS - 1) buckets, so the error of a value is
+ * below 1/2^(XSKNF_HIST_SUB_BITS - 1) (~3%). Values above 2^XSKNF_HIST_MAX_BITS
+ * end up in the last bucket.
+ * Every thread (the I/O one of a worker and its processing threads in
+ * pipelined mode) records in its own block of the stats shared memory, blocks
+ * are updated in place without sequence counters: a reader can see a sample
+ * counted in a bucket and not yet in count, which is negligible for
+ * percentiles
+ */
+#define XSKNF_HIST_SUB_BITS 6
+#define XSKNF_HIST_MAX_BITS 40
+#define XSKNF_HIST_BUCKETS ((1 << XSKNF_HIST_SUB_BITS) + (XSKNF_HIST_MAX_BITS \
+		- XSKNF_HIST_SUB_BITS) * (1 << (XSKNF_HIST_SUB_BITS - 1)))
+
+enum xsknf_hist_type {
+	/*
+	 * rx to tx time of the packets, from their collection from the rx ring
+	 * to the submission of the batch to the tx (or fill) ring, in cycles
+	 */
+	XSKNF_HIST_LATENCY,
+	/* Duration of the calls of the processing functions, in cycles */
+	XSKNF_HIST_PROCESS,
+	/* Packets of the non-empty rx batches */
+	XSKNF_HIST_BATCH,
+	XSKNF_NUM_HISTS
+};
+
+struct xsknf_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[XSKNF_HIST_BUCKETS];
+};
+
+struct xsknf_hist_block {
+	uint32_t worker;
+	uint32_t thread;	/* 0 = I/O thread, n = processing thread n - 1 */
+	struct xsknf_hist hists[XSKNF_NUM_HISTS];
+} __attribute__((aligned(64)));
+
+static inline struct xsknf_hist_block *xsknf_stats_hists(
+		struct xsknf_stats_header *hdr)
+{
+	return (struct xsknf_hist_block *)((char *)xsknf_stats_blocks(hdr)
+			+ hdr->nblocks * hdr->block_size);
+}
+
+static inline unsigned xsknf_hist_bucket(uint64_t val)
+{
+	unsigned shift;
+
+	if (val < (1 << XSKNF_HIST_SUB_BITS))
+		return val;
+	if (val >> XSKNF_HIST_MAX_BITS)
+		return XSKNF_HIST_BUCKETS - 1;
+
+	/* The top XSKNF_HIST_SUB_BITS bits of val select the bucket */
+	shift = 63 - __builtin_clzll(val) - (XSKNF_HIST_SUB_BITS - 1);
+
+	return (1 << XSKNF_HIST_SUB_BITS)
+			+ (shift - 1) * (1 << (XSKNF_HIST_SUB_BITS - 1))
+			+ (val >> shift) - (1 << (XSKNF_HIST_SUB_BITS - 1));
+}
+
+/* Highest value counted in a bucket */
+static inline uint64_t xsknf_hist_value(unsigned bucket)
+{
+	unsigned off, shift;
+
+	if (bucket < (1 << XSKNF_HIST_SUB_BITS))
+		return bucket;
+
+	off = bucket - (1 << XSKNF_HIST_SUB_BITS);
+	shift = off / (1 << (XSKNF_HIST_SUB_BITS - 1)) + 1;
+
+	return ((uint64_t)(off % (1 << (XSKNF_HIST_SUB_BITS - 1))
+			+ (1 << (XSKNF_HIST_SUB_BITS - 1)) + 1) << shift) - 1;
+}
+
+/* Value below which are p% of the samples, 0 < p <= 100 */
+static inline uint64_t xsknf_hist_percentile(const struct xsknf_hist *hist,
+		double p)
+{
+	uint64_t target = hist->count * p / 100, seen = 0, val;
+
+	if (!hist->count)
+		return 0;
+	if (target == 0 || target < hist->count * p / 100)
+		target++;
+
+	for (unsigned i = 0; i < XSKNF_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target) {
+			val = xsknf_hist_value(i);
+			return val < hist->max ? val : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+/* Per-worker stats of a processing stage */
+struct xsknf_stage_stats {
+	unsigned long npkts;	/* packets received by the stage */
+	unsigned long ndropped;	/* packets dropped by the stage */
+	/* Time spent in the stage, in TSC cycles where available, ns otherwise */
+	unsigned long cycles;
+};
 
 int xsknf_parse_args(int argc, char **argv, struct xsknf_config *config);
 int xsknf_init(struct xsknf_config *config, struct bpf_object **bpf_obj);
 int xsknf_cleanup();
 int xsknf_start_workers();
 int xsknf_stop_workers();
+/*
+ * Parks a running worker to save its CPU when the load is low: its thread
+ * completes the transmissions in flight and sleeps, and its sockets are
+ * served by the thread of worker target_idx until xsknf_unpark_worker().
+ * Sockets, UMEMs and queues don't change, nothing is reconfigured on the NIC
+ * and the stats of the sockets stay with the parked worker. A worker serving
+ * parked workers can't be parked. Only in AF_XDP mode, without pipelining,
+ * steering and benchmark. Return 0 on success, -1 on error
+ */
+int xsknf_park_worker(unsigned worker_idx, unsigned target_idx);
+int xsknf_unpark_worker(unsigned worker_idx);
+/* Index of the worker whose thread serves the sockets of worker_idx */
+int xsknf_worker_server(unsigned worker_idx);
 int xsknf_get_socket_stats(unsigned worker_idx, unsigned iface_idx,
 		struct xsknf_socket_stats *stats);
+unsigned xsknf_num_stages();
+const char *xsknf_stage_name(unsigned stage_idx);
+int xsknf_get_stage_stats(unsigned worker_idx, unsigned stage_idx,
+		struct xsknf_stage_stats *stats);
+/*
+ * Sums the histograms of type of all the threads of a worker, returns -1 if
+ * histograms are disabled
+ */
+int xsknf_get_hist(unsigned worker_idx, enum xsknf_hist_type type,
+		struct xsknf_hist *hist);
+/* Cycles per second of the times in the histograms */
+uint64_t xsknf_tsc_hz();
+
+/*
+ * Fast path cache of COMBINED mode: the processing functions (the slow path)
+ * decide what to do with a new flow and install the decision in an eBPF map
+ * read by the XDP program (the fast path), so that the following packets of
+ * the flow don't reach user space. Entries are queued by the calling thread,
+ * with no syscalls, and written in the maps in batches by a thread of the
+ * library.
+ * xsknf_fastpath_map() takes a map of the eBPF object by name, after
+ * xsknf_init() and before xsknf_start_workers(). Returns the id of the map
+ * or -1 on error
+ */
+int xsknf_fastpath_map(const char *name);
+/*
+ * Queues the update of key in the map, from the processing functions.
+ * Returns -1 if the queue of the thread is full, the caller will install the
+ * flow again with one of its next packets
+ */
+int xsknf_fastpath_install(int map_id, const void *key, const void *value);
+
+struct xsknf_fastpath_stats {
+	unsigned long queued;
+	unsigned long full;	/* not queued, the queue was full */
+	unsigned long installed;
+	unsigned long errors;	/* rejected by the map, e.g. when full */
+	unsigned long syscalls;
+};
+
+int xsknf_get_fastpath_stats(struct xsknf_fastpath_stats *stats);
+
+/* Per-worker results of the benchmark mode */
+struct xsknf_bench_stats {
+	unsigned long npkts;
+	unsigned long ntx;	/* packets not dropped */
+	unsigned long cycles;	/* spent in the processing functions */
+	/* Hardware counters of the processing functions, -1 if not available */
+	long instructions;
+	long l1d_misses;
+	long llc_misses;
+};
+
+/*
+ * Returns -1 if not in benchmark mode. When all the workers are done with
+ * their npkts packets the library sends SIGINT to the process
+ */
+int xsknf_get_bench_stats(unsigned worker_idx,
+		struct xsknf_bench_stats *stats);
 
 #ifdef __cplusplus
 }  /* extern "C" */
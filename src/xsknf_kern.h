@@ -0,0 +1,184 @@
+#ifndef __XSKNF_XSKNF_KERN_H
+#define __XSKNF_XSKNF_KERN_H
+
+/*
+ * Definitions shared by the eBPF programs of the applications, to be included
+ * after bpf_helpers.h
+ */
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+/* Must match the definitions in xsknf.h */
+#define XSKNF_MAX_INTERFACES 32
+#define XSKNF_MAX_QUEUES 64
+
+/*
+ * AF_XDP sockets of all the interfaces, the socket of queue q of interface i
+ * (index in the order of the command line) has key i * XSKNF_MAX_QUEUES + q
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_XSKMAP);
+	__uint(key_size, sizeof(int));
+	__uint(value_size, sizeof(int));
+	__uint(max_entries, XSKNF_MAX_INTERFACES * XSKNF_MAX_QUEUES);
+} xsks SEC(".maps");
+
+/* Maps the ifindex of every interface to its index, filled by the library */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, int);
+	__type(value, int);
+	__uint(max_entries, XSKNF_MAX_INTERFACES);
+} xsknf_ifaces SEC(".maps");
+
+/*
+ * Set by the library when rx_metadata is enabled, xsknf_redirect() then stores
+ * the RX hints of the NIC before the packet (see struct xsknf_rx_meta in
+ * xsknf.h). Being constant the check is removed by the verifier
+ */
+const volatile int xsknf_rx_metadata = 0;
+
+#define XSKNF_META_HASH 0x1
+#define XSKNF_META_TIMESTAMP 0x2
+#define XSKNF_META_VLAN 0x4
+
+struct xsknf_rx_meta {
+	__u64 timestamp;
+	__u32 hash;
+	__u32 hash_type;
+	__u16 vlan_proto;
+	__u16 vlan_tci;
+	__u32 flags;
+};
+
+enum xdp_rss_hash_type;
+
+extern int bpf_xdp_metadata_rx_hash(const struct xdp_md *ctx, __u32 *hash,
+		enum xdp_rss_hash_type *rss_type) __ksym __weak;
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
+		__u64 *timestamp) __ksym __weak;
+extern int bpf_xdp_metadata_rx_vlan_tag(const struct xdp_md *ctx,
+		__be16 *vlan_proto, __u16 *vlan_tci) __ksym __weak;
+
+/*
+ * Stores the RX metadata in front of the packet, fields not supported by the
+ * kernel or by the NIC are left out of flags. Returns 0 on success
+ */
+static __always_inline int xsknf_store_rx_meta(struct xdp_md *ctx)
+{
+	struct xsknf_rx_meta *meta;
+	void *data;
+
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(struct xsknf_rx_meta)))
+		return -1;
+
+	data = (void *)(long)ctx->data;
+	meta = (void *)(long)ctx->data_meta;
+	if ((void *)(meta + 1) > data)
+		return -1;
+
+	meta->flags = 0;
+
+	if (bpf_ksym_exists(bpf_xdp_metadata_rx_hash)
+			&& !bpf_xdp_metadata_rx_hash(ctx, &meta->hash,
+			(enum xdp_rss_hash_type *)&meta->hash_type))
+		meta->flags |= XSKNF_META_HASH;
+
+	if (bpf_ksym_exists(bpf_xdp_metadata_rx_timestamp)
+			&& !bpf_xdp_metadata_rx_timestamp(ctx, &meta->timestamp))
+		meta->flags |= XSKNF_META_TIMESTAMP;
+
+	if (bpf_ksym_exists(bpf_xdp_metadata_rx_vlan_tag)
+			&& !bpf_xdp_metadata_rx_vlan_tag(ctx, &meta->vlan_proto,
+			&meta->vlan_tci))
+		meta->flags |= XSKNF_META_VLAN;
+
+	return 0;
+}
+
+/*
+ * RSS hash of the packet, the same stored in the RX metadata, for programs
+ * that must agree with user space on it. Returns 0 on success, the kfunc
+ * needs a program bound to the device, i.e. rx_metadata
+ */
+static __always_inline int xsknf_rx_hash(struct xdp_md *ctx, __u32 *hash)
+{
+	__u32 type;
+
+	if (!xsknf_rx_metadata || !bpf_ksym_exists(bpf_xdp_metadata_rx_hash))
+		return -1;
+
+	return bpf_xdp_metadata_rx_hash(ctx, hash,
+			(enum xdp_rss_hash_type *)&type) ? -1 : 0;
+}
+
+/* Key of the socket bound to the ingress queue of the packet */
+static __always_inline int xsknf_xsk_key(struct xdp_md *ctx)
+{
+	int ifindex = ctx->ingress_ifindex;
+	int *iface = bpf_map_lookup_elem(&xsknf_ifaces, &ifindex);
+
+	if (!iface)
+		return -1;
+
+	return *iface * XSKNF_MAX_QUEUES + ctx->rx_queue_index;
+}
+
+/*
+ * Redirects the packet to the socket of its ingress queue, action is returned
+ * if there is no socket (or no space for the RX metadata)
+ */
+static __always_inline int xsknf_redirect(struct xdp_md *ctx, __u64 action)
+{
+	if (xsknf_rx_metadata && xsknf_store_rx_meta(ctx))
+		return action;
+
+	return bpf_redirect_map(&xsks, xsknf_xsk_key(ctx), action);
+}
+
+/*
+ * Set to 0 by the library with --no-xdp-stats, the programs skip their packet
+ * counters when it is cleared. Being constant the check is removed by the
+ * verifier
+ */
+const volatile int xsknf_xdp_stats = 1;
+
+/* Must match struct bootstrap_data in xsknf.c */
+struct xsknf_bootstrap {
+	__u32 pending;
+	__u8 sockets[XSKNF_MAX_INTERFACES * XSKNF_MAX_QUEUES];
+};
+
+/*
+ * Sockets (by xsks key) that still need a packet to learn the NAPI context to
+ * busy poll, set by the library in COMBINED mode with busy polling. In its own
+ * section since the library writes it whole
+ */
+struct xsknf_bootstrap xsknf_bootstrap SEC(".data.xsknf") = {0};
+
+/*
+ * Returns 1 if the packet must be redirected with xsknf_redirect() to start
+ * busy polling on the socket of its queue, whatever the program would do with
+ * it. It happens once per socket, afterwards the cost is a load from global
+ * data. A queue is handled by one CPU at a time, no need for atomic swaps
+ */
+static __always_inline int xsknf_bootstrapping(struct xdp_md *ctx)
+{
+	int key;
+
+	if (!*(volatile __u32 *)&xsknf_bootstrap.pending)
+		return 0;
+
+	key = xsknf_xsk_key(ctx);
+	if (key < 0 || key >= XSKNF_MAX_INTERFACES * XSKNF_MAX_QUEUES
+			|| !xsknf_bootstrap.sockets[key])
+		return 0;
+
+	xsknf_bootstrap.sockets[key] = 0;
+	__sync_fetch_and_add(&xsknf_bootstrap.pending, -1);
+
+	return 1;
+}
+
+#endif  /* __XSKNF_XSKNF_KERN_H */
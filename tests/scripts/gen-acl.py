@@ -1,17 +1,41 @@
 #!/usr/bin/python3
 
 import argparse
+import socket
+import struct
 
 parser = argparse.ArgumentParser()
 parser.add_argument('rules', help='Number of rules (different src ip address) to generate',
                     type=int)
+parser.add_argument('--binary', action='store_true',
+                    help='Write acl.bin, loaded by the firewall without parsing (see firewall.h)')
 args = parser.parse_args()
 
-with open('acl.txt', 'w') as acl:
-  acl.write(f'{args.rules}\n')
+ACL_BIN_MAGIC = 0x4c434158
 
-  for i in range(args.rules):
-    first = i & 0xff
-    second = i >> 8 & 0xff
-    third = i >> 16 & 0xff
-    acl.write(f'11.{third}.{second}.{first} 172.0.0.1 5000 80 UDP DROP\n')
\ No newline at end of file
+def rule_addrs(i):
+  first = i & 0xff
+  second = i >> 8 & 0xff
+  third = i >> 16 & 0xff
+  return f'11.{third}.{second}.{first}', '172.0.0.1'
+
+if args.binary:
+  with open('acl.bin', 'wb') as acl:
+    acl.write(struct.pack('<II', ACL_BIN_MAGIC, args.rules))
+
+    # struct session_id, addresses and ports in network byte order
+    for i in range(args.rules):
+      saddr, daddr = rule_addrs(i)
+      acl.write(socket.inet_aton(saddr) + socket.inet_aton(daddr)
+                + struct.pack('!HHB', 5000, 80, socket.IPPROTO_UDP))
+
+    # Actions start at the first multiple of 8 bytes
+    acl.write(b'\0' * (-acl.tell() % 8))
+    acl.write(struct.pack(f'<{args.rules}i', *([-1] * args.rules)))
+else:
+  with open('acl.txt', 'w') as acl:
+    acl.write(f'{args.rules}\n')
+
+    for i in range(args.rules):
+      saddr, daddr = rule_addrs(i)
+      acl.write(f'{saddr} {daddr} 5000 80 UDP DROP\n')
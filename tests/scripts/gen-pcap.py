@@ -0,0 +1,86 @@
+#!/usr/bin/python3
+
+# Writes trace.pcap, UDP traffic with flows continuously ending and starting to
+# replay through the NFs with tools/xsknf-replay. Flows go from 10.0.0.0/8 to
+# the first service of gen-services.py (172.0.0.1:80)
+
+import argparse
+import struct
+
+parser = argparse.ArgumentParser()
+parser.add_argument('flows', help='Number of flows to generate', type=int)
+parser.add_argument('pkts', help='Number of packets of every flow', type=int)
+parser.add_argument('--active', help='Flows active at the same time, a new one starts as soon as one ends (default 1000)',
+                    type=int, default=1000)
+parser.add_argument('--rate', help='Packets per second (default 1000000)',
+                    type=float, default=1000000)
+parser.add_argument('--size', help='Size of the packets without FCS (default 64)',
+                    type=int, default=64)
+args = parser.parse_args()
+
+PCAP_MAGIC_NS = 0xa1b23c4d
+HDR_SIZE = 14 + 20 + 8
+
+if args.flows <= 0 or args.pkts <= 0 or args.active <= 0 or args.rate <= 0:
+  print("Flows, packets, active flows and rate must be > 0")
+  exit(1)
+
+if args.size < HDR_SIZE or args.size > 1514:
+  print(f'Size must be in [{HDR_SIZE}, 1514]')
+  exit(1)
+
+def csum(data):
+  if len(data) % 2:
+    data += b'\0'
+  s = sum(struct.unpack(f'!{len(data) // 2}H', data))
+  while s >> 16:
+    s = (s & 0xffff) + (s >> 16)
+  return ~s & 0xffff
+
+def packet(flow):
+  saddr = struct.pack('!I', 10 << 24 | flow >> 8 & 0xffffff)
+  daddr = bytes([172, 0, 0, 1])
+  sport = 5000 + (flow & 0xff)
+  payload = b'\0' * (args.size - HDR_SIZE)
+  udp_len = 8 + len(payload)
+
+  udp = struct.pack('!HHHH', sport, 80, udp_len, 0) + payload
+  pseudo = saddr + daddr + struct.pack('!BBH', 0, 17, udp_len)
+  udp = udp[:6] + struct.pack('!H', csum(pseudo + udp) or 0xffff) + udp[8:]
+
+  ip = struct.pack('!BBHHHBBH', 0x45, 0, 20 + udp_len, 0, 0, 64, 17, 0) \
+       + saddr + daddr
+  ip = ip[:10] + struct.pack('!H', csum(ip)) + ip[12:]
+
+  return bytes([0x0a, 0, 0, 0, 0, 2, 0x0a, 0, 0, 0, 0, 1]) + b'\x08\x00' \
+         + ip + udp
+
+with open('trace.pcap', 'wb') as trace:
+  trace.write(struct.pack('<IHHiIII', PCAP_MAGIC_NS, 2, 4, 0, 0, 65535, 1))
+
+  # Active flows are served round robin: [flow, packets left]
+  active = [[f, args.pkts] for f in range(min(args.active, args.flows))]
+  next_flow = len(active)
+  n = 0
+  i = 0
+
+  while active:
+    flow = active[i]
+    pkt = packet(flow[0])
+    ts = int(n * 1e9 / args.rate)
+    trace.write(struct.pack('<IIII', ts // 1000000000, ts % 1000000000,
+                            len(pkt), len(pkt)) + pkt)
+    n += 1
+
+    flow[1] -= 1
+    if not flow[1]:
+      if next_flow < args.flows:
+        active[i] = [next_flow, args.pkts]
+        next_flow += 1
+      else:
+        del active[i]
+        i -= 1
+
+    i = i + 1 if i + 1 < len(active) else 0
+
+print(f'Written {n} packets of {args.flows} flows')
@@ -1,31 +1,63 @@
 #!/usr/bin/python3
 
 import argparse
+import socket
+import struct
 
 parser = argparse.ArgumentParser()
 parser.add_argument('services', help='Number of distinct virtual services generate',
                     type=int)
 parser.add_argument('backends', help='Number of backends per service',
                     type=int)
+parser.add_argument('--binary', action='store_true',
+                    help='Write services.bin, loaded by the load balancer without parsing (see load_balancer.h)')
 args = parser.parse_args()
 
+SERVICES_BIN_MAGIC = 0x56525358
+
 tot_backends = args.services * args.backends
 
 if args.services <= 0 or args.backends <= 0:
   print("Services and backends number must be > 0")
   exit(1)
 
-with open('services.txt', 'w') as services:
-  services.write(f'{args.services} {tot_backends}\n')
-
-  for service in range(1, args.services + 1):
-    srv_first = service & 0xff
-    srv_second = service >> 8 & 0xff
-    srv_third = service >> 16 & 0xff
-
-    for backend in range(1, args.backends + 1):
-      bkd_first = backend & 0xff
-      bkd_second = backend >> 8 & 0xff
-      bkd_third = backend >> 16 & 0xff
-
-      services.write(f'172.{srv_third}.{srv_second}.{srv_first} 80 UDP 192.{bkd_third}.{bkd_second}.{bkd_first} 80 0a:00:00:00:00:01 ens1f0\n')
\ No newline at end of file
+def addr(prefix, n):
+  return f'{prefix}.{n >> 16 & 0xff}.{n >> 8 & 0xff}.{n & 0xff}'
+
+def align(f):
+  f.write(b'\0' * (-f.tell() % 8))
+
+if args.binary:
+  # struct service_id: vaddr, vport (network byte order), proto
+  def service_id(service):
+    return socket.inet_aton(addr(172, service)) + struct.pack('!HB', 80, socket.IPPROTO_UDP)
+
+  with open('services.bin', 'wb') as services:
+    services.write(struct.pack('<IIII', SERVICES_BIN_MAGIC, args.services, tot_backends, 0))
+
+    for service in range(1, args.services + 1):
+      services.write(service_id(service))
+    align(services)
+
+    # struct service_info: number of backends, Maglev table (assigned by the NF)
+    services.write(struct.pack('<II', args.backends, 0) * args.services)
+    align(services)
+
+    # struct backend_id: service_id, index
+    for service in range(1, args.services + 1):
+      for index in range(args.backends):
+        services.write(service_id(service) + struct.pack('<I', index))
+    align(services)
+
+    # struct backend_info: addr, port, mac, index of the interface of the NF
+    for service in range(1, args.services + 1):
+      for backend in range(1, args.backends + 1):
+        services.write(socket.inet_aton(addr(192, backend)) + struct.pack('!H', 80)
+                       + bytes([0x0a, 0, 0, 0, 0, 1]) + struct.pack('<H', 0))
+else:
+  with open('services.txt', 'w') as services:
+    services.write(f'{args.services} {tot_backends}\n')
+
+    for service in range(1, args.services + 1):
+      for backend in range(1, args.backends + 1):
+        services.write(f'{addr(172, service)} 80 UDP {addr(192, backend)} 80 0a:00:00:00:00:01 ens1f0\n')
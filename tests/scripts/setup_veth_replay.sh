@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Creates the veth pair used to replay pcaps through the NF with
+# tools/xsknf-replay: the NF runs on veth2b, xsknf-replay on veth2a. No
+# addresses are assigned so the kernel sends nothing on the pair and the
+# packets received by xsknf-replay are only the ones sent by the NF
+
+if  [ $# -lt 1 ]; then
+	queues=1
+else
+	queues=$1
+fi
+
+sudo ip link del veth2a
+
+sudo ip link add veth2a numrxqueues $queues numtxqueues $queues type veth \
+		peer veth2b numrxqueues $queues numtxqueues $queues
+sudo sysctl -q net.ipv6.conf.veth2a.disable_ipv6=1
+sudo sysctl -q net.ipv6.conf.veth2b.disable_ipv6=1
+sudo ip link set veth2a address 0a:00:00:00:00:01
+sudo ip link set veth2b address 0a:00:00:00:00:02
+sudo ip link set veth2a up
+sudo ip link set veth2b up
+
+# Needed, otherwise TCP/UDP checksums of the replayed packets are wrong
+sudo ethtool -K veth2a tx off txvlan off
+sudo ethtool -K veth2b tx off txvlan off
+# Packets sent by XDP on veth2b are only delivered to veth2a with NAPI enabled
+sudo ethtool -K veth2a gro on
+
+sudo ip link set veth2a promisc on
+sudo ip link set veth2b promisc on
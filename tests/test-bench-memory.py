@@ -0,0 +1,86 @@
+#!/usr/bin/python3
+
+# Measures the cycles per packet of test_memory as a function of the size of
+# the array, for several access patterns, with the benchmark mode of the
+# library (--bench), no tester needed. Every size is labeled with the level of
+# the cache hierarchy of the CPU running the test that can hold it, to size
+# the tables of the NFs on a given CPU.
+
+import os
+import subprocess
+
+curdir = os.path.dirname(__file__)
+
+IFNAME       = 'ens1f0'
+CPU          = 0
+APP_PATH     = f'{curdir}/../examples/test_memory/test_memory'
+RES_FILENAME = 'res-bench-memory.csv'
+RUNS         = 3
+PKTS         = 20000000  # Packets per run
+LINE_SIZE    = 64
+SIZES        = [2 ** i for i in range(6, 25)]  # Lines, 4 KiB to 1 GiB
+PATTERNS     = ['uniform', 'zipf:0.99', 'seq', 'chase']
+LINES        = [1, 4]
+WRITES       = ['none', 'shared']
+HUGEPAGES    = True
+
+def cache_levels(cpu):
+    # Data and unified caches of the CPU, (name, bytes) from the smallest
+    path = f'/sys/devices/system/cpu/cpu{cpu}/cache'
+    levels = []
+    for index in sorted(os.listdir(path)):
+        if not index.startswith('index'):
+            continue
+        read = lambda f: open(f'{path}/{index}/{f}').read().strip()
+        if read('type') == 'Instruction':
+            continue
+        size = read('size')
+        mult = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}.get(size[-1], 1)
+        levels.append((f'L{read("level")}', int(size.rstrip('KMG')) * mult))
+    levels.sort(key=lambda l: l[1])
+    levels[-1] = ('LLC', levels[-1][1])
+    return levels
+
+def level_of(levels, nbytes):
+    for name, size in levels:
+        if nbytes <= size:
+            return name
+    return 'DRAM'
+
+def run_bench(args):
+    cmd = ['taskset', '-c', str(CPU), 'sudo', APP_PATH, '-i', IFNAME,
+            f'--bench=pkts={PKTS},size=64', '--', '-q', '-c', 'DROP'] + args
+    if HUGEPAGES:
+        cmd.append('-H')
+    res = subprocess.run(cmd, check=True, capture_output=True,
+            text=True).stdout.splitlines()
+
+    # TOTAL line of the report: Mpps, cycles, instructions, L1D and LLC misses
+    # per packet and % of transmitted packets
+    start = [i for i, l in enumerate(res) if l.startswith(' BENCH')][-1]
+    total = [l for l in res[start:] if l.startswith(' TOTAL')][0]
+    return total.split()[1:]
+
+levels = cache_levels(CPU)
+print('Cache levels: ' + ', '.join(f'{n} {s >> 10} KiB' for n, s in levels))
+
+out = open(RES_FILENAME, 'w')
+out.write("run,pattern,lines,writes,size,bytes,level,throughput,cycles,instructions,l1d-misses,llc-misses,tx\n")
+
+for run in range(RUNS):
+    for pattern in PATTERNS:
+        for lines in LINES:
+            for writes in WRITES:
+                for size in SIZES:
+                    nbytes = size * LINE_SIZE
+                    level = level_of(levels, nbytes)
+                    print(f'Run {run}: measuring {pattern}, {lines} lines, '
+                            f'{writes} writes, {nbytes >> 10} KiB ({level})...')
+                    res = run_bench(['-s', str(size), '-p', pattern, '-l',
+                            str(lines), '-w', writes])
+                    print(f'Throughput {res[0]} Mpps, {res[1]} cycles/pkt')
+                    out.write(f'{run},{pattern},{lines},{writes},{size},'
+                            f'{nbytes},{level},{",".join(res)}\n')
+                    out.flush()
+
+out.close()
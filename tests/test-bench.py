@@ -0,0 +1,67 @@
+#!/usr/bin/python3
+
+# Benchmarks the NFs on synthetic traffic with the benchmark mode of the library
+# (--bench), no tester needed. Interfaces are only names in this mode, IFNAME
+# is the one used by the generated services.
+
+import os
+import subprocess
+
+curdir = os.path.dirname(__file__)
+
+IFNAME            = 'ens1f0'
+ACL_GEN_PATH      = f'{curdir}/scripts/gen-acl.py'
+SERVICES_GEN_PATH = f'{curdir}/scripts/gen-services.py'
+RES_FILENAME      = 'res-bench.csv'
+RUNS              = 3
+PKTS              = 20000000  # Packets per worker
+FLOWS             = [1, 1000, 100000, 1000000]
+ZIPF              = [0, 1.1]
+ACL_SIZES         = [1, 1000, 100000]
+BACKENDS          = [1, 10, 100]
+
+def run_bench(app, spec, args=[]):
+    cmd = ['taskset', '1', 'sudo', f'{curdir}/../examples/{app}/{app}', '-i',
+            IFNAME, f'--bench=pkts={PKTS},{spec}', '--', '-q'] + args
+    res = subprocess.run(cmd, check=True, capture_output=True,
+            text=True).stdout.splitlines()
+
+    # TOTAL line of the report: Mpps, cycles, instructions, L1D and LLC misses
+    # per packet and % of transmitted packets
+    start = [i for i, l in enumerate(res) if l.startswith(' BENCH')][-1]
+    total = [l for l in res[start:] if l.startswith(' TOTAL')][0]
+    return total.split()[1:]
+
+out = open(RES_FILENAME, 'w')
+out.write("run,app,param,flows,zipf,throughput,cycles,instructions,l1d-misses,llc-misses,tx\n")
+
+def measure(run, app, param, spec, args=[]):
+    for flows in FLOWS:
+        for zipf in ZIPF:
+            print(f'Run {run}: measuring {app} {param} with {flows} flows, zipf {zipf}...')
+            res = run_bench(app, f'{spec},flows={flows},zipf={zipf}', args)
+            print(f'Throughput {res[0]} Mpps, {res[1]} cycles/pkt')
+            out.write(f'{run},{app},{param},{flows},{zipf},{",".join(res)}\n')
+            out.flush()
+
+for run in range(RUNS):
+    measure(run, 'macswap', '', 'size=64')
+
+    for acl_size in ACL_SIZES:
+        cmd = [ACL_GEN_PATH, str(acl_size)]
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL,
+                stderr=subprocess.DEVNULL)
+
+        # Flows match the rules of the ACL (11.0.0.0/8 -> 172.0.0.1)
+        measure(run, 'firewall', acl_size, 'src=11.0.0.0/8')
+
+    for backends in BACKENDS:
+        cmd = [SERVICES_GEN_PATH, '1', str(backends)]
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL,
+                stderr=subprocess.DEVNULL)
+
+        # Flows go to the only service (172.0.0.1:80)
+        measure(run, 'load_balancer', backends, 'src=10.0.0.0/8',
+                ['-f', 'services.txt'])
+
+out.close()
@@ -0,0 +1,83 @@
+#!/usr/bin/python3
+
+# Replays traces with session churn through the load balancer running on a veth
+# pair (see scripts/setup_veth_replay.sh), measuring the rate at which the
+# packets come back to xsknf-replay. Every trace has the same number of packets
+# with flows of different length, the shorter the flows the more sessions are
+# created and evicted from the table of active sessions.
+
+import os
+import subprocess
+import time
+
+curdir = os.path.dirname(__file__)
+
+APP_NAME          = 'load_balancer'
+APP_PATH          = f'{curdir}/../examples/{APP_NAME}/{APP_NAME}'
+REPLAY_PATH       = f'{curdir}/../tools/xsknf-replay'
+PCAP_GEN_PATH     = f'{curdir}/scripts/gen-pcap.py'
+SERVICES_GEN_PATH = f'{curdir}/scripts/gen-services.py'
+NF_IFNAME         = 'veth2b'
+REPLAY_IFNAME     = 'veth2a'
+RES_FILENAME      = 'res-replay-lb.csv'
+RUNS              = 3
+PKTS              = 1000000
+FLOW_PKTS         = [1, 10, 100, 1000]  # Packets per flow
+ACTIVE_FLOWS      = 10000
+BACKENDS          = 10
+MODES             = ['xdp', 'af_xdp', 'af_xdp-poll']
+FLAGS             = {
+                     'xdp': ['-M', 'XDP'],
+                     'af_xdp': [],
+                     'af_xdp-poll': ['-p']
+                    }
+APP_START_TIME    = 2  # Seconds
+
+def replay():
+    cmd = ['sudo', REPLAY_PATH, '-i', REPLAY_IFNAME, '-m', 'trace.pcap']
+    res = subprocess.run(cmd, check=True, capture_output=True,
+            text=True).stdout.replace(',', '').splitlines()
+
+    sent = res[0].split()
+    received = [l for l in res if l.startswith('received')][0].split()
+    # Mpps, sent and received packets
+    return sent[8][1:], sent[1], received[1]
+
+# Backends are reached through the NF interface, the MAC is the one of veth2a
+cmd = [SERVICES_GEN_PATH, '1', str(BACKENDS)]
+subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL)
+cmd = ['sed', '-i', f's/ens1f0/{NF_IFNAME}/', 'services.txt']
+subprocess.run(cmd, check=True)
+
+out = open(RES_FILENAME, 'w')
+out.write("run,mode,flow-pkts,tx-rate,sent,received,loss\n")
+
+for run in range(RUNS):
+    for flow_pkts in FLOW_PKTS:
+        cmd = [PCAP_GEN_PATH, str(PKTS // flow_pkts), str(flow_pkts),
+                '--active', str(ACTIVE_FLOWS)]
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL,
+                stderr=subprocess.DEVNULL)
+
+        for mode in MODES:
+            print(f'Run {run}: measuring mode {mode} with {flow_pkts} packets per flow...')
+
+            cmd = ['taskset', '1', 'sudo', APP_PATH, '-i', NF_IFNAME] \
+                    + FLAGS[mode] + ['--', '-q', '-f', 'services.txt']
+            app = subprocess.Popen(cmd, stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL)
+            time.sleep(APP_START_TIME)
+
+            rate, sent, received = replay()
+            loss = (int(sent) - int(received)) / int(sent)
+            print(f'Sent {sent} at {rate} Mpps, received {received}, loss {(loss*100):.2f}%')
+
+            cmd = ['sudo', 'killall', APP_NAME]
+            subprocess.run(cmd, check=True)
+            app.wait()
+
+            out.write(f'{run},{mode},{flow_pkts},{rate},{sent},{received},{loss}\n')
+            out.flush()
+
+out.close()
@@ -0,0 +1,626 @@
+/*
+ * Replays a pcap through a network interface, normally the peer of a veth
+ * whose other end is served by the NF through AF_XDP (see
+ * tests/scripts/setup_veth_replay.sh), and collects the packets the NF sends
+ * back on the same interface. Packets are sent with the timing of the capture
+ * (optionally scaled) or as fast as possible, and the collected ones can be
+ * saved to a pcap and verified against the expected output of the NF.
+ * The pcap is mapped in memory and indexed before starting, packets are sent
+ * from the mapping with no parsing or copy on the send path.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <locale.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define BATCH_SIZE 64
+#define RX_FRAME_SIZE 65536
+/* Gaps shorter than this are waited spinning, longer ones sleeping */
+#define SPIN_NS 100000
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;	/* us or ns, depending on the magic */
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+/* Packet of a mapped pcap */
+struct record {
+	uint64_t ts_ns;	/* relative to the first packet */
+	const void *data;
+	uint32_t len;
+};
+
+struct trace {
+	void *map;
+	size_t size;
+	struct record *recs;
+	unsigned nrecs;
+	unsigned truncated;
+};
+
+static const char *opt_iface;
+static double opt_speed = 1;	/* 0 = max rate */
+static unsigned opt_loops = 1;
+static unsigned opt_wait_ms = 1000;
+static const char *opt_out_path;
+static const char *opt_expected_path;
+
+static volatile int done;
+static volatile int sending = 1;
+
+/* Collected by the rx thread */
+static unsigned long rx_npkts, rx_nbytes;
+static uint64_t *rx_hashes;
+static unsigned long rx_hashes_size;
+static FILE *out_file;
+
+static unsigned long get_nsecs(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* FNV-1a, enough to tell packets apart in the verification */
+static uint64_t packet_hash(const void *data, unsigned len)
+{
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (unsigned i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash ^ len;
+}
+
+static void read_trace(const char *path, struct trace *trace)
+{
+	struct pcap_file_hdr *hdr;
+	struct pcap_rec_hdr rec;
+	uint64_t first = 0, ts;
+	size_t off, size = 0;
+	int swapped, nsec;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "ERROR: unable to open %s: %s\n", path,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "ERROR: %s is not a pcap file\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	trace->size = st.st_size;
+	trace->map = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+			fd, 0);
+	if (trace->map == MAP_FAILED) {
+		fprintf(stderr, "ERROR: unable to map %s: %s\n", path,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	hdr = trace->map;
+	swapped = hdr->magic == __builtin_bswap32(PCAP_MAGIC_US)
+			|| hdr->magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	nsec = hdr->magic == PCAP_MAGIC_NS
+			|| hdr->magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	if (!swapped && hdr->magic != PCAP_MAGIC_US && !nsec) {
+		fprintf(stderr, "ERROR: %s is not a pcap file (pcapng is not "
+				"supported)\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if ((swapped ? __builtin_bswap32(hdr->linktype) : hdr->linktype)
+			!= PCAP_LINKTYPE_ETHERNET) {
+		fprintf(stderr, "ERROR: %s is not an Ethernet capture\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	trace->recs = NULL;
+	trace->nrecs = 0;
+	trace->truncated = 0;
+
+	for (off = sizeof(*hdr); off + sizeof(rec) <= trace->size;
+			off += sizeof(rec) + rec.incl_len) {
+		memcpy(&rec, trace->map + off, sizeof(rec));
+		if (swapped) {
+			rec.ts_sec = __builtin_bswap32(rec.ts_sec);
+			rec.ts_frac = __builtin_bswap32(rec.ts_frac);
+			rec.incl_len = __builtin_bswap32(rec.incl_len);
+			rec.orig_len = __builtin_bswap32(rec.orig_len);
+		}
+		if (off + sizeof(rec) + rec.incl_len > trace->size)
+			break;
+
+		if (trace->nrecs == size) {
+			size = size ? size * 2 : 1024;
+			trace->recs = realloc(trace->recs, size * sizeof(*trace->recs));
+			if (!trace->recs) {
+				fprintf(stderr, "ERROR: out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		ts = rec.ts_sec * 1000000000ULL + rec.ts_frac * (nsec ? 1 : 1000);
+		if (!trace->nrecs)
+			first = ts;
+
+		/* Captures are not always sorted, keep the time going forward */
+		trace->recs[trace->nrecs].ts_ns = ts > first ? ts - first : 0;
+		if (trace->nrecs && trace->recs[trace->nrecs].ts_ns
+				< trace->recs[trace->nrecs - 1].ts_ns) {
+			trace->recs[trace->nrecs].ts_ns =
+					trace->recs[trace->nrecs - 1].ts_ns;
+		}
+		trace->recs[trace->nrecs].data = trace->map + off + sizeof(rec);
+		trace->recs[trace->nrecs++].len = rec.incl_len;
+		trace->truncated += rec.incl_len < rec.orig_len;
+	}
+
+	if (!trace->nrecs) {
+		fprintf(stderr, "ERROR: no packets in %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void free_trace(struct trace *trace)
+{
+	free(trace->recs);
+	munmap(trace->map, trace->size);
+}
+
+static int open_socket(int ifindex, int rx)
+{
+	struct sockaddr_ll sll = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_ALL),
+		.sll_ifindex = ifindex
+	};
+	struct timeval timeout = {0, 100000};
+	int fd, one = 1, bufsize = 64 << 20;
+
+	fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sll, sizeof(sll))) {
+		fprintf(stderr, "ERROR: unable to open a packet socket on %s: %s\n",
+				opt_iface, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Best effort, sizes are capped by the sysctls without CAP_NET_ADMIN */
+	if (rx) {
+		setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+				sizeof(one));
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize,
+				sizeof(bufsize))) {
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+		}
+		/* The rx thread checks regularly if it has to stop */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	} else {
+		setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bufsize,
+				sizeof(bufsize))) {
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+		}
+	}
+
+	return fd;
+}
+
+static void write_pcap_header(FILE *f)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC_NS,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = RX_FRAME_SIZE,
+		.linktype = PCAP_LINKTYPE_ETHERNET
+	};
+
+	fwrite(&hdr, sizeof(hdr), 1, f);
+}
+
+static void write_pcap_record(FILE *f, const void *data, unsigned len)
+{
+	unsigned long now = get_nsecs(CLOCK_REALTIME);
+	struct pcap_rec_hdr rec = {
+		.ts_sec = now / 1000000000,
+		.ts_frac = now % 1000000000,
+		.incl_len = len,
+		.orig_len = len
+	};
+
+	fwrite(&rec, sizeof(rec), 1, f);
+	fwrite(data, len, 1, f);
+}
+
+static void *rx_loop(void *arg)
+{
+	int fd = *(int *)arg, n;
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	struct sockaddr_ll addrs[BATCH_SIZE];
+	char *bufs;
+
+	bufs = malloc((size_t)BATCH_SIZE * RX_FRAME_SIZE);
+	if (!bufs) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		iovs[i].iov_base = bufs + (size_t)i * RX_FRAME_SIZE;
+		iovs[i].iov_len = RX_FRAME_SIZE;
+	}
+
+	while (!done) {
+		for (int i = 0; i < BATCH_SIZE; i++) {
+			memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		n = recvmmsg(fd, msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+		if (n <= 0)
+			continue;
+
+		for (int i = 0; i < n; i++) {
+			/* Kernels without PACKET_IGNORE_OUTGOING */
+			if (addrs[i].sll_pkttype == PACKET_OUTGOING)
+				continue;
+
+			rx_npkts++;
+			rx_nbytes += msgs[i].msg_len;
+
+			if (out_file)
+				write_pcap_record(out_file, iovs[i].iov_base, msgs[i].msg_len);
+
+			if (opt_expected_path) {
+				if (rx_npkts > rx_hashes_size) {
+					rx_hashes_size = rx_hashes_size ? rx_hashes_size * 2
+							: 1024;
+					rx_hashes = realloc(rx_hashes, rx_hashes_size
+							* sizeof(*rx_hashes));
+					if (!rx_hashes) {
+						fprintf(stderr, "ERROR: out of memory\n");
+						exit(EXIT_FAILURE);
+					}
+				}
+				rx_hashes[rx_npkts - 1] = packet_hash(iovs[i].iov_base,
+						msgs[i].msg_len);
+			}
+		}
+	}
+
+	free(bufs);
+
+	return NULL;
+}
+
+/* Sleeps until the CLOCK_MONOTONIC time t, the last part spinning */
+static void wait_until(unsigned long t)
+{
+	unsigned long now = get_nsecs(CLOCK_MONOTONIC);
+	struct timespec ts;
+
+	if (t > now + SPIN_NS) {
+		ts.tv_sec = (t - SPIN_NS) / 1000000000;
+		ts.tv_nsec = (t - SPIN_NS) % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	while (get_nsecs(CLOCK_MONOTONIC) < t && !done)
+		;
+}
+
+/*
+ * Sends the trace opt_loops times. With timing every batch holds the packets
+ * already due, without it full batches are sent back to back. Returns the
+ * number of packets sent
+ */
+static unsigned long replay(int fd, struct trace *trace,
+		unsigned long *nbytes, unsigned long *nerrors)
+{
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	unsigned long start, now, due, npkts = 0, loop_ns = 0;
+	/* Time between the end of a loop and the start of the next one */
+	unsigned long gap = trace->nrecs > 1 ? trace->recs[trace->nrecs - 1].ts_ns
+			/ (trace->nrecs - 1) : 0;
+	unsigned i = 0, n;
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs));
+	start = get_nsecs(CLOCK_MONOTONIC);
+
+	for (unsigned loop = 0; loop < opt_loops && !done; ) {
+		now = get_nsecs(CLOCK_MONOTONIC);
+		for (n = 0; n < BATCH_SIZE && loop < opt_loops; n++) {
+			if (opt_speed) {
+				due = start + (loop_ns + trace->recs[i].ts_ns) / opt_speed;
+				if (due > now) {
+					if (n)
+						break;
+					wait_until(due);
+				}
+			}
+
+			iovs[n].iov_base = (void *)trace->recs[i].data;
+			iovs[n].iov_len = trace->recs[i].len;
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			*nbytes += trace->recs[i].len;
+
+			if (++i == trace->nrecs) {
+				i = 0;
+				loop++;
+				loop_ns += trace->recs[trace->nrecs - 1].ts_ns + gap;
+			}
+		}
+
+		for (unsigned sent = 0; sent < n; ) {
+			ret = sendmmsg(fd, msgs + sent, n - sent, 0);
+			if (ret < 0) {
+				if (errno == ENOBUFS || errno == EAGAIN)
+					continue;
+				/* Dropped packet, either too big or malformed */
+				(*nerrors)++;
+				sent++;
+				continue;
+			}
+			sent += ret;
+		}
+		npkts += n;
+	}
+
+	return npkts;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Matches the received packets with the ones of the expected pcap, in any
+ * order since workers can reorder them. Returns 0 if they are the same
+ */
+static int verify(struct trace *expected)
+{
+	unsigned long nexp = expected->nrecs, matched = 0, i = 0, j = 0;
+	uint64_t *exp_hashes;
+
+	exp_hashes = malloc(nexp * sizeof(*exp_hashes));
+	if (!exp_hashes) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nexp; i++) {
+		exp_hashes[i] = packet_hash(expected->recs[i].data,
+				expected->recs[i].len);
+	}
+
+	qsort(exp_hashes, nexp, sizeof(*exp_hashes), cmp_u64);
+	qsort(rx_hashes, rx_npkts, sizeof(*rx_hashes), cmp_u64);
+
+	for (i = 0, j = 0; i < nexp && j < rx_npkts; ) {
+		if (exp_hashes[i] == rx_hashes[j]) {
+			matched++;
+			i++;
+			j++;
+		} else if (exp_hashes[i] < rx_hashes[j]) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+
+	printf("%-10s %'lu matched, %'lu missing, %'lu unexpected\n", "verify",
+			matched, nexp - matched, rx_npkts - matched);
+
+	free(exp_hashes);
+
+	return matched != nexp || matched != rx_npkts;
+}
+
+static struct option long_options[] = {
+	{"iface", required_argument, 0, 'i'},
+	{"speed", required_argument, 0, 's'},
+	{"max-rate", no_argument, 0, 'm'},
+	{"loops", required_argument, 0, 'l'},
+	{"wait", required_argument, 0, 't'},
+	{"write", required_argument, 0, 'w'},
+	{"expect", required_argument, 0, 'e'},
+	{0, 0, 0, 0}
+};
+
+static void usage(const char *prog)
+{
+	const char *str =
+		"  Usage: %s [OPTIONS] file.pcap\n"
+		"  Replays a pcap on an interface and collects the packets coming back.\n"
+		"  Options:\n"
+		"  -i, --iface=n		Interface to replay on (required)\n"
+		"  -s, --speed=x		Scale the timing of the capture by x (default 1)\n"
+		"  -m, --max-rate		Ignore the timing, send as fast as possible\n"
+		"  -l, --loops=n		Replay the capture n times (default 1)\n"
+		"  -t, --wait=ms		Wait for packets for ms after the last one is sent\n"
+		"			(default 1000)\n"
+		"  -w, --write=file	Save the packets received in a pcap\n"
+		"  -e, --expect=file	Verify that the packets received are the ones of a pcap,\n"
+		"			in any order. Exits with an error if they are not\n"
+		"\n";
+	fprintf(stderr, str, prog);
+
+	exit(EXIT_FAILURE);
+}
+
+static void int_exit(int sig)
+{
+	done = 1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long npkts, nbytes = 0, nerrors = 0, start, elapsed;
+	struct trace trace, expected;
+	int option_index, c, tx_fd, rx_fd, ifindex, ret = 0;
+	pthread_t rx_thread;
+
+	for (;;) {
+		c = getopt_long(argc, argv, "i:s:ml:t:w:e:", long_options,
+				&option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'i':
+			opt_iface = optarg;
+			break;
+		case 's':
+			opt_speed = atof(optarg);
+			if (opt_speed <= 0) {
+				fprintf(stderr, "ERROR: invalid speed %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'm':
+			opt_speed = 0;
+			break;
+		case 'l':
+			opt_loops = atoi(optarg);
+			break;
+		case 't':
+			opt_wait_ms = atoi(optarg);
+			break;
+		case 'w':
+			opt_out_path = optarg;
+			break;
+		case 'e':
+			opt_expected_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || !opt_iface)
+		usage(argv[0]);
+
+	setlocale(LC_ALL, "");
+
+	ifindex = if_nametoindex(opt_iface);
+	if (!ifindex) {
+		fprintf(stderr, "ERROR: interface \"%s\" does not exist\n", opt_iface);
+		exit(EXIT_FAILURE);
+	}
+
+	read_trace(argv[optind], &trace);
+	if (trace.truncated) {
+		fprintf(stderr, "WARNING: %u packets are truncated in the capture, "
+				"only the captured part is sent\n", trace.truncated);
+	}
+	if (opt_expected_path)
+		read_trace(opt_expected_path, &expected);
+
+	if (opt_out_path) {
+		out_file = fopen(opt_out_path, "w");
+		if (!out_file) {
+			fprintf(stderr, "ERROR: unable to open %s: %s\n", opt_out_path,
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		write_pcap_header(out_file);
+	}
+
+	tx_fd = open_socket(ifindex, 0);
+	rx_fd = open_socket(ifindex, 1);
+
+	signal(SIGINT, int_exit);
+	signal(SIGTERM, int_exit);
+
+	ret = pthread_create(&rx_thread, NULL, rx_loop, &rx_fd);
+	if (ret) {
+		fprintf(stderr, "ERROR: unable to start the rx thread: %s\n",
+				strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	start = get_nsecs(CLOCK_MONOTONIC);
+	npkts = replay(tx_fd, &trace, &nbytes, &nerrors);
+	elapsed = get_nsecs(CLOCK_MONOTONIC) - start;
+
+	/* Packets still in the NF */
+	for (unsigned i = 0; i < opt_wait_ms / 100 && !done; i++)
+		usleep(100000);
+	done = 1;
+	pthread_join(rx_thread, NULL);
+
+	printf("%-10s %'lu pkts, %'lu bytes in %.3f s (%.3f Mpps, %.3f Gbps)\n",
+			"sent", npkts - nerrors, nbytes, elapsed / 1e9,
+			(npkts - nerrors) * 1e3 / elapsed, nbytes * 8. / elapsed);
+	if (nerrors)
+		printf("%-10s %'lu pkts not sent\n", "errors", nerrors);
+	printf("%-10s %'lu pkts, %'lu bytes (%.2f%% of the sent ones)\n",
+			"received", rx_npkts, rx_nbytes, npkts - nerrors
+			? rx_npkts * 100. / (npkts - nerrors) : 0);
+
+	if (opt_expected_path) {
+		ret = verify(&expected);
+		free_trace(&expected);
+	}
+
+	if (out_file)
+		fclose(out_file);
+	free(rx_hashes);
+	free_trace(&trace);
+	close(tx_fd);
+	close(rx_fd);
+
+	return ret ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * Reads the stats exported by an NF started with --stats-shm (see xsknf.h),
+ * without any help from the NF. Prints the counters of every socket, their
+ * rates when an interval is given or, with -p, the counters in the text
+ * format of Prometheus to be served by an exporter. Latency histograms of NFs
+ * started with --latency-hist are printed as percentiles (summaries for
+ * Prometheus).
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <locale.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xsknf.h>
+
+#define FIELD(f) {#f, offsetof(struct xsknf_socket_stats, f)}
+
+static const struct {
+	const char *name;
+	size_t offset;
+} fields[] = {
+	FIELD(rx_npkts),
+	FIELD(tx_npkts),
+	FIELD(rx_dropped_npkts),
+	FIELD(rx_invalid_npkts),
+	FIELD(tx_invalid_npkts),
+	FIELD(rx_full_npkts),
+	FIELD(rx_fill_empty_npkts),
+	FIELD(tx_empty_npkts),
+	FIELD(rx_empty_polls),
+	FIELD(fill_fail_polls),
+	FIELD(tx_wakeup_sendtos),
+	FIELD(tx_trigger_sendtos),
+	FIELD(opt_polls),
+	FIELD(idle_polls),
+	FIELD(steered_npkts),
+	FIELD(tx_backpressure_npkts),
+};
+
+#define NUM_FIELDS (sizeof(fields) / sizeof(fields[0]))
+
+/* Times are in seconds for Prometheus and in microseconds otherwise */
+static const struct {
+	const char *name;
+	const char *prom_name;
+	int is_time;
+} hists[XSKNF_NUM_HISTS] = {
+	[XSKNF_HIST_LATENCY] = {"rx-tx (us)", "rx_tx_latency_seconds", 1},
+	[XSKNF_HIST_PROCESS] = {"process (us)", "process_seconds", 1},
+	[XSKNF_HIST_BATCH] = {"batch (pkts)", "batch_packets", 0},
+};
+
+static const double quantiles[] = {50, 90, 99, 99.9};
+
+#define NUM_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+static unsigned opt_interval;
+static int opt_prometheus;
+static int done;
+
+static inline unsigned long field(struct xsknf_stats_block *b, int f)
+{
+	return *(unsigned long *)((char *)&b->stats + fields[f].offset);
+}
+
+static struct xsknf_stats_header *open_stats(const char *name, size_t *len)
+{
+	struct xsknf_stats_header *hdr;
+	char path[256];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+	fd = shm_open(path, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "ERROR: unable to open %s: %s\n", path,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "ERROR: %s is not an xsknf stats segment\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "ERROR: unable to map %s: %s\n", path,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != XSKNF_STATS_MAGIC
+			|| hdr->version != XSKNF_STATS_VERSION
+			|| hdr->block_size != sizeof(struct xsknf_stats_block)
+			|| (hdr->nhists && hdr->hist_size
+			!= sizeof(struct xsknf_hist_block))
+			|| hdr->header_size + (size_t)hdr->nblocks * hdr->block_size
+			+ (size_t)hdr->nhists * hdr->hist_size > st.st_size) {
+		fprintf(stderr, "ERROR: %s is not an xsknf stats segment of this "
+				"version\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (kill(hdr->pid, 0) && errno == ESRCH) {
+		fprintf(stderr, "WARNING: NF %d is not running, stats are stale\n",
+				hdr->pid);
+	}
+
+	*len = st.st_size;
+
+	return hdr;
+}
+
+static void snapshot(struct xsknf_stats_header *hdr,
+		struct xsknf_stats_block *snaps)
+{
+	struct xsknf_stats_block *blocks = xsknf_stats_blocks(hdr);
+
+	for (int i = 0; i < hdr->nblocks; i++) {
+		xsknf_read_stats_block(&blocks[i], &snaps[i]);
+	}
+}
+
+static void print_prometheus(struct xsknf_stats_header *hdr,
+		struct xsknf_stats_block *snaps)
+{
+	for (int f = 0; f < NUM_FIELDS; f++) {
+		printf("# TYPE xsknf_%s counter\n", fields[f].name);
+		for (int i = 0; i < hdr->nblocks; i++) {
+			printf("xsknf_%s{worker=\"%u\",iface=\"%s\",queue=\"%u\"} %lu\n",
+					fields[f].name, snaps[i].worker,
+					hdr->interfaces[snaps[i].iface], snaps[i].queue,
+					field(&snaps[i], f));
+		}
+	}
+}
+
+static void print_prometheus_hists(struct xsknf_stats_header *hdr)
+{
+	struct xsknf_hist_block *blocks = xsknf_stats_hists(hdr);
+	struct xsknf_hist *hist;
+	double scale;
+
+	for (int h = 0; h < XSKNF_NUM_HISTS && hdr->nhists; h++) {
+		scale = hists[h].is_time ? 1. / hdr->tsc_hz : 1;
+
+		printf("# TYPE xsknf_%s summary\n", hists[h].prom_name);
+		for (int i = 0; i < hdr->nhists; i++) {
+			hist = &blocks[i].hists[h];
+			for (int q = 0; q < NUM_QUANTILES; q++) {
+				printf("xsknf_%s{worker=\"%u\",thread=\"%u\","
+						"quantile=\"%g\"} %g\n", hists[h].prom_name,
+						blocks[i].worker, blocks[i].thread,
+						quantiles[q] / 100,
+						xsknf_hist_percentile(hist, quantiles[q]) * scale);
+			}
+			printf("xsknf_%s_sum{worker=\"%u\",thread=\"%u\"} %g\n",
+					hists[h].prom_name, blocks[i].worker, blocks[i].thread,
+					hist->sum * scale);
+			printf("xsknf_%s_count{worker=\"%u\",thread=\"%u\"} %lu\n",
+					hists[h].prom_name, blocks[i].worker, blocks[i].thread,
+					hist->count);
+		}
+	}
+}
+
+/* Percentiles of the histograms of every thread, since the start */
+static void print_hists(struct xsknf_stats_header *hdr)
+{
+	struct xsknf_hist_block *blocks = xsknf_stats_hists(hdr);
+	struct xsknf_hist *hist;
+	char buff[64];
+	double scale;
+
+	for (int i = 0; i < hdr->nhists; i++) {
+		snprintf(buff, sizeof(buff), "worker %u thread %u", blocks[i].worker,
+				blocks[i].thread);
+		printf("%-33s", buff);
+		for (int q = 0; q < NUM_QUANTILES; q++)
+			printf(" p%-9g", quantiles[q]);
+		printf(" max\n");
+
+		for (int h = 0; h < XSKNF_NUM_HISTS; h++) {
+			hist = &blocks[i].hists[h];
+			scale = hists[h].is_time ? 1000000. / hdr->tsc_hz : 1;
+
+			printf("  %-31s", hists[h].name);
+			for (int q = 0; q < NUM_QUANTILES; q++) {
+				printf(" %-10.2f",
+						xsknf_hist_percentile(hist, quantiles[q]) * scale);
+			}
+			printf(" %.2f\n", hist->max * scale);
+		}
+	}
+	if (hdr->nhists)
+		printf("\n");
+}
+
+/* Counters of every socket, with their rate since prev if not NULL */
+static void print_stats(struct xsknf_stats_header *hdr,
+		struct xsknf_stats_block *snaps, struct xsknf_stats_block *prev)
+{
+	for (int i = 0; i < hdr->nblocks; i++) {
+		double dt = 0;
+
+		if (prev && snaps[i].timestamp_ns > prev[i].timestamp_ns)
+			dt = (snaps[i].timestamp_ns - prev[i].timestamp_ns) / 1e9;
+
+		printf("worker %u %s queue %u\n", snaps[i].worker,
+				hdr->interfaces[snaps[i].iface], snaps[i].queue);
+		for (int f = 0; f < NUM_FIELDS; f++) {
+			printf("  %-22s %'18lu", fields[f].name, field(&snaps[i], f));
+			if (dt)
+				printf("  %'14.0f/s", (field(&snaps[i], f)
+						- field(&prev[i], f)) / dt);
+			printf("\n");
+		}
+	}
+	printf("\n");
+}
+
+static struct option long_options[] = {
+	{"interval", required_argument, 0, 'i'},
+	{"prometheus", no_argument, 0, 'p'},
+	{0, 0, 0, 0}
+};
+
+static void usage(const char *prog)
+{
+	const char *str =
+		"  Usage: %s [OPTIONS] name\n"
+		"  Prints the stats of the NF started with --stats-shm=name.\n"
+		"  Options:\n"
+		"  -i, --interval=s	Print again every s seconds, with the rates.\n"
+		"  -p, --prometheus	Print the counters in the Prometheus text format.\n"
+		"\n";
+	fprintf(stderr, str, prog);
+
+	exit(EXIT_FAILURE);
+}
+
+static void int_exit(int sig)
+{
+	done = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct xsknf_stats_block *snaps, *prev, *tmp;
+	struct xsknf_stats_header *hdr;
+	int option_index, c;
+	size_t len;
+
+	for (;;) {
+		c = getopt_long(argc, argv, "i:p", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'i':
+			opt_interval = atoi(optarg);
+			break;
+		case 'p':
+			opt_prometheus = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	setlocale(LC_ALL, "");
+
+	hdr = open_stats(argv[optind], &len);
+
+	snaps = calloc(hdr->nblocks + 1, sizeof(*snaps));
+	prev = calloc(hdr->nblocks + 1, sizeof(*prev));
+	if (!snaps || !prev) {
+		fprintf(stderr, "ERROR: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	snapshot(hdr, snaps);
+	if (opt_prometheus) {
+		print_prometheus(hdr, snaps);
+		print_prometheus_hists(hdr);
+	} else {
+		print_stats(hdr, snaps, NULL);
+		print_hists(hdr);
+	}
+
+	signal(SIGINT, int_exit);
+	signal(SIGTERM, int_exit);
+
+	while (opt_interval && !opt_prometheus && !done) {
+		sleep(opt_interval);
+		tmp = prev;
+		prev = snaps;
+		snaps = tmp;
+		snapshot(hdr, snaps);
+		print_stats(hdr, snaps, prev);
+		print_hists(hdr);
+	}
+
+	free(snaps);
+	free(prev);
+	munmap(hdr, len);
+
+	return 0;
+}